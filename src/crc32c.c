@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ *
+ * CRC32C of frame payloads. It has to keep up with the link, so it runs
+ * a word at a time: with the SSE4.2 or ARMv8 CRC instructions when the
+ * CPU has them, and with slicing-by-8 tables everywhere else.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_CRC32C_SSE42
+#  include <cpuid.h>
+#  include <nmmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__ARM_FEATURE_CRC32)
+#  define HAVE_CRC32C_ARMV8
+#  include <arm_acle.h>
+#endif
+
+/* Castagnoli polynomial, bit reversed */
+#define CRC32C_POLY 0x82f63b78u
+
+typedef uint32_t (*crc32c_func) (uint32_t crc, const unsigned char *p,
+				 size_t length);
+
+static uint32_t table[8][256];
+static crc32c_func crc32c_impl;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Slicing-by-8, eight table lookups for every 8 bytes */
+static uint32_t crc32c_sw (uint32_t crc, const unsigned char *p,
+			   size_t length)
+{
+  uint32_t lo, hi;
+
+  while (length > 0 && ((uintptr_t) p & 7) != 0)
+  {
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    length--;
+  }
+
+  while (length >= 8)
+  {
+    lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 |
+		(uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+    hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 |
+      (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+      table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+      table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+      table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    p += 8;
+    length -= 8;
+  }
+
+  while (length-- > 0)
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__ ((target ("sse4.2")))
+static uint32_t crc32c_sse42 (uint32_t crc, const unsigned char *p,
+			      size_t length)
+{
+#ifdef __x86_64__
+  uint64_t crc64;
+  uint64_t word;
+#else
+  uint32_t word;
+#endif
+
+  while (length > 0 && ((uintptr_t) p & (sizeof word - 1)) != 0)
+  {
+    crc = _mm_crc32_u8 (crc, *p++);
+    length--;
+  }
+
+#ifdef __x86_64__
+  crc64 = crc;
+  while (length >= sizeof word)
+  {
+    memcpy (&word, p, sizeof word);
+    crc64 = _mm_crc32_u64 (crc64, word);
+    p += sizeof word;
+    length -= sizeof word;
+  }
+  crc = (uint32_t) crc64;
+#else
+  while (length >= sizeof word)
+  {
+    memcpy (&word, p, sizeof word);
+    crc = _mm_crc32_u32 (crc, word);
+    p += sizeof word;
+    length -= sizeof word;
+  }
+#endif
+
+  while (length-- > 0)
+    crc = _mm_crc32_u8 (crc, *p++);
+
+  return crc;
+}
+#endif
+
+#ifdef HAVE_CRC32C_ARMV8
+static uint32_t crc32c_armv8 (uint32_t crc, const unsigned char *p,
+			      size_t length)
+{
+  uint64_t word;
+
+  while (length > 0 && ((uintptr_t) p & 7) != 0)
+  {
+    crc = __crc32cb (crc, *p++);
+    length--;
+  }
+
+  while (length >= 8)
+  {
+    memcpy (&word, p, 8);
+    crc = __crc32cd (crc, word);
+    p += 8;
+    length -= 8;
+  }
+
+  while (length-- > 0)
+    crc = __crc32cb (crc, *p++);
+
+  return crc;
+}
+#endif
+
+static void crc32c_init (void)
+{
+  uint32_t crc;
+  int i, j;
+#ifdef HAVE_CRC32C_SSE42
+  unsigned int eax, ebx, ecx, edx;
+#endif
+
+  for (i = 0; i < 256; i++)
+  {
+    crc = i;
+    for (j = 0; j < 8; j++)
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++)
+    for (j = 1; j < 8; j++)
+      table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+
+  crc32c_impl = crc32c_sw;
+#ifdef HAVE_CRC32C_SSE42
+  if (__get_cpuid (1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+    crc32c_impl = crc32c_sse42;
+#endif
+#ifdef HAVE_CRC32C_ARMV8
+  /* Built for a CPU that has them */
+  crc32c_impl = crc32c_armv8;
+#endif
+}
+
+uint32_t crc32c (uint32_t crc, const void *data, size_t length)
+{
+  pthread_once (&crc32c_once, crc32c_init);
+
+  return ~crc32c_impl (~crc, (const unsigned char *) data, length);
+}
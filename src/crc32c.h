@@ -0,0 +1,22 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+  * \brief CRC32C (Castagnoli polynomial) of a buffer. Uses the CRC
+  * instructions of the CPU when it has them, slicing-by-8 tables
+  * otherwise.
+  * \param crc CRC of the data before this buffer, 0 to start a new one.
+  * \param data Buffer to checksum.
+  * \param length Size in bytes of the buffer.
+  * \return The CRC of all the data so far.
+  */
+extern uint32_t crc32c (uint32_t crc, const void *data, size_t length);
+
+#endif /* __CRC32C_H__ */
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ *
+ * Inter-frame delta coding. The encoded frame is a list of records, each
+ * one a little endian count of unchanged bytes, a count of changed bytes
+ * and the changed bytes XORed with the reference. Frames are compared in
+ * blocks of DELTA_BLOCK bytes with the widest vectors the CPU has.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "delta.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#  define HAVE_DELTA_SSE2
+#  include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#  define HAVE_DELTA_AVX2
+#  include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__ARM_NEON)
+#  define HAVE_DELTA_NEON
+#  include <arm_neon.h>
+#endif
+
+/* Granularity of the unchanged runs */
+#define DELTA_BLOCK 32
+
+/* Size of the counts starting every record */
+#define DELTA_RECORD 8
+
+/* XORs a block into dst, returns non zero if anything changed */
+typedef int (*delta_block_func) (uint8_t *dst, const uint8_t *a,
+				 const uint8_t *b);
+
+static delta_block_func delta_block;
+static pthread_once_t delta_once = PTHREAD_ONCE_INIT;
+
+static int delta_block_c (uint8_t *dst, const uint8_t *a, const uint8_t *b)
+{
+  uint64_t x, y, any = 0;
+  int i;
+
+  for (i = 0; i < DELTA_BLOCK; i += 8)
+  {
+    memcpy (&x, a + i, 8);
+    memcpy (&y, b + i, 8);
+    x ^= y;
+    memcpy (dst + i, &x, 8);
+    any |= x;
+  }
+  return any != 0;
+}
+
+#ifdef HAVE_DELTA_SSE2
+static int delta_block_sse2 (uint8_t *dst, const uint8_t *a,
+			     const uint8_t *b)
+{
+  __m128i x0 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) a),
+			      _mm_loadu_si128 ((const __m128i *) b));
+  __m128i x1 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (a + 16)),
+			      _mm_loadu_si128 ((const __m128i *) (b + 16)));
+
+  _mm_storeu_si128 ((__m128i *) dst, x0);
+  _mm_storeu_si128 ((__m128i *) (dst + 16), x1);
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_or_si128 (x0, x1),
+					    _mm_setzero_si128 ())) != 0xffff;
+}
+#endif
+
+#ifdef HAVE_DELTA_AVX2
+__attribute__ ((target ("avx2")))
+static int delta_block_avx2 (uint8_t *dst, const uint8_t *a,
+			     const uint8_t *b)
+{
+  __m256i x = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i *) a),
+				_mm256_loadu_si256 ((const __m256i *) b));
+
+  _mm256_storeu_si256 ((__m256i *) dst, x);
+  return !_mm256_testz_si256 (x, x);
+}
+#endif
+
+#ifdef HAVE_DELTA_NEON
+static int delta_block_neon (uint8_t *dst, const uint8_t *a,
+			     const uint8_t *b)
+{
+  uint8x16_t x0 = veorq_u8 (vld1q_u8 (a), vld1q_u8 (b));
+  uint8x16_t x1 = veorq_u8 (vld1q_u8 (a + 16), vld1q_u8 (b + 16));
+  uint64x2_t any = vreinterpretq_u64_u8 (vorrq_u8 (x0, x1));
+
+  vst1q_u8 (dst, x0);
+  vst1q_u8 (dst + 16, x1);
+  return (vgetq_lane_u64 (any, 0) | vgetq_lane_u64 (any, 1)) != 0;
+}
+#endif
+
+static void delta_init (void)
+{
+  delta_block = delta_block_c;
+#ifdef HAVE_DELTA_SSE2
+  delta_block = delta_block_sse2;
+#endif
+#ifdef HAVE_DELTA_AVX2
+  if (__builtin_cpu_supports ("avx2"))
+    delta_block = delta_block_avx2;
+#endif
+#ifdef HAVE_DELTA_NEON
+  delta_block = delta_block_neon;
+#endif
+}
+
+/* XORs n bytes, a block at a time while there are whole ones */
+static int delta_xor (uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		      size_t n)
+{
+  int any = 0;
+
+  for (; n >= DELTA_BLOCK; n -= DELTA_BLOCK)
+  {
+    any |= delta_block (dst, a, b);
+    dst += DELTA_BLOCK;
+    a += DELTA_BLOCK;
+    b += DELTA_BLOCK;
+  }
+  while (n-- > 0)
+    any |= (*dst++ = *a++ ^ *b++);
+
+  return any;
+}
+
+static void put_le32 (uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t get_le32 (const uint8_t *p)
+{
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+    (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+size_t delta_encode (uint8_t *out, size_t out_size, const uint8_t *cur,
+		     const uint8_t *ref, size_t size)
+{
+  size_t pos, n, o = 0, rec = 0, same = 0, changed = 0;
+  int in_changed = 0;
+
+  pthread_once (&delta_once, delta_init);
+
+  /* The XOR of every block goes right where it would be sent, it's only
+   * kept if something changed */
+  for (pos = 0; pos < size; pos += n)
+  {
+    n = size - pos < DELTA_BLOCK ? size - pos : DELTA_BLOCK;
+    if (!in_changed)
+    {
+      if (o + DELTA_RECORD + DELTA_BLOCK > out_size)
+	return 0;
+      if (!delta_xor (out + o + DELTA_RECORD, cur + pos, ref + pos, n))
+      {
+	same += n;
+	continue;
+      }
+      rec = o;
+      o += DELTA_RECORD + n;
+      changed = n;
+      in_changed = 1;
+    }
+    else
+    {
+      if (o + DELTA_BLOCK > out_size)
+	return 0;
+      if (delta_xor (out + o, cur + pos, ref + pos, n))
+      {
+	o += n;
+	changed += n;
+	continue;
+      }
+      put_le32 (out + rec, same);
+      put_le32 (out + rec + 4, changed);
+      same = n;
+      in_changed = 0;
+    }
+  }
+
+  if (in_changed)
+  {
+    put_le32 (out + rec, same);
+    put_le32 (out + rec + 4, changed);
+  }
+  else if (same > 0 || size == 0)
+  {
+    if (o + DELTA_RECORD > out_size)
+      return 0;
+    put_le32 (out + o, same);
+    put_le32 (out + o + 4, 0);
+    o += DELTA_RECORD;
+  }
+
+  return o;
+}
+
+int delta_decode (uint8_t *out, const uint8_t *ref, size_t size,
+		  const uint8_t *in, size_t in_size)
+{
+  size_t pos = 0, i = 0, same, changed;
+
+  pthread_once (&delta_once, delta_init);
+
+  while (i < in_size)
+  {
+    if (in_size - i < DELTA_RECORD)
+      return 0;
+    same = get_le32 (in + i);
+    changed = get_le32 (in + i + 4);
+    i += DELTA_RECORD;
+    if (same > size - pos || changed > size - pos - same ||
+	changed > in_size - i)
+      return 0;
+
+    memcpy (out + pos, ref + pos, same);
+    pos += same;
+    delta_xor (out + pos, in + i, ref + pos, changed);
+    pos += changed;
+    i += changed;
+  }
+
+  return pos == size;
+}
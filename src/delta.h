@@ -0,0 +1,38 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+  * \brief Encodes a frame as its difference with a reference frame of the
+  * same size. Unchanged regions are run-length encoded, changed ones are
+  * sent XORed with the reference.
+  * \param out Where to put the encoded frame.
+  * \param out_size Room in out.
+  * \param cur Frame to encode.
+  * \param ref Reference frame.
+  * \param size Size in bytes of both frames.
+  * \return Size of the encoded frame, 0 if it didn't fit in out_size.
+  */
+extern size_t delta_encode (uint8_t *out, size_t out_size,
+			    const uint8_t *cur, const uint8_t *ref,
+			    size_t size);
+
+/**
+  * \brief Rebuilds a frame encoded by delta_encode().
+  * \param out Where to put the frame, size bytes long.
+  * \param ref Reference frame the encoder used.
+  * \param size Size in bytes of the frame.
+  * \param in Encoded frame.
+  * \param in_size Size of the encoded frame.
+  * \return 1 on success, 0 if the encoded frame is malformed.
+  */
+extern int delta_decode (uint8_t *out, const uint8_t *ref, size_t size,
+			 const uint8_t *in, size_t in_size);
+
+#endif /* __DELTA_H__ */
@@ -8,6 +8,7 @@
 #include <gst/gst.h>
 #include "gstusbsink.h"
 #include "gstusbsrc.h"
+#include "gstusbfanout.h"
 
 static gboolean
 plugin_init (GstPlugin * plugin)
@@ -22,6 +23,11 @@ plugin_init (GstPlugin * plugin)
     return FALSE;
   }
 
+  if (!gst_element_register (plugin, "usbfanout", GST_RANK_NONE,
+      GST_TYPE_USB_FANOUT)) {
+    return FALSE;
+  }
+
   return TRUE;
 }
 
@@ -0,0 +1,290 @@
+/*
+ * GStreamer
+ * Copyright (C) 2011 RidgeRun
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+
+#include "gstusbfanout.h"
+#include "gstusbsink.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_usb_fanout_debug);
+#define GST_CAT_DEFAULT gst_usb_fanout_debug
+
+enum
+{
+  PROP_0,
+  PROP_DEVICES
+};
+
+static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("ANY")
+    );
+
+GST_BOILERPLATE (GstUsbFanout, gst_usb_fanout, GstBin, GST_TYPE_BIN);
+
+static void gst_usb_fanout_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec);
+static void gst_usb_fanout_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec);
+static void gst_usb_fanout_finalize (GObject * object);
+static GstStateChangeReturn gst_usb_fanout_change_state (GstElement *
+    element, GstStateChange transition);
+
+static void
+gst_usb_fanout_base_init (gpointer gclass)
+{
+  GstElementClass *element_class = GST_ELEMENT_CLASS (gclass);
+
+  gst_element_class_set_details_simple(element_class,
+    "usbfanout",
+    "Hardware",
+    "Sends the same data across several USB links",
+    "RidgeRun");
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&sink_factory));
+}
+
+static void
+gst_usb_fanout_class_init (GstUsbFanoutClass * klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+
+  GST_DEBUG_CATEGORY_INIT (gst_usb_fanout_debug, "usbfanout",
+      0, "USB fan out element");
+
+  gobject_class = (GObjectClass *) klass;
+  gstelement_class = (GstElementClass *) klass;
+
+  gobject_class->set_property = gst_usb_fanout_set_property;
+  gobject_class->get_property = gst_usb_fanout_get_property;
+  gobject_class->finalize = gst_usb_fanout_finalize;
+
+  gstelement_class->change_state =
+    GST_DEBUG_FUNCPTR (gst_usb_fanout_change_state);
+
+  g_object_class_install_property (gobject_class, PROP_DEVICES,
+				   g_param_spec_string ("devices", "Devices",
+							"Gadgets to stream to, one usbsink device selector each separated by ';', as in \"serial=board1;serial=board2\" (\"any\"=the next free one)",
+							NULL, G_PARAM_READWRITE));
+}
+
+static void
+gst_usb_fanout_init (GstUsbFanout * f,
+		     GstUsbFanoutClass * gclass)
+{
+  GstPad *pad;
+
+  f->tee = gst_element_factory_make ("tee", NULL);
+  gst_bin_add (GST_BIN (f), f->tee);
+
+  pad = gst_element_get_static_pad (f->tee, "sink");
+  f->sinkpad = gst_ghost_pad_new ("sink", pad);
+  gst_object_unref (pad);
+  gst_element_add_pad (GST_ELEMENT (f), f->sinkpad);
+
+  f->devices = NULL;
+  f->sinks = NULL;
+  f->queues = NULL;
+  f->teepads = NULL;
+  f->n_sinks = 0;
+}
+
+static void
+gst_usb_fanout_finalize (GObject * object)
+{
+  GstUsbFanout *f = GST_USB_FANOUT (object);
+
+  g_free (f->devices);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+gst_usb_fanout_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstUsbFanout *filter = GST_USB_FANOUT (object);
+
+  switch (prop_id) {
+    case PROP_DEVICES:
+      g_free (filter->devices);
+      filter->devices = g_value_dup_string (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_usb_fanout_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstUsbFanout *filter = GST_USB_FANOUT (object);
+
+  switch (prop_id) {
+    case PROP_DEVICES:
+      g_value_set_string (value, filter->devices);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+/* Removes a branch: the sink, its queue and the tee pad feeding it */
+static void
+gst_usb_fanout_remove (GstUsbFanout * f, GstElement * sink,
+    GstElement * queue, GstPad * teepad)
+{
+  GstPad *pad;
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_element_set_state (queue, GST_STATE_NULL);
+  if (teepad) {
+    pad = gst_element_get_static_pad (queue, "sink");
+    gst_pad_unlink (teepad, pad);
+    gst_object_unref (pad);
+    gst_element_release_request_pad (f->tee, teepad);
+    gst_object_unref (teepad);
+  }
+  gst_bin_remove (GST_BIN (f), sink);
+  gst_bin_remove (GST_BIN (f), queue);
+}
+
+/* Removes the branches of the devices */
+static void
+gst_usb_fanout_clear (GstUsbFanout * f)
+{
+  guint i;
+
+  for (i = 0; i < f->n_sinks; i++)
+    gst_usb_fanout_remove (f, f->sinks[i], f->queues[i], f->teepads[i]);
+  g_free (f->sinks);
+  g_free (f->queues);
+  g_free (f->teepads);
+  f->sinks = NULL;
+  f->queues = NULL;
+  f->teepads = NULL;
+  f->n_sinks = 0;
+}
+
+/* Adds a branch per device: a tee pad into a queue into a usbsink. The
+ * queues leak the oldest buffers, so the tee never waits for a slow
+ * device, and the sinks leak too so their queue keeps moving */
+static gboolean
+gst_usb_fanout_build (GstUsbFanout * f)
+{
+  usb_host_match match;
+  gchar **selectors, *name;
+  GstElement *sink, *queue;
+  GstPad *pad, *teepad;
+  guint i, n;
+
+  if (f->devices == NULL || *f->devices == '\0') {
+    GST_ELEMENT_ERROR (f, RESOURCE, SETTINGS, (NULL),
+        ("No devices to stream to"));
+    return FALSE;
+  }
+
+  selectors = g_strsplit (f->devices, ";", -1);
+  n = g_strv_length (selectors);
+  for (i = 0; i < n; i++) {
+    if (!usb_host_match_parse (&match, selectors[i])) {
+      GST_ELEMENT_ERROR (f, RESOURCE, SETTINGS, (NULL),
+          ("Malformed device selector \"%s\"", selectors[i]));
+      g_strfreev (selectors);
+      return FALSE;
+    }
+  }
+
+  f->sinks = g_new0 (GstElement *, n);
+  f->queues = g_new0 (GstElement *, n);
+  f->teepads = g_new0 (GstPad *, n);
+  for (i = 0; i < n; i++) {
+    name = g_strdup_printf ("queue%u", i);
+    queue = gst_element_factory_make ("queue", name);
+    g_free (name);
+    if (queue == NULL) {
+      GST_ELEMENT_ERROR (f, CORE, MISSING_PLUGIN, (NULL),
+          ("No queue element to feed \"%s\"", selectors[i]));
+      gst_usb_fanout_clear (f);
+      g_strfreev (selectors);
+      return FALSE;
+    }
+    gst_util_set_object_arg (G_OBJECT (queue), "leaky", "downstream");
+    g_object_set (queue, "max-size-buffers", GST_USB_FANOUT_QUEUE_SIZE,
+        "max-size-bytes", 0, "max-size-time", (guint64) 0, NULL);
+
+    name = g_strdup_printf ("usbsink%u", i);
+    sink = g_object_new (GST_TYPE_USB_SINK, "name", name,
+        "device", selectors[i], "leaky", GST_USB_SINK_LEAK_DOWNSTREAM, NULL);
+    g_free (name);
+    gst_bin_add_many (GST_BIN (f), queue, sink, NULL);
+
+    teepad = gst_element_get_request_pad (f->tee, "src%d");
+    pad = gst_element_get_static_pad (queue, "sink");
+    if (teepad == NULL || gst_pad_link (teepad, pad) != GST_PAD_LINK_OK ||
+        !gst_element_link (queue, sink)) {
+      gst_object_unref (pad);
+      gst_usb_fanout_remove (f, sink, queue, teepad);
+      GST_ELEMENT_ERROR (f, CORE, PAD, (NULL),
+          ("Unable to link the sink of \"%s\"", selectors[i]));
+      gst_usb_fanout_clear (f);
+      g_strfreev (selectors);
+      return FALSE;
+    }
+    gst_object_unref (pad);
+    f->sinks[i] = sink;
+    f->queues[i] = queue;
+    f->teepads[i] = teepad;
+    f->n_sinks = i + 1;
+    GST_DEBUG_OBJECT (f, "Streaming to \"%s\"", selectors[i]);
+  }
+  g_strfreev (selectors);
+
+  return TRUE;
+}
+
+static GstStateChangeReturn
+gst_usb_fanout_change_state (GstElement * element,
+    GstStateChange transition)
+{
+  GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
+  GstUsbFanout *f = GST_USB_FANOUT (element);
+
+  switch (transition) {
+  case GST_STATE_CHANGE_NULL_TO_READY:
+    if (!gst_usb_fanout_build (f))
+      return GST_STATE_CHANGE_FAILURE;
+    break;
+  default:
+    break;
+  }
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+  switch (transition) {
+  case GST_STATE_CHANGE_NULL_TO_READY:
+    if (ret == GST_STATE_CHANGE_FAILURE)
+      gst_usb_fanout_clear (f);
+    break;
+  case GST_STATE_CHANGE_READY_TO_NULL:
+    gst_usb_fanout_clear (f);
+    break;
+  default:
+    break;
+  }
+
+  return ret;
+}
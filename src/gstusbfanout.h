@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+#ifndef __GST_USB_FANOUT_H__
+#define __GST_USB_FANOUT_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_USB_FANOUT \
+  (gst_usb_fanout_get_type())
+#define GST_USB_FANOUT(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_USB_FANOUT,GstUsbFanout))
+#define GST_USB_FANOUT_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_USB_FANOUT,GstUsbFanoutClass))
+#define GST_IS_USB_FANOUT(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_USB_FANOUT))
+#define GST_IS_USB_FANOUT_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_USB_FANOUT))
+
+typedef struct _GstUsbFanout      GstUsbFanout;
+typedef struct _GstUsbFanoutClass GstUsbFanoutClass;
+
+/** Buffers a branch holds before dropping its oldest ones */
+#define GST_USB_FANOUT_QUEUE_SIZE 30
+
+/**
+ * Sends the same stream to several gadgets: a tee feeding one queue and
+ * usbsink per device. Each queue runs its branch in a thread of its own
+ * and leaks its oldest buffers when full, so a slow device drops buffers
+ * instead of holding the tee and the others back
+ */
+struct _GstUsbFanout
+{
+  GstBin parent;
+
+  /* Ghost of the tee sink pad */
+  GstPad *sinkpad;
+  GstElement *tee;
+
+  /* Selectors of the devices, separated by ';', see the device property
+   * of usbsink */
+  gchar *devices;
+
+  /* One usbsink per device, the queue in front of it and the tee pad
+   * feeding that, from READY on */
+  GstElement **sinks;
+  GstElement **queues;
+  GstPad **teepads;
+  guint n_sinks;
+};
+
+struct _GstUsbFanoutClass
+{
+  GstBinClass parent_class;
+};
+
+GType gst_usb_fanout_get_type (void);
+
+G_END_DECLS
+
+#endif /* __GST_USB_FANOUT_H__ */
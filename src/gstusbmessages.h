@@ -30,10 +30,261 @@ typedef enum _GST_USB_MESSAGE
   /** Remote device is telling he is ready to play */
   GST_USB_PLAY,
 
-  /** End of stream event */
-  GST_USB_STOP
+  /** End of a stream, sent by the sink once the buffers of the stream
+   * crossed the link and acknowledged by the src */
+  GST_USB_STOP,
+
+  /** Reply to a request that carries no data, the payload is a status
+   * word, 0 on success */
+  GST_USB_ACK,
+
+  /** Capability exchange, sent by the sink once connected and replied by
+   * the src, both with a #GstUsbHello payload */
+  GST_USB_HELLO,
+
+  /** Notification of the src, it lost the delta reference of the stream
+   * and needs a full frame */
+  GST_USB_KEYFRAME
 
 } GST_USB_MESSAGE;	  
 
+/**
+ * Control messages on the events endpoints: a header transfer, followed
+ * by a payload transfer when length is not 0. A reply carries the
+ * sequence number of its request, so several requests can be in flight
+ * and be answered in any order.
+ */
+typedef struct _GstUsbControlHeader
+{
+  /** #GST_USB_MESSAGE, with the stream id in the upper byte */
+  unsigned int type;
+
+  /** Picked by the requester and copied into the reply, never 0 */
+  unsigned int seq;
+
+  /** Length in bytes of the payload */
+  unsigned int length;
+
+} GstUsbControlHeader;
+
+/** Largest payload of a control message */
+#define GST_USB_CONTROL_MAX 65536
+
+/** Version of the link protocol, both ends must speak the same one */
+#define GST_USB_PROTOCOL_VERSION 3
+
+/**
+ * Optional parts of the protocol. Each end announces the ones it supports
+ * and only those supported by both are used.
+ */
+typedef enum _GST_USB_FEATURE
+{
+  /** Payloads striped across the two stream endpoints */
+  GST_USB_FEATURE_STRIPED = 1 << 0,
+
+  /** Low latency lane on its own endpoint */
+  GST_USB_FEATURE_LANE = 1 << 1,
+
+  /** Several streams multiplexed over the link */
+  GST_USB_FEATURE_STREAMS = 1 << 2,
+
+  /** Caps and time queries as vendor requests on ep0 */
+  GST_USB_FEATURE_VENDOR = 1 << 3,
+
+  /** CRC32C of the payload in the frame preamble */
+  GST_USB_FEATURE_CRC = 1 << 4,
+
+  /** Payloads compressed with LZ4 when that makes them smaller */
+  GST_USB_FEATURE_LZ4 = 1 << 5,
+
+  /** Raw video sent as its difference with the previous frame */
+  GST_USB_FEATURE_DELTA = 1 << 6,
+
+  /** Link qualification: the stream endpoint carries a test pattern
+   * instead of frames. Only announced by an element in test mode */
+  GST_USB_FEATURE_TEST = 1 << 7
+
+} GST_USB_FEATURE;
+
+/** Compression is only there if liblz4 was found at build time */
+#ifdef HAVE_LZ4
+#define GST_USB_FEATURES_LZ4 GST_USB_FEATURE_LZ4
+#else
+#define GST_USB_FEATURES_LZ4 0
+#endif
+
+/** Every feature this build of the elements implements */
+#define GST_USB_FEATURES_ALL \
+  (GST_USB_FEATURE_STRIPED | GST_USB_FEATURE_LANE | \
+   GST_USB_FEATURE_STREAMS | GST_USB_FEATURE_VENDOR | \
+   GST_USB_FEATURE_CRC | GST_USB_FEATURES_LZ4 | GST_USB_FEATURE_DELTA | \
+   GST_USB_FEATURE_TEST)
+
+/**
+ * Payload of #GST_USB_HELLO
+ */
+typedef struct _GstUsbHello
+{
+  /** #GST_USB_PROTOCOL_VERSION of the sender */
+  unsigned int version;
+
+  /** Mask of #GST_USB_FEATURE supported by the sender */
+  unsigned int features;
+
+  /** Largest single bulk transfer the sender handles, 0 for no limit */
+  unsigned int max_transfer;
+
+  /** LINK_TEST_PATTERN the sender streams or checks, LINK_TEST_NONE out
+   * of test mode. Both ends must be in the same one */
+  unsigned int test_mode;
+
+  /** Bytes per transfer in test mode. The sink sends its own, the src
+   * replies with the one it reads with, 0 if it refused it */
+  unsigned int test_size;
+
+} GstUsbHello;
+
+/** A transfer limit in whole high speed packets, so the chunks of a
+ * payload never end in a short packet. 0 means no limit */
+#define GST_USB_ALIGN_TRANSFER(max) \
+  ((max) == 0 ? 0 : MAX ((max) & ~(GST_USB_STRIPE_ALIGN - 1), \
+			 GST_USB_STRIPE_ALIGN))
+
+/** Smallest of two transfer limits */
+#define GST_USB_MIN_TRANSFER(a, b) \
+  (((a) == 0 || ((b) != 0 && (b) < (a))) ? (b) : (a))
+
+/**
+ * Vendor control requests on ep0, used for queries that need a reply.
+ * wIndex carries the stream id where it applies.
+ */
+typedef enum _GST_USB_REQUEST
+{
+  /** Caps the src accepts on a stream, replied as a caps string */
+  GST_USB_REQ_GET_CAPS = 0x40,
+
+  /** Src system time, replied as a little endian 64 bits nanoseconds
+   * count */
+  GST_USB_REQ_GET_TIME
+
+} GST_USB_REQUEST;
+
+/** Largest reply of a vendor request, the gadgetfs ep0 limit */
+#define GST_USB_REQUEST_MAX 4096
+
+/**
+ * Several streams share the link, each sink pad of usbsink is paired with
+ * a src pad of usbsrc. Stream 0 belongs to the always pads, the rest to
+ * the request pads of usbsink and the sometimes pads of usbsrc.
+ */
+#define GST_USB_MAX_STREAMS 128
+
+/** The stream id goes in the upper byte of messages and frame length
+ * words, bit 31 is left for the frame flags */
+#define GST_USB_STREAM_SHIFT 24
+#define GST_USB_STREAM_MASK (0x7fu << GST_USB_STREAM_SHIFT)
+#define GST_USB_WITH_STREAM(word, stream) \
+  ((word) | ((unsigned int) (stream) << GST_USB_STREAM_SHIFT))
+#define GST_USB_GET_STREAM(word) \
+  (((word) & GST_USB_STREAM_MASK) >> GST_USB_STREAM_SHIFT)
+
+/** Message type of a notification that may carry a stream id */
+#define GST_USB_MESSAGE_TYPE(word) ((word) & ~GST_USB_STREAM_MASK)
+
+/**
+ * Stream framing: every buffer is sent as a #GstUsbFramePreamble, the GDP
+ * header and the payload, each one in a transfer of its own. The length
+ * word in the preamble also carries the stream id and the frame flags.
+ * The GDP header carries its CRC, so a receiver that lost track of the
+ * frame boundaries skips transfers until a valid preamble shows up. The
+ * second part of a striped payload follows a #GstUsbStripeTag on the
+ * second stream endpoint, so the stripes of the frames skipped meanwhile
+ * are skipped too.
+ */
+
+/** Magic number starting every frame, "USBF" in memory order */
+#define GST_USB_FRAME_MAGIC 0x46425355u
+
+/**
+ * First transfer of a frame
+ */
+typedef struct _GstUsbFramePreamble
+{
+  /** #GST_USB_FRAME_MAGIC */
+  unsigned int magic;
+
+  /** GDP header length, stream id and frame flags */
+  unsigned int word;
+
+  /** #GST_USB_FRAME_CHECK of word */
+  unsigned int check;
+
+  /** CRC32C of the payload if the word has #GST_USB_FRAME_CRC set */
+  unsigned int crc;
+
+  /** Length of the payload on the link if the word has
+   * #GST_USB_FRAME_LZ4 or #GST_USB_FRAME_DELTA set, the GDP header has
+   * the decoded one */
+  unsigned int wire_length;
+
+  /** Reference a #GST_USB_FRAME_DELTA payload applies to. A
+   * #GST_USB_FRAME_REF payload becomes the reference with this number, or
+   * with the next one if it's a delta itself */
+  unsigned int ref;
+
+  /** Number of the #GstUsbStripeTag the second part of the payload
+   * follows, if the word has #GST_USB_FRAME_STRIPED set */
+  unsigned int stripe;
+
+} GstUsbFramePreamble;
+
+#define GST_USB_FRAME_CHECK(word) (~(word) ^ GST_USB_FRAME_MAGIC)
+#define GST_USB_FRAME_PREAMBLE_IS_VALID(p) \
+  ((p)->magic == GST_USB_FRAME_MAGIC && \
+   (p)->check == GST_USB_FRAME_CHECK ((p)->word))
+
+/** Set in the header length when the payload is striped across the two
+ * stream endpoints */
+#define GST_USB_FRAME_STRIPED (1u << 31)
+
+/** Set in the header length when the preamble carries the payload CRC */
+#define GST_USB_FRAME_CRC (1u << 23)
+
+/** Set in the header length when the payload is LZ4 compressed */
+#define GST_USB_FRAME_LZ4 (1u << 22)
+
+/** Set in the header length when the payload is the delta_encode() of
+ * the frame against a reference */
+#define GST_USB_FRAME_DELTA (1u << 21)
+
+/** Set in the header length when the receiver has to keep the frame as
+ * the reference of its stream */
+#define GST_USB_FRAME_REF (1u << 20)
+
+/** Mask to get the header length out of the first word */
+#define GST_USB_FRAME_LENGTH_MASK 0x000fffffu
+
+/** Magic number starting every stripe tag, "USBS" in memory order */
+#define GST_USB_STRIPE_MAGIC 0x53425355u
+
+/**
+ * Transfer of its own on the second stream endpoint ahead of each stripe
+ */
+typedef struct _GstUsbStripeTag
+{
+  /** #GST_USB_STRIPE_MAGIC */
+  unsigned int magic;
+
+  /** Number of the stripe, as in the preamble of its frame */
+  unsigned int seq;
+
+} GstUsbStripeTag;
+
+/** Striped payloads are split at a high speed bulk packet boundary, the
+ * first part goes on the stream endpoint and the rest on the second one */
+#define GST_USB_STRIPE_ALIGN 512
+#define GST_USB_STRIPE_SPLIT(size) \
+  ((((size) / 2) + GST_USB_STRIPE_ALIGN - 1) & ~(GST_USB_STRIPE_ALIGN - 1))
+
 
 #endif /* __GST_USB_MESSAGES_H__ */
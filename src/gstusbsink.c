@@ -9,9 +9,17 @@
 #endif
 
 #include <gst/gst.h>
+#include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#ifdef HAVE_LZ4
+#  include <lz4.h>
+#endif
 #include "gstusbsink.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "linkemu.h"
 
 
 GST_DEBUG_CATEGORY_STATIC (gst_usb_sink_debug);
@@ -24,13 +32,193 @@ GST_DEBUG_CATEGORY_STATIC (gst_usb_sink_debug);
 #define GST_USB_SINK_STATE_UNLOCK(s) \
   (g_mutex_unlock(GST_USB_SINK_GET_STATE_LOCK(s)))
 
+#define GST_USB_SINK_QUEUE_LOCK(s) \
+  (g_mutex_lock(GST_USB_SINK(s)->queue_lock))
+#define GST_USB_SINK_QUEUE_UNLOCK(s) \
+  (g_mutex_unlock(GST_USB_SINK(s)->queue_lock))
+
+/* Same defaults as the queue element */
+#define DEFAULT_MAX_SIZE_BUFFERS 200
+#define DEFAULT_MAX_SIZE_BYTES   (10 * 1024 * 1024)
+#define DEFAULT_MAX_SIZE_TIME    GST_SECOND
+#define DEFAULT_LEAKY            GST_USB_SINK_NO_LEAK
+
+#define DEFAULT_GOP_DROP         FALSE
+#define DEFAULT_DROP_LATENCY     (200 * GST_MSECOND)
+#define DEFAULT_DROP_BACKLOG     0
+
+#define DEFAULT_STRIPED          FALSE
+#define DEFAULT_STRIPE_THRESHOLD (128 * 1024)
+
+#define DEFAULT_LANE_THRESHOLD   0
+
+#define DEFAULT_MAX_TRANSFER     0
+
+#define DEFAULT_RESUME           FALSE
+
+#define DEFAULT_CRC              FALSE
+
+#define DEFAULT_COMPRESS         FALSE
+#define DEFAULT_COMPRESS_WORKERS 0
+
+#define DEFAULT_TEST_MODE        LINK_TEST_NONE
+#define DEFAULT_TEST_SIZE        (64 * 1024)
+
+/* Nanoseconds between link test reports */
+#define TEST_REPORT_INTERVAL GST_SECOND
+
+#define DEFAULT_DELTA             FALSE
+#define DEFAULT_KEYFRAME_INTERVAL 30
+
+#define DEFAULT_THREAD_POLICY    SCHED_OTHER
+#define DEFAULT_THREAD_PRIORITY  1
+
+#define DEFAULT_BUSY_POLL        0
+#define DEFAULT_OPEN_TIMEOUT     10000
+
+/* Milliseconds between two attempts to open the gadget */
+#define OPEN_RETRY 100
+
+/* Payloads smaller than a packet aren't worth compressing */
+#define COMPRESS_MIN_SIZE GST_USB_STRIPE_ALIGN
+
+/* Ids the gadget enumerates with */
+#define GADGET_VENDOR_ID  0x0525
+#define GADGET_PRODUCT_ID 0xa4a4
+
+/* Microseconds between attempts to open the device again in resume mode */
+#define RELINK_INTERVAL 100000
+
+/* Timeout in milliseconds for control messages and for retrying a frame
+ * that already started crossing the link */
+#define TRANSFER_TIMEOUT 1000
+
+/* Milliseconds to wait for a notification before checking if the up
+ * events thread has to stop */
+#define NOTIFY_TIMEOUT 100
+
+/* Milliseconds to wait for the reply to a control request */
+#define CONTROL_TIMEOUT 2000
+
+/* Phases of the data path, profiled when configured with
+ * --enable-profiling. Render is upstream's thread, the rest the sender's */
+enum
+{
+  PROF_RENDER,
+  PROF_PREPARE,
+  PROF_HEADER_BUILD,
+  PROF_LENGTH_WRITE,
+  PROF_HEADER_WRITE,
+  PROF_PAYLOAD_WRITE,
+  PROF_N_PHASES
+};
+
+static const char *const prof_phases[PROF_N_PHASES] = {
+  "render", "prepare", "header-build", "length-write", "header-write",
+  "payload-write"
+};
+
+/* Figures of a phase in the stats, in usb_prof_phase order */
+static const gchar *const prof_figures[] = {
+  "count", "ns", "cycles", "instructions", "cache-misses"
+};
 
 enum
 {
   PROP_0,
-  PROP_USBSYNC
+  PROP_USBSYNC,
+  PROP_MAX_SIZE_BUFFERS,
+  PROP_MAX_SIZE_BYTES,
+  PROP_MAX_SIZE_TIME,
+  PROP_LEAKY,
+  PROP_GOP_DROP,
+  PROP_DROP_LATENCY,
+  PROP_DROP_BACKLOG,
+  PROP_STRIPED,
+  PROP_STRIPE_THRESHOLD,
+  PROP_LANE_THRESHOLD,
+  PROP_LANE_CAPS,
+  PROP_MAX_TRANSFER,
+  PROP_RESUME,
+  PROP_CRC,
+  PROP_COMPRESS,
+  PROP_COMPRESS_WORKERS,
+  PROP_DELTA,
+  PROP_KEYFRAME_INTERVAL,
+  PROP_TEST_MODE,
+  PROP_TEST_SIZE,
+  PROP_EMULATE,
+  PROP_THREAD_POLICY,
+  PROP_THREAD_PRIORITY,
+  PROP_THREAD_AFFINITY,
+  PROP_BUSY_POLL,
+  PROP_DEVICE,
+  PROP_OPEN_TIMEOUT,
+  PROP_STATS
 };
 
+#define GST_TYPE_USB_SINK_TEST_MODE (gst_usb_sink_test_mode_get_type ())
+
+static GType
+gst_usb_sink_test_mode_get_type (void)
+{
+  static GType usb_sink_test_mode_type = 0;
+  static const GEnumValue usb_sink_test_mode[] = {
+    {LINK_TEST_NONE, "Normal operation", "none"},
+    {LINK_TEST_ZERO, "Stream zeros", "zero"},
+    {LINK_TEST_MOD63, "Stream the mod63 pattern", "mod63"},
+    {0, NULL, NULL},
+  };
+
+  if (!usb_sink_test_mode_type) {
+    usb_sink_test_mode_type =
+      g_enum_register_static ("GstUsbSinkTestMode", usb_sink_test_mode);
+  }
+  return usb_sink_test_mode_type;
+}
+
+#define GST_TYPE_USB_SINK_LEAKY (gst_usb_sink_leaky_get_type ())
+
+static GType
+gst_usb_sink_leaky_get_type (void)
+{
+  static GType usb_sink_leaky_type = 0;
+  static const GEnumValue usb_sink_leaky[] = {
+    {GST_USB_SINK_NO_LEAK, "Not Leaky", "no"},
+    {GST_USB_SINK_LEAK_UPSTREAM, "Leaky on upstream (new buffers)", "upstream"},
+    {GST_USB_SINK_LEAK_DOWNSTREAM, "Leaky on downstream (old buffers)",
+     "downstream"},
+    {0, NULL, NULL},
+  };
+
+  if (!usb_sink_leaky_type) {
+    usb_sink_leaky_type =
+      g_enum_register_static ("GstUsbSinkLeaky", usb_sink_leaky);
+  }
+  return usb_sink_leaky_type;
+}
+
+#define GST_TYPE_USB_SINK_THREAD_POLICY (gst_usb_sink_thread_policy_get_type ())
+
+static GType
+gst_usb_sink_thread_policy_get_type (void)
+{
+  static GType usb_sink_thread_policy_type = 0;
+  static const GEnumValue usb_sink_thread_policy[] = {
+    {SCHED_OTHER, "Time sharing", "other"},
+    {SCHED_FIFO, "Real time, first in first out", "fifo"},
+    {SCHED_RR, "Real time, round robin", "rr"},
+    {0, NULL, NULL},
+  };
+
+  if (!usb_sink_thread_policy_type) {
+    usb_sink_thread_policy_type =
+      g_enum_register_static ("GstUsbSinkThreadPolicy",
+			      usb_sink_thread_policy);
+  }
+  return usb_sink_thread_policy_type;
+}
+
 /* the capabilities of the inputs and outputs.
  *
  * describe the real formats here.
@@ -41,6 +229,13 @@ static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
     GST_STATIC_CAPS ("ANY")
     );
 
+/* Extra streams multiplexed on the same link */
+static GstStaticPadTemplate stream_factory = GST_STATIC_PAD_TEMPLATE ("sink_%d",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS ("ANY")
+    );
+
 GST_BOILERPLATE (GstUsbSink, gst_usb_sink, GstBaseSink,
     GST_TYPE_BASE_SINK);
 
@@ -48,6 +243,7 @@ static void gst_usb_sink_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
 static void gst_usb_sink_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
+static void gst_usb_sink_finalize (GObject * object);
 static gboolean gst_usb_sink_set_caps 
     (GstBaseSink * bsink, GstCaps * caps);
 static GstCaps * gst_usb_sink_get_caps (GstBaseSink * bsink);
@@ -55,14 +251,45 @@ static GstFlowReturn gst_usb_sink_render
     (GstBaseSink *sink, GstBuffer *buffer);
 static gboolean gst_usb_sink_start (GstBaseSink *sink);
 static gboolean gst_usb_sink_stop (GstBaseSink *sink);
+static gboolean gst_usb_sink_unlock (GstBaseSink *sink);
+static gboolean gst_usb_sink_unlock_stop (GstBaseSink *sink);
+static gboolean gst_usb_sink_event (GstBaseSink *sink, GstEvent *event);
 static GstStateChangeReturn gst_usb_sink_change_state (GstElement *
     element, GstStateChange transition);
+static GstPad *gst_usb_sink_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * name);
+static void gst_usb_sink_release_pad (GstElement * element, GstPad * pad);
 
 /* Extra functions */
 void *gst_usb_sink_up_event (void *sink);	
 static void close_up_event(void *param);
-static GstCaps * gst_usb_sink_receive_caps(GstUsbSink *s);
-static gboolean gst_usb_sink_send_caps(GstUsbSink *s, GstCaps *caps);
+static void gst_usb_sink_ping(GstUsbSink *s);
+void *gst_usb_sink_control_reader (void *sink);
+static void gst_usb_sink_stop_control(GstUsbSink *s);
+static GstUsbSinkRequest *gst_usb_sink_control_send(GstUsbSink *s,
+    guint type, gconstpointer payload, guint length);
+static gboolean gst_usb_sink_control_wait(GstUsbSink *s,
+    GstUsbSinkRequest *req, guint *type, guint8 **payload, guint *length);
+static gboolean gst_usb_sink_hello(GstUsbSink *s, gchar **error);
+static gboolean gst_usb_sink_link_enter(GstUsbSink *s, gboolean control);
+static void gst_usb_sink_link_leave(GstUsbSink *s);
+static void gst_usb_sink_link_lost(GstUsbSink *s);
+void *gst_usb_sink_relinker (void *sink);
+static void gst_usb_sink_schedule(GstUsbSink *s, pthread_t thread,
+    const char *name);
+static GstCaps *gst_usb_sink_query_caps(GstUsbSink *s, guint stream);
+static gboolean gst_usb_sink_set_stream_caps(GstUsbSink *s, guint stream,
+    GstCaps *caps);
+static GstFlowReturn gst_usb_sink_enqueue(GstUsbSink *s, guint stream,
+    GstSegment *segment, GstBuffer *buffer);
+void *gst_usb_sink_sender (void *lane);
+void *gst_usb_sink_tester (void *sink);
+static void gst_usb_sink_stop_senders (GstUsbSink *s, gint n);
+static GstFlowReturn gst_usb_sink_send_buffer(GstUsbSink *s,
+    GstUsbSinkLane *lane, GstUsbSinkItem *item);
+static void gst_usb_sink_queue_flush(GstUsbSink *s);
+static GstStructure *gst_usb_sink_get_stats(GstUsbSink *s);
+static void gst_usb_sink_log_profile(GstUsbSink *s);
 
 
 /* GObject vmethod implementations */
@@ -80,6 +307,8 @@ gst_usb_sink_base_init (gpointer gclass)
 
     gst_element_class_add_pad_template (element_class,
       gst_static_pad_template_get (&sink_factory));
+    gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&stream_factory));
 }
 
 /* initialize the usbsink's class */
@@ -101,9 +330,14 @@ gst_usb_sink_class_init (GstUsbSinkClass * klass)
 
   gobject_class->set_property = gst_usb_sink_set_property;
   gobject_class->get_property = gst_usb_sink_get_property;
+  gobject_class->finalize = gst_usb_sink_finalize;
 
   gstelement_class->change_state =
     GST_DEBUG_FUNCPTR (gst_usb_sink_change_state);
+  gstelement_class->request_new_pad =
+    GST_DEBUG_FUNCPTR (gst_usb_sink_request_new_pad);
+  gstelement_class->release_pad =
+    GST_DEBUG_FUNCPTR (gst_usb_sink_release_pad);
 		  
   /* Using basesink class
    */
@@ -112,10 +346,127 @@ gst_usb_sink_class_init (GstUsbSinkClass * klass)
   gstbasesink_class->render = GST_DEBUG_FUNCPTR (gst_usb_sink_render);
   gstbasesink_class->start = GST_DEBUG_FUNCPTR (gst_usb_sink_start);
   gstbasesink_class->stop = GST_DEBUG_FUNCPTR (gst_usb_sink_stop);	
+  gstbasesink_class->unlock = GST_DEBUG_FUNCPTR (gst_usb_sink_unlock);
+  gstbasesink_class->unlock_stop =
+    GST_DEBUG_FUNCPTR (gst_usb_sink_unlock_stop);
+  gstbasesink_class->event = GST_DEBUG_FUNCPTR (gst_usb_sink_event);
 
     g_object_class_install_property (gobject_class, PROP_USBSYNC,
 				     g_param_spec_boolean ("usbsync", "UsbSync", "Synchronize timestamps with src time",
 							   TRUE, G_PARAM_READWRITE));    
+    g_object_class_install_property (gobject_class, PROP_MAX_SIZE_BUFFERS,
+				     g_param_spec_uint ("max-size-buffers", "Max. size (buffers)",
+							"Max. number of buffers waiting to be sent (0=disable)",
+							0, G_MAXUINT, DEFAULT_MAX_SIZE_BUFFERS, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_MAX_SIZE_BYTES,
+				     g_param_spec_uint ("max-size-bytes", "Max. size (bytes)",
+							"Max. amount of data waiting to be sent (bytes, 0=disable)",
+							0, G_MAXUINT, DEFAULT_MAX_SIZE_BYTES, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_MAX_SIZE_TIME,
+				     g_param_spec_uint64 ("max-size-time", "Max. size (ns)",
+							  "Max. amount of data waiting to be sent (in ns, 0=disable)",
+							  0, G_MAXUINT64, DEFAULT_MAX_SIZE_TIME, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_LEAKY,
+				     g_param_spec_enum ("leaky", "Leaky",
+							"Where the send queue leaks, if at all",
+							GST_TYPE_USB_SINK_LEAKY, DEFAULT_LEAKY, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_GOP_DROP,
+				     g_param_spec_boolean ("gop-drop", "GOP drop",
+							   "Under congestion skip delta units until the next keyframe",
+							   DEFAULT_GOP_DROP, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_DROP_LATENCY,
+				     g_param_spec_uint64 ("drop-latency", "Drop latency",
+							  "Queued time (in ns) that triggers GOP dropping (0=disable)",
+							  0, G_MAXUINT64, DEFAULT_DROP_LATENCY, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_DROP_BACKLOG,
+				     g_param_spec_uint ("drop-backlog", "Drop backlog",
+							"Queued bytes that trigger GOP dropping (0=disable)",
+							0, G_MAXUINT, DEFAULT_DROP_BACKLOG, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_STRIPED,
+				     g_param_spec_boolean ("striped", "Striped",
+							   "Split big payloads across two bulk endpoints",
+							   DEFAULT_STRIPED, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_STRIPE_THRESHOLD,
+				     g_param_spec_uint ("stripe-threshold", "Stripe threshold",
+							"Minimum payload size in bytes to be striped",
+							2 * GST_USB_STRIPE_ALIGN, G_MAXUINT, DEFAULT_STRIPE_THRESHOLD,
+							G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_LANE_THRESHOLD,
+				     g_param_spec_uint ("lane-threshold", "Lane threshold",
+							"Streams whose first buffer is smaller than this (bytes) go through the low latency lane (0=disable)",
+							0, G_MAXUINT, DEFAULT_LANE_THRESHOLD, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_LANE_CAPS,
+				     g_param_spec_boxed ("lane-caps", "Lane caps",
+							 "Streams whose first buffer has caps compatible with these go through the low latency lane",
+							 GST_TYPE_CAPS, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_MAX_TRANSFER,
+				     g_param_spec_uint ("max-transfer", "Max transfer",
+							"Largest bulk transfer in bytes, the smallest of both ends is used (0=unlimited)",
+							0, G_MAXUINT, DEFAULT_MAX_TRANSFER, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_RESUME,
+				     g_param_spec_boolean ("resume", "Resume",
+							   "Keep running across disconnections and resume the session once the src is back",
+							   DEFAULT_RESUME, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_CRC,
+				     g_param_spec_boolean ("crc", "CRC",
+							   "Send a CRC32C of every payload for the src to verify",
+							   DEFAULT_CRC, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_COMPRESS,
+				     g_param_spec_boolean ("compress", "Compress",
+							   "Compress payloads with LZ4 if the src supports it",
+							   DEFAULT_COMPRESS, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_COMPRESS_WORKERS,
+				     g_param_spec_uint ("compress-workers", "Compress workers",
+							"Threads compressing payloads in parallel (0=one per CPU)",
+							0, 64, DEFAULT_COMPRESS_WORKERS, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_DELTA,
+				     g_param_spec_boolean ("delta", "Delta",
+							   "Send raw video as its difference with the previous frame if the src supports it",
+							   DEFAULT_DELTA, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_KEYFRAME_INTERVAL,
+				     g_param_spec_uint ("keyframe-interval", "Keyframe interval",
+							"Delta frames between full frames (0=only the first)",
+							0, G_MAXUINT, DEFAULT_KEYFRAME_INTERVAL, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_TEST_MODE,
+				     g_param_spec_enum ("test-mode", "Test mode",
+							"Qualify the link streaming a test pattern instead of buffers, the src has to be in test mode too",
+							GST_TYPE_USB_SINK_TEST_MODE, DEFAULT_TEST_MODE, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_TEST_SIZE,
+				     g_param_spec_uint ("test-size", "Test size",
+							"Size in bytes of every transfer in test mode",
+							GST_USB_STRIPE_ALIGN, G_MAXINT, DEFAULT_TEST_SIZE, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_EMULATE,
+				     g_param_spec_string ("emulate", "Emulate",
+							  "Send through an emulated bad link described by this script, see linkemu.h (NULL=real link)",
+							  NULL, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_THREAD_POLICY,
+				     g_param_spec_enum ("thread-policy", "Thread policy",
+							"Scheduling policy of the I/O threads, the real time ones need CAP_SYS_NICE or an rtprio limit",
+							GST_TYPE_USB_SINK_THREAD_POLICY, DEFAULT_THREAD_POLICY, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_THREAD_PRIORITY,
+				     g_param_spec_int ("thread-priority", "Thread priority",
+						       "Real time priority of the I/O threads, with the fifo and rr policies",
+						       1, 99, DEFAULT_THREAD_PRIORITY, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_THREAD_AFFINITY,
+				     g_param_spec_string ("thread-affinity", "Thread affinity",
+							  "Cpus the I/O threads run on, as in \"0,2-3\" (NULL=any)",
+							  NULL, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_BUSY_POLL,
+				     g_param_spec_uint ("busy-poll", "Busy poll",
+							"Microseconds a transfer spins for its completion before sleeping, trading a core for the wakeup latency. The element then gets a libusb context of its own instead of sharing one with the other elements (0=never spin)",
+							0, G_MAXUINT, DEFAULT_BUSY_POLL, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_DEVICE,
+				     g_param_spec_string ("device", "Device",
+							  "Gadget to stream to among several, as in \"bus=1,port=2.1,serial=board3\", any field can be left out, or \"loop=<name>\" for the usbsrc of this process with that loop (NULL=the first free one)",
+							  NULL, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_OPEN_TIMEOUT,
+				     g_param_spec_uint ("open-timeout", "Open timeout",
+							"Milliseconds to wait for a gadget matching the device to show up before failing (0=wait for ever)",
+							0, G_MAXUINT, DEFAULT_OPEN_TIMEOUT, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_STATS,
+				     g_param_spec_boxed ("stats", "Statistics",
+							 "Send queue and drop statistics",
+							 GST_TYPE_STRUCTURE, G_PARAM_READABLE));
 }
 
 /* initialize the new element
@@ -127,15 +478,144 @@ static void
 gst_usb_sink_init (GstUsbSink * s,
     GstUsbSinkClass * gclass)
 {	
+  gint i;
+
   /* Initialize the data protocol library */	
   gst_dp_init();	
   s->usbsync = TRUE;
 
   s->play=FALSE;
-  s->host = g_malloc(sizeof(usb_host));
-  s->caps = NULL;
-  s->emptycaps = TRUE;
+  /* Not connected until started, get_caps may come before */
+  s->host = g_malloc0(sizeof(usb_host));
+  s->rtt = GST_CLOCK_TIME_NONE;
+  s->time_offset = 0;
+  memset (s->streams, 0, sizeof s->streams);
   s->state_lock = g_mutex_new ();	  
+  s->control_lock = g_mutex_new ();
+  s->pending_lock = g_mutex_new ();
+  s->control_reply = g_cond_new ();
+  s->pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+  s->next_seq = 0;
+  s->control_running = FALSE;
+
+  for (i = 0; i < GST_USB_SINK_N_LANES; i++) {
+    GstUsbSinkLane *lane = &s->lanes[i];
+
+    lane->sink = s;
+    lane->queue = g_queue_new ();
+    lane->item_add = g_cond_new ();
+    lane->sending = FALSE;
+    lane->cur_level_buffers = 0;
+    lane->cur_level_bytes = 0;
+    lane->last_stream = 0;
+    lane->sent = 0;
+  }
+  s->lanes[GST_USB_SINK_LANE_STREAM].endp = EP2_OUT;
+  s->lanes[GST_USB_SINK_LANE_LOW_LATENCY].endp = EP4_OUT;
+  s->queue_lock = g_mutex_new ();
+  s->item_del = g_cond_new ();
+  s->sender_running = FALSE;
+  s->flushing = FALSE;
+  s->sender_ret = GST_FLOW_OK;
+  s->max_size_buffers = DEFAULT_MAX_SIZE_BUFFERS;
+  s->max_size_bytes = DEFAULT_MAX_SIZE_BYTES;
+  s->max_size_time = DEFAULT_MAX_SIZE_TIME;
+  s->leaky = DEFAULT_LEAKY;
+  s->dropped = 0;
+
+  s->gop_drop = DEFAULT_GOP_DROP;
+  s->drop_latency = DEFAULT_DROP_LATENCY;
+  s->drop_backlog = DEFAULT_DROP_BACKLOG;
+  s->gop_dropping = FALSE;
+  s->congestion_events = 0;
+  s->dropped_delta = 0;
+  s->dropped_delta_bytes = 0;
+  s->dropped_late = 0;
+  s->striped = DEFAULT_STRIPED;
+  s->stripe_threshold = DEFAULT_STRIPE_THRESHOLD;
+  s->stripe_seq = 0;
+  s->lane_threshold = DEFAULT_LANE_THRESHOLD;
+  s->lane_caps = NULL;
+  s->max_transfer = DEFAULT_MAX_TRANSFER;
+  s->link_features = 0;
+  s->link_max_transfer = 0;
+  s->resume = DEFAULT_RESUME;
+  s->link_lock = g_mutex_new ();
+  s->link_cond = g_cond_new ();
+  s->link_state = GST_USB_SINK_LINK_UP;
+  s->link_closing = FALSE;
+  s->link_users = 0;
+  s->relinking = FALSE;
+  s->outage_start = GST_CLOCK_TIME_NONE;
+  s->outages = 0;
+  s->crc = DEFAULT_CRC;
+  s->compress = DEFAULT_COMPRESS;
+  s->compress_workers = DEFAULT_COMPRESS_WORKERS;
+  s->compress_pool = NULL;
+  s->compress_done = g_cond_new ();
+  s->compressed_frames = 0;
+  s->compressed_saved = 0;
+  s->delta = DEFAULT_DELTA;
+  s->keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+  memset (s->delta_refs, 0, sizeof s->delta_refs);
+  s->delta_scratch = NULL;
+  s->delta_scratch_size = 0;
+  s->delta_reset = FALSE;
+  s->delta_frames = 0;
+  s->delta_keyframes = 0;
+  s->delta_saved = 0;
+  s->test_mode = DEFAULT_TEST_MODE;
+  s->test_size = DEFAULT_TEST_SIZE;
+  s->test_running = FALSE;
+  s->test_bytes = 0;
+  s->test_retries = 0;
+  s->emulate = NULL;
+  s->sched.policy = DEFAULT_THREAD_POLICY;
+  s->sched.priority = DEFAULT_THREAD_PRIORITY;
+  s->sched.cpus = NULL;
+  s->thread_affinity = NULL;
+  s->busy_poll = DEFAULT_BUSY_POLL;
+  s->device = NULL;
+  s->open_timeout = DEFAULT_OPEN_TIMEOUT;
+  usb_host_match_parse (&s->match, NULL);
+#ifdef ENABLE_PROFILING
+  s->prof = usb_prof_new (prof_phases, PROF_N_PHASES);
+#else
+  s->prof = NULL;
+#endif
+}
+
+/* Everything from init lives until the element goes, the host is reused
+ * across state cycles */
+static void
+gst_usb_sink_finalize (GObject * object)
+{
+  GstUsbSink *s = GST_USB_SINK (object);
+  gint i;
+
+  g_free (s->emulate);
+  g_free (s->thread_affinity);
+  g_free (s->device);
+  if (s->prof)
+    usb_prof_free (s->prof);
+  gst_caps_replace (&s->lane_caps, NULL);
+  for (i = 0; i < GST_USB_SINK_N_LANES; i++) {
+    g_queue_free (s->lanes[i].queue);
+    g_cond_free (s->lanes[i].item_add);
+  }
+  g_hash_table_destroy (s->pending);
+  g_cond_free (s->control_reply);
+  g_cond_free (s->item_del);
+  g_cond_free (s->link_cond);
+  g_cond_free (s->compress_done);
+  g_mutex_free (s->state_lock);
+  g_mutex_free (s->control_lock);
+  g_mutex_free (s->pending_lock);
+  g_mutex_free (s->queue_lock);
+  g_mutex_free (s->link_lock);
+  g_free (s->host);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
 static void
@@ -148,6 +628,102 @@ gst_usb_sink_set_property (GObject * object, guint prop_id,
     case PROP_USBSYNC:
       filter->usbsync = g_value_get_boolean (value);
       break;
+    case PROP_MAX_SIZE_BUFFERS:
+      GST_USB_SINK_QUEUE_LOCK (filter);
+      filter->max_size_buffers = g_value_get_uint (value);
+      g_cond_broadcast (filter->item_del);
+      GST_USB_SINK_QUEUE_UNLOCK (filter);
+      break;
+    case PROP_MAX_SIZE_BYTES:
+      GST_USB_SINK_QUEUE_LOCK (filter);
+      filter->max_size_bytes = g_value_get_uint (value);
+      g_cond_broadcast (filter->item_del);
+      GST_USB_SINK_QUEUE_UNLOCK (filter);
+      break;
+    case PROP_MAX_SIZE_TIME:
+      GST_USB_SINK_QUEUE_LOCK (filter);
+      filter->max_size_time = g_value_get_uint64 (value);
+      g_cond_broadcast (filter->item_del);
+      GST_USB_SINK_QUEUE_UNLOCK (filter);
+      break;
+    case PROP_LEAKY:
+      filter->leaky = g_value_get_enum (value);
+      break;
+    case PROP_GOP_DROP:
+      filter->gop_drop = g_value_get_boolean (value);
+      break;
+    case PROP_DROP_LATENCY:
+      filter->drop_latency = g_value_get_uint64 (value);
+      break;
+    case PROP_DROP_BACKLOG:
+      filter->drop_backlog = g_value_get_uint (value);
+      break;
+    case PROP_STRIPED:
+      filter->striped = g_value_get_boolean (value);
+      break;
+    case PROP_STRIPE_THRESHOLD:
+      filter->stripe_threshold = g_value_get_uint (value);
+      break;
+    case PROP_LANE_THRESHOLD:
+      filter->lane_threshold = g_value_get_uint (value);
+      break;
+    case PROP_LANE_CAPS:
+      GST_OBJECT_LOCK (filter);
+      gst_caps_replace (&filter->lane_caps,
+          (GstCaps *) gst_value_get_caps (value));
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_MAX_TRANSFER:
+      filter->max_transfer = GST_USB_ALIGN_TRANSFER (g_value_get_uint (value));
+      break;
+    case PROP_RESUME:
+      filter->resume = g_value_get_boolean (value);
+      break;
+    case PROP_CRC:
+      filter->crc = g_value_get_boolean (value);
+      break;
+    case PROP_COMPRESS:
+      filter->compress = g_value_get_boolean (value);
+      break;
+    case PROP_COMPRESS_WORKERS:
+      filter->compress_workers = g_value_get_uint (value);
+      break;
+    case PROP_DELTA:
+      filter->delta = g_value_get_boolean (value);
+      break;
+    case PROP_KEYFRAME_INTERVAL:
+      filter->keyframe_interval = g_value_get_uint (value);
+      break;
+    case PROP_TEST_MODE:
+      filter->test_mode = g_value_get_enum (value);
+      break;
+    case PROP_TEST_SIZE:
+      filter->test_size = GST_USB_ALIGN_TRANSFER (g_value_get_uint (value));
+      break;
+    case PROP_EMULATE:
+      g_free (filter->emulate);
+      filter->emulate = g_value_dup_string (value);
+      break;
+    case PROP_THREAD_POLICY:
+      filter->sched.policy = g_value_get_enum (value);
+      break;
+    case PROP_THREAD_PRIORITY:
+      filter->sched.priority = g_value_get_int (value);
+      break;
+    case PROP_THREAD_AFFINITY:
+      g_free (filter->thread_affinity);
+      filter->thread_affinity = g_value_dup_string (value);
+      break;
+    case PROP_BUSY_POLL:
+      filter->busy_poll = g_value_get_uint (value);
+      break;
+    case PROP_DEVICE:
+      g_free (filter->device);
+      filter->device = g_value_dup_string (value);
+      break;
+    case PROP_OPEN_TIMEOUT:
+      filter->open_timeout = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -164,6 +740,92 @@ gst_usb_sink_get_property (GObject * object, guint prop_id,
     case PROP_USBSYNC:
       g_value_set_boolean (value, filter->usbsync);
       break;
+    case PROP_MAX_SIZE_BUFFERS:
+      g_value_set_uint (value, filter->max_size_buffers);
+      break;
+    case PROP_MAX_SIZE_BYTES:
+      g_value_set_uint (value, filter->max_size_bytes);
+      break;
+    case PROP_MAX_SIZE_TIME:
+      g_value_set_uint64 (value, filter->max_size_time);
+      break;
+    case PROP_LEAKY:
+      g_value_set_enum (value, filter->leaky);
+      break;
+    case PROP_GOP_DROP:
+      g_value_set_boolean (value, filter->gop_drop);
+      break;
+    case PROP_DROP_LATENCY:
+      g_value_set_uint64 (value, filter->drop_latency);
+      break;
+    case PROP_DROP_BACKLOG:
+      g_value_set_uint (value, filter->drop_backlog);
+      break;
+    case PROP_STRIPED:
+      g_value_set_boolean (value, filter->striped);
+      break;
+    case PROP_STRIPE_THRESHOLD:
+      g_value_set_uint (value, filter->stripe_threshold);
+      break;
+    case PROP_LANE_THRESHOLD:
+      g_value_set_uint (value, filter->lane_threshold);
+      break;
+    case PROP_LANE_CAPS:
+      GST_OBJECT_LOCK (filter);
+      gst_value_set_caps (value, filter->lane_caps);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_MAX_TRANSFER:
+      g_value_set_uint (value, filter->max_transfer);
+      break;
+    case PROP_RESUME:
+      g_value_set_boolean (value, filter->resume);
+      break;
+    case PROP_CRC:
+      g_value_set_boolean (value, filter->crc);
+      break;
+    case PROP_COMPRESS:
+      g_value_set_boolean (value, filter->compress);
+      break;
+    case PROP_COMPRESS_WORKERS:
+      g_value_set_uint (value, filter->compress_workers);
+      break;
+    case PROP_DELTA:
+      g_value_set_boolean (value, filter->delta);
+      break;
+    case PROP_KEYFRAME_INTERVAL:
+      g_value_set_uint (value, filter->keyframe_interval);
+      break;
+    case PROP_TEST_MODE:
+      g_value_set_enum (value, filter->test_mode);
+      break;
+    case PROP_TEST_SIZE:
+      g_value_set_uint (value, filter->test_size);
+      break;
+    case PROP_EMULATE:
+      g_value_set_string (value, filter->emulate);
+      break;
+    case PROP_THREAD_POLICY:
+      g_value_set_enum (value, filter->sched.policy);
+      break;
+    case PROP_THREAD_PRIORITY:
+      g_value_set_int (value, filter->sched.priority);
+      break;
+    case PROP_THREAD_AFFINITY:
+      g_value_set_string (value, filter->thread_affinity);
+      break;
+    case PROP_BUSY_POLL:
+      g_value_set_uint (value, filter->busy_poll);
+      break;
+    case PROP_DEVICE:
+      g_value_set_string (value, filter->device);
+      break;
+    case PROP_OPEN_TIMEOUT:
+      g_value_set_uint (value, filter->open_timeout);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_usb_sink_get_stats (filter));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -172,214 +834,1891 @@ gst_usb_sink_get_property (GObject * object, guint prop_id,
 
 /* GstElement vmethod implementations */
 
+/* Runs a query as a vendor request on the control pipe if the src takes
+ * them, as a control message otherwise or if the src stalls the request,
+ * as it does with replies over GST_USB_REQUEST_MAX. The reply belongs to
+ * the caller */
+static gboolean
+gst_usb_sink_query (GstUsbSink *s, guint type, guint8 request, guint stream,
+		    guint8 **reply, guint *length)
+{
+  GstUsbSinkRequest *req;
+  guint reply_type;
+  int transferred;
+
+  if (s->link_features & GST_USB_FEATURE_VENDOR)
+  {
+    if (!gst_usb_sink_link_enter (s, TRUE))
+      return FALSE;
+    *reply = g_malloc (GST_USB_REQUEST_MAX);
+    if (usb_host_device_control(s->host, 1, request, 0, stream, *reply,
+				GST_USB_REQUEST_MAX, TRANSFER_TIMEOUT,
+				&transferred) == EOK)
+    {
+      gst_usb_sink_link_leave (s);
+      *length = transferred;
+      return TRUE;
+    }
+    gst_usb_sink_link_leave (s);
+    g_free (*reply);
+    GST_DEBUG_OBJECT (s, "Vendor request 0x%02x failed, asking with a "
+		      "control message", request);
+  }
+
+  req = gst_usb_sink_control_send (s, GST_USB_WITH_STREAM (type, stream),
+				   NULL, 0);
+  if (req == NULL)
+    return FALSE;
+  return gst_usb_sink_control_wait (s, req, &reply_type, reply, length);
+}
+
+/* Asks the src for the caps it accepts on the given stream */
 static GstCaps *
-gst_usb_sink_get_caps (GstBaseSink * bs)
+gst_usb_sink_query_caps (GstUsbSink *s, guint stream)
 {
-  GstUsbSink *s = GST_USB_SINK (bs);  
-  guint *notification = g_malloc(sizeof(guint));
+  guint8 *reply;
+  guint length;
+  gchar *str;
+  GstCaps *caps;
 
   /* If device is not connected try later */
   if (s->host->connected != 1)
     return NULL;
-		
-  /* Wait for device to finish tasks */
-  GST_USB_SINK_STATE_LOCK(s);
-  
-  s->emptycaps = TRUE;
-  notification[0] = GST_USB_GET_CAPS; /* Ask for src's caps */	 
-  
-  if (usb_host_device_transfer(s->host, 
-			       EP1_OUT, 
- 			       (unsigned char *) notification,
-		               sizeof(guint),
-			       0) == ERR_TRANSFER)
-  {   
-    g_free(notification);
-    GST_USB_SINK_STATE_UNLOCK(s);
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-    ("Error sending get caps notification"));
-    return NULL;						  
-  } 
-  
-  g_free(notification);	
-  GST_USB_SINK_STATE_UNLOCK(s);
- 
-  GST_DEBUG_OBJECT(s, "Waiting for caps");
-  /* Wait until up_events thread fills the caps */
-  while (s->emptycaps)
-    g_usleep(1000);	
-  
-  GST_DEBUG_OBJECT(s, "Caps received");
+
+  if (!gst_usb_sink_query (s, GST_USB_GET_CAPS, GST_USB_REQ_GET_CAPS, stream,
+			   &reply, &length))
+  {
+    GST_WARNING_OBJECT(s, "Src didn't reply the caps of stream %u", stream);
+    return NULL;
+  }
+  str = g_strndup ((gchar *) reply, length);
+  g_free (reply);
+
+  GST_DEBUG_OBJECT(s, "Caps of stream %u: %s", stream, str);
+  caps = gst_caps_from_string (str);
+  g_free (str);
   
-  return s->caps;
+  return caps;
 }
 
-static gboolean
-gst_usb_sink_set_caps (GstBaseSink * bs, GstCaps * caps)
+/* Time sync ping, the offset assumes the reply was taken half way
+ * through the round trip */
+static void
+gst_usb_sink_ping (GstUsbSink *s)
 {
-  GstUsbSink *s = GST_USB_SINK (bs);
-  guint *notification =	g_malloc(sizeof(guint));
-  gboolean ret=TRUE;
-  
-  /* If device is not connected try later */
-  if (s->host->connected != 1)
-    return FALSE;
-  
-  /* Wait for host to finish tasks */
-  GST_USB_SINK_STATE_LOCK(s);
-  
-  /* Ask the src to set the following caps */
-  notification[0] = GST_USB_SET_CAPS; 
-
-  /* Notify that these caps are needed to be set */	
-  if (usb_host_device_transfer(s->host, 
-                               EP1_OUT, 
-                              (unsigned char *) notification,
-                               sizeof(guint),
-                               0) == ERR_TRANSFER)
-  {   
-    g_free(notification);
-    GST_USB_SINK_STATE_UNLOCK(s);
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-		      ("Error sending caps"));
-    return FALSE;						  
-  } 
-  
-  ret = gst_usb_sink_send_caps(s, caps);
-  GST_USB_SINK_STATE_UNLOCK(s);
+  GstClockTime sent, received, remote;
+  guint8 *reply;
+  guint length;
 
-  return TRUE;
+  sent = gst_util_get_timestamp ();
+  if (!gst_usb_sink_query (s, GST_USB_GET_TIME, GST_USB_REQ_GET_TIME, 0,
+			   &reply, &length))
+  {
+    GST_WARNING_OBJECT(s, "Src didn't reply the time ping");
+    return;
+  }
+  received = gst_util_get_timestamp ();
+  if (length != 8)
+  {
+    GST_WARNING_OBJECT(s, "Bad reply to the time ping");
+    g_free (reply);
+    return;
+  }
+  remote = GST_READ_UINT64_LE (reply);
+  g_free (reply);
+
+  s->rtt = received - sent;
+  s->time_offset = GST_CLOCK_DIFF (sent + s->rtt / 2, remote);
+  GST_DEBUG_OBJECT(s, "Link round trip %" GST_TIME_FORMAT ", src clock "
+		   "offset %" G_GINT64_FORMAT " ns", GST_TIME_ARGS (s->rtt),
+		   s->time_offset);
 }
 
-static GstFlowReturn gst_usb_sink_render (GstBaseSink *bs, 
-					  GstBuffer *buffer)
+/* Writes a control request, several can be in flight and each one is
+ * matched with its reply by gst_usb_sink_control_wait() */
+static GstUsbSinkRequest *
+gst_usb_sink_control_send (GstUsbSink *s, guint type, gconstpointer payload,
+			   guint length)
 {
-  GstUsbSink *s = GST_USB_SINK (bs);
-  GstDPPacketizer *gdp = gst_dp_packetizer_new (GST_DP_VERSION_0_2);
-  guint *length; 
-  guint8 *header;
-  
-  /* Syncronize timestamps */
-  if (s->usbsync)
-    GST_BUFFER_TIMESTAMP(buffer) -= s->sync;
-  
-  
+  GstUsbSinkRequest *req = g_new0 (GstUsbSinkRequest, 1);
+  GstUsbControlHeader header;
+  gboolean ok;
 
-  /* Start transfer */  
-  length = g_malloc(sizeof(guint));
-  gdp->header_from_buffer(buffer,
-                          GST_DP_HEADER_FLAG_NONE,
-			  &length[0],
-                          &header);
+  g_mutex_lock (s->pending_lock);
+  /* 0 is never used as a sequence number */
+  if (++s->next_seq == 0)
+    s->next_seq++;
+  req->seq = s->next_seq;
+  g_hash_table_insert (s->pending, GUINT_TO_POINTER (req->seq), req);
+  g_mutex_unlock (s->pending_lock);
+
+  header.type = type;
+  header.seq = req->seq;
+  header.length = length;
 
-  /* Send as first byte the header size */
-  if (usb_host_device_transfer(s->host, 
-                               EP2_OUT, 
-                              (unsigned char *) length,
-                               sizeof(guint),
-                               0) == ERR_TRANSFER)
+  /* The payload has to follow its own header on the link */
+  ok = gst_usb_sink_link_enter (s, TRUE);
+  if (ok)
   {
-    g_free(length);
-    g_free(header);
-    gst_dp_packetizer_free (gdp);
-    return GST_FLOW_ERROR;								  
-  }
-  /* Now send the header */									 
-  if (usb_host_device_transfer(s->host, 
-                               EP2_OUT, 
-                              (unsigned char *) header,
-                               length[0],
-                               0) == ERR_TRANSFER)
-  {   
-    g_free(length);
-    g_free(header);
-    gst_dp_packetizer_free (gdp);
-    return GST_FLOW_ERROR;								  
+    g_mutex_lock (s->control_lock);
+    ok = usb_host_device_transfer(s->host, EP1_OUT,
+				  (unsigned char *) &header, sizeof header,
+				  TRANSFER_TIMEOUT) == EOK &&
+      (length == 0 ||
+       usb_host_device_transfer(s->host, EP1_OUT, (unsigned char *) payload,
+				length, TRANSFER_TIMEOUT) == EOK);
+    g_mutex_unlock (s->control_lock);
+    gst_usb_sink_link_leave (s);
+    if (!ok && s->resume)
+      gst_usb_sink_link_lost (s);
   }
-  /* Now send the buffer */									 
-  if (usb_host_device_transfer(s->host, 
-                               EP2_OUT, 
-                              (unsigned char *) buffer->data,
-                               buffer->size,
-                               0) == ERR_TRANSFER)
-  {   
-    g_free(length);
-    g_free(header);
-    gst_dp_packetizer_free (gdp);
-    return GST_FLOW_ERROR;								  
+  if (!ok)
+  {
+    g_mutex_lock (s->pending_lock);
+    g_hash_table_remove (s->pending, GUINT_TO_POINTER (req->seq));
+    g_mutex_unlock (s->pending_lock);
+    g_free (req);
+    return NULL;
   }
-  g_free(length);
-  g_free(header);
-  gst_dp_packetizer_free (gdp); 
 
-  return GST_FLOW_OK;
+  return req;
 }
 
-/* Use this to define a search timeout, currently there's no*/
-#define TIMEOUT 10
+/* Waits for the reply to a request and frees it. On success the payload
+ * of the reply belongs to the caller */
+static gboolean
+gst_usb_sink_control_wait (GstUsbSink *s, GstUsbSinkRequest *req,
+			   guint *type, guint8 **payload, guint *length)
+{
+  GTimeVal timeout;
+  gboolean ret;
 
-static gboolean gst_usb_sink_start (GstBaseSink *bs)
+  g_get_current_time (&timeout);
+  g_time_val_add (&timeout, CONTROL_TIMEOUT * 1000);
+
+  g_mutex_lock (s->pending_lock);
+  while (!req->done)
+    if (!g_cond_timed_wait (s->control_reply, s->pending_lock, &timeout))
+      break;
+  g_hash_table_remove (s->pending, GUINT_TO_POINTER (req->seq));
+  g_mutex_unlock (s->pending_lock);
+
+  ret = req->done && !req->failed;
+  if (ret)
+  {
+    *type = req->reply.type;
+    *payload = req->payload;
+    *length = req->reply.length;
+  }
+  else
+  {
+    GST_WARNING_OBJECT (s, "No reply to control request %u", req->seq);
+    g_free (req->payload);
+  }
+  g_free (req);
+
+  return ret;
+}
+
+/* Capability exchange, both ends go with the features they have in
+ * common and the smallest transfer limit. On failure error tells why */
+static gboolean
+gst_usb_sink_hello (GstUsbSink *s, gchar **error)
 {
-  GstUsbSink *s = GST_USB_SINK (bs);   
+  GstUsbSinkRequest *req;
+  GstUsbHello hello, *remote;
+  guint8 *reply;
+  guint type, length;
 
-  /* Init usb context */
-  if (usb_host_new(s->host, LEVEL3) != EOK)
+  hello.version = GST_USB_PROTOCOL_VERSION;
+  hello.features = GST_USB_FEATURES_ALL;
+  if (!s->crc)
+    hello.features &= ~GST_USB_FEATURE_CRC;
+  if (!s->compress)
+    hello.features &= ~GST_USB_FEATURE_LZ4;
+  if (!s->delta)
+    hello.features &= ~GST_USB_FEATURE_DELTA;
+  if (s->test_mode == LINK_TEST_NONE)
+    hello.features &= ~GST_USB_FEATURE_TEST;
+  hello.max_transfer = s->max_transfer;
+  hello.test_mode = s->test_mode;
+  hello.test_size = s->test_mode == LINK_TEST_NONE ? 0 : s->test_size;
+
+  req = gst_usb_sink_control_send (s, GST_USB_HELLO, &hello, sizeof hello);
+  if (req == NULL || !gst_usb_sink_control_wait (s, req, &type, &reply,
+						 &length))
   {
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-            ("Failed opening usb context!"));
+    *error = g_strdup ("No reply to the capability exchange");
     return FALSE;
   }
-  GST_DEBUG_OBJECT(s, "Success opening usb context.");
-  
-  /* Give a little time to gadget to connect */
-  GST_DEBUG_OBJECT(s, "Searching for a gadget device");
-  /* TODO: see if a timeout is required */
-  for (;;)
+  if (GST_USB_MESSAGE_TYPE (type) != GST_USB_HELLO ||
+      length != sizeof (GstUsbHello))
   {
-    /* Usb host object, vendor ID, product ID */
-    if (usb_host_device_open(s->host, 0x0525, 0xa4a4)==EOK)
-    {
-      GST_DEBUG_OBJECT(s, "Found a gadget device.");
-      goto success;	  
-    }
+    g_free (reply);
+    *error = g_strdup ("Src doesn't support the capability exchange");
+    return FALSE;
   }
-  GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-    ("Error opening usb device!"));
-  return FALSE;
-  
-success:  
-  GST_USB_SINK_STATE_UNLOCK(s);
-  /* Create the up events thread to receive connection form gadget */
-  if (pthread_create (&(s->host->up_events), NULL,
-	 (void *) gst_usb_sink_up_event, (void *) bs) != 0)
+
+  remote = (GstUsbHello *) reply;
+  if (remote->version != GST_USB_PROTOCOL_VERSION)
   {
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-      ("Unable to create up events thread, aborting.."));	  
+    *error = g_strdup_printf ("Src speaks protocol version %u, expected %u",
+			      remote->version, GST_USB_PROTOCOL_VERSION);
+    g_free (reply);
     return FALSE;
   }
-  
-  /* Waiting for the connected notification on the events thread*/
-  while (s->host->connected != 1)
-    g_usleep(1000); /* Wait a millisecond */
-  GST_DEBUG_OBJECT(s, "Connection stablished");
-   	
+  /* A test would only report errors for what the other end got wrong */
+  if (remote->test_mode != hello.test_mode ||
+      remote->test_size != hello.test_size)
+  {
+    *error = g_strdup_printf ("Src tests with pattern %u and %u byte "
+			      "transfers, expected pattern %u and %u bytes",
+			      remote->test_mode, remote->test_size,
+			      hello.test_mode, hello.test_size);
+    g_free (reply);
+    return FALSE;
+  }
+  s->link_features = hello.features & remote->features;
+  s->link_max_transfer = GST_USB_MIN_TRANSFER (hello.max_transfer,
+					       remote->max_transfer);
+  g_free (reply);
+
+  GST_INFO_OBJECT (s, "Link features 0x%x, max transfer %u bytes",
+		   s->link_features, s->link_max_transfer);
   return TRUE;
 }
 
+/* Asks the src to set the caps on the given stream */
+static gboolean
+gst_usb_sink_set_stream_caps (GstUsbSink *s, guint stream, GstCaps *caps)
+{
+  GstUsbSinkRequest *req;
+  guint8 *reply;
+  guint type, length;
+  gchar *str;
+  gboolean ret;
+  
+  /* If device is not connected try later */
+  if (s->host->connected != 1)
+    return FALSE;
+
+  if (stream != 0 && !(s->link_features & GST_USB_FEATURE_STREAMS))
+  {
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+		      ("Src doesn't support several streams"));
+    return FALSE;
+  }
+  
+  str = gst_caps_to_string (caps);
+  req = gst_usb_sink_control_send (s,
+				   GST_USB_WITH_STREAM (GST_USB_SET_CAPS,
+							stream),
+				   str, strlen (str) + 1);
+  g_free (str);
+  /* In resume mode the caps are sent again once the link is back */
+  if (req == NULL)
+  {
+    if (s->resume)
+      GST_WARNING_OBJECT (s, "Error sending caps of stream %u", stream);
+    else
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			("Error sending caps"));
+    return FALSE;						  
+  } 
+
+  /* The src acks once it tried to set them */
+  if (!gst_usb_sink_control_wait (s, req, &type, &reply, &length))
+  {
+    if (s->resume)
+      GST_WARNING_OBJECT (s, "Src didn't acknowledge the caps of stream %u",
+			  stream);
+    else
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			("Src didn't acknowledge the caps of stream %u",
+			 stream));
+    return FALSE;
+  }
+  ret = GST_USB_MESSAGE_TYPE (type) == GST_USB_ACK &&
+    length == sizeof (guint) && *(guint *) reply == 0;
+  g_free (reply);
+  if (!ret)
+    GST_WARNING_OBJECT (s, "Src refused the caps of stream %u", stream);
+
+  return ret;
+}
+
+static GstCaps *
+gst_usb_sink_get_caps (GstBaseSink * bs)
+{
+  return gst_usb_sink_query_caps (GST_USB_SINK (bs), 0);
+}
+
+static gboolean
+gst_usb_sink_set_caps (GstBaseSink * bs, GstCaps * caps)
+{
+  gst_usb_sink_set_stream_caps (GST_USB_SINK (bs), 0, caps);
+  return TRUE;
+}
+
+/* Time span covered by the queued buffers, as the queue element does it */
+static GstClockTime
+gst_usb_sink_queue_time_level (GstUsbSinkLane *lane)
+{
+  GstUsbSinkItem *head, *tail;
+
+  head = g_queue_peek_head (lane->queue);
+  tail = g_queue_peek_tail (lane->queue);
+  if (head == NULL || !GST_BUFFER_TIMESTAMP_IS_VALID (head->buffer) ||
+      !GST_BUFFER_TIMESTAMP_IS_VALID (tail->buffer) ||
+      GST_BUFFER_TIMESTAMP (tail->buffer) < GST_BUFFER_TIMESTAMP (head->buffer))
+    return 0;
+
+  return GST_BUFFER_TIMESTAMP (tail->buffer) -
+      GST_BUFFER_TIMESTAMP (head->buffer);
+}
+
+/* Must be called with the queue lock held. An empty queue is never full,
+ * so a single buffer bigger than max-size-bytes still goes through. */
+static gboolean
+gst_usb_sink_queue_is_full (GstUsbSink *s, GstUsbSinkLane *lane)
+{
+  if (lane->cur_level_buffers == 0)
+    return FALSE;
+  if (s->max_size_buffers && lane->cur_level_buffers >= s->max_size_buffers)
+    return TRUE;
+  if (s->max_size_bytes && lane->cur_level_bytes >= s->max_size_bytes)
+    return TRUE;
+  if (s->max_size_time &&
+      gst_usb_sink_queue_time_level (lane) >= s->max_size_time)
+    return TRUE;
+  return FALSE;
+}
+
+/* Raw video on the stream lane is delta coded, frames on the low latency
+ * lane may overtake it so they never take part */
+static gboolean
+gst_usb_sink_delta_wanted (GstUsbSink *s, GstUsbSinkLane *lane,
+			   GstBuffer *buffer)
+{
+  GstCaps *caps = GST_BUFFER_CAPS (buffer);
+
+  if (!(s->link_features & GST_USB_FEATURE_DELTA) ||
+      lane != &s->lanes[GST_USB_SINK_LANE_STREAM] ||
+      GST_BUFFER_SIZE (buffer) == 0 || caps == NULL || gst_caps_get_size (caps) == 0)
+    return FALSE;
+
+  return g_str_has_prefix (gst_structure_get_name (
+      gst_caps_get_structure (caps, 0)), "video/x-raw-");
+}
+
+/* Forgets the references, the next frame of every stream is a keyframe */
+static void
+gst_usb_sink_delta_clear (GstUsbSink *s)
+{
+  gint i;
+
+  for (i = 0; i < GST_USB_MAX_STREAMS; i++)
+  {
+    if (s->delta_refs[i].ref)
+      gst_buffer_unref (s->delta_refs[i].ref);
+    s->delta_refs[i].ref = NULL;
+    s->delta_refs[i].since_key = 0;
+  }
+}
+
+/* Codes a raw video buffer against the reference of its stream. Returns
+ * the frame flags, and the encoded payload if it's a delta. Falls back to
+ * a keyframe if there's no usable reference, the keyframe interval is up
+ * or the delta isn't any smaller */
+static guint
+gst_usb_sink_delta_encode (GstUsbSink *s, guint stream, GstBuffer *buffer,
+			   guint8 **payload, guint *payload_size, guint *ref)
+{
+  GstUsbSinkDelta *delta = &s->delta_refs[stream];
+  guint size = GST_BUFFER_SIZE (buffer);
+  gsize encoded;
+
+  if (s->delta_reset)
+  {
+    s->delta_reset = FALSE;
+    gst_usb_sink_delta_clear (s);
+  }
+
+  if (delta->ref && GST_BUFFER_SIZE (delta->ref) == size &&
+      (s->keyframe_interval == 0 || delta->since_key < s->keyframe_interval))
+  {
+    if (s->delta_scratch_size < size)
+    {
+      g_free (s->delta_scratch);
+      s->delta_scratch = g_malloc (size);
+      s->delta_scratch_size = size;
+    }
+    encoded = delta_encode (s->delta_scratch, size - 1,
+			    GST_BUFFER_DATA (buffer),
+			    GST_BUFFER_DATA (delta->ref), size);
+    if (encoded > 0)
+    {
+      *payload = s->delta_scratch;
+      *payload_size = encoded;
+      *ref = delta->id;
+      return GST_USB_FRAME_DELTA | GST_USB_FRAME_REF;
+    }
+  }
+
+  *ref = delta->id + 1;
+  return GST_USB_FRAME_REF;
+}
+
+/* The src has the frame now, it's the next reference */
+static void
+gst_usb_sink_delta_commit (GstUsbSink *s, guint stream, GstBuffer *buffer,
+			   guint flags, guint payload_size)
+{
+  GstUsbSinkDelta *delta = &s->delta_refs[stream];
+
+  gst_buffer_replace (&delta->ref, buffer);
+  delta->id++;
+  if (flags & GST_USB_FRAME_DELTA)
+  {
+    delta->since_key++;
+    s->delta_frames++;
+    s->delta_saved += GST_BUFFER_SIZE (buffer) - payload_size;
+  }
+  else
+  {
+    delta->since_key = 0;
+    s->delta_keyframes++;
+  }
+}
+
+static void
+gst_usb_sink_compressed_unref (GstUsbSinkCompressed *job)
+{
+  if (!g_atomic_int_dec_and_test (&job->refcount))
+    return;
+
+  gst_buffer_unref (job->buffer);
+  g_free (job->data);
+  g_slice_free (GstUsbSinkCompressed, job);
+}
+
+#ifdef HAVE_LZ4
+/* Compression worker, runs in the thread pool. Only keeps the result if
+ * it's smaller than the payload */
+static void
+gst_usb_sink_compress_func (gpointer data, gpointer user_data)
+{
+  GstUsbSinkCompressed *job = (GstUsbSinkCompressed *) data;
+  GstUsbSink *s = GST_USB_SINK (user_data);
+  guint size = GST_BUFFER_SIZE (job->buffer);
+  guint8 *out = g_malloc (size);
+  int ret;
+
+  ret = LZ4_compress_default ((const char *) GST_BUFFER_DATA (job->buffer),
+			      (char *) out, size, size - 1);
+  if (ret <= 0)
+  {
+    g_free (out);
+    out = NULL;
+    ret = 0;
+  }
+
+  GST_USB_SINK_QUEUE_LOCK (s);
+  job->data = out;
+  job->size = ret;
+  job->done = TRUE;
+  g_cond_broadcast (s->compress_done);
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+
+  gst_usb_sink_compressed_unref (job);
+}
+#endif
+
+/* Must be called with the queue lock held. Hands the buffer of a new
+ * item to the compression workers, the sender picks the result up */
+static void
+gst_usb_sink_compress_start (GstUsbSink *s, GstUsbSinkLane *lane,
+			     GstUsbSinkItem *item)
+{
+  GstUsbSinkCompressed *job;
+
+  if (s->compress_pool == NULL ||
+      !(s->link_features & GST_USB_FEATURE_LZ4) ||
+      GST_BUFFER_SIZE (item->buffer) < COMPRESS_MIN_SIZE ||
+      gst_usb_sink_delta_wanted (s, lane, item->buffer))
+    return;
+
+  job = g_slice_new0 (GstUsbSinkCompressed);
+  job->refcount = 2;
+  job->buffer = gst_buffer_ref (item->buffer);
+  item->compressed = job;
+  g_thread_pool_push (s->compress_pool, job, NULL);
+}
+
+static void
+gst_usb_sink_item_free (GstUsbSinkItem *item)
+{
+  if (item->compressed)
+    gst_usb_sink_compressed_unref (item->compressed);
+  gst_buffer_unref (item->buffer);
+  g_slice_free (GstUsbSinkItem, item);
+}
+
+/* Must be called with the queue lock held */
+static GstUsbSinkItem *
+gst_usb_sink_queue_pop (GstUsbSinkLane *lane)
+{
+  GstUsbSinkItem *item = g_queue_pop_head (lane->queue);
+
+  if (item) {
+    lane->cur_level_buffers--;
+    lane->cur_level_bytes -= GST_BUFFER_SIZE (item->buffer);
+    g_cond_broadcast (lane->sink->item_del);
+  }
+  return item;
+}
+
+/* Must be called with the queue lock held. Takes the oldest buffer of the
+ * stream following the last one served, so a busy stream can't starve
+ * the others sharing the lane. */
+static GstUsbSinkItem *
+gst_usb_sink_queue_pop_next (GstUsbSinkLane *lane)
+{
+  GstUsbSinkItem *item;
+  GList *link, *next = NULL;
+  guint dist, best = GST_USB_MAX_STREAMS;
+
+  for (link = g_queue_peek_head_link (lane->queue); link; link = link->next) {
+    item = link->data;
+    dist = (item->stream - lane->last_stream - 1) & (GST_USB_MAX_STREAMS - 1);
+    if (dist < best) {
+      best = dist;
+      next = link;
+      if (dist == 0)
+        break;
+    }
+  }
+  if (next == NULL)
+    return NULL;
+
+  item = next->data;
+  g_queue_delete_link (lane->queue, next);
+  lane->cur_level_buffers--;
+  lane->cur_level_bytes -= GST_BUFFER_SIZE (item->buffer);
+  lane->last_stream = item->stream;
+  g_cond_broadcast (lane->sink->item_del);
+  return item;
+}
+
+/* Drop everything still waiting to be sent */
+static void
+gst_usb_sink_queue_flush (GstUsbSink *s)
+{
+  GstUsbSinkItem *item;
+  gint i;
+
+  GST_USB_SINK_QUEUE_LOCK (s);
+  for (i = 0; i < GST_USB_SINK_N_LANES; i++)
+    while ((item = gst_usb_sink_queue_pop (&s->lanes[i])) != NULL)
+      gst_usb_sink_item_free (item);
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+}
+
+/* Drop what a request pad still has waiting to be sent */
+static void
+gst_usb_sink_queue_flush_stream (GstUsbSink *s, guint stream)
+{
+  GstUsbSinkLane *lane;
+  GstUsbSinkItem *item;
+  GList *link, *next;
+  gint i;
+
+  GST_USB_SINK_QUEUE_LOCK (s);
+  for (i = 0; i < GST_USB_SINK_N_LANES; i++)
+  {
+    lane = &s->lanes[i];
+    for (link = g_queue_peek_head_link (lane->queue); link; link = next)
+    {
+      next = link->next;
+      item = link->data;
+      if (item->stream != stream)
+        continue;
+      g_queue_delete_link (lane->queue, link);
+      lane->cur_level_buffers--;
+      lane->cur_level_bytes -= GST_BUFFER_SIZE (item->buffer);
+      gst_usb_sink_item_free (item);
+    }
+  }
+  g_cond_broadcast (s->item_del);
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+}
+
+/* Must be called with the queue lock held. A request pad flushes on its
+ * own, the element flushes them all. A released pad is flushing for good */
+static gboolean
+gst_usb_sink_is_flushing (GstUsbSink *s, guint stream)
+{
+  return s->flushing || (stream != 0 && (s->streams[stream] == NULL ||
+					  s->streams[stream]->flushing));
+}
+
+/* The deadline of a buffer is its running time plus the basesink
+ * max-lateness, translated to the system time so the sender thread can
+ * check it without the clock. */
+static GstClockTime
+gst_usb_sink_get_deadline (GstUsbSink *s, GstSegment *segment,
+			   GstBuffer *buffer)
+{
+  GstBaseSink *bs = GST_BASE_SINK (s);
+  gint64 max_lateness = gst_base_sink_get_max_lateness (bs);
+  GstClockTime now, running_time, clock_time;
+  GstClock *clock;
+
+  if (max_lateness < 0)
+    return GST_CLOCK_TIME_NONE;
+
+  now = gst_util_get_timestamp ();
+  if (!GST_BUFFER_TIMESTAMP_IS_VALID (buffer))
+    return now + max_lateness;
+
+  running_time = gst_segment_to_running_time (segment, GST_FORMAT_TIME,
+      GST_BUFFER_TIMESTAMP (buffer));
+  clock = gst_element_get_clock (GST_ELEMENT (s));
+  if (clock == NULL || !GST_CLOCK_TIME_IS_VALID (running_time)) {
+    if (clock)
+      gst_object_unref (clock);
+    return now + max_lateness;
+  }
+
+  clock_time = gst_clock_get_time (clock) -
+      gst_element_get_base_time (GST_ELEMENT (s));
+  gst_object_unref (clock);
+
+  /* Already late */
+  if (running_time + max_lateness <= clock_time)
+    return now;
+
+  return now + (running_time + max_lateness - clock_time);
+}
+
+/* Must be called with the queue lock held. Only the stream lane carries
+ * GOPs, so only its backlog counts. */
+static gboolean
+gst_usb_sink_is_congested (GstUsbSink *s)
+{
+  GstUsbSinkLane *lane = &s->lanes[GST_USB_SINK_LANE_STREAM];
+
+  if (s->drop_backlog && lane->cur_level_bytes >= s->drop_backlog)
+    return TRUE;
+  if (s->drop_latency &&
+      gst_usb_sink_queue_time_level (lane) >= s->drop_latency)
+    return TRUE;
+  return FALSE;
+}
+
+/* Must be called with the queue lock held. Decides whether the incoming
+ * buffer is part of a delta run that has to be skipped. Entering the
+ * dropping state also removes the delta units at the end of the queue,
+ * nothing queued after them depends on them. */
+static gboolean
+gst_usb_sink_gop_drop (GstUsbSink *s, GstBuffer *buffer)
+{
+  GstUsbSinkLane *lane = &s->lanes[GST_USB_SINK_LANE_STREAM];
+  GstUsbSinkItem *tail;
+  GList *link, *prev;
+
+  if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    if (s->gop_dropping)
+      GST_DEBUG_OBJECT (s, "Keyframe received, stop dropping");
+    s->gop_dropping = FALSE;
+    return FALSE;
+  }
+
+  if (!s->gop_dropping && gst_usb_sink_is_congested (s)) {
+    GST_DEBUG_OBJECT (s, "Link congested (%u bytes queued), dropping "
+        "delta units until the next keyframe", lane->cur_level_bytes);
+    s->gop_dropping = TRUE;
+    s->congestion_events++;
+
+    /* Other streams interleaved with the delta run stay queued */
+    link = g_queue_peek_tail_link (lane->queue);
+    while (link != NULL) {
+      prev = link->prev;
+      tail = link->data;
+      if (tail->stream == 0) {
+        if (!GST_BUFFER_FLAG_IS_SET (tail->buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+          break;
+        g_queue_delete_link (lane->queue, link);
+        lane->cur_level_buffers--;
+        lane->cur_level_bytes -= GST_BUFFER_SIZE (tail->buffer);
+        s->dropped_delta++;
+        s->dropped_delta_bytes += GST_BUFFER_SIZE (tail->buffer);
+        gst_usb_sink_item_free (tail);
+      }
+      link = prev;
+    }
+    g_cond_broadcast (s->item_del);
+  }
+
+  if (s->gop_dropping) {
+    s->dropped_delta++;
+    s->dropped_delta_bytes += GST_BUFFER_SIZE (buffer);
+  }
+
+  return s->gop_dropping;
+}
+
+/* Small buffers and the ones matching lane-caps skip the stream queue.
+ * The first buffer of a stream decides for the whole stream, the two
+ * lanes race each other and its frames must not overtake one another */
+static GstUsbSinkLane *
+gst_usb_sink_pick_lane (GstUsbSink *s, guint stream, GstBuffer *buffer)
+{
+  gboolean low_latency = FALSE;
+
+  if (!(s->link_features & GST_USB_FEATURE_LANE))
+    return &s->lanes[GST_USB_SINK_LANE_STREAM];
+
+  if (s->stream_lanes[stream] != NULL)
+    return s->stream_lanes[stream];
+
+  if (s->lane_threshold && GST_BUFFER_SIZE (buffer) < s->lane_threshold)
+    low_latency = TRUE;
+
+  GST_OBJECT_LOCK (s);
+  if (!low_latency && s->lane_caps && GST_BUFFER_CAPS (buffer))
+    low_latency = gst_caps_can_intersect (s->lane_caps,
+        GST_BUFFER_CAPS (buffer));
+  GST_OBJECT_UNLOCK (s);
+
+  s->stream_lanes[stream] = &s->lanes[low_latency ?
+      GST_USB_SINK_LANE_LOW_LATENCY : GST_USB_SINK_LANE_STREAM];
+  GST_DEBUG_OBJECT (s, "Stream %u goes through the %s lane", stream,
+      low_latency ? "low latency" : "stream");
+  return s->stream_lanes[stream];
+}
+
+static GstFlowReturn gst_usb_sink_render (GstBaseSink *bs, 
+					  GstBuffer *buffer)
+{
+  GstUsbSink *s = GST_USB_SINK (bs);
+  usb_prof_mark mark;
+  GstFlowReturn ret;
+
+  USB_PROF_START (&mark);
+  ret = gst_usb_sink_enqueue (s, 0, &bs->segment, buffer);
+  USB_PROF_LAP (s->prof, PROF_RENDER, &mark);
+  return ret;
+}
+
+/* Queues a buffer of any stream, blocking or leaking if the queue of its
+ * lane is full */
+static GstFlowReturn gst_usb_sink_enqueue (GstUsbSink *s, guint stream,
+					   GstSegment *segment,
+					   GstBuffer *buffer)
+{
+  GstUsbSinkLane *lane;
+  GstUsbSinkItem *item;
+  GstClockTime deadline;
+  GstFlowReturn ret;
+
+  /* The link belongs to the test pattern */
+  if (s->test_mode != LINK_TEST_NONE)
+    return GST_FLOW_OK;
+
+  deadline = gst_usb_sink_get_deadline (s, segment, buffer);
+
+  /* The queue keeps its own reference, with the timestamp shifted to
+   * the src's time base */
+  buffer = gst_buffer_make_metadata_writable (gst_buffer_ref (buffer));
+
+  /* Syncronize timestamps */
+  if (s->usbsync)
+    GST_BUFFER_TIMESTAMP(buffer) -= s->sync;
+
+  lane = gst_usb_sink_pick_lane (s, stream, buffer);
+
+  GST_USB_SINK_QUEUE_LOCK (s);
+  if (s->gop_drop && stream == 0 &&
+      lane == &s->lanes[GST_USB_SINK_LANE_STREAM] &&
+      gst_usb_sink_gop_drop (s, buffer)) {
+    GST_USB_SINK_QUEUE_UNLOCK (s);
+    gst_buffer_unref (buffer);
+    return GST_FLOW_OK;
+  }
+
+  while (s->sender_ret == GST_FLOW_OK &&
+         !gst_usb_sink_is_flushing (s, stream) &&
+         gst_usb_sink_queue_is_full (s, lane)) {
+    switch (s->leaky) {
+      case GST_USB_SINK_LEAK_UPSTREAM:
+        GST_LOG_OBJECT (s, "Send queue full, dropping incoming buffer");
+        s->dropped++;
+        GST_USB_SINK_QUEUE_UNLOCK (s);
+        gst_buffer_unref (buffer);
+        return GST_FLOW_OK;
+      case GST_USB_SINK_LEAK_DOWNSTREAM:
+        GST_LOG_OBJECT (s, "Send queue full, dropping oldest buffer");
+        s->dropped++;
+        gst_usb_sink_item_free (gst_usb_sink_queue_pop (lane));
+        break;
+      default:
+        g_cond_wait (s->item_del, s->queue_lock);
+        break;
+    }
+  }
+
+  if (gst_usb_sink_is_flushing (s, stream))
+    ret = GST_FLOW_WRONG_STATE;
+  else
+    ret = s->sender_ret;
+
+  if (ret != GST_FLOW_OK) {
+    GST_USB_SINK_QUEUE_UNLOCK (s);
+    gst_buffer_unref (buffer);
+    return ret;
+  }
+
+  item = g_slice_new (GstUsbSinkItem);
+  item->buffer = buffer;
+  item->deadline = deadline;
+  item->stream = stream;
+  item->compressed = NULL;
+  gst_usb_sink_compress_start (s, lane, item);
+  g_queue_push_tail (lane->queue, item);
+  lane->cur_level_buffers++;
+  lane->cur_level_bytes += GST_BUFFER_SIZE (buffer);
+  g_cond_signal (lane->item_add);
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+
+  return GST_FLOW_OK;
+}
+
+/* Milliseconds left until the deadline, never 0 since that means no
+ * timeout to libusb */
+static unsigned int
+gst_usb_sink_time_left (GstClockTime deadline)
+{
+  GstClockTime now;
+
+  if (!GST_CLOCK_TIME_IS_VALID (deadline))
+    return 0;
+
+  now = gst_util_get_timestamp ();
+  if (now >= deadline)
+    return 1;
+
+  return MAX (GST_TIME_AS_MSECONDS (deadline - now), 1);
+}
+
+/* Pushes the rest of a frame that already started crossing the link,
+ * running the given transfers concurrently. The src can't skip part of a
+ * frame, so timeouts are retried until the data goes through or the sink
+ * stops. */
+static gboolean
+gst_usb_sink_write_xfers (GstUsbSink *s, usb_host_transfer *xfers, gint n)
+{
+  gint i, left;
+
+  for (;;)
+  {
+    switch (usb_host_device_transfer_parallel(s->host, xfers, n,
+					      TRANSFER_TIMEOUT))
+    {
+      case EOK:
+        return TRUE;
+      case ERR_TIMEOUT:
+        if (!s->sender_running)
+          return FALSE;
+        /* Retry whatever didn't make it */
+        for (i = 0, left = 0; i < n; i++)
+        {
+          xfers[i].buffer += xfers[i].transferred;
+          xfers[i].length -= xfers[i].transferred;
+          if (xfers[i].length > 0)
+            xfers[left++] = xfers[i];
+        }
+        GST_LOG_OBJECT (s, "Link stalled, %d transfers pending", left);
+        if (left == 0)
+          return TRUE;
+        n = left;
+        break;
+      default:
+        return FALSE;
+    }
+  }
+}
+
+/* Runs the transfers in rounds of at most the link's transfer limit */
+static gboolean
+gst_usb_sink_write_chunked (GstUsbSink *s, usb_host_transfer *xfers, gint n)
+{
+  usb_host_transfer chunks[2];
+  guint max = s->link_max_transfer;
+  gint i, m;
+
+  if (max == 0)
+    return gst_usb_sink_write_xfers (s, xfers, n);
+
+  for (;;)
+  {
+    for (i = 0, m = 0; i < n; i++)
+    {
+      if (xfers[i].length == 0)
+        continue;
+      chunks[m] = xfers[i];
+      chunks[m].length = MIN ((guint) xfers[i].length, max);
+      xfers[i].buffer += chunks[m].length;
+      xfers[i].length -= chunks[m].length;
+      m++;
+    }
+    if (m == 0)
+      return TRUE;
+    if (!gst_usb_sink_write_xfers (s, chunks, m))
+      return FALSE;
+  }
+}
+
+static gboolean
+gst_usb_sink_write_all (GstUsbSink *s, EP_ADRESS endp,
+			unsigned char *data, guint size)
+{
+  usb_host_transfer xfer;
+
+  if (size == 0)
+    return TRUE;
+
+  xfer.endp = endp;
+  xfer.buffer = data;
+  xfer.length = size;
+  return gst_usb_sink_write_chunked (s, &xfer, 1);
+}
+
+/* Sends the payload, striped across both stream endpoints if the frame
+ * was flagged so. The stripe on EP3 goes after its tag */
+static gboolean
+gst_usb_sink_write_payload (GstUsbSink *s, EP_ADRESS endp,
+			    unsigned char *data, guint size, gboolean striped,
+			    guint stripe)
+{
+  usb_host_transfer xfers[2];
+  GstUsbStripeTag tag;
+  guint split;
+
+  if (!striped)
+    return gst_usb_sink_write_all (s, endp, data, size);
+
+  tag.magic = GST_USB_STRIPE_MAGIC;
+  tag.seq = stripe;
+  if (!gst_usb_sink_write_all (s, EP3_OUT, (unsigned char *) &tag,
+			       sizeof tag))
+    return FALSE;
+
+  split = GST_USB_STRIPE_SPLIT (size);
+  xfers[0].endp = EP2_OUT;
+  xfers[0].buffer = data;
+  xfers[0].length = split;
+  xfers[1].endp = EP3_OUT;
+  xfers[1].buffer = data + split;
+  xfers[1].length = size - split;
+  return gst_usb_sink_write_chunked (s, xfers, 2);
+}
+
+static GstFlowReturn gst_usb_sink_send_buffer (GstUsbSink *s,
+					       GstUsbSinkLane *lane,
+					       GstUsbSinkItem *item)
+{
+  GstDPPacketizer *gdp;
+  GstBuffer *buffer = item->buffer;
+  GstUsbFramePreamble preamble;
+  guint8 *header, *payload;
+  guint header_length, payload_size, delta_flags = 0, ref = 0;
+  gboolean striped;
+  int transferred;
+  HOST_EXIT_CODE ret;
+  usb_prof_mark mark;
+
+  USB_PROF_START (&mark);
+
+  /* Wait for the workers if the payload is being compressed, what goes
+   * on the link is the smaller of both */
+  payload = GST_BUFFER_DATA (buffer);
+  payload_size = GST_BUFFER_SIZE (buffer);
+  if (item->compressed)
+  {
+    GST_USB_SINK_QUEUE_LOCK (s);
+    while (!item->compressed->done)
+      g_cond_wait (s->compress_done, s->queue_lock);
+    GST_USB_SINK_QUEUE_UNLOCK (s);
+    if (item->compressed->data)
+    {
+      payload = item->compressed->data;
+      payload_size = item->compressed->size;
+    }
+  }
+
+  /* Don't bother with buffers that can't make it in time */
+  if (GST_CLOCK_TIME_IS_VALID (item->deadline) &&
+      gst_util_get_timestamp () >= item->deadline)
+  {
+    GST_LOG_OBJECT (s, "Buffer missed its deadline, dropping");
+    s->dropped_late++;
+    return GST_FLOW_OK;
+  }
+
+  /* Raw video goes as its difference with the last frame sent */
+  if (gst_usb_sink_delta_wanted (s, lane, buffer))
+    delta_flags = gst_usb_sink_delta_encode (s, item->stream, buffer,
+					     &payload, &payload_size, &ref);
+  USB_PROF_LAP (s->prof, PROF_PREPARE, &mark);
+
+  /* Start transfer, the header carries its CRC so the src can tell a
+   * frame boundary from garbage */
+  gdp = gst_dp_packetizer_new (GST_DP_VERSION_0_2);
+  gdp->header_from_buffer(buffer,
+                          GST_DP_HEADER_FLAG_CRC_HEADER,
+			  &header_length,
+                          &header);
+
+  /* Big payloads go across both stream endpoints at once */
+  striped = s->striped && lane->endp == EP2_OUT &&
+      (s->link_features & GST_USB_FEATURE_STRIPED) &&
+      payload_size >= s->stripe_threshold &&
+      payload_size > GST_USB_STRIPE_SPLIT (payload_size);
+  preamble.magic = GST_USB_FRAME_MAGIC;
+  preamble.word = header_length;
+  if (striped)
+    preamble.word |= GST_USB_FRAME_STRIPED;
+  preamble.word = GST_USB_WITH_STREAM (preamble.word, item->stream);
+  preamble.crc = 0;
+  preamble.wire_length = 0;
+  preamble.ref = ref;
+  preamble.stripe = 0;
+  if (striped)
+    preamble.stripe = ++s->stripe_seq;
+  if (delta_flags)
+    preamble.word |= delta_flags;
+  else if (payload != GST_BUFFER_DATA (buffer))
+    preamble.word |= GST_USB_FRAME_LZ4;
+  if (payload != GST_BUFFER_DATA (buffer))
+    preamble.wire_length = payload_size;
+  if (s->link_features & GST_USB_FEATURE_CRC)
+  {
+    preamble.word |= GST_USB_FRAME_CRC;
+    preamble.crc = crc32c (0, buffer->data, buffer->size);
+  }
+  preamble.check = GST_USB_FRAME_CHECK (preamble.word);
+  USB_PROF_LAP (s->prof, PROF_HEADER_BUILD, &mark);
+
+  /* Send the preamble first, this is the only transfer that can be given
+   * up cleanly: nothing of the frame reached the src yet */
+  ret = usb_host_device_transfer_timed(s->host,
+				       lane->endp,
+				       (unsigned char *) &preamble,
+				       sizeof preamble,
+				       gst_usb_sink_time_left (item->deadline),
+				       &transferred);
+  if (ret == ERR_TIMEOUT && transferred == 0)
+  {
+    GST_LOG_OBJECT (s, "Link busy past the buffer deadline, dropping");
+    s->dropped_late++;
+    g_free(header);
+    gst_dp_packetizer_free (gdp);
+    return GST_FLOW_OK;
+  }
+  if (ret == ERR_TIMEOUT)
+  {
+    /* Too late to take it back */
+    if (!gst_usb_sink_write_all (s, lane->endp,
+				 (unsigned char *) &preamble + transferred,
+				 sizeof preamble - transferred))
+      ret = ERR_TRANSFER;
+    else
+      ret = EOK;
+  }
+  if (ret != EOK)
+  {
+    g_free(header);
+    gst_dp_packetizer_free (gdp);
+    return GST_FLOW_ERROR;								  
+  }
+  USB_PROF_LAP (s->prof, PROF_LENGTH_WRITE, &mark);
+  /* Now send the header */									 
+  if (!gst_usb_sink_write_all (s, lane->endp, (unsigned char *) header,
+			       header_length))
+  {   
+    g_free(header);
+    gst_dp_packetizer_free (gdp);
+    return GST_FLOW_ERROR;								  
+  }
+  USB_PROF_LAP (s->prof, PROF_HEADER_WRITE, &mark);
+  /* Now send the buffer */									 
+  if (!gst_usb_sink_write_payload (s, lane->endp, payload, payload_size,
+				   striped, preamble.stripe))
+  {   
+    g_free(header);
+    gst_dp_packetizer_free (gdp);
+    return GST_FLOW_ERROR;								  
+  }
+  USB_PROF_LAP (s->prof, PROF_PAYLOAD_WRITE, &mark);
+  g_free(header);
+  gst_dp_packetizer_free (gdp); 
+  lane->sent++;
+  if (delta_flags)
+    gst_usb_sink_delta_commit (s, item->stream, buffer, delta_flags,
+			       payload_size);
+  else if (payload != GST_BUFFER_DATA (buffer))
+  {
+    s->compressed_frames++;
+    s->compressed_saved += GST_BUFFER_SIZE (buffer) - payload_size;
+  }
+
+  return GST_FLOW_OK;
+}
+
+/* Stops the first n sender threads, whatever is still queued stays there */
+static void gst_usb_sink_stop_senders (GstUsbSink *s, gint n)
+{
+  gint i;
+
+  GST_USB_SINK_QUEUE_LOCK (s);
+  s->sender_running = FALSE;
+  for (i = 0; i < n; i++)
+    g_cond_broadcast (s->lanes[i].item_add);
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+
+  for (i = 0; i < n; i++)
+    pthread_join (s->lanes[i].sender, NULL);
+}
+
+/* Names and schedules one of our threads as the properties say. Failing
+ * isn't fatal, the thread just runs as it would have */
+static void gst_usb_sink_schedule (GstUsbSink *s, pthread_t thread,
+				   const char *name)
+{
+  int err = usb_thread_setup (thread, name, &s->sched);
+
+  if (err != 0)
+    GST_WARNING_OBJECT (s, "Unable to schedule the %s thread: %s", name,
+			g_strerror (err));
+}
+
+/* Use this to define a search timeout, currently there's no*/
+#define TIMEOUT 10
+
+static gboolean gst_usb_sink_start (GstBaseSink *bs)
+{
+  GstUsbSink *s = GST_USB_SINK (bs);   
+  GstClockTime deadline;
+  gchar *error;
+  gint i;
+
+  s->link_state = GST_USB_SINK_LINK_UP;
+  s->link_closing = FALSE;
+  s->link_users = 0;
+  s->outage_start = GST_CLOCK_TIME_NONE;
+  memset (s->stream_lanes, 0, sizeof s->stream_lanes);
+
+  if (s->thread_affinity && !usb_thread_cpus_valid (s->thread_affinity))
+  {
+    GST_ELEMENT_ERROR(s,RESOURCE,SETTINGS,(NULL),
+            ("Malformed thread affinity \"%s\"", s->thread_affinity));
+    return FALSE;
+  }
+  s->sched.cpus = s->thread_affinity;
+
+  if (!usb_host_match_parse (&s->match, s->device))
+  {
+    GST_ELEMENT_ERROR(s,RESOURCE,SETTINGS,(NULL),
+            ("Malformed device selector \"%s\"", s->device));
+    return FALSE;
+  }
+
+  /* Init usb context */
+  if (usb_host_new(s->host, LEVEL3) != EOK)
+  {
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+            ("Failed opening usb context!"));
+    return FALSE;
+  }
+  GST_DEBUG_OBJECT(s, "Success opening usb context.");
+  if (usb_host_set_busy_poll (s->host, s->busy_poll) != EOK)
+  {
+    usb_host_free (s->host);
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+            ("Failed opening a usb context to busy poll"));
+    return FALSE;
+  }
+
+  if (s->emulate && (s->host->emu = link_emu_new (s->emulate)) == NULL)
+  {
+    usb_host_free (s->host);
+    GST_ELEMENT_ERROR(s,RESOURCE,SETTINGS,(NULL),
+            ("Malformed link emulation script \"%s\"", s->emulate));
+    return FALSE;
+  }
+  
+  /* Give a little time to gadget to connect */
+  GST_DEBUG_OBJECT(s, "Searching for a gadget device");
+  deadline = gst_util_get_timestamp () + s->open_timeout * GST_MSECOND;
+  for (;;)
+  {
+    /* Usb host object, vendor ID, product ID, which of them */
+    if (usb_host_device_open_match(s->host, GADGET_VENDOR_ID,
+				   GADGET_PRODUCT_ID, &s->match)==EOK)
+    {
+      GST_DEBUG_OBJECT(s, "Found a gadget device.");
+      goto success;	  
+    }
+    /* A selector matching nothing must not hold a fan out back */
+    if (s->open_timeout && gst_util_get_timestamp () >= deadline)
+      break;
+    g_usleep (OPEN_RETRY * 1000);
+  }
+  GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+    ("Error opening usb device!"));
+  goto close;
+  
+success:  
+  GST_USB_SINK_STATE_UNLOCK(s);
+  /* Keep an interrupt transfer posted for the notifications */
+  if (usb_host_notify_start(s->host, EP5_IN, sizeof(guint)) != EOK)
+  {
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+      ("Unable to listen for notifications, aborting.."));
+    goto close;
+  }
+
+  /* Create the up events thread to receive connection form gadget */
+  s->up_running = TRUE;
+  if (pthread_create (&(s->host->up_events), NULL,
+	 (void *) gst_usb_sink_up_event, (void *) bs) != 0)
+  {
+    s->up_running = FALSE;
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+      ("Unable to create up events thread, aborting.."));	  
+    goto close;
+  }
+  gst_usb_sink_schedule (s, s->host->up_events, "usbsink-up");
+  
+  /* Waiting for the connected notification on the events thread*/
+  while (s->host->connected != 1)
+    g_usleep(1000); /* Wait a millisecond */
+  GST_DEBUG_OBJECT(s, "Connection stablished");
+
+  /* Replies to control requests come on their own thread, so requests
+   * don't wait for each other */
+  s->control_running = TRUE;
+  if (pthread_create (&s->control_reader, NULL,
+	 (void *) gst_usb_sink_control_reader, (void *) s) != 0)
+  {
+    s->control_running = FALSE;
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+      ("Unable to create control reader thread, aborting.."));
+    goto stop_events;
+  }
+  gst_usb_sink_schedule (s, s->control_reader, "usbsink-ctrl");
+
+  /* Agree with the src on what the link is able to do */
+  if (!gst_usb_sink_hello (s, &error))
+  {
+    gst_usb_sink_stop_control (s);
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL), ("%s", error));
+    g_free (error);
+    goto stop_events;
+  }
+
+  if (s->test_mode != LINK_TEST_NONE)
+  {
+    if (!(s->link_features & GST_USB_FEATURE_TEST))
+    {
+      gst_usb_sink_stop_control (s);
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+        ("The src is not in test mode"));
+      goto stop_events;
+    }
+    s->test_bytes = 0;
+    s->test_retries = 0;
+    s->test_running = TRUE;
+    if (pthread_create (&s->tester, NULL, (void *) gst_usb_sink_tester,
+		        (void *) s) != 0)
+    {
+      s->test_running = FALSE;
+      gst_usb_sink_stop_control (s);
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+        ("Unable to create tester thread, aborting.."));
+      goto stop_events;
+    }
+    gst_usb_sink_schedule (s, s->tester, "usbsink-test");
+  }
+
+#ifdef HAVE_LZ4
+  /* Workers compressing the queued payloads. Kept across relinks even if
+   * a new src doesn't do compression, buffers just go uncompressed */
+  if (s->compress)
+  {
+    s->compress_pool = g_thread_pool_new (gst_usb_sink_compress_func, s,
+	s->compress_workers ? s->compress_workers :
+	MAX (sysconf (_SC_NPROCESSORS_ONLN), 1), FALSE, NULL);
+    if (s->compress_pool == NULL)
+      GST_WARNING_OBJECT (s, "Unable to create compression workers");
+  }
+#endif
+
+  /* Create one sender thread per lane, each drains its queue into its
+   * own endpoint */
+  s->sender_ret = GST_FLOW_OK;
+  s->sender_running = TRUE;
+  for (i = 0; i < GST_USB_SINK_N_LANES; i++)
+  {
+    if (pthread_create (&(s->lanes[i].sender), NULL,
+	   (void *) gst_usb_sink_sender, (void *) &s->lanes[i]) != 0)
+    {
+      gst_usb_sink_stop_senders (s, i);
+      if (s->test_running)
+      {
+        s->test_running = FALSE;
+        pthread_join (s->tester, NULL);
+      }
+      if (s->compress_pool)
+      {
+        g_thread_pool_free (s->compress_pool, FALSE, TRUE);
+        s->compress_pool = NULL;
+      }
+      gst_usb_sink_stop_control (s);
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+        ("Unable to create sender thread, aborting.."));
+      goto stop_events;
+    }
+    gst_usb_sink_schedule (s, s->lanes[i].sender,
+			   i == GST_USB_SINK_LANE_STREAM ? "usbsink-stream" :
+			   "usbsink-lane");
+  }
+   	
+  return TRUE;
+
+  /* basesink doesn't call stop after a failed start */
+stop_events:
+  s->up_running = FALSE;
+  pthread_join (s->host->up_events, NULL);
+close:
+  usb_host_free (s->host);
+  return FALSE;
+}
+
 static gboolean gst_usb_sink_stop (GstBaseSink *bs)
 {
-  GstUsbSink *s = GST_USB_SINK (bs); 
+  GstUsbSink *s = GST_USB_SINK (bs); 
+  gboolean relinking;
+
+  /* Nobody waits for the link anymore */
+  g_mutex_lock (s->link_lock);
+  s->link_closing = TRUE;
+  g_cond_broadcast (s->link_cond);
+  relinking = s->relinking;
+  s->relinking = FALSE;
+  g_mutex_unlock (s->link_lock);
+  if (relinking)
+    pthread_join (s->relinker, NULL);
+
+  if (s->test_running)
+  {
+    s->test_running = FALSE;
+    pthread_join (s->tester, NULL);
+  }
+
+  /* Stop the sender threads, whatever is still queued is dropped */
+  if (s->sender_running)
+    gst_usb_sink_stop_senders (s, GST_USB_SINK_N_LANES);
+  if (s->compress_pool)
+  {
+    /* Let the workers finish what they started */
+    g_thread_pool_free (s->compress_pool, FALSE, TRUE);
+    s->compress_pool = NULL;
+  }
+  gst_usb_sink_queue_flush (s);
+  gst_usb_sink_delta_clear (s);
+  g_free (s->delta_scratch);
+  s->delta_scratch = NULL;
+  s->delta_scratch_size = 0;
+  if (s->control_running)
+    gst_usb_sink_stop_control (s);
+
+  /* Init usb context */
+  GST_DEBUG_OBJECT(s, "Closing usb device");
+  /* Stop main events thread, it notices within NOTIFY_TIMEOUT */
+  if (s->up_running)
+  {
+    s->up_running = FALSE;
+    pthread_join (s->host->up_events, NULL);
+  }
+  if (s->host->emu)
+    GST_INFO_OBJECT (s, "Emulated link: %" G_GUINT64_FORMAT " transfers, %"
+        G_GUINT64_FORMAT " stalled, %" G_GUINT64_FORMAT " short, %"
+        G_GUINT64_FORMAT " disconnections", s->host->emu->transfers,
+        s->host->emu->stalls, s->host->emu->shorts,
+        s->host->emu->disconnects);
+  if (s->prof)
+    gst_usb_sink_log_profile (s);
+  usb_host_free(s->host);
+  /* The next session sets its caps again */
+  s->play = FALSE;
+
+  return TRUE;
+}
+
+/* Wake up a render blocked on a full queue */
+static gboolean gst_usb_sink_unlock (GstBaseSink *bs)
+{
+  GstUsbSink *s = GST_USB_SINK (bs);
+
+  GST_USB_SINK_QUEUE_LOCK (s);
+  s->flushing = TRUE;
+  g_cond_broadcast (s->item_del);
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+
+  return TRUE;
+}
+
+static gboolean gst_usb_sink_unlock_stop (GstBaseSink *bs)
+{
+  GstUsbSink *s = GST_USB_SINK (bs);
 
-  /* Init usb context */
-  GST_DEBUG_OBJECT(s, "Closing usb device");
-  /* Cancel main events thread */
-  pthread_cancel (s->host->up_events);
-  usb_host_free(s->host);
-  g_free(s->host);
+  GST_USB_SINK_QUEUE_LOCK (s);
+  s->flushing = FALSE;
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+
+  return TRUE;
+}
+
+static GstStructure *gst_usb_sink_get_stats (GstUsbSink *s)
+{
+  GstUsbSinkLane *stream = &s->lanes[GST_USB_SINK_LANE_STREAM];
+  GstUsbSinkLane *lane = &s->lanes[GST_USB_SINK_LANE_LOW_LATENCY];
+  GstStructure *stats;
+  gchar *name;
+  guint i, j;
+
+  GST_USB_SINK_QUEUE_LOCK (s);
+  stats = gst_structure_new ("application/x-usbsink-stats",
+      "queued-buffers", G_TYPE_UINT, stream->cur_level_buffers,
+      "queued-bytes", G_TYPE_UINT, stream->cur_level_bytes,
+      "queued-time", G_TYPE_UINT64, gst_usb_sink_queue_time_level (stream),
+      "lane-queued-buffers", G_TYPE_UINT, lane->cur_level_buffers,
+      "lane-queued-bytes", G_TYPE_UINT, lane->cur_level_bytes,
+      "sent", G_TYPE_UINT64, stream->sent,
+      "lane-sent", G_TYPE_UINT64, lane->sent,
+      "dropped-leaky", G_TYPE_UINT64, s->dropped,
+      "dropped-delta", G_TYPE_UINT64, s->dropped_delta,
+      "dropped-delta-bytes", G_TYPE_UINT64, s->dropped_delta_bytes,
+      "congestion-events", G_TYPE_UINT64, s->congestion_events,
+      "dropped-late", G_TYPE_UINT64, s->dropped_late,
+      "link-rtt", G_TYPE_UINT64, s->rtt,
+      "clock-offset", G_TYPE_INT64, s->time_offset,
+      "link-features", G_TYPE_UINT, s->link_features,
+      "link-max-transfer", G_TYPE_UINT, s->link_max_transfer,
+      "link-outages", G_TYPE_UINT64, s->outages,
+      "compressed-frames", G_TYPE_UINT64, s->compressed_frames,
+      "compressed-saved-bytes", G_TYPE_UINT64, s->compressed_saved,
+      "delta-frames", G_TYPE_UINT64, s->delta_frames,
+      "delta-keyframes", G_TYPE_UINT64, s->delta_keyframes,
+      "delta-saved-bytes", G_TYPE_UINT64, s->delta_saved,
+      "test-bytes", G_TYPE_UINT64, s->test_bytes,
+      "test-retries", G_TYPE_UINT64, s->test_retries,
+      NULL);
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+
+  /* The totals of each phase as prof-<phase>-<figure> */
+  for (i = 0; s->prof && i < s->prof->n_phases; i++)
+  {
+    usb_prof_phase *phase = &s->prof->phases[i];
+    guint64 values[] = { phase->count, phase->ns,
+			 phase->counters[USB_PROF_CYCLES],
+			 phase->counters[USB_PROF_INSTRUCTIONS],
+			 phase->counters[USB_PROF_CACHE_MISSES] };
+
+    for (j = 0; j < G_N_ELEMENTS (values); j++)
+    {
+      name = g_strdup_printf ("prof-%s-%s", phase->name, prof_figures[j]);
+      gst_structure_set (stats, name, G_TYPE_UINT64, values[j], NULL);
+      g_free (name);
+    }
+  }
+
+  return stats;
+}
+
+static void gst_usb_sink_log_profile (GstUsbSink *s)
+{
+  usb_prof_phase *phase;
+  gint i;
+
+  if (!s->prof->hw)
+    GST_INFO_OBJECT (s, "No hardware counters, profiling time only");
+  for (i = 0; i < s->prof->n_phases; i++)
+  {
+    phase = &s->prof->phases[i];
+    GST_INFO_OBJECT (s, "Phase %s: %" G_GUINT64_FORMAT " runs, %"
+        G_GUINT64_FORMAT " ns, %" G_GUINT64_FORMAT " cycles, %"
+        G_GUINT64_FORMAT " instructions, %" G_GUINT64_FORMAT
+        " cache misses", phase->name, phase->count, phase->ns,
+        phase->counters[USB_PROF_CYCLES],
+        phase->counters[USB_PROF_INSTRUCTIONS],
+        phase->counters[USB_PROF_CACHE_MISSES]);
+  }
+}
+
+static gboolean gst_usb_sink_event (GstBaseSink *bs, GstEvent *event)
+{
+  GstUsbSink *s = GST_USB_SINK (bs);
+  gint i;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_FLUSH_STOP:
+      gst_usb_sink_queue_flush (s);
+      /* Whatever arrives next is the start of a new GOP or garbage */
+      s->gop_dropping = FALSE;
+      break;
+    case GST_EVENT_EOS:
+      /* Don't let EOS through before the data actually crossed the link */
+      GST_DEBUG_OBJECT (s, "Draining send queues");
+      GST_USB_SINK_QUEUE_LOCK (s);
+      for (i = 0; i < GST_USB_SINK_N_LANES; i++)
+        while ((s->lanes[i].cur_level_buffers > 0 || s->lanes[i].sending) &&
+               !s->flushing && s->sender_ret == GST_FLOW_OK)
+          g_cond_wait (s->item_del, s->queue_lock);
+      GST_USB_SINK_QUEUE_UNLOCK (s);
+      break;
+    default:
+      break;
+  }
 
   return TRUE;
 }
 
+/* Takes the link for a transfer, waiting while it is being restored.
+ * Control traffic goes through during the handshake. Returns FALSE if
+ * the element is stopping */
+static gboolean
+gst_usb_sink_link_enter (GstUsbSink *s, gboolean control)
+{
+  gboolean ret;
+
+  g_mutex_lock (s->link_lock);
+  while (!s->link_closing &&
+	 (s->link_state == GST_USB_SINK_LINK_DOWN ||
+	  (!control && s->link_state == GST_USB_SINK_LINK_HANDSHAKE)))
+    g_cond_wait (s->link_cond, s->link_lock);
+  ret = !s->link_closing;
+  if (ret)
+    s->link_users++;
+  g_mutex_unlock (s->link_lock);
+
+  return ret;
+}
+
+static void
+gst_usb_sink_link_leave (GstUsbSink *s)
+{
+  g_mutex_lock (s->link_lock);
+  if (--s->link_users == 0)
+    g_cond_broadcast (s->link_cond);
+  g_mutex_unlock (s->link_lock);
+}
+
+/* Resume mode: a transfer failed for good, the relinker thread reopens
+ * the device */
+static void
+gst_usb_sink_link_lost (GstUsbSink *s)
+{
+  gboolean relinking;
+  pthread_t previous;
+
+  g_mutex_lock (s->link_lock);
+  if (s->link_state != GST_USB_SINK_LINK_UP || s->link_closing)
+  {
+    g_mutex_unlock (s->link_lock);
+    return;
+  }
+  s->link_state = GST_USB_SINK_LINK_DOWN;
+  s->outage_start = gst_util_get_timestamp ();
+  /* Whatever reference the src had may be gone */
+  s->delta_reset = TRUE;
+  relinking = s->relinking;
+  previous = s->relinker;
+  s->relinking = FALSE;
+  g_mutex_unlock (s->link_lock);
+
+  /* A previous relinker is done once the link is up, but it may still be
+   * on its way out. It's joined without the lock it takes to leave */
+  if (relinking)
+    pthread_join (previous, NULL);
+
+  /* stop() came in the meantime, the link isn't coming back */
+  g_mutex_lock (s->link_lock);
+  if (s->link_closing)
+  {
+    g_mutex_unlock (s->link_lock);
+    return;
+  }
+  s->relinking = pthread_create (&s->relinker, NULL,
+				 (void *) gst_usb_sink_relinker,
+				 (void *) s) == 0;
+  if (!s->relinking)
+  {
+    g_mutex_unlock (s->link_lock);
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+      ("Unable to create relinker thread"));
+    return;
+  }
+  gst_usb_sink_schedule (s, s->relinker, "usbsink-relink");
+  g_mutex_unlock (s->link_lock);
+}
+
+/* Repeats on the new device what start() and the caps negotiation did */
+static gboolean
+gst_usb_sink_restore (GstUsbSink *s)
+{
+  GstCaps *caps[GST_USB_MAX_STREAMS];
+  GstPad *pad;
+  gchar *error;
+  gboolean ret = TRUE;
+  guint i;
+
+  /* The src announces itself once the host configured it */
+  for (i = 0; s->host->connected != 1; i++)
+  {
+    if (s->link_closing || i == CONTROL_TIMEOUT)
+      return FALSE;
+    g_usleep (1000);
+  }
+
+  if (!gst_usb_sink_hello (s, &error))
+  {
+    GST_WARNING_OBJECT (s, "%s", error);
+    g_free (error);
+    return FALSE;
+  }
+
+  /* Caps last set on each pad */
+  GST_OBJECT_LOCK (s);
+  for (i = 0; i < GST_USB_MAX_STREAMS; i++)
+  {
+    if (i == 0)
+      pad = GST_BASE_SINK_PAD (s);
+    else
+      pad = s->streams[i] ? s->streams[i]->pad : NULL;
+    caps[i] = NULL;
+    if (pad && GST_PAD_CAPS (pad))
+      caps[i] = gst_caps_ref (GST_PAD_CAPS (pad));
+  }
+  GST_OBJECT_UNLOCK (s);
+
+  for (i = 0; i < GST_USB_MAX_STREAMS; i++)
+  {
+    if (caps[i] == NULL)
+      continue;
+    if (ret && !gst_usb_sink_set_stream_caps (s, i, caps[i]))
+      ret = FALSE;
+    gst_caps_unref (caps[i]);
+  }
+
+  /* The src clock may have moved meanwhile */
+  if (ret)
+    gst_usb_sink_ping (s);
+
+  return ret;
+}
+
+/* Relinker thread, reopens the device once nobody uses the old handle and
+ * restores the session */
+void *gst_usb_sink_relinker (void *sink)
+{
+  GstUsbSink *s = GST_USB_SINK (sink);
+  GstClockTime outage;
+
+  GST_WARNING_OBJECT (s, "Link lost, waiting for the src to come back");
+  gst_element_post_message (GST_ELEMENT (s),
+      gst_message_new_element (GST_OBJECT (s),
+	  gst_structure_new ("usb-link-lost", NULL)));
+
+  while (TRUE)
+  {
+    g_mutex_lock (s->link_lock);
+    s->link_state = GST_USB_SINK_LINK_DOWN;
+    while (s->link_users > 0 && !s->link_closing)
+      g_cond_wait (s->link_cond, s->link_lock);
+    g_mutex_unlock (s->link_lock);
+    if (s->link_closing)
+      return NULL;
+
+    usb_host_device_close (s->host);
+    while (usb_host_device_open_match (s->host, GADGET_VENDOR_ID,
+				       GADGET_PRODUCT_ID, &s->match) != EOK ||
+	   usb_host_notify_start (s->host, EP5_IN, sizeof(guint)) != EOK)
+    {
+      usb_host_device_close (s->host);
+      if (s->link_closing)
+	return NULL;
+      g_usleep (RELINK_INTERVAL);
+    }
+    GST_DEBUG_OBJECT (s, "Device open again, restoring the session");
+
+    g_mutex_lock (s->link_lock);
+    s->link_state = GST_USB_SINK_LINK_HANDSHAKE;
+    g_cond_broadcast (s->link_cond);
+    g_mutex_unlock (s->link_lock);
+
+    if (gst_usb_sink_restore (s))
+      break;
+    GST_WARNING_OBJECT (s, "Couldn't restore the session, retrying");
+  }
+
+  g_mutex_lock (s->link_lock);
+  s->link_state = GST_USB_SINK_LINK_UP;
+  outage = gst_util_get_timestamp () - s->outage_start;
+  s->outages++;
+  g_cond_broadcast (s->link_cond);
+  g_mutex_unlock (s->link_lock);
+
+  GST_INFO_OBJECT (s, "Link resumed after %" GST_TIME_FORMAT,
+		   GST_TIME_ARGS (outage));
+  gst_element_post_message (GST_ELEMENT (s),
+      gst_message_new_element (GST_OBJECT (s),
+	  gst_structure_new ("usb-link-resumed",
+	      "outage", G_TYPE_UINT64, outage, NULL)));
+  return NULL;
+}
+
+/* Test mode thread, streams the pattern on the stream endpoint with
+ * back to back transfers and posts a usb-link-test message every
+ * TEST_REPORT_INTERVAL */
+void *gst_usb_sink_tester (void *param)
+{
+  GstUsbSink *s = GST_USB_SINK (param);
+  GstClockTime start, last, now;
+  guint64 offset = 0, last_offset = 0;
+  guint8 *pattern;
+  gint done, transferred;
+  HOST_EXIT_CODE ret = EOK;
+
+  pattern = link_test_pattern_new (s->test_mode, s->test_size);
+  if (pattern == NULL)
+  {
+    GST_ELEMENT_ERROR(s,RESOURCE,NO_SPACE_LEFT,(NULL),
+      ("Unable to allocate the test pattern"));
+    return NULL;
+  }
+
+  start = last = gst_util_get_timestamp ();
+  while (s->test_running && ret == EOK)
+  {
+    if (!gst_usb_sink_link_enter (s, FALSE))
+      break;
+
+    /* A timeout only means the src is slow, the rest of the transfer
+     * goes on the next try */
+    for (done = 0; done < s->test_size && s->test_running; done += transferred)
+    {
+      ret = usb_host_device_transfer_timed (s->host, EP2_OUT,
+	  (unsigned char *) link_test_data (pattern, offset) + done,
+	  s->test_size - done, TRANSFER_TIMEOUT, &transferred);
+      if (ret == ERR_TIMEOUT)
+      {
+	s->test_retries++;
+	ret = EOK;
+      }
+      else if (ret != EOK)
+	break;
+    }
+    gst_usb_sink_link_leave (s);
+    offset += done;
+    s->test_bytes = offset;
+
+    now = gst_util_get_timestamp ();
+    if (now - last >= TEST_REPORT_INTERVAL || ret != EOK)
+    {
+      gst_element_post_message (GST_ELEMENT (s),
+	  gst_message_new_element (GST_OBJECT (s),
+	      gst_structure_new ("usb-link-test",
+		  "bytes", G_TYPE_UINT64, offset,
+		  "throughput", G_TYPE_UINT64,
+		  gst_util_uint64_scale (offset - last_offset, GST_SECOND,
+					 MAX (now - last, 1)),
+		  "average-throughput", G_TYPE_UINT64,
+		  gst_util_uint64_scale (offset, GST_SECOND,
+					 MAX (now - start, 1)),
+		  "retries", G_TYPE_UINT64, s->test_retries, NULL)));
+      last = now;
+      last_offset = offset;
+    }
+  }
+
+  if (ret != EOK)
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+      ("Link test failed after %" G_GUINT64_FORMAT " bytes", offset));
+  free (pattern);
+  GST_INFO_OBJECT (s, "Closing tester thread");
+  return NULL;
+}
+
+/* Sender thread, the only one writing to the endpoint of its lane */
+void *gst_usb_sink_sender (void *param)
+{
+  GstUsbSinkLane *lane = (GstUsbSinkLane *) param;
+  GstUsbSink *s = lane->sink;
+  GstUsbSinkItem *item;
+  GstFlowReturn ret;
+
+  GST_USB_SINK_QUEUE_LOCK (s);
+  while (TRUE)
+  {
+    while (s->sender_running && g_queue_is_empty (lane->queue))
+      g_cond_wait (lane->item_add, s->queue_lock);
+    if (!s->sender_running)
+      break;
+
+    item = gst_usb_sink_queue_pop_next (lane);
+    lane->sending = TRUE;
+    GST_USB_SINK_QUEUE_UNLOCK (s);
+
+    if (!gst_usb_sink_link_enter (s, FALSE))
+      /* Stopping, the buffer is dropped */
+      ret = GST_FLOW_OK;
+    else
+    {
+      ret = gst_usb_sink_send_buffer (s, lane, item);
+      gst_usb_sink_link_leave (s);
+      if (ret != GST_FLOW_OK && s->resume)
+      {
+        /* The buffer is lost with the link */
+        gst_usb_sink_link_lost (s);
+        ret = GST_FLOW_OK;
+      }
+    }
+    gst_usb_sink_item_free (item);
+
+    GST_USB_SINK_QUEUE_LOCK (s);
+    lane->sending = FALSE;
+    g_cond_broadcast (s->item_del);
+    if (ret != GST_FLOW_OK)
+    {
+      /* Next render returns the error to upstream */
+      s->sender_ret = ret;
+      GST_USB_SINK_QUEUE_UNLOCK (s);
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+        ("Error sending buffer across usb link"));
+      GST_USB_SINK_QUEUE_LOCK (s);
+      break;
+    }
+  }
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+
+  GST_INFO_OBJECT (s, "Closing sender thread of endpoint 0x%02x, %"
+      G_GUINT64_FORMAT " buffers sent", lane->endp, lane->sent);
+  return NULL;
+}
+
 
 /* Up events thread */
 void *gst_usb_sink_up_event (void *sink)
@@ -390,35 +2729,29 @@ void *gst_usb_sink_up_event (void *sink)
   
   pthread_cleanup_push (close_up_event, (void *) notification);
   
-  while (TRUE)
+  while (s->up_running)
   {
-    /* Create a cancellation test point */  
-    pthread_testcancel();  
-    
-    /* Receive an event (internal polling) */
-    /*
-     *  FIXME: If there is no timeout process sleeps
-     *  and blocks all other threads. Made a workaround
-     *  setting timeout to 1 millisecond. Find a way to 
-     *  fix this
-     */
-    if ((ret = usb_host_device_transfer(s->host, 
-	  				EP1_IN, 
-		  			(unsigned char *) notification,
-			  		sizeof(guint),
-				  	1)) == ERR_TRANSFER){ 
+    if (!gst_usb_sink_link_enter (s, TRUE))
+      break;
+    /* Receive an event from the interrupt endpoint, waking up now and
+     * then to check if we have to stop */
+    ret = usb_host_notify_wait(s->host,
+			       (unsigned char *) notification,
+			       sizeof(guint),
+			       NOTIFY_TIMEOUT);
+    gst_usb_sink_link_leave (s);
+    if (ret != EOK){ 
+      if (ret == ERR_TRANSFER)
+      {
+        GST_WARNING_OBJECT(s, "Error receiving upstream event");
+        if (s->resume)
+          gst_usb_sink_link_lost (s);
+      }
       continue;	
     }
     /* Wait until device is free */
     GST_USB_SINK_STATE_LOCK(s);
-    switch (notification[0]){ 	  
-      /* Src is returning his possible caps */		
-    case GST_USB_CAPS:
-      GST_DEBUG_OBJECT(s, "Received a caps"); 
-      s->caps = gst_usb_sink_receive_caps(s);
-      GST_DEBUG_OBJECT(s, "Caps received from src");
-      s->emptycaps = FALSE;
-      break;
+    switch (GST_USB_MESSAGE_TYPE (notification[0])){ 	  
       /* Gadget has finished connecting */
     case GST_USB_CONNECTED:
       GST_DEBUG_OBJECT(s, "Received connection notice from src");
@@ -429,6 +2762,12 @@ void *gst_usb_sink_up_event (void *sink)
       GST_DEBUG_OBJECT(s, "Received play notice from src");
       s->play = TRUE;
       break;	
+      /* Gadget lost a delta reference, start over with full frames */
+    case GST_USB_KEYFRAME:
+      GST_DEBUG_OBJECT(s, "Src asked for a keyframe on stream %u",
+		       GST_USB_GET_STREAM (notification[0]));
+      s->delta_reset = TRUE;
+      break;
 /*     TODO: Add the stop notification here if needed */
     default:
       GST_WARNING_OBJECT(s, "Unknown downstream event");
@@ -436,8 +2775,8 @@ void *gst_usb_sink_up_event (void *sink)
     }
     GST_USB_SINK_STATE_UNLOCK(s);
   }
-  /* It should never reach this point */
   pthread_cleanup_pop (1);	 	  
+  return NULL;
 }	
 
 static void close_up_event(void *param)
@@ -447,148 +2786,344 @@ static void close_up_event(void *param)
   g_free(notification);
 }
 
-static GstCaps* gst_usb_sink_receive_caps(GstUsbSink *s)
+/* Reads and drops a reply payload nobody can take, a chunk at a time, so
+ * the next header read starts on a header. With the link entered */
+static HOST_EXIT_CODE
+gst_usb_sink_control_discard (GstUsbSink *s, guint length)
 {
-  GstCaps *caps;
-  guint8 *header, *payload;
-  guint *length = g_malloc(sizeof(guint)), paylength;
-  	
-	/* Ask for the size of the header */
-  if ( usb_host_device_transfer (s->host,
-				 EP1_IN,   
-				 (unsigned char *) length, 
-				 sizeof(guint), 
-				 0) == ERR_TRANSFER){	
-    g_free(length);  		
-    return NULL;
-  }
+  guint8 *chunk = g_malloc (GST_USB_CONTROL_MAX);
+  HOST_EXIT_CODE ret = EOK;
+  int transferred;
+  guint size;
 
-  /* Alocate memory for the header */
-  header = (void *) g_malloc(length[0]);
-    
-  /* Ask for the header */
-  if ( usb_host_device_transfer (s->host,
-				 EP1_IN,   
-				 (unsigned char *) header, 
-				 length[0], 
-				 0) == ERR_TRANSFER){	
-    g_free(length);
-    g_free(header);  											
-    return NULL;
+  while (length > 0 && ret == EOK)
+  {
+    size = MIN (length, GST_USB_CONTROL_MAX);
+    ret = usb_host_device_transfer_timed(s->host, EP1_IN, chunk, size,
+					 TRANSFER_TIMEOUT, &transferred);
+    /* A short transfer ends the payload */
+    if ((guint) transferred < size)
+      break;
+    length -= size;
   }
-  
+  g_free (chunk);
+  return ret;
+}
 
-  /* Check for the payload type to be a caps header */
-  if (GST_READ_UINT16_BE(header+4) != GST_DP_PAYLOAD_CAPS){
-    GST_WARNING_OBJECT(s, "Received header is not a cap's header");  
-    g_free(length);
-    g_free(header);  
-    return NULL;
-  }
+/* Control reader thread, hands each reply to the request it answers */
+void *gst_usb_sink_control_reader (void *sink)
+{
+  GstUsbSink *s = GST_USB_SINK (sink);
+  GstUsbControlHeader header;
+  GstUsbSinkRequest *req;
+  guint8 *payload;
+  int transferred;
+  HOST_EXIT_CODE ret;
 
-  /* Get the size of the payload */
-  paylength = GST_READ_UINT32_BE(header+6);
-  payload = g_malloc(paylength);
+  while (s->control_running)
+  {
+    if (!gst_usb_sink_link_enter (s, TRUE))
+      break;
+    /* Wake up now and then to check if we have to stop */
+    ret = usb_host_device_transfer_timed(s->host, EP1_IN,
+					 (unsigned char *) &header,
+					 sizeof header, NOTIFY_TIMEOUT,
+					 &transferred);
+    if (ret == ERR_TIMEOUT && transferred == 0)
+    {
+      gst_usb_sink_link_leave (s);
+      continue;
+    }
 
-  /* Ask for the payload */
-  if ( usb_host_device_transfer (s->host,
-				 EP1_IN,   
-				 (unsigned char *) payload, 
-				 paylength, 
-				 0) == ERR_TRANSFER){
-    g_free(length);  
-    g_free(payload);
-    g_free(header);  
-    return NULL;
-  }
-  
-  /* Finally get caps from header and payload */
-  caps = gst_dp_caps_from_packet (length[0],
-                                  header,
-                                  payload);
-								  
-  /* Free allocated vectors */
-  g_free(length);  
-  g_free(payload);
-  g_free(header);  
-  return caps;	
-} 
-
-static gboolean gst_usb_sink_send_caps(GstUsbSink *s, GstCaps *caps)
-{
-  GstDPPacketizer *gdp = gst_dp_packetizer_new (GST_DP_VERSION_0_2);
-  guint8 *header, *payload;
-  guint *length = g_malloc(sizeof(guint)), paylength;	
-   
-  /* Make a package from the given caps */	
-  gdp->packet_from_caps(caps,
-                        GST_DP_HEADER_FLAG_NONE,
-                        &length[0],
-                        &header,
-                        &payload);
-  
-  /* Send the size of the header */
-  if (usb_host_device_transfer(s->host, 
-			       EP1_OUT, 
-			       (unsigned char *) length,
-			       sizeof(guint),
-			       0) == ERR_TRANSFER){   
-    g_free(length);
-    g_free(header);
-    g_free(payload);
-    gst_dp_packetizer_free (gdp);
-    return FALSE;								  
+    payload = NULL;
+    if (ret == EOK && header.length > GST_USB_CONTROL_MAX)
+    {
+      GST_WARNING_OBJECT(s, "Control reply of %u bytes is too big",
+			 header.length);
+      ret = gst_usb_sink_control_discard (s, header.length);
+      gst_usb_sink_link_leave (s);
+      if (ret == ERR_TRANSFER && s->resume)
+	gst_usb_sink_link_lost (s);
+      continue;
+    }
+    if (ret == EOK && header.length > 0)
+    {
+      payload = g_malloc (header.length);
+      ret = usb_host_device_transfer_timed(s->host, EP1_IN, payload,
+					   header.length, TRANSFER_TIMEOUT,
+					   &transferred);
+    }
+    gst_usb_sink_link_leave (s);
+    if (ret != EOK)
+    {
+      GST_WARNING_OBJECT(s, "Error receiving a control reply");
+      g_free (payload);
+      if (ret == ERR_TRANSFER && s->resume)
+	gst_usb_sink_link_lost (s);
+      continue;
+    }
+
+    g_mutex_lock (s->pending_lock);
+    req = g_hash_table_lookup (s->pending, GUINT_TO_POINTER (header.seq));
+    if (req != NULL && !req->done)
+    {
+      req->reply = header;
+      req->payload = payload;
+      req->done = TRUE;
+      g_cond_broadcast (s->control_reply);
+    }
+    else
+    {
+      /* Its requester gave up already */
+      GST_DEBUG_OBJECT(s, "Dropping reply to request %u", header.seq);
+      g_free (payload);
+    }
+    g_mutex_unlock (s->pending_lock);
   }
 
-  /* Now send the header */
-  if (usb_host_device_transfer(s->host, 
-			       EP1_OUT, 
-			       (unsigned char *) header,
-			       length[0],
-			       0) == ERR_TRANSFER){   
-    g_free(length);
-    g_free(header);
-    g_free(payload);
-    gst_dp_packetizer_free (gdp);
-    return FALSE;								  
+  return NULL;
+}
+
+static void
+fail_request (gpointer key, gpointer value, gpointer user_data)
+{
+  GstUsbSinkRequest *req = (GstUsbSinkRequest *) value;
+
+  req->done = TRUE;
+  req->failed = TRUE;
+}
+
+/* Stops the control reader and fails the requests still waiting */
+static void gst_usb_sink_stop_control (GstUsbSink *s)
+{
+  s->control_running = FALSE;
+  pthread_join (s->control_reader, NULL);
+
+  g_mutex_lock (s->pending_lock);
+  g_hash_table_foreach (s->pending, fail_request, NULL);
+  g_cond_broadcast (s->control_reply);
+  g_mutex_unlock (s->pending_lock);
+}
+
+/* Request pads, each one feeds its own stream into the shared queues */
+
+static GstCaps *
+gst_usb_sink_stream_getcaps (GstPad * pad)
+{
+  GstUsbSinkStream *stream = gst_pad_get_element_private (pad);
+  GstCaps *caps;
+
+  caps = gst_usb_sink_query_caps (stream->sink, stream->id);
+  if (caps == NULL)
+    caps = gst_caps_copy (gst_pad_get_pad_template_caps (pad));
+  return caps;
+}
+
+static gboolean
+gst_usb_sink_stream_setcaps (GstPad * pad, GstCaps * caps)
+{
+  GstUsbSinkStream *stream = gst_pad_get_element_private (pad);
+
+  return gst_usb_sink_set_stream_caps (stream->sink, stream->id, caps);
+}
+
+static GstFlowReturn
+gst_usb_sink_stream_chain (GstPad * pad, GstBuffer * buffer)
+{
+  GstUsbSinkStream *stream = gst_pad_get_element_private (pad);
+  GstFlowReturn ret;
+
+  ret = gst_usb_sink_enqueue (stream->sink, stream->id, &stream->segment,
+      buffer);
+  gst_buffer_unref (buffer);
+  return ret;
+}
+
+/* Must be called with the queue lock held */
+static gboolean
+gst_usb_sink_stream_pending (GstUsbSinkLane *lane, guint stream)
+{
+  GList *link;
+
+  if (lane->sending && lane->last_stream == stream)
+    return TRUE;
+  for (link = g_queue_peek_head_link (lane->queue); link; link = link->next)
+    if (((GstUsbSinkItem *) link->data)->stream == stream)
+      return TRUE;
+  return FALSE;
+}
+
+/* Tells the src a request pad reached its end, once the buffers the
+ * stream had queued crossed the link, so its pad there ends after them */
+static void
+gst_usb_sink_stream_eos (GstUsbSink *s, guint stream)
+{
+  GstUsbSinkLane *lane = s->stream_lanes[stream];
+  GstUsbSinkRequest *req;
+  gboolean drained;
+  guint8 *payload;
+  guint type, length;
+
+  GST_DEBUG_OBJECT (s, "Draining stream %u", stream);
+  GST_USB_SINK_QUEUE_LOCK (s);
+  while (lane && gst_usb_sink_stream_pending (lane, stream) &&
+         !gst_usb_sink_is_flushing (s, stream) &&
+         s->sender_ret == GST_FLOW_OK)
+    g_cond_wait (s->item_del, s->queue_lock);
+  drained = !gst_usb_sink_is_flushing (s, stream) &&
+      s->sender_ret == GST_FLOW_OK;
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+  if (!drained)
+    return;
+
+  req = gst_usb_sink_control_send (s, GST_USB_WITH_STREAM (GST_USB_STOP,
+							   stream), NULL, 0);
+  if (req == NULL ||
+      !gst_usb_sink_control_wait (s, req, &type, &payload, &length))
+  {
+    GST_WARNING_OBJECT (s, "Src didn't take the end of stream %u", stream);
+    return;
   }
+  g_free (payload);
+}
 
-  /* Get the length of the payload */
-  paylength = GST_READ_UINT32_BE(header+6);
-  
-  /* Send the payload */
-  if (usb_host_device_transfer(s->host, 
-			       EP1_OUT, 
-			       (unsigned char *) payload,
-			       paylength,
-			       0) == ERR_TRANSFER){   
-    g_free(length);
-    g_free(header);
-    g_free(payload);
-    gst_dp_packetizer_free (gdp);
-    return FALSE;								  
+static gboolean
+gst_usb_sink_stream_event (GstPad * pad, GstEvent * event)
+{
+  GstUsbSinkStream *stream = gst_pad_get_element_private (pad);
+  gboolean update;
+  gdouble rate, arate;
+  GstFormat format;
+  gint64 start, stop, time;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_NEWSEGMENT:
+      gst_event_parse_new_segment_full (event, &update, &rate, &arate,
+          &format, &start, &stop, &time);
+      gst_segment_set_newsegment_full (&stream->segment, update, rate, arate,
+          format, start, stop, time);
+      break;
+    case GST_EVENT_FLUSH_START:
+      /* A chain blocked on a full queue gives up */
+      GST_USB_SINK_QUEUE_LOCK (stream->sink);
+      stream->flushing = TRUE;
+      g_cond_broadcast (stream->sink->item_del);
+      GST_USB_SINK_QUEUE_UNLOCK (stream->sink);
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      gst_usb_sink_queue_flush_stream (stream->sink, stream->id);
+      GST_USB_SINK_QUEUE_LOCK (stream->sink);
+      stream->flushing = FALSE;
+      GST_USB_SINK_QUEUE_UNLOCK (stream->sink);
+      gst_segment_init (&stream->segment, GST_FORMAT_TIME);
+      break;
+    case GST_EVENT_EOS:
+      gst_usb_sink_stream_eos (stream->sink, stream->id);
+      break;
+    default:
+      break;
   }
-  
-  g_free(length);
-  g_free(header);
-  g_free(payload);
-  gst_dp_packetizer_free (gdp);
+  gst_event_unref (event);
+
   return TRUE;
 }
 
+static GstPad *
+gst_usb_sink_request_new_pad (GstElement * element, GstPadTemplate * templ,
+    const gchar * name)
+{
+  GstUsbSink *s = GST_USB_SINK (element);
+  GstUsbSinkStream *stream;
+  gchar *padname;
+  guint id;
+
+  GST_OBJECT_LOCK (s);
+  if (name && sscanf (name, "sink_%u", &id) == 1) {
+    if (id == 0 || id >= GST_USB_MAX_STREAMS || s->streams[id]) {
+      GST_OBJECT_UNLOCK (s);
+      GST_WARNING_OBJECT (s, "Stream %s not available", name);
+      return NULL;
+    }
+  } else {
+    for (id = 1; id < GST_USB_MAX_STREAMS && s->streams[id]; id++);
+    if (id == GST_USB_MAX_STREAMS) {
+      GST_OBJECT_UNLOCK (s);
+      GST_WARNING_OBJECT (s, "All %d streams in use", GST_USB_MAX_STREAMS);
+      return NULL;
+    }
+  }
+  stream = g_new0 (GstUsbSinkStream, 1);
+  s->streams[id] = stream;
+  GST_OBJECT_UNLOCK (s);
+
+  stream->sink = s;
+  stream->id = id;
+  gst_segment_init (&stream->segment, GST_FORMAT_TIME);
+
+  padname = g_strdup_printf ("sink_%u", id);
+  stream->pad = gst_pad_new_from_template (templ, padname);
+  g_free (padname);
+
+  gst_pad_set_element_private (stream->pad, stream);
+  gst_pad_set_chain_function (stream->pad,
+      GST_DEBUG_FUNCPTR (gst_usb_sink_stream_chain));
+  gst_pad_set_event_function (stream->pad,
+      GST_DEBUG_FUNCPTR (gst_usb_sink_stream_event));
+  gst_pad_set_getcaps_function (stream->pad,
+      GST_DEBUG_FUNCPTR (gst_usb_sink_stream_getcaps));
+  gst_pad_set_setcaps_function (stream->pad,
+      GST_DEBUG_FUNCPTR (gst_usb_sink_stream_setcaps));
+
+  GST_DEBUG_OBJECT (s, "Adding pad for stream %u", id);
+  gst_pad_set_active (stream->pad, TRUE);
+  gst_element_add_pad (element, stream->pad);
+
+  return stream->pad;
+}
+
+/* Buffers of the stream still queued are dropped along with the pad */
+static void
+gst_usb_sink_release_pad (GstElement * element, GstPad * pad)
+{
+  GstUsbSink *s = GST_USB_SINK (element);
+  GstUsbSinkStream *stream = gst_pad_get_element_private (pad);
+
+  GST_DEBUG_OBJECT (s, "Releasing pad of stream %u", stream->id);
+
+  /* A chain blocked on a full queue gives up, or deactivating the pad
+   * would wait for its stream lock for ever */
+  GST_USB_SINK_QUEUE_LOCK (s);
+  stream->flushing = TRUE;
+  g_cond_broadcast (s->item_del);
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+
+  gst_pad_set_active (pad, FALSE);
+  gst_usb_sink_queue_flush_stream (s, stream->id);
+  s->stream_lanes[stream->id] = NULL;
+
+  GST_OBJECT_LOCK (s);
+  GST_USB_SINK_QUEUE_LOCK (s);
+  s->streams[stream->id] = NULL;
+  GST_USB_SINK_QUEUE_UNLOCK (s);
+  GST_OBJECT_UNLOCK (s);
+
+  gst_element_remove_pad (element, pad);
+  g_free (stream);
+}
+
 static GstStateChangeReturn
 gst_usb_sink_change_state (GstElement * element,
     GstStateChange transition)
 {
   GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
   GstUsbSink *sink = GST_USB_SINK (element);
-  guint *notification = g_malloc(sizeof(guint));
 
   switch (transition) {
     
   case GST_STATE_CHANGE_PAUSED_TO_PLAYING:{
     while (!sink->play)
       g_usleep(10);
+    gst_usb_sink_ping(sink);
     sink->sync= gst_util_get_timestamp()- gst_element_get_base_time(element);
     GST_DEBUG_OBJECT(sink, "Estimated %" GST_TIME_FORMAT " for time sync", GST_TIME_ARGS(sink->sync));
   }
@@ -607,8 +3142,6 @@ gst_usb_sink_change_state (GstElement * element,
   default:
     break;
   }
-  
-  g_free(notification);
 
   return ret;
 }
@@ -11,6 +11,9 @@
 
 #include "usbhost.h"
 #include "gstusbmessages.h"
+#include "linktest.h"
+#include "usbprof.h"
+#include "usbthread.h"
 
 G_BEGIN_DECLS
 
@@ -28,6 +31,174 @@ G_BEGIN_DECLS
 typedef struct _GstUsbSink      GstUsbSink;
 typedef struct _GstUsbSinkClass GstUsbSinkClass;
 
+/**
+ * What to do with buffers when the send queue is full
+ */
+typedef enum _GstUsbSinkLeaky
+{
+  /** Block the upstream thread until there is room */
+  GST_USB_SINK_NO_LEAK,
+
+  /** Drop the incoming buffer */
+  GST_USB_SINK_LEAK_UPSTREAM,
+
+  /** Drop the oldest queued buffer */
+  GST_USB_SINK_LEAK_DOWNSTREAM
+
+} GstUsbSinkLeaky;
+
+/**
+ * A payload being compressed by the worker pool. Shared by the queue item
+ * and the worker, the last one to let go frees it
+ */
+typedef struct _GstUsbSinkCompressed
+{
+  gint refcount;
+
+  /** Payload to compress */
+  GstBuffer *buffer;
+
+  /** Set by the worker once it's finished, under the queue lock */
+  gboolean done;
+
+  /** Compressed payload, NULL if it didn't get any smaller */
+  guint8 *data;
+  guint size;
+
+} GstUsbSinkCompressed;
+
+/**
+ * Entry of the send queue
+ */
+typedef struct _GstUsbSinkItem
+{
+  GstBuffer *buffer;
+
+  /** System time after which the buffer is not worth sending */
+  GstClockTime deadline;
+
+  /** Stream the buffer belongs to */
+  guint stream;
+
+  /** Compression started for the buffer when it was queued, or NULL */
+  GstUsbSinkCompressed *compressed;
+
+} GstUsbSinkItem;
+
+/**
+ * Last raw video frame of a stream the src holds, what the next one is
+ * delta coded against
+ */
+typedef struct _GstUsbSinkDelta
+{
+  GstBuffer *ref;
+
+  /** Number of the reference, both ends count them */
+  guint id;
+
+  /** Delta frames sent since the last keyframe */
+  guint since_key;
+
+} GstUsbSinkDelta;
+
+/**
+ * A request pad and the stream it feeds
+ */
+typedef struct _GstUsbSinkStream
+{
+  GstUsbSink *sink;
+  GstPad *pad;
+
+  /** Id sent along with every frame and caps message */
+  guint id;
+
+  /** Last segment received, to compute the deadlines */
+  GstSegment segment;
+
+  /** Between a FLUSH_START and its FLUSH_STOP, guarded by the queue
+   * lock */
+  gboolean flushing;
+
+} GstUsbSinkStream;
+
+/**
+ * A control request waiting for its reply
+ */
+typedef struct _GstUsbSinkRequest
+{
+  guint seq;
+
+  /** Set once the reply arrived or the link went down */
+  gboolean done;
+  gboolean failed;
+
+  /** Reply header, and its payload if the length is not 0 */
+  GstUsbControlHeader reply;
+  guint8 *payload;
+
+} GstUsbSinkRequest;
+
+/**
+ * Paths to the src, each one with its own endpoint and sender thread
+ */
+typedef enum _GstUsbSinkLaneId
+{
+  /** Main stream on EP2, optionally striped with EP3 */
+  GST_USB_SINK_LANE_STREAM,
+
+  /** Small or priority buffers on EP4, never waits behind the stream */
+  GST_USB_SINK_LANE_LOW_LATENCY,
+
+  GST_USB_SINK_N_LANES
+
+} GstUsbSinkLaneId;
+
+/**
+ * State of the link, it only leaves UP in resume mode
+ */
+typedef enum _GstUsbSinkLinkState
+{
+  /** Everything flows */
+  GST_USB_SINK_LINK_UP,
+
+  /** Device lost, nobody touches it until it is open again */
+  GST_USB_SINK_LINK_DOWN,
+
+  /** Device open again, only control traffic while the session is
+   * restored */
+  GST_USB_SINK_LINK_HANDSHAKE
+
+} GstUsbSinkLinkState;
+
+/**
+ * A send queue drained into one endpoint by its own sender thread
+ */
+typedef struct _GstUsbSinkLane
+{
+  /** Element the lane belongs to */
+  GstUsbSink *sink;
+
+  /** Endpoint the frames are written to */
+  EP_ADRESS endp;
+
+  /** Buffers waiting to be sent, as #GstUsbSinkItem */
+  GQueue *queue;
+  GCond *item_add;
+  pthread_t sender;
+  gboolean sending;
+
+  /** Current queue levels */
+  guint cur_level_buffers;
+  guint cur_level_bytes;
+
+  /** Stream served last, the next one is picked round robin */
+  guint last_stream;
+
+  /** Buffers sent through this lane */
+  guint64 sent;
+
+} GstUsbSinkLane;
+
 struct _GstUsbSink
 {
   GstBaseSink parent;
@@ -37,10 +208,27 @@ struct _GstUsbSink
   
   usb_host *host;
   
-  /* Used in get and set caps accross usb link */
-  GstCaps *caps;
-  gboolean emptycaps;
+  /* Last time sync ping, round trip and offset of the src clock */
+  GstClockTime rtt;
+  GstClockTimeDiff time_offset;
+
+  /* Request pads, indexed by stream id. Stream 0 is the always pad */
+  GstUsbSinkStream *streams[GST_USB_MAX_STREAMS];
   
+  /* Cleared to stop the up events thread */
+  gboolean up_running;
+
+  /* Control requests in flight by sequence number. control_lock only
+   * keeps the messages from interleaving on the link, pending_lock guards
+   * the table and is never held during a transfer */
+  GMutex *control_lock;
+  GMutex *pending_lock;
+  GCond *control_reply;
+  GHashTable *pending;
+  guint next_seq;
+  pthread_t control_reader;
+  gboolean control_running;
+
   /* Vars that aids sync */
   gboolean play;
   GstClockTimeDiff sync;
@@ -48,6 +236,133 @@ struct _GstUsbSink
   /* Lock to prevent the state to change while working */
   GMutex *state_lock;
 
+  /* Send queues, drained to the link by the sender threads. The lock
+   * and the item_del condition are shared by all lanes */
+  GstUsbSinkLane lanes[GST_USB_SINK_N_LANES];
+  GMutex *queue_lock;
+  GCond *item_del;
+  gboolean sender_running;
+  gboolean flushing;
+  GstFlowReturn sender_ret;
+
+  /* Maximum levels of each queue, 0 disables a limit */
+  guint max_size_buffers;
+  guint max_size_bytes;
+  guint64 max_size_time;
+  GstUsbSinkLeaky leaky;
+  guint64 dropped;
+
+  /* GOP-aware congestion control, thresholds of 0 are disabled */
+  gboolean gop_drop;
+  guint64 drop_latency;
+  guint drop_backlog;
+  gboolean gop_dropping;
+  guint64 congestion_events;
+  guint64 dropped_delta;
+  guint64 dropped_delta_bytes;
+
+  /* Buffers that missed their max-lateness deadline */
+  guint64 dropped_late;
+
+  /* Split payloads bigger than the threshold across EP2 and EP3 */
+  gboolean striped;
+  guint stripe_threshold;
+
+  /* Number of the last stripe tag sent, only the sender of the stream
+   * lane touches it */
+  guint stripe_seq;
+
+  /* Largest bulk transfer to issue, 0 for no limit */
+  guint max_transfer;
+
+  /* Negotiated with the src once connected: features both ends support
+   * and the transfer limit of the link */
+  guint link_features;
+  guint link_max_transfer;
+
+  /* Streams whose first buffer is smaller than the threshold or matches
+   * the caps are sent through the low latency lane. Each stream stays on
+   * the lane picked for it, set by its streaming thread, NULL until then */
+  guint lane_threshold;
+  GstCaps *lane_caps;
+  GstUsbSinkLane *stream_lanes[GST_USB_MAX_STREAMS];
+
+  /* Resume mode: ride through disconnections and restore the session
+   * once the src is back. Threads enter the link around their transfers,
+   * so the relinker thread reopens the device when nobody uses it */
+  gboolean resume;
+  GMutex *link_lock;
+  GCond *link_cond;
+  GstUsbSinkLinkState link_state;
+  gboolean link_closing;
+  guint link_users;
+  pthread_t relinker;
+  gboolean relinking;
+  GstClockTime outage_start;
+  guint64 outages;
+
+  /* Send a CRC of every payload, used if the src supports it */
+  gboolean crc;
+
+  /* Compress payloads if both ends support it. The workers compress
+   * several queued buffers at once, the sender waits for each one in
+   * queue order */
+  gboolean compress;
+  guint compress_workers;
+  GThreadPool *compress_pool;
+  GCond *compress_done;
+  guint64 compressed_frames;
+  guint64 compressed_saved;
+
+  /* Send raw video as deltas against the previous frame, with a full
+   * keyframe every keyframe_interval frames. Only the sender of the
+   * stream lane touches the references, the others set delta_reset to
+   * have them dropped, on a relink or when the src asks for a keyframe */
+  gboolean delta;
+  guint keyframe_interval;
+  GstUsbSinkDelta delta_refs[GST_USB_MAX_STREAMS];
+  guint8 *delta_scratch;
+  guint delta_scratch_size;
+  gboolean delta_reset;
+  guint64 delta_frames;
+  guint64 delta_keyframes;
+  guint64 delta_saved;
+
+  /* Link qualification: the tester thread streams the pattern on the
+   * stream endpoint as fast as the link takes it, buffers from upstream
+   * are dropped */
+  LINK_TEST_PATTERN test_mode;
+  guint test_size;
+  pthread_t tester;
+  gboolean test_running;
+  guint64 test_bytes;
+  guint64 test_retries;
+
+  /* Script of the emulated link the transfers go through, NULL to use
+   * the real one */
+  gchar *emulate;
+
+  /* Where the CPU goes in each phase of the data path, NULL unless
+   * configured with --enable-profiling */
+  usb_prof *prof;
+
+  /* Scheduling of the I/O threads the element creates, the cpus point
+   * into thread_affinity once started. The streaming thread belongs to
+   * the pipeline and is left alone */
+  usb_thread_sched sched;
+  gchar *thread_affinity;
+
+  /* Microseconds the transfers spin for their completion, 0 to sleep */
+  guint busy_poll;
+
+  /* Selector of the gadget to open, NULL for the first free one, and
+   * its parsed form once started */
+  gchar *device;
+  usb_host_match match;
+
+  /* Milliseconds start waits for the gadget to show up, 0 for ever */
+  guint open_timeout;
+
   /* Clock implementation */
   GstClock *provided_clock;
   GstClockTime gadgetclock;
@@ -11,9 +11,17 @@
 
 #include <gst/gst.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_LZ4
+#  include <lz4.h>
+#endif
 
 #include "gstusbsrc.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "linkemu.h"
+#include "usbcapture.h"
 
 
 GST_DEBUG_CATEGORY_STATIC (gst_usb_src_debug);
@@ -26,12 +34,137 @@ GST_DEBUG_CATEGORY_STATIC (gst_usb_src_debug);
 #define GST_USB_SRC_STATE_UNLOCK(s) \
   (g_mutex_unlock(GST_USB_SRC_GET_STATE_LOCK(s)))
 
+/* Milliseconds to wait for a frame before checking if we are flushing */
+#define READ_TIMEOUT 100
+
+#define DEFAULT_MAX_LATENESS -1
+#define DEFAULT_MAX_TRANSFER 0
+#define DEFAULT_RESUME FALSE
+#define DEFAULT_CRC_ACTION GST_USB_SRC_CRC_DROP
+#define DEFAULT_TEST_MODE LINK_TEST_NONE
+
+/* Largest read in test mode, and nanoseconds between test reports */
+/* Largest test transfer the sink can ask for */
+#define TEST_MAX_SIZE (16 * 1024 * 1024)
+#define TEST_REPORT_INTERVAL GST_SECOND
+/* Microseconds between checks for the size of the test transfers */
+#define TEST_WAIT_INTERVAL 10000
+
+/* Phases of the data path, profiled when configured with
+ * --enable-profiling. Create is the streaming thread, the rest the
+ * readers */
+enum
+{
+  PROF_LENGTH_READ,
+  PROF_HEADER_READ,
+  PROF_PARSE,
+  PROF_ALLOCATE,
+  PROF_PAYLOAD_READ,
+  PROF_DECODE,
+  PROF_CREATE,
+  PROF_N_PHASES
+};
+
+static const char *const prof_phases[PROF_N_PHASES] = {
+  "length-read", "header-read", "parse", "allocate", "payload-read",
+  "decode", "create"
+};
+
+/* Figures of a phase in the stats, in usb_prof_phase order */
+static const gchar *const prof_figures[] = {
+  "count", "ns", "cycles", "instructions", "cache-misses"
+};
+
 enum
 {
   PROP_0,
-  PROP_USBSYNC
+  PROP_USBSYNC,
+  PROP_MAX_LATENESS,
+  PROP_MAX_TRANSFER,
+  PROP_RESUME,
+  PROP_CRC_ACTION,
+  PROP_TEST_MODE,
+  PROP_EMULATE,
+  PROP_CAPTURE,
+  PROP_REPLAY,
+  PROP_REPLAY_REALTIME,
+  PROP_LOOP,
+  PROP_THREAD_POLICY,
+  PROP_THREAD_PRIORITY,
+  PROP_THREAD_AFFINITY,
+  PROP_BUSY_POLL,
+  PROP_SERIAL,
+  PROP_MAX_SIZE_BUFFERS,
+  PROP_STATS
 };
 
+#define DEFAULT_REPLAY_REALTIME TRUE
+#define DEFAULT_THREAD_POLICY SCHED_OTHER
+#define DEFAULT_THREAD_PRIORITY 1
+#define DEFAULT_BUSY_POLL 0
+#define DEFAULT_MAX_SIZE_BUFFERS 64
+
+#define GST_TYPE_USB_SRC_TEST_MODE (gst_usb_src_test_mode_get_type ())
+
+static GType
+gst_usb_src_test_mode_get_type (void)
+{
+  static GType usb_src_test_mode_type = 0;
+  static const GEnumValue usb_src_test_mode[] = {
+    {LINK_TEST_NONE, "Normal operation", "none"},
+    {LINK_TEST_ZERO, "Check for zeros", "zero"},
+    {LINK_TEST_MOD63, "Check for the mod63 pattern", "mod63"},
+    {0, NULL, NULL},
+  };
+
+  if (!usb_src_test_mode_type) {
+    usb_src_test_mode_type =
+      g_enum_register_static ("GstUsbSrcTestMode", usb_src_test_mode);
+  }
+  return usb_src_test_mode_type;
+}
+
+#define GST_TYPE_USB_SRC_CRC_ACTION (gst_usb_src_crc_action_get_type ())
+
+static GType
+gst_usb_src_crc_action_get_type (void)
+{
+  static GType usb_src_crc_action_type = 0;
+  static const GEnumValue usb_src_crc_action[] = {
+    {GST_USB_SRC_CRC_DROP, "Drop the buffer", "drop"},
+    {GST_USB_SRC_CRC_MARK, "Push the buffer flagged as a discontinuity",
+     "mark"},
+    {GST_USB_SRC_CRC_IGNORE, "Push the buffer as is", "ignore"},
+    {0, NULL, NULL},
+  };
+
+  if (!usb_src_crc_action_type) {
+    usb_src_crc_action_type =
+      g_enum_register_static ("GstUsbSrcCrcAction", usb_src_crc_action);
+  }
+  return usb_src_crc_action_type;
+}
+
+#define GST_TYPE_USB_SRC_THREAD_POLICY (gst_usb_src_thread_policy_get_type ())
+
+static GType
+gst_usb_src_thread_policy_get_type (void)
+{
+  static GType usb_src_thread_policy_type = 0;
+  static const GEnumValue usb_src_thread_policy[] = {
+    {SCHED_OTHER, "Time sharing", "other"},
+    {SCHED_FIFO, "Real time, first in first out", "fifo"},
+    {SCHED_RR, "Real time, round robin", "rr"},
+    {0, NULL, NULL},
+  };
+
+  if (!usb_src_thread_policy_type) {
+    usb_src_thread_policy_type =
+      g_enum_register_static ("GstUsbSrcThreadPolicy", usb_src_thread_policy);
+  }
+  return usb_src_thread_policy_type;
+}
+
 /* the capabilities of the inputs and outputs.
  */
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
@@ -40,6 +173,14 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_STATIC_CAPS ("ANY")
     );
 
+/* Extra streams multiplexed on the same link, added once the sink sets
+ * their caps */
+static GstStaticPadTemplate stream_factory = GST_STATIC_PAD_TEMPLATE ("src_%d",
+    GST_PAD_SRC,
+    GST_PAD_SOMETIMES,
+    GST_STATIC_CAPS ("ANY")
+    );
+
 GST_BOILERPLATE (GstUsbSrc, gst_usb_src, GstPushSrc,
     GST_TYPE_PUSH_SRC);
 
@@ -47,17 +188,36 @@ static void gst_usb_src_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
 static void gst_usb_src_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
+static void gst_usb_src_finalize (GObject * object);
 static GstFlowReturn gst_usb_src_create 
 (GstPushSrc * ps, GstBuffer ** buf);
 static gboolean gst_usb_src_start (GstBaseSrc * bs);
 static gboolean gst_usb_src_stop (GstBaseSrc * bs);
+static gboolean gst_usb_src_unlock (GstBaseSrc * bs);
+static gboolean gst_usb_src_unlock_stop (GstBaseSrc * bs);
 static GstStateChangeReturn gst_usb_src_change_state (GstElement *
 						      element, GstStateChange transition);
 
 void *gst_usb_src_down_event (void *src);	
 static void close_down_event(void *param);
-static gboolean gst_usb_src_send_caps(GstUsbSrc *s, GstCaps *caps);
-static GstCaps *gst_usb_src_receive_caps(GstUsbSrc *s);
+static void gst_usb_src_handle_request(GstUsbSrc *s,
+    GstUsbControlHeader *request, guint8 *payload);
+static gboolean gst_usb_src_reply(GstUsbSrc *s, GstUsbControlHeader *request,
+    guint type, gconstpointer payload, guint length);
+static gboolean gst_usb_src_set_stream_caps(GstUsbSrc *s, guint stream,
+					    GstCaps *caps);
+static void gst_usb_src_remove_streams(GstUsbSrc *s);
+static void gst_usb_src_wait_link(GstUsbSrc *s, guint session,
+    gboolean *running);
+static void gst_usb_src_resume_link(GstUsbSrc *s);
+static GstCaps *gst_usb_src_get_stream_caps(GstUsbSrc *s, guint stream);
+static int gst_usb_src_vendor_request(usb_gadget *gadget,
+    unsigned char request, unsigned short value, unsigned short index,
+    unsigned char *buffer, int length, void *user_data);
+static GstStructure *gst_usb_src_get_stats(GstUsbSrc *s);
+static void gst_usb_src_log_profile(GstUsbSrc *s);
+void *gst_usb_src_reader (void *reader);
+static void gst_usb_src_stop_readers (GstUsbSrc *s, gint n);
 
 /* GObject vmethod implementations */
 
@@ -75,6 +235,8 @@ gst_usb_src_base_init (gpointer gclass)
   
   gst_element_class_add_pad_template (element_class,
 				      gst_static_pad_template_get (&src_factory));
+  gst_element_class_add_pad_template (element_class,
+				      gst_static_pad_template_get (&stream_factory));
 }
 
 /* initialize the usbsrc's class */
@@ -93,6 +255,7 @@ gst_usb_src_class_init (GstUsbSrcClass * klass)
 
   gobject_class->set_property = gst_usb_src_set_property;
   gobject_class->get_property = gst_usb_src_get_property; 
+  gobject_class->finalize = gst_usb_src_finalize;
 
   gstelement_class->change_state =
     gst_usb_src_change_state;
@@ -100,10 +263,80 @@ gst_usb_src_class_init (GstUsbSrcClass * klass)
   push_class->create = gst_usb_src_create;
   base_class->start = gst_usb_src_start;
   base_class->stop = gst_usb_src_stop;
+  base_class->unlock = gst_usb_src_unlock;
+  base_class->unlock_stop = gst_usb_src_unlock_stop;
 
   g_object_class_install_property (gobject_class, PROP_USBSYNC,
 				   g_param_spec_boolean ("usbsync", "UsbSync", "Synchronize timestamps with src time",
 							 TRUE, G_PARAM_READWRITE));    
+  g_object_class_install_property (gobject_class, PROP_MAX_LATENESS,
+				   g_param_spec_int64 ("max-lateness", "Max Lateness",
+						       "Drop buffers received later than this after their timestamp (in ns, -1 unlimited)",
+						       -1, G_MAXINT64, DEFAULT_MAX_LATENESS, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_MAX_TRANSFER,
+				   g_param_spec_uint ("max-transfer", "Max transfer",
+						      "Largest bulk transfer in bytes, the smallest of both ends is used (0=unlimited)",
+						      0, G_MAXUINT, DEFAULT_MAX_TRANSFER, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_RESUME,
+				   g_param_spec_boolean ("resume", "Resume",
+							 "Keep running across disconnections and resume the session once the host is back",
+							 DEFAULT_RESUME, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_CRC_ACTION,
+				   g_param_spec_enum ("crc-action", "CRC action",
+						      "What to do with a payload that doesn't match the CRC sent by the sink",
+						      GST_TYPE_USB_SRC_CRC_ACTION, DEFAULT_CRC_ACTION, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_TEST_MODE,
+				   g_param_spec_enum ("test-mode", "Test mode",
+						      "Qualify the link checking the test pattern streamed by the sink, which has to use the same one",
+						      GST_TYPE_USB_SRC_TEST_MODE, DEFAULT_TEST_MODE, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_EMULATE,
+				   g_param_spec_string ("emulate", "Emulate",
+							"Receive through an emulated bad link described by this script, see linkemu.h (NULL=real link)",
+							NULL, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_CAPTURE,
+				   g_param_spec_string ("capture", "Capture",
+							"Record the traffic of the stream and event endpoints to this file (NULL=don't record)",
+							NULL, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_REPLAY,
+				   g_param_spec_string ("replay", "Replay",
+							"Serve a file recorded with capture instead of the gadget, no device is needed (NULL=use the gadget)",
+							NULL, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_REPLAY_REALTIME,
+				   g_param_spec_boolean ("replay-realtime", "Replay realtime",
+							 "Replay with the original timing, otherwise as fast as possible and with no late drops",
+							 DEFAULT_REPLAY_REALTIME, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_LOOP,
+				   g_param_spec_string ("loop", "Loop",
+							"Serve the usbsink of this process whose device is \"loop=<name>\" instead of the gadget, no device is needed (NULL=use the gadget)",
+							NULL, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_THREAD_POLICY,
+				   g_param_spec_enum ("thread-policy", "Thread policy",
+						      "Scheduling policy of the I/O threads, the gadget's included, the real time ones need CAP_SYS_NICE or an rtprio limit",
+						      GST_TYPE_USB_SRC_THREAD_POLICY, DEFAULT_THREAD_POLICY, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_THREAD_PRIORITY,
+				   g_param_spec_int ("thread-priority", "Thread priority",
+						     "Real time priority of the I/O threads, with the fifo and rr policies",
+						     1, 99, DEFAULT_THREAD_PRIORITY, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_THREAD_AFFINITY,
+				   g_param_spec_string ("thread-affinity", "Thread affinity",
+							"Cpus the I/O threads run on, as in \"0,2-3\" (NULL=any)",
+							NULL, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_BUSY_POLL,
+				   g_param_spec_uint ("busy-poll", "Busy poll",
+						      "Microseconds a read of the stream spins for its completion before sleeping, trading a core for the wakeup latency (0=never spin)",
+						      0, G_MAXUINT, DEFAULT_BUSY_POLL, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_SERIAL,
+				   g_param_spec_string ("serial", "Serial",
+							"Serial number the gadget reports, for a sink to pick this board among others (NULL=none)",
+							NULL, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_MAX_SIZE_BUFFERS,
+				   g_param_spec_uint ("max-size-buffers", "Max. size (buffers)",
+						      "Max. number of frames read ahead of the streaming thread, the readers wait for room past it (0=disable)",
+						      0, G_MAXUINT, DEFAULT_MAX_SIZE_BUFFERS, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_STATS,
+				   g_param_spec_boxed ("stats", "Statistics",
+						       "Receive statistics",
+						       GST_TYPE_STRUCTURE, G_PARAM_READABLE));
 }
 
 /* initialize the new element
@@ -115,12 +348,95 @@ gst_usb_src_init (GstUsbSrc * s,
   /* Initialize data protocol library */	
   gst_dp_init();	
   gst_base_src_set_live (GST_BASE_SRC (s), TRUE);
+  /* Buffers carry the timestamps of the sink, deadlines are checked
+   * against their running time */
+  gst_base_src_set_format (GST_BASE_SRC (s), GST_FORMAT_TIME);
 
-  s->gadget = g_malloc(sizeof(usb_gadget));
+  s->gadget = g_malloc0(sizeof(usb_gadget));
   s->play=FALSE;
   s->state_lock = g_mutex_new ();
   s->sync = GST_CLOCK_TIME_NONE;
   s->usbsync = TRUE;
+  s->flushing = FALSE;
+  s->max_lateness = DEFAULT_MAX_LATENESS;
+  s->dropped_late = 0;
+  s->max_transfer = DEFAULT_MAX_TRANSFER;
+  s->link_features = 0;
+  s->resume = DEFAULT_RESUME;
+  s->link_session = 0;
+  s->outage_start = GST_CLOCK_TIME_NONE;
+  s->outages = 0;
+  s->framing_errors = 0;
+  s->crc_action = DEFAULT_CRC_ACTION;
+  s->crc_checked = 0;
+  s->crc_errors = 0;
+  s->decompressed_frames = 0;
+  memset (s->delta_refs, 0, sizeof s->delta_refs);
+  s->delta_frames = 0;
+  s->delta_missed = 0;
+  s->test_mode = DEFAULT_TEST_MODE;
+  s->test_size = 0;
+  s->test_bytes = 0;
+  s->test_errors = 0;
+  s->test_first_error = G_MAXUINT64;
+  s->test_last_error = G_MAXUINT64;
+  s->emulate = NULL;
+  s->capture = NULL;
+  s->replay = NULL;
+  s->replay_realtime = DEFAULT_REPLAY_REALTIME;
+  s->loop = NULL;
+  s->readers_ended = 0;
+  s->link_max_transfer = 0;
+  s->sched.policy = DEFAULT_THREAD_POLICY;
+  s->sched.priority = DEFAULT_THREAD_PRIORITY;
+  s->sched.cpus = NULL;
+  s->thread_affinity = NULL;
+  s->busy_poll = DEFAULT_BUSY_POLL;
+  s->serial = NULL;
+  /* The gadget threads follow the same properties */
+  s->gadget->sched = &s->sched;
+#ifdef ENABLE_PROFILING
+  s->prof = usb_prof_new (prof_phases, PROF_N_PHASES);
+#else
+  s->prof = NULL;
+#endif
+
+  s->frames = g_async_queue_new ();
+  s->max_size_buffers = DEFAULT_MAX_SIZE_BUFFERS;
+  s->frames_lock = g_mutex_new ();
+  s->frames_cond = g_cond_new ();
+  memset (s->readers, 0, sizeof s->readers);
+  s->readers[0].src = s;
+  s->readers[0].endp = GAD_STREAM_EP;
+  s->readers[1].src = s;
+  s->readers[1].endp = GAD_LANE_EP;
+  s->readers_running = FALSE;
+  s->reader_ret = GAD_EOK;
+  memset (s->streams, 0, sizeof s->streams);
+}
+
+/* Everything from init lives until the element goes, the gadget is reused
+ * across state cycles */
+static void
+gst_usb_src_finalize (GObject * object)
+{
+  GstUsbSrc *s = GST_USB_SRC (object);
+
+  g_free (s->emulate);
+  g_free (s->thread_affinity);
+  g_free (s->serial);
+  g_free (s->capture);
+  g_free (s->replay);
+  g_free (s->loop);
+  if (s->prof)
+    usb_prof_free (s->prof);
+  g_mutex_free (s->state_lock);
+  g_async_queue_unref (s->frames);
+  g_mutex_free (s->frames_lock);
+  g_cond_free (s->frames_cond);
+  g_free (s->gadget);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
 static void
@@ -133,6 +449,60 @@ gst_usb_src_set_property (GObject * object, guint prop_id,
     case PROP_USBSYNC:
       filter->usbsync = g_value_get_boolean (value);
       break;
+    case PROP_MAX_LATENESS:
+      filter->max_lateness = g_value_get_int64 (value);
+      break;
+    case PROP_MAX_TRANSFER:
+      filter->max_transfer = GST_USB_ALIGN_TRANSFER (g_value_get_uint (value));
+      break;
+    case PROP_RESUME:
+      filter->resume = g_value_get_boolean (value);
+      break;
+    case PROP_CRC_ACTION:
+      filter->crc_action = g_value_get_enum (value);
+      break;
+    case PROP_TEST_MODE:
+      filter->test_mode = g_value_get_enum (value);
+      break;
+    case PROP_EMULATE:
+      g_free (filter->emulate);
+      filter->emulate = g_value_dup_string (value);
+      break;
+    case PROP_CAPTURE:
+      g_free (filter->capture);
+      filter->capture = g_value_dup_string (value);
+      break;
+    case PROP_REPLAY:
+      g_free (filter->replay);
+      filter->replay = g_value_dup_string (value);
+      break;
+    case PROP_REPLAY_REALTIME:
+      filter->replay_realtime = g_value_get_boolean (value);
+      break;
+    case PROP_LOOP:
+      g_free (filter->loop);
+      filter->loop = g_value_dup_string (value);
+      break;
+    case PROP_THREAD_POLICY:
+      filter->sched.policy = g_value_get_enum (value);
+      break;
+    case PROP_THREAD_PRIORITY:
+      filter->sched.priority = g_value_get_int (value);
+      break;
+    case PROP_THREAD_AFFINITY:
+      g_free (filter->thread_affinity);
+      filter->thread_affinity = g_value_dup_string (value);
+      break;
+    case PROP_BUSY_POLL:
+      filter->busy_poll = g_value_get_uint (value);
+      break;
+    case PROP_MAX_SIZE_BUFFERS:
+      filter->max_size_buffers = g_value_get_uint (value);
+      break;
+    case PROP_SERIAL:
+      g_free (filter->serial);
+      filter->serial = g_value_dup_string (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -149,6 +519,57 @@ gst_usb_src_get_property (GObject * object, guint prop_id,
     case PROP_USBSYNC:
       g_value_set_boolean (value, filter->usbsync);
       break;
+    case PROP_MAX_LATENESS:
+      g_value_set_int64 (value, filter->max_lateness);
+      break;
+    case PROP_MAX_TRANSFER:
+      g_value_set_uint (value, filter->max_transfer);
+      break;
+    case PROP_RESUME:
+      g_value_set_boolean (value, filter->resume);
+      break;
+    case PROP_CRC_ACTION:
+      g_value_set_enum (value, filter->crc_action);
+      break;
+    case PROP_TEST_MODE:
+      g_value_set_enum (value, filter->test_mode);
+      break;
+    case PROP_EMULATE:
+      g_value_set_string (value, filter->emulate);
+      break;
+    case PROP_CAPTURE:
+      g_value_set_string (value, filter->capture);
+      break;
+    case PROP_REPLAY:
+      g_value_set_string (value, filter->replay);
+      break;
+    case PROP_REPLAY_REALTIME:
+      g_value_set_boolean (value, filter->replay_realtime);
+      break;
+    case PROP_LOOP:
+      g_value_set_string (value, filter->loop);
+      break;
+    case PROP_THREAD_POLICY:
+      g_value_set_enum (value, filter->sched.policy);
+      break;
+    case PROP_THREAD_PRIORITY:
+      g_value_set_int (value, filter->sched.priority);
+      break;
+    case PROP_THREAD_AFFINITY:
+      g_value_set_string (value, filter->thread_affinity);
+      break;
+    case PROP_BUSY_POLL:
+      g_value_set_uint (value, filter->busy_poll);
+      break;
+    case PROP_MAX_SIZE_BUFFERS:
+      g_value_set_uint (value, filter->max_size_buffers);
+      break;
+    case PROP_SERIAL:
+      g_value_set_string (value, filter->serial);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_usb_src_get_stats (filter));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -157,43 +578,108 @@ gst_usb_src_get_property (GObject * object, guint prop_id,
 
 /* GstElement vmethod implementations */
 
+/* Names and schedules one of our threads as the properties say. Failing
+ * isn't fatal, the thread just runs as it would have */
+static void
+gst_usb_src_schedule (GstUsbSrc *s, pthread_t thread, const char *name)
+{
+  int err = usb_thread_setup (thread, name, &s->sched);
+
+  if (err != 0)
+    GST_WARNING_OBJECT (s, "Unable to schedule the %s thread: %s", name,
+			g_strerror (err));
+}
+
 static gboolean
 gst_usb_src_start (GstBaseSrc * bs)
 {
   GstUsbSrc *s = GST_USB_SRC (bs);
+  gint i;
   
-   
-  switch (usb_gadget_new(s->gadget, GLEVEL0)){
-  case GAD_EOK:
-    break;  
-  case ERR_GAD_DIR:
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-		      ("Cannot work on /dev/gadget dir. Make sure it exists"\
-		       "and you have a gadgetfs mounted there."));
-    return FALSE;
-  case ERR_OPEN_FD:
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-		      ("Can't open gadget's file descriptor"));
-    return FALSE;
-  case ERR_NO_DEVICE:
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-		      ("No asociated device found"));  
-    return FALSE;
-  case ERR_WRITE_FD:
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-		      ("Can't write to file descriptor"));
+  if (s->thread_affinity && !usb_thread_cpus_valid (s->thread_affinity))
+  {
+    GST_ELEMENT_ERROR(s,RESOURCE,SETTINGS,(NULL),
+		      ("Malformed thread affinity \"%s\"", s->thread_affinity));
     return FALSE;
-  case SHORT_WRITE_FD:
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-		      ("Short write in file descriptor, aborting..."));
+  }
+  s->sched.cpus = s->thread_affinity;
+  s->test_size = 0;
+   
+  if (s->replay)
+  {
+    if (usb_gadget_replay_new (s->gadget, s->replay, s->replay_realtime,
+			       GLEVEL0) != GAD_EOK)
+    {
+      GST_ELEMENT_ERROR(s,RESOURCE,OPEN_READ,(NULL),
+			("Can't open capture \"%s\"", s->replay));
+      return FALSE;
+    }
+  }
+  else if (s->loop)
+  {
+    if (usb_gadget_loop_new (s->gadget, s->loop, GLEVEL0) != GAD_EOK)
+    {
+      GST_ELEMENT_ERROR(s,RESOURCE,BUSY,(NULL),
+			("Another usbsrc serves loop \"%s\"", s->loop));
+      return FALSE;
+    }
+  }
+  else
+  {
+    s->gadget->serial = s->serial;
+    switch (usb_gadget_new(s->gadget, GLEVEL0)){
+    case GAD_EOK:
+      break;  
+    case ERR_GAD_DIR:
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			("Cannot work on /dev/gadget dir. Make sure it exists"\
+			 "and you have a gadgetfs mounted there."));
+      return FALSE;
+    case ERR_OPEN_FD:
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			("Can't open gadget's file descriptor"));
+      return FALSE;
+    case ERR_NO_DEVICE:
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			("No asociated device found"));  
+      return FALSE;
+    case ERR_WRITE_FD:
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			("Can't write to file descriptor"));
+      return FALSE;
+    case SHORT_WRITE_FD:
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			("Short write in file descriptor, aborting..."));
+      return FALSE;
+    default:
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			("Error initializing device"));
+      return FALSE;
+    }
+  }
+
+  if (s->capture && (s->gadget->capture = usb_capture_new (s->capture)) == NULL)
+  {
+    usb_gadget_free (s->gadget);
+    GST_ELEMENT_ERROR(s,RESOURCE,OPEN_WRITE,(NULL),
+		      ("Can't create capture \"%s\"", s->capture));
     return FALSE;
-  default:
-    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-		      ("Error initializing device"));
+  }
+
+  if (s->emulate && (s->gadget->emu = link_emu_new (s->emulate)) == NULL)
+  {
+    usb_gadget_free (s->gadget);
+    GST_ELEMENT_ERROR(s,RESOURCE,SETTINGS,(NULL),
+		      ("Malformed link emulation script \"%s\"", s->emulate));
     return FALSE;
   }
   
-  guint *notification = g_malloc(sizeof(guint)); 
+  s->gadget->busy_poll = s->busy_poll;
+
+  /* Queries from the sink come on the control pipe */
+  usb_gadget_set_vendor_handler (s->gadget, gst_usb_src_vendor_request, s);
+
+  guint notification;
 
   /* Poll for gadget connection */
   GST_DEBUG_OBJECT (s,"Waiting for gadget to connect...");
@@ -202,47 +688,344 @@ gst_usb_src_start (GstBaseSrc * bs)
   GST_DEBUG_OBJECT (s,"Gadget connected!");
   
   /* Send sink the connection notification */
-  notification[0] = GST_USB_CONNECTED;
+  notification = GST_USB_CONNECTED;
   GST_DEBUG_OBJECT (s,"Notifying sink of connection status");
   if ( usb_gadget_transfer (s->gadget,
-                            GAD_UP_EP,   
-                            (unsigned char *) notification, 
+                            GAD_NOTIFY_EP,
+                            (unsigned char *) &notification, 
 			    sizeof(guint)) != GAD_EOK)
   {
-    g_free(notification);	  							
     GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
       ("Error Establishing connection with sink"));
     return FALSE;
   }		
+  s->link_session = s->gadget->session;
+  s->outage_start = GST_CLOCK_TIME_NONE;
 
   /* Create a thread for downstream events */
   if (pthread_create (&(s->gadget->ev_down.thread), NULL,
 		      (void *) gst_usb_src_down_event, (void *) bs) != 0){
     GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
       ("Unable to create down events thread, aborting.."));	  
-    g_free(notification);
     return FALSE;
   }	
+  gst_usb_src_schedule (s, s->gadget->ev_down.thread, "usbsrc-down");
+
+  /* Create the readers, so a small frame on the low latency lane doesn't
+   * wait for a big one on the stream */
+  s->reader_ret = GAD_EOK;
+  s->readers_ended = 0;
+  s->readers_running = TRUE;
+  for (i = 0; i < GST_USB_SRC_N_READERS; i++)
+  {
+    s->readers[i].frame_stream = -1;
+    s->readers[i].stripe_pending = FALSE;
+    if (pthread_create (&(s->readers[i].thread), NULL,
+			(void *) gst_usb_src_reader, (void *) &s->readers[i]) != 0)
+    {
+      gst_usb_src_stop_readers (s, i);
+      GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+	("Unable to create reader thread, aborting.."));
+      return FALSE;
+    }
+    gst_usb_src_schedule (s, s->readers[i].thread,
+			  s->readers[i].endp == GAD_STREAM_EP ? "usbsrc-read" :
+			  "usbsrc-lane");
+  }
 
   GST_USB_SRC_STATE_UNLOCK(s);
-  g_free(notification);
   return TRUE;
 }
 
+static void
+gst_usb_src_frame_free (GstUsbSrcFrame *frame)
+{
+  if (frame->buffer)
+    gst_buffer_unref (frame->buffer);
+  g_slice_free (GstUsbSrcFrame, frame);
+}
+
+/* Wakes up the readers waiting for room in a queue, after taking frames
+ * out of it or to have them check if they have to stop */
+static void
+gst_usb_src_frames_wake (GstUsbSrc *s)
+{
+  g_mutex_lock (s->frames_lock);
+  g_cond_broadcast (s->frames_cond);
+  g_mutex_unlock (s->frames_lock);
+}
+
+/* Hands a frame to the streaming thread, waiting while its queue is full.
+ * The frame is dropped if the readers are stopped or the element flushes
+ * in the meantime */
+static gboolean
+gst_usb_src_queue_frame (GstUsbSrc *s, GAsyncQueue *queue,
+			 GstUsbSrcFrame *frame)
+{
+  GTimeVal timeout;
+
+  g_mutex_lock (s->frames_lock);
+  while (s->readers_running && !s->flushing && s->max_size_buffers &&
+	 g_async_queue_length (queue) >= (gint) s->max_size_buffers)
+  {
+    g_get_current_time (&timeout);
+    g_time_val_add (&timeout, READ_TIMEOUT * 1000);
+    g_cond_timed_wait (s->frames_cond, s->frames_lock, &timeout);
+  }
+  g_mutex_unlock (s->frames_lock);
+
+  if (!s->readers_running || s->flushing)
+  {
+    gst_usb_src_frame_free (frame);
+    return FALSE;
+  }
+  g_async_queue_push (queue, frame);
+  return TRUE;
+}
+
+/* Queues a frame for the pad of its stream, dropping it if the stream
+ * has no pad */
+static gboolean
+gst_usb_src_dispatch_frame (GstUsbSrc *s, GstUsbSrcFrame *frame)
+{
+  GAsyncQueue *queue;
+  gboolean ret;
+
+  if (frame->stream == 0)
+    return gst_usb_src_queue_frame (s, s->frames, frame);
+
+  GST_OBJECT_LOCK (s);
+  queue = s->stream_frames[frame->stream];
+  if (queue)
+    g_async_queue_ref (queue);
+  GST_OBJECT_UNLOCK (s);
+
+  if (queue == NULL)
+  {
+    GST_LOG_OBJECT (s, "No pad for stream %u, dropping buffer",
+		    frame->stream);
+    gst_usb_src_frame_free (frame);
+    return FALSE;
+  }
+
+  ret = gst_usb_src_queue_frame (s, queue, frame);
+  g_async_queue_unref (queue);
+  return ret;
+}
+
+/* Tells which stream the frame a reader is reading belongs to, -1 once
+ * the frame is handed over or dropped */
+static void
+gst_usb_src_reader_frame (GstUsbSrc *s, GstUsbSrcReader *reader,
+			  gint stream)
+{
+  g_mutex_lock (s->frames_lock);
+  reader->frame_stream = stream;
+  if (stream < 0)
+    g_cond_broadcast (s->frames_cond);
+  g_mutex_unlock (s->frames_lock);
+}
+
+/* Queues the end of an extra stream behind its last frame. The sink ends
+ * the stream once that frame crossed the link, a reader may still be
+ * handing it over though */
+static void
+gst_usb_src_end_stream (GstUsbSrc *s, guint stream)
+{
+  GstUsbSrcFrame *frame;
+  GTimeVal timeout;
+  gint i;
+
+  g_mutex_lock (s->frames_lock);
+  for (i = 0; i < GST_USB_SRC_N_READERS; i++)
+    while (s->readers_running && s->readers[i].frame_stream == stream)
+    {
+      g_get_current_time (&timeout);
+      g_time_val_add (&timeout, READ_TIMEOUT * 1000);
+      g_cond_timed_wait (s->frames_cond, s->frames_lock, &timeout);
+    }
+  g_mutex_unlock (s->frames_lock);
+
+  frame = g_slice_new (GstUsbSrcFrame);
+  frame->buffer = NULL;
+  frame->stream = stream;
+  gst_usb_src_dispatch_frame (s, frame);
+}
+
+/* Readers notice within READ_TIMEOUT, unless they are in the middle of
+ * a frame */
+static void
+gst_usb_src_stop_readers (GstUsbSrc *s, gint n)
+{
+  GstUsbSrcFrame *frame;
+  gint i;
+
+  s->readers_running = FALSE;
+  gst_usb_src_frames_wake (s);
+  for (i = 0; i < n; i++)
+  {
+    pthread_join (s->readers[i].thread, NULL);
+    g_free (s->readers[i].scratch);
+    s->readers[i].scratch = NULL;
+    s->readers[i].scratch_size = 0;
+  }
+  for (i = 0; i < GST_USB_MAX_STREAMS; i++)
+  {
+    if (s->delta_refs[i].ref)
+      gst_buffer_unref (s->delta_refs[i].ref);
+    s->delta_refs[i].ref = NULL;
+    s->delta_refs[i].key_requested = FALSE;
+  }
+
+  while ((frame = g_async_queue_try_pop (s->frames)) != NULL)
+    gst_usb_src_frame_free (frame);
+}
+
 static gboolean
 gst_usb_src_stop (GstBaseSrc * bs)
 {
   GstUsbSrc *s = GST_USB_SRC (bs);
 
+  if (s->readers_running)
+    gst_usb_src_stop_readers (s, GST_USB_SRC_N_READERS);
+  gst_usb_src_remove_streams (s);
+
   if (pthread_cancel(s->gadget->ev_down.thread))
   {
     GST_WARNING_OBJECT(s,"Problem closing USB events thread");
   }
-  usb_gadget_free(s->gadget);
-  g_free(s->gadget);
+  /* Even one that already ended, its resources go only once joined */
+  pthread_join (s->gadget->ev_down.thread, NULL);
+  if (s->gadget->emu)
+    GST_INFO_OBJECT (s, "Emulated link: %" G_GUINT64_FORMAT " transfers, %"
+        G_GUINT64_FORMAT " stalled, %" G_GUINT64_FORMAT " short, %"
+        G_GUINT64_FORMAT " disconnections", s->gadget->emu->transfers,
+        s->gadget->emu->stalls, s->gadget->emu->shorts,
+        s->gadget->emu->disconnects);
+  if (s->prof)
+    gst_usb_src_log_profile (s);
+  if (usb_gadget_free(s->gadget) == ERR_CAPTURE)
+    GST_WARNING_OBJECT (s, "Capture \"%s\" couldn't be trimmed, it ends "
+        "with unused room", s->capture);
+  /* The next session sets its caps again */
+  s->play = FALSE;
+  return TRUE;
+}
+
+static gboolean
+gst_usb_src_unlock (GstBaseSrc * bs)
+{
+  GstUsbSrc *s = GST_USB_SRC (bs);
+
+  s->flushing = TRUE;
+  gst_usb_src_frames_wake (s);
+  return TRUE;
+}
+
+static gboolean
+gst_usb_src_unlock_stop (GstBaseSrc * bs)
+{
+  GstUsbSrc *s = GST_USB_SRC (bs);
+
+  s->flushing = FALSE;
   return TRUE;
 }
 
+/* A buffer whose timestamp plus max-lateness is already behind the
+ * running time is worthless to a live pipeline */
+static gboolean
+gst_usb_src_is_late (GstUsbSrc *s, GstBuffer *buf)
+{
+  GstClock *clock;
+  GstClockTime running_time;
+  gint64 deadline;
+
+  if (s->max_lateness < 0 || !GST_BUFFER_TIMESTAMP_IS_VALID (buf))
+    return FALSE;
+
+  /* A fast replay is ahead of the clock, not behind */
+  if (s->replay && !s->replay_realtime)
+    return FALSE;
+
+  /* Outside of the segment it's clipped downstream, not late */
+  deadline = gst_segment_to_running_time (&GST_BASE_SRC (s)->segment,
+      GST_FORMAT_TIME, GST_BUFFER_TIMESTAMP (buf));
+  if (deadline < 0)
+    return FALSE;
+
+  clock = gst_element_get_clock (GST_ELEMENT (s));
+  if (clock == NULL)
+    return FALSE;
+  running_time = gst_clock_get_time (clock) -
+      gst_element_get_base_time (GST_ELEMENT (s));
+  gst_object_unref (clock);
+
+  return (GstClockTime) (deadline + s->max_lateness) < running_time;
+}
+
+static GstStructure *
+gst_usb_src_get_stats (GstUsbSrc *s)
+{
+  GstStructure *stats;
+  gchar *name;
+  guint i, j;
+
+  stats = gst_structure_new ("application/x-usbsrc-stats",
+      "dropped-late", G_TYPE_UINT64, s->dropped_late,
+      "link-features", G_TYPE_UINT, s->link_features,
+      "link-max-transfer", G_TYPE_UINT, s->link_max_transfer,
+      "link-outages", G_TYPE_UINT64, s->outages,
+      "framing-errors", G_TYPE_UINT64, s->framing_errors,
+      "crc-checked", G_TYPE_UINT64, s->crc_checked,
+      "crc-errors", G_TYPE_UINT64, s->crc_errors,
+      "decompressed-frames", G_TYPE_UINT64, s->decompressed_frames,
+      "delta-frames", G_TYPE_UINT64, s->delta_frames,
+      "delta-missed", G_TYPE_UINT64, s->delta_missed,
+      "test-bytes", G_TYPE_UINT64, s->test_bytes,
+      "test-errors", G_TYPE_UINT64, s->test_errors,
+      NULL);
+
+  /* The totals of each phase as prof-<phase>-<figure> */
+  for (i = 0; s->prof && i < s->prof->n_phases; i++)
+  {
+    usb_prof_phase *phase = &s->prof->phases[i];
+    guint64 values[] = { phase->count, phase->ns,
+			 phase->counters[USB_PROF_CYCLES],
+			 phase->counters[USB_PROF_INSTRUCTIONS],
+			 phase->counters[USB_PROF_CACHE_MISSES] };
+
+    for (j = 0; j < G_N_ELEMENTS (values); j++)
+    {
+      name = g_strdup_printf ("prof-%s-%s", phase->name, prof_figures[j]);
+      gst_structure_set (stats, name, G_TYPE_UINT64, values[j], NULL);
+      g_free (name);
+    }
+  }
+
+  return stats;
+}
+
+static void
+gst_usb_src_log_profile (GstUsbSrc *s)
+{
+  usb_prof_phase *phase;
+  gint i;
+
+  if (!s->prof->hw)
+    GST_INFO_OBJECT (s, "No hardware counters, profiling time only");
+  for (i = 0; i < s->prof->n_phases; i++)
+  {
+    phase = &s->prof->phases[i];
+    GST_INFO_OBJECT (s, "Phase %s: %" G_GUINT64_FORMAT " runs, %"
+        G_GUINT64_FORMAT " ns, %" G_GUINT64_FORMAT " cycles, %"
+        G_GUINT64_FORMAT " instructions, %" G_GUINT64_FORMAT
+        " cache misses", phase->name, phase->count, phase->ns,
+        phase->counters[USB_PROF_CYCLES],
+        phase->counters[USB_PROF_INSTRUCTIONS],
+        phase->counters[USB_PROF_CACHE_MISSES]);
+  }
+}
+
 #define PRINTERR(ret,s) switch(ret) \
                         { \
 	                  case ERR_OPEN_FD:\
@@ -257,307 +1040,1054 @@ gst_usb_src_stop (GstBaseSrc * bs)
                             GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),\
 			      ("File descriptor short read, aborting."));\
 	                    break;\
+			  case ERR_LINK_FD:\
+                            GST_ELEMENT_ERROR(s,RESOURCE,READ,(NULL),\
+			      ("The host went away"));\
+	                    break;\
 	                  default:\
                             break;\
                         }	   
 					    
-static GstFlowReturn
-gst_usb_src_create (GstPushSrc * ps, GstBuffer ** buf)
+/* Finds the tag of a stripe on the second stream endpoint. The stripes
+ * of the frames dropped on the stream endpoint are skipped, like the
+ * pieces of frames read_preamble() skips. A tag of a later frame means
+ * the stripe is lost, the tag is kept for its frame */
+static int
+gst_usb_src_find_stripe (GstUsbSrc *s, GstUsbSrcReader *reader, guint seq)
 {
-  GstUsbSrc *s = GST_USB_SRC (ps);
-  guint *size = g_malloc(sizeof(guint)), ret;
-  unsigned char *header = NULL;
-  guint8 *data;
+  guint8 packet[GST_USB_STRIPE_ALIGN];
+  GstUsbStripeTag *tag = (GstUsbStripeTag *) packet;
+  guint skipped = 0;
+  int ret, transferred;
 
-  //GST_USB_SRC_STATE_LOCK(s);
-  /* Ask for the size of the header */
-  if ( (ret=usb_gadget_transfer (s->gadget,
-                                 GAD_STREAM_EP, 
-                                (unsigned char *) size, 
-		  		 sizeof(guint)))  != GAD_EOK )
-  {	
-    g_free(size);
-    PRINTERR(ret,s)
-    return GST_FLOW_ERROR;
+  while (!reader->stripe_pending ||
+	 (gint) (reader->stripe_seq - seq) < 0)
+  {
+    reader->stripe_pending = FALSE;
+    ret = usb_gadget_read (s->gadget, GAD_STREAM2_EP, packet, sizeof packet,
+			   READ_TIMEOUT, &transferred);
+    /* The sink sends the tag along with the frame, it's on its way */
+    if (ret == ERR_TIMEOUT_FD && s->readers_running)
+      continue;
+    if (ret != GAD_EOK)
+      return ret;
+    if (transferred == sizeof (GstUsbStripeTag) &&
+	tag->magic == GST_USB_STRIPE_MAGIC)
+    {
+      reader->stripe_pending = TRUE;
+      reader->stripe_seq = tag->seq;
+    }
+    else
+      skipped += transferred;
+  }
+  if (skipped > 0)
+    GST_WARNING_OBJECT (s, "Skipped %u bytes of stale stripes", skipped);
+
+  if (reader->stripe_seq != seq)
+  {
+    GST_WARNING_OBJECT (s, "Stripe %u lost", seq);
+    return SHORT_READ_FD;
   }
+  reader->stripe_pending = FALSE;
+  return GAD_EOK;
+}
+
+/* Reads the payload, reassembling it from both stream endpoints if the
+ * sink striped it */
+static int
+gst_usb_src_read_payload (GstUsbSrc *s, GstUsbSrcReader *reader,
+			  guint8 *data, guint size, gboolean striped,
+			  guint stripe)
+{
+  GAD_EP_ADDRESS endp = reader->endp;
+  usb_gadget_xfer xfers[2], chunks[2];
+  guint split, max = s->link_max_transfer;
+  gint i, n, m, ret;
 
-  /* Alocate memory for the header */
-  header = (void *) g_malloc(size[0]);
+  if (striped && (ret = gst_usb_src_find_stripe (s, reader, stripe)) !=
+      GAD_EOK)
+    return ret;
+
+  if (!striped)
+  {
+    xfers[0].endp = endp;
+    xfers[0].buffer = (unsigned char *) data;
+    xfers[0].length = size;
+    n = 1;
+  }
+  else
+  {
+    split = GST_USB_STRIPE_SPLIT (size);
+    xfers[0].endp = GAD_STREAM_EP;
+    xfers[0].buffer = (unsigned char *) data;
+    xfers[0].length = split;
+    xfers[1].endp = GAD_STREAM2_EP;
+    xfers[1].buffer = (unsigned char *) data + split;
+    xfers[1].length = size - split;
+    n = 2;
+  }
 
-  /* Ask for the header */
-  if ( (ret=usb_gadget_transfer (s->gadget, 
-                                 GAD_STREAM_EP,  
-                                (unsigned char *) header, 
-                        	 size[0])) != GAD_EOK)	
-  {												
-    g_free(size);
-    g_free(header);
-    PRINTERR(ret,s)
-    return GST_FLOW_ERROR;
+  /* Read in rounds of at most the link's transfer limit */
+  for (;;)
+  {
+    for (i = 0, m = 0; i < n; i++)
+    {
+      if (xfers[i].length == 0)
+	continue;
+      chunks[m] = xfers[i];
+      if (max != 0 && (guint) chunks[m].length > max)
+	chunks[m].length = max;
+      xfers[i].buffer += chunks[m].length;
+      xfers[i].length -= chunks[m].length;
+      m++;
+    }
+    if (m == 0)
+      return GAD_EOK;
+    if (m == 1)
+      ret = usb_gadget_transfer (s->gadget, chunks[0].endp,
+				 chunks[0].buffer, chunks[0].length);
+    else
+      ret = usb_gadget_transfer_parallel (s->gadget, chunks, m);
+    if (ret != GAD_EOK)
+      return ret;
   }
+}
+
+/* Reads transfers until one is a valid frame preamble. Preambles and
+ * headers always come in transfers of their own, reading a whole packet
+ * makes a piece of anything else show up with the wrong length */
+static int
+gst_usb_src_read_preamble (GstUsbSrc *s, GAD_EP_ADDRESS endp,
+			   GstUsbFramePreamble *found)
+{
+  guint8 packet[GST_USB_STRIPE_ALIGN];
+  GstUsbFramePreamble *preamble = (GstUsbFramePreamble *) packet;
+  guint skipped = 0;
+  int ret, transferred;
+
+  for (;;)
+  {
+    if ((ret = usb_gadget_read (s->gadget, endp, packet, sizeof packet,
+				READ_TIMEOUT, &transferred)) != GAD_EOK)
+      return ret;
+    if (transferred == sizeof (GstUsbFramePreamble) &&
+	GST_USB_FRAME_PREAMBLE_IS_VALID (preamble))
+      break;
+    if (skipped == 0)
+      GST_WARNING_OBJECT (s, "Lost frame sync on endpoint %d", endp);
+    skipped += transferred;
+  }
+  if (skipped > 0)
+    GST_WARNING_OBJECT (s, "Frame sync found after %u bytes", skipped);
+
+  *found = *preamble;
+  return GAD_EOK;
+}
+
+/* Unpacks a compressed payload straight into its buffer */
+static gboolean
+gst_usb_src_decompress (GstUsbSrc *s, const guint8 *data, guint length,
+			GstBuffer *buf)
+{
+#ifdef HAVE_LZ4
+  int ret = LZ4_decompress_safe ((const char *) data,
+				 (char *) GST_BUFFER_DATA (buf), length,
+				 GST_BUFFER_SIZE (buf));
+
+  if (ret == (int) GST_BUFFER_SIZE (buf))
+  {
+    s->decompressed_frames++;
+    return TRUE;
+  }
+#endif
+  return FALSE;
+}
+
+/* Keeps a copy of the frame as the delta reference of its stream, reusing
+ * the previous one when it's the same size */
+static void
+gst_usb_src_delta_keep (GstUsbSrcDelta *delta, GstBuffer *buf)
+{
+  guint size = GST_BUFFER_SIZE (buf);
+
+  if (delta->ref == NULL || GST_BUFFER_SIZE (delta->ref) != size)
+  {
+    if (delta->ref)
+      gst_buffer_unref (delta->ref);
+    delta->ref = gst_buffer_new_and_alloc (size);
+  }
+  memcpy (GST_BUFFER_DATA (delta->ref), GST_BUFFER_DATA (buf), size);
+}
+
+/* The delta reference of the stream is gone, asks the sink for a full
+ * frame instead of waiting for its keyframe interval. Only once until
+ * the keyframe arrives */
+static void
+gst_usb_src_request_keyframe (GstUsbSrc *s, guint stream)
+{
+  GstUsbSrcDelta *delta = &s->delta_refs[stream];
+  guint notification = GST_USB_WITH_STREAM (GST_USB_KEYFRAME, stream);
+
+  if (delta->ref)
+    gst_buffer_unref (delta->ref);
+  delta->ref = NULL;
+  if (delta->key_requested)
+    return;
+
+  GST_DEBUG_OBJECT (s, "Asking for a keyframe on stream %u", stream);
+  delta->key_requested =
+      usb_gadget_transfer_timeout (s->gadget, GAD_NOTIFY_EP,
+				   (unsigned char *) &notification,
+				   sizeof notification, READ_TIMEOUT) == GAD_EOK;
+  if (!delta->key_requested)
+    GST_WARNING_OBJECT (s, "Unable to ask the sink for a keyframe");
+}
+
+/* Reads a whole frame from the endpoint of the reader. Gives up with
+ * ERR_TIMEOUT_FD only if the frame didn't start after READ_TIMEOUT. A
+ * frame with a broken header is dropped and the next one read instead */
+static int
+gst_usb_src_read_frame (GstUsbSrc *s, GstUsbSrcReader *reader,
+			GstBuffer **buf, guint *stream)
+{
+  GAD_EP_ADDRESS endp = reader->endp;
+  guint8 header[GST_USB_STRIPE_ALIGN];
+  GstUsbFramePreamble preamble;
+  GstUsbSrcDelta *delta;
+  guint8 *data;
+  guint size, length;
+  gboolean striped, corrupt;
+  int ret, transferred;
+  usb_prof_mark mark;
+
+again:
+  gst_usb_src_reader_frame (s, reader, -1);
+  USB_PROF_START (&mark);
+  if ((ret = gst_usb_src_read_preamble (s, endp, &preamble)) != GAD_EOK)
+    return ret;
+  USB_PROF_LAP (s->prof, PROF_LENGTH_READ, &mark);
+  striped = (preamble.word & GST_USB_FRAME_STRIPED) != 0;
+  *stream = GST_USB_GET_STREAM (preamble.word);
+  gst_usb_src_reader_frame (s, reader, *stream);
+  size = preamble.word & GST_USB_FRAME_LENGTH_MASK;
+
+  /* Ask for the header, it has to pass its CRC before its payload size
+   * is trusted */
+  if ((ret = usb_gadget_read (s->gadget, endp, header, sizeof header, 0,
+			      &transferred)) != GAD_EOK)
+    return ret;
+  USB_PROF_LAP (s->prof, PROF_HEADER_READ, &mark);
+  if (size > sizeof header || transferred != size ||
+      !gst_dp_validate_header (size, header))
+  {
+    GST_WARNING_OBJECT (s, "Bad frame header, resynchronizing");
+    s->framing_errors++;
+    goto again;
+  }
+  USB_PROF_LAP (s->prof, PROF_PARSE, &mark);
 	
   /* Create the buffer using gst data protocol */
+  *buf = gst_dp_buffer_from_header (size, header);
+  data = GST_BUFFER_DATA (*buf);
+  length = GST_BUFFER_SIZE (*buf);
+
+  /* A compressed or delta coded payload is always smaller than its
+   * buffer */
+  if (preamble.word & (GST_USB_FRAME_LZ4 | GST_USB_FRAME_DELTA))
+  {
+    length = preamble.wire_length;
+    if (length == 0 || length >= GST_BUFFER_SIZE (*buf))
+    {
+      GST_WARNING_OBJECT (s, "Bad encoded length, resynchronizing");
+      gst_buffer_unref (*buf);
+      *buf = NULL;
+      s->framing_errors++;
+      goto again;
+    }
+    if (reader->scratch_size < length)
+    {
+      g_free (reader->scratch);
+      reader->scratch = g_malloc (length);
+      reader->scratch_size = length;
+    }
+    data = reader->scratch;
+  }
 
-  *buf = gst_dp_buffer_from_header (size[0], header);
-  data = GST_BUFFER_DATA(*buf);
-  /* Now read the data */
+  USB_PROF_LAP (s->prof, PROF_ALLOCATE, &mark);
 
-  /* Ask for the header */
-  if ((ret=usb_gadget_transfer (s->gadget,
-                                GAD_STREAM_EP,   
-                               (unsigned char *) data, 
-    	                       (*buf)->size)) != GAD_EOK)	
+  /* Ask for the payload */
+  ret = gst_usb_src_read_payload (s, reader, data, length, striped,
+				  preamble.stripe);
+  if (ret != GAD_EOK)
   {	
-
-    g_free(data);
-    g_free(size);
-    g_free(header);
-    PRINTERR(ret,s)
-    return GST_FLOW_ERROR;
+    gst_buffer_unref(*buf);
+    *buf = NULL;
   }	
+  /* Cut short by the next frame, which is lost too */
+  if (ret == SHORT_READ_FD)
+  {
+    GST_WARNING_OBJECT (s, "Short frame payload, resynchronizing");
+    s->framing_errors++;
+    goto again;
+  }
+  if (ret != GAD_EOK)
+    return ret;
+  USB_PROF_LAP (s->prof, PROF_PAYLOAD_READ, &mark);
+
+  if ((preamble.word & GST_USB_FRAME_LZ4) &&
+      !gst_usb_src_decompress (s, data, length, *buf))
+  {
+    GST_WARNING_OBJECT (s, "Unable to decompress a payload of %u bytes",
+			length);
+    gst_buffer_unref (*buf);
+    *buf = NULL;
+    s->framing_errors++;
+    goto again;
+  }
+
+  /* Rebuild a delta from the reference it was coded against, if that's
+   * not the one we have some frame got lost: wait for a keyframe */
+  delta = &s->delta_refs[*stream];
+  if (preamble.word & GST_USB_FRAME_DELTA)
+  {
+    if (delta->ref == NULL || delta->id != preamble.ref ||
+	GST_BUFFER_SIZE (delta->ref) != GST_BUFFER_SIZE (*buf))
+    {
+      GST_LOG_OBJECT (s, "No reference for a delta frame, dropping");
+      gst_buffer_unref (*buf);
+      *buf = NULL;
+      s->delta_missed++;
+      gst_usb_src_request_keyframe (s, *stream);
+      goto again;
+    }
+    if (!delta_decode (GST_BUFFER_DATA (*buf), GST_BUFFER_DATA (delta->ref),
+		       GST_BUFFER_SIZE (*buf), data, length))
+    {
+      GST_WARNING_OBJECT (s, "Malformed delta frame of %u bytes", length);
+      gst_buffer_unref (*buf);
+      *buf = NULL;
+      s->framing_errors++;
+      goto again;
+    }
+    s->delta_frames++;
+  }
+
+  corrupt = FALSE;
+  if (preamble.word & GST_USB_FRAME_CRC)
+  {
+    s->crc_checked++;
+    if (crc32c (0, GST_BUFFER_DATA (*buf), GST_BUFFER_SIZE (*buf)) !=
+	preamble.crc)
+    {
+      GST_WARNING_OBJECT (s, "Payload of %u bytes failed its CRC",
+			  GST_BUFFER_SIZE (*buf));
+      s->crc_errors++;
+      corrupt = TRUE;
+      switch (s->crc_action) {
+	case GST_USB_SRC_CRC_DROP:
+	  gst_buffer_unref (*buf);
+	  *buf = NULL;
+	  goto again;
+	case GST_USB_SRC_CRC_MARK:
+	  GST_BUFFER_FLAG_SET (*buf, GST_BUFFER_FLAG_DISCONT);
+	  break;
+	case GST_USB_SRC_CRC_IGNORE:
+	  break;
+      }
+    }
+  }
+
+  /* The sink codes the next frame against this one. A corrupt one would
+   * spoil every delta after it */
+  if ((preamble.word & GST_USB_FRAME_REF) && corrupt)
+    gst_usb_src_request_keyframe (s, *stream);
+  else if (preamble.word & GST_USB_FRAME_REF)
+  {
+    gst_usb_src_delta_keep (delta, *buf);
+    delta->id = preamble.ref;
+    if (preamble.word & GST_USB_FRAME_DELTA)
+      delta->id++;
+    else
+      delta->key_requested = FALSE;
+  }
+  USB_PROF_LAP (s->prof, PROF_DECODE, &mark);
+
+  return GAD_EOK;
+}
+
+/* Resume mode: whether a transfer started during the given gadget session
+ * failed because the host went away. Any other error is the stream's own
+ * and isn't cured by waiting for the host */
+static gboolean
+gst_usb_src_link_is_lost (GstUsbSrc *s, guint session, int ret)
+{
+  return ret == ERR_LINK_FD || session != s->gadget->session;
+}
+
+/* Resume mode: the link went down during the given gadget session, waits
+ * for the host to configure the device again. The down events thread
+ * restores the session with the sink */
+static void
+gst_usb_src_wait_link (GstUsbSrc *s, guint session, gboolean *running)
+{
+  gboolean lost = FALSE;
+
+  GST_OBJECT_LOCK (s);
+  if (!GST_CLOCK_TIME_IS_VALID (s->outage_start))
+  {
+    s->outage_start = gst_util_get_timestamp ();
+    lost = TRUE;
+  }
+  GST_OBJECT_UNLOCK (s);
+
+  if (lost)
+  {
+    GST_WARNING_OBJECT (s, "Link lost, waiting for the host");
+    gst_element_post_message (GST_ELEMENT (s),
+	gst_message_new_element (GST_OBJECT (s),
+	    gst_structure_new ("usb-link-lost", NULL)));
+  }
+
+  while ((running == NULL || *running) &&
+	 usb_gadget_wait_session (s->gadget, session, READ_TIMEOUT) != GAD_EOK);
+}
+
+/* Resume mode: the host configured the device again, tells the sink so
+ * it restores the session */
+static void
+gst_usb_src_resume_link (GstUsbSrc *s)
+{
+  guint session = s->gadget->session;
+  guint notification = GST_USB_CONNECTED;
+  GstClockTime outage = GST_CLOCK_TIME_NONE;
+
+  if (usb_gadget_transfer (s->gadget, GAD_NOTIFY_EP,
+			   (unsigned char *) &notification,
+			   sizeof(guint)) != GAD_EOK)
+  {
+    /* Tried again on the next pass */
+    GST_WARNING_OBJECT (s, "Error notifying the sink of the connection");
+    return;
+  }
+  s->link_session = session;
+
+  GST_OBJECT_LOCK (s);
+  if (GST_CLOCK_TIME_IS_VALID (s->outage_start))
+    outage = gst_util_get_timestamp () - s->outage_start;
+  s->outage_start = GST_CLOCK_TIME_NONE;
+  s->outages++;
+  GST_OBJECT_UNLOCK (s);
+
+  GST_INFO_OBJECT (s, "Link resumed after %" GST_TIME_FORMAT,
+		   GST_TIME_ARGS (outage));
+  gst_element_post_message (GST_ELEMENT (s),
+      gst_message_new_element (GST_OBJECT (s),
+	  gst_structure_new ("usb-link-resumed",
+	      "outage", G_TYPE_UINT64, outage, NULL)));
+}
+
+/* Test mode reader of the stream endpoint, checks everything that
+ * arrives against the pattern and posts a usb-link-test message every
+ * TEST_REPORT_INTERVAL. Link errors end the test */
+static int
+gst_usb_src_test_read (GstUsbSrc *s, GstUsbSrcReader *reader)
+{
+  GstClockTime start = GST_CLOCK_TIME_NONE, last = 0, now;
+  guint64 offset = 0, last_offset = 0;
+  guint8 *pattern, *data;
+  size_t bad, first;
+  guint size;
+  int ret = GAD_EOK, transferred;
+
+  /* The sink tells the size of its transfers once connected */
+  while (s->readers_running && (size = g_atomic_int_get (&s->test_size)) == 0)
+    g_usleep (TEST_WAIT_INTERVAL);
+  if (!s->readers_running)
+    return GAD_EOK;
+
+  pattern = link_test_pattern_new (s->test_mode, size);
+  data = g_malloc (size);
+  s->test_bytes = 0;
+  s->test_errors = 0;
+  s->test_first_error = G_MAXUINT64;
+  s->test_last_error = G_MAXUINT64;
+
+  while (s->readers_running && pattern != NULL)
+  {
+    ret = usb_gadget_read (s->gadget, reader->endp, data, size,
+			   READ_TIMEOUT, &transferred);
+    if (ret == ERR_TIMEOUT_FD)
+      continue;
+    if (ret != GAD_EOK)
+      break;
+
+    /* Throughput counts from the first data on */
+    now = gst_util_get_timestamp ();
+    if (!GST_CLOCK_TIME_IS_VALID (start))
+      start = last = now;
+
+    bad = link_test_check (pattern, data, transferred, offset, &first);
+    if (bad > 0)
+    {
+      GST_WARNING_OBJECT (s, "%u bad bytes at offset %" G_GUINT64_FORMAT,
+			  (guint) bad, offset + first);
+      s->test_errors += bad;
+      if (s->test_first_error == G_MAXUINT64)
+	s->test_first_error = offset + first;
+      s->test_last_error = offset + first;
+    }
+    offset += transferred;
+    s->test_bytes = offset;
+
+    if (now - last >= TEST_REPORT_INTERVAL)
+    {
+      gst_element_post_message (GST_ELEMENT (s),
+	  gst_message_new_element (GST_OBJECT (s),
+	      gst_structure_new ("usb-link-test",
+		  "bytes", G_TYPE_UINT64, offset,
+		  "throughput", G_TYPE_UINT64,
+		  gst_util_uint64_scale (offset - last_offset, GST_SECOND,
+					 MAX (now - last, 1)),
+		  "average-throughput", G_TYPE_UINT64,
+		  gst_util_uint64_scale (offset, GST_SECOND,
+					 MAX (now - start, 1)),
+		  "errors", G_TYPE_UINT64, s->test_errors,
+		  "first-error", G_TYPE_UINT64, s->test_first_error,
+		  "last-error", G_TYPE_UINT64, s->test_last_error, NULL)));
+      last = now;
+      last_offset = offset;
+    }
+  }
+
+  if (pattern == NULL)
+    ret = ERR_THRD;
+  free (pattern);
+  g_free (data);
+  return ret;
+}
+
+/* Reader thread, the only one reading the endpoint of its lane */
+void *gst_usb_src_reader (void *param)
+{
+  GstUsbSrcReader *reader = (GstUsbSrcReader *) param;
+  GstUsbSrc *s = reader->src;
+  GstUsbSrcFrame *frame;
+  GstBuffer *buf;
+  guint stream, session;
+  int ret;
+
+  if (s->test_mode != LINK_TEST_NONE && reader->endp == GAD_STREAM_EP)
+  {
+    ret = gst_usb_src_test_read (s, reader);
+    if (ret != GAD_EOK && s->readers_running)
+    {
+      s->reader_ret = ret;
+      PRINTERR(ret,s)
+    }
+    GST_INFO_OBJECT (s, "Closing test reader thread");
+    return NULL;
+  }
+
+  while (s->readers_running)
+  {
+    session = s->gadget->session;
+    ret = gst_usb_src_read_frame (s, reader, &buf, &stream);
+    if (ret == ERR_TIMEOUT_FD)
+      continue;
+    if (ret == ERR_END_FD)
+    {
+      /* Nothing else left in the replayed capture */
+      g_atomic_int_inc (&s->readers_ended);
+      break;
+    }
+    if (ret != GAD_EOK && s->resume && s->readers_running &&
+	gst_usb_src_link_is_lost (s, session, ret))
+    {
+      /* Whatever part of the frame arrived is lost, the stripes too */
+      gst_usb_src_wait_link (s, session, &s->readers_running);
+      reader->stripe_pending = FALSE;
+      continue;
+    }
+    if (ret != GAD_EOK)
+    {
+      if (s->readers_running)
+      {
+	/* Next create returns the error downstream */
+	s->reader_ret = ret;
+	PRINTERR(ret,s)
+      }
+      break;
+    }
+    frame = g_slice_new (GstUsbSrcFrame);
+    frame->buffer = buf;
+    frame->stream = stream;
+    gst_usb_src_dispatch_frame (s, frame);
+  }
+  gst_usb_src_reader_frame (s, reader, -1);
+
+  GST_INFO_OBJECT (s, "Closing reader thread of endpoint %d", reader->endp);
+  return NULL;
+}
+
+/* Task of a sometimes pad, pushes the frames of its stream */
+static void
+gst_usb_src_stream_loop (GstPad *pad)
+{
+  GstUsbSrc *s = GST_USB_SRC (GST_PAD_PARENT (pad));
+  GAsyncQueue *queue = gst_pad_get_element_private (pad);
+  GstUsbSrcFrame *frame;
+  GstFlowReturn ret;
+  GTimeVal timeout;
+  GstBuffer *buf;
+
+  /* Waking up now and then lets the task be stopped on an idle link */
+  g_get_current_time (&timeout);
+  g_time_val_add (&timeout, READ_TIMEOUT * 1000);
+  frame = g_async_queue_timed_pop (queue, &timeout);
+  if (frame == NULL)
+    return;
+  gst_usb_src_frames_wake (s);
+
+  buf = frame->buffer;
+  g_slice_free (GstUsbSrcFrame, frame);
+  if (buf == NULL)
+  {
+    GST_DEBUG_OBJECT (s, "End of the stream of %s", GST_PAD_NAME (pad));
+    gst_pad_push_event (pad, gst_event_new_eos ());
+    gst_pad_pause_task (pad);
+    return;
+  }
+
+  if (s->usbsync)
+    GST_BUFFER_TIMESTAMP(buf) += s->sync;
+
+  if (gst_usb_src_is_late (s, buf))
+  {
+    GST_LOG_OBJECT (s, "Buffer of %s arrived past its deadline, dropping",
+		    GST_PAD_NAME (pad));
+    s->dropped_late++;
+    gst_buffer_unref (buf);
+    return;
+  }
+
+  gst_buffer_set_caps (buf, GST_PAD_CAPS (pad));
+  ret = gst_pad_push (pad, buf);
+  /* An unlinked stream doesn't stop the others */
+  if (ret == GST_FLOW_OK || ret == GST_FLOW_NOT_LINKED)
+    return;
+
+  GST_DEBUG_OBJECT (s, "Pausing the task of %s, reason %s",
+		    GST_PAD_NAME (pad), gst_flow_get_name (ret));
+  gst_pad_pause_task (pad);
+  if (ret != GST_FLOW_WRONG_STATE && ret != GST_FLOW_UNEXPECTED)
+  {
+    GST_ELEMENT_ERROR (s, STREAM, FAILED, (NULL),
+		       ("Streaming of %s stopped, reason %s",
+			GST_PAD_NAME (pad), gst_flow_get_name (ret)));
+    gst_pad_push_event (pad, gst_event_new_eos ());
+  }
+}
+
+static GstFlowReturn
+gst_usb_src_create (GstPushSrc * ps, GstBuffer ** buf)
+{
+  GstUsbSrc *s = GST_USB_SRC (ps);
+  GstUsbSrcFrame *frame;
+  GTimeVal timeout;
+  usb_prof_mark mark;
+
+again:
+  /* Wait for a frame of any lane, waking up now and then so a flush or a
+   * state change isn't stuck on an idle link */
+  do
+  {
+    if (s->flushing)
+      return GST_FLOW_WRONG_STATE;
+    if (s->reader_ret != GAD_EOK)
+      return GST_FLOW_ERROR;
+    if (g_atomic_int_get (&s->readers_ended) == GST_USB_SRC_N_READERS &&
+	g_async_queue_length (s->frames) <= 0)
+    {
+      GST_INFO_OBJECT (s, "End of the replayed capture");
+      return GST_FLOW_UNEXPECTED;
+    }
+
+    g_get_current_time (&timeout);
+    g_time_val_add (&timeout, READ_TIMEOUT * 1000);
+    frame = g_async_queue_timed_pop (s->frames, &timeout);
+  } while (frame == NULL);
+  gst_usb_src_frames_wake (s);
+  USB_PROF_START (&mark);
+
+  *buf = frame->buffer;
+  g_slice_free (GstUsbSrcFrame, frame);
 
   /* Synchronize with sink's timestamps */
   if (s->usbsync)
     GST_BUFFER_TIMESTAMP(*buf) += s->sync;
 
-  //GST_USB_SRC_STATE_UNLOCK(s);
-  g_free(header);
-  g_free(size); 
+  if (gst_usb_src_is_late (s, *buf))
+  {
+    GST_LOG_OBJECT (s, "Buffer arrived past its deadline, dropping");
+    s->dropped_late++;
+    gst_buffer_unref(*buf);
+    goto again;
+  }
+  USB_PROF_LAP (s->prof, PROF_CREATE, &mark);
 
   return GST_FLOW_OK;
 }
 
+/* Caps accepted downstream of the pad of a stream */
+static GstCaps *
+gst_usb_src_get_stream_caps (GstUsbSrc *s, guint stream)
+{
+  GstPad *pad;
+
+  if (stream >= GST_USB_MAX_STREAMS)
+    return gst_caps_new_empty ();
+
+  pad = stream ? s->streams[stream] : GST_BASE_SRC_PAD(s);
+  if (pad == NULL)
+    /* The pad of the stream doesn't exist until its caps are set */
+    return gst_caps_copy (gst_static_caps_get (&stream_factory.static_caps));
+  if (gst_pad_is_linked(pad))
+    return gst_pad_peer_get_caps (pad);
+  return gst_caps_copy (gst_pad_get_pad_template_caps (pad));
+}
+
+/* Vendor control requests, run from the gadget's ep0 thread */
+static int
+gst_usb_src_vendor_request (usb_gadget *gadget, unsigned char request,
+			    unsigned short value, unsigned short index,
+			    unsigned char *buffer, int length, void *user_data)
+{
+  GstUsbSrc *s = GST_USB_SRC (user_data);
+  GstCaps *caps;
+  gchar *str;
+  int size;
+
+  switch (request)
+  {
+    case GST_USB_REQ_GET_CAPS:
+      caps = gst_usb_src_get_stream_caps (s, index);
+      str = gst_caps_to_string (caps);
+      gst_caps_unref (caps);
+      size = strlen (str);
+      GST_DEBUG_OBJECT (s, "Replying caps of stream %u: %s", index, str);
+      if (size > length)
+      {
+	/* The sink asks again with a control message */
+	GST_DEBUG_OBJECT (s, "Caps of stream %u don't fit in a reply",
+			  index);
+	g_free (str);
+	return -1;
+      }
+      memcpy (buffer, str, size);
+      g_free (str);
+      return size;
+    case GST_USB_REQ_GET_TIME:
+      if (length < 8)
+	return -1;
+      GST_WRITE_UINT64_LE (buffer, gst_util_get_timestamp ());
+      return 8;
+    default:
+      GST_WARNING_OBJECT (s, "Unknown vendor request 0x%02x", request);
+      return -1;
+  }
+}
+
 /* Down events thread */
 void *gst_usb_src_down_event (void *src)
 {
   GstBaseSrc *bs = GST_BASE_SRC(src);	
   GstUsbSrc *s = GST_USB_SRC(bs);	
   
-  guint *notification = g_malloc(sizeof(guint));	
-  GstCaps *caps;
+  /* Room for a header and the largest payload */
+  guint8 *message = g_malloc (sizeof (GstUsbControlHeader) +
+			      GST_USB_CONTROL_MAX);
+  GstUsbControlHeader *header = (GstUsbControlHeader *) message;
+  guint8 *payload = message + sizeof (GstUsbControlHeader);
+  guint session;
+  int ret;
   
-  pthread_cleanup_push (close_down_event, (void *) notification);
+  pthread_cleanup_push (close_down_event, (void *) message);
   
   while (TRUE)
   {
     /* Create a cancellation test point */  
     pthread_testcancel();  
-    /* Receive an event (internal polling) */
-    if (usb_gadget_transfer(s->gadget, 
-	                    GAD_DOWN_EP, 
-		  	   (unsigned char *) notification,
-			    sizeof(guint)) != GAD_EOK)
+    session = s->gadget->session;
+    if (s->resume && session != s->link_session)
+      gst_usb_src_resume_link (s);
+    /* Receive a request (internal polling) */
+    ret = usb_gadget_transfer(s->gadget, 
+	                      GAD_DOWN_EP, 
+		  	     (unsigned char *) header,
+			      sizeof (GstUsbControlHeader));
+    /* A replay has nothing else to say */
+    if (ret == ERR_END_FD)
+      break;
+    if (ret != GAD_EOK)
     { 
       GST_WARNING_OBJECT(s,"Error receving downstream event");
+      if (s->resume && gst_usb_src_link_is_lost (s, session, ret))
+	gst_usb_src_wait_link (s, session, NULL);
       continue;    							      
     }
-    /* Wait until gadget is free */
-    GST_USB_SRC_STATE_LOCK(s);
-    switch (notification[0])
+    if (header->length > GST_USB_CONTROL_MAX)
+    {
+      GST_WARNING_OBJECT(s,"Control message of %u bytes is too big",
+			 header->length);
+      continue;
+    }
+    if (header->length > 0 &&
+	usb_gadget_transfer(s->gadget, 
+			    GAD_DOWN_EP, 
+			    payload,
+			    header->length) != GAD_EOK)
     { 
-      /* Sink is asking for our allowed caps */
-      case GST_USB_GET_CAPS:
-      {		  
-	notification[0] = GST_USB_CAPS;
-	GST_DEBUG_OBJECT (s,"Received a get caps");
-	/* Send a caps message */
-	if ( usb_gadget_transfer (s->gadget,
-                                 GAD_UP_EP,   
-                                 (unsigned char *) notification, 
-				  sizeof(guint)) != GAD_EOK)
-	{			
-	  GST_USB_SRC_STATE_UNLOCK(s);
-          GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-                           ("Error returning caps"));	
-        }
-	if (gst_pad_is_linked(GST_BASE_SRC_PAD(bs)))
-	  caps = gst_pad_peer_get_caps (GST_BASE_SRC_PAD(bs));
-	else
-	  caps = gst_caps_copy (gst_pad_get_pad_template_caps\
-		                       (GST_BASE_SRC_PAD(bs)));	   
-	if (!gst_usb_src_send_caps(s, caps))
-	{
-	  GST_USB_SRC_STATE_UNLOCK(s);
-	  GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-			    ("Error sending caps"));
-	}
-	GST_DEBUG_OBJECT (s,"Caps sent\n");
-	gst_caps_unref(caps);
-	break;
-      }
-      /* Sink is sending a set of caps for src to set */
-      case GST_USB_SET_CAPS:{
-	GstCaps *caps;
-        GST_DEBUG_OBJECT (s,"Received a set caps");
-	caps = gst_usb_src_receive_caps(s);
-	s->play = TRUE;
-	if (!gst_pad_set_caps (GST_BASE_SRC_PAD(bs), caps)){
-	  GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
-			    ("Error setting caps"));
-	}
-	else{
-	  GST_DEBUG_OBJECT (s,"Caps set correctly");
-	}
-	break;
-      }
-      default:
-	GST_WARNING_OBJECT(s,"Unknown downstream event");
-	break;	  
+      GST_WARNING_OBJECT(s,"Error receving downstream event");
+      continue;    							      
     }
+    /* Wait until gadget is free */
+    GST_USB_SRC_STATE_LOCK(s);
+    gst_usb_src_handle_request (s, header, payload);
     GST_USB_SRC_STATE_UNLOCK(s);
   }
-  /* It should never reach this point */
+  /* Only a replay gets here */
   pthread_cleanup_pop (1);	 	  
+  return NULL;
 }	
 
-static void close_down_event(void *param)
+/* Answers a control request from the sink, the reply carries the sequence
+ * number of the request so the sink can match it */
+static void gst_usb_src_handle_request(GstUsbSrc *s,
+				       GstUsbControlHeader *request,
+				       guint8 *payload)
 {
-  GST_INFO ("Closing down events thread");		
-  guint *notification = (guint *) param;	
-  g_free(notification);	
+  guint stream = GST_USB_GET_STREAM (request->type);
+  guint status = 1;
+  guint8 time[8];
+  GstCaps *caps;
+  gchar *str;
+
+  switch (GST_USB_MESSAGE_TYPE (request->type))
+  { 
+    /* Sink is asking for our allowed caps */
+    case GST_USB_GET_CAPS:
+      GST_DEBUG_OBJECT (s,"Received a get caps for stream %u", stream);
+      caps = gst_usb_src_get_stream_caps (s, stream);
+      str = gst_caps_to_string (caps);
+      gst_caps_unref (caps);
+      gst_usb_src_reply (s, request, GST_USB_CAPS, str, strlen (str) + 1);
+      g_free (str);
+      break;
+    /* Sink tells what it supports, we answer the same */
+    case GST_USB_HELLO:
+    {
+      GstUsbHello hello, *remote = (GstUsbHello *) payload;
+
+      hello.version = GST_USB_PROTOCOL_VERSION;
+      hello.features = GST_USB_FEATURES_ALL;
+      if (s->test_mode == LINK_TEST_NONE)
+	hello.features &= ~GST_USB_FEATURE_TEST;
+      hello.max_transfer = s->max_transfer;
+      hello.test_mode = s->test_mode;
+      hello.test_size = 0;
+      if (request->length != sizeof (GstUsbHello) ||
+	  remote->version != GST_USB_PROTOCOL_VERSION)
+	/* The sink gives up when it sees our version */
+	GST_WARNING_OBJECT (s, "Sink speaks another protocol version");
+      else if (remote->test_mode != s->test_mode ||
+	       remote->test_size > TEST_MAX_SIZE)
+      {
+	/* The sink gives up too when it sees our reply */
+	GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			  ("Sink tests with pattern %u and %u byte transfers, "
+			   "expected pattern %u and up to %u bytes",
+			   remote->test_mode, remote->test_size,
+			   s->test_mode, TEST_MAX_SIZE));
+      }
+      else
+      {
+	/* The test reader reads in the transfers the sink sends */
+	hello.test_size = remote->test_size;
+	g_atomic_int_set (&s->test_size, remote->test_size);
+	s->link_features = hello.features & remote->features;
+	s->link_max_transfer = GST_USB_MIN_TRANSFER (hello.max_transfer,
+						     remote->max_transfer);
+	GST_INFO_OBJECT (s, "Link features 0x%x, max transfer %u bytes",
+			 s->link_features, s->link_max_transfer);
+      }
+      gst_usb_src_reply (s, request, GST_USB_HELLO, &hello, sizeof hello);
+      break;
+    }
+    /* Sink is done with an extra stream */
+    case GST_USB_STOP:
+      GST_DEBUG_OBJECT (s, "Received the end of stream %u", stream);
+      if (stream != 0)
+	gst_usb_src_end_stream (s, stream);
+      status = 0;
+      gst_usb_src_reply (s, request, GST_USB_ACK, &status, sizeof status);
+      break;
+    /* Sink is asking for our system time */
+    case GST_USB_GET_TIME:
+      GST_WRITE_UINT64_LE (time, gst_util_get_timestamp ());
+      gst_usb_src_reply (s, request, GST_USB_TIME, time, sizeof time);
+      break;
+    /* Sink is sending a set of caps for src to set */
+    case GST_USB_SET_CAPS:
+      GST_DEBUG_OBJECT (s,"Received a set caps for stream %u", stream);
+      caps = NULL;
+      if (request->length > 0)
+      {
+	payload[request->length - 1] = '\0';
+	caps = gst_caps_from_string ((gchar *) payload);
+      }
+      s->play = TRUE;
+      if (stream != 0)
+	status = !gst_usb_src_set_stream_caps (s, stream, caps);
+      else if (caps == NULL || !gst_pad_set_caps (GST_BASE_SRC_PAD(s), caps))
+	GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+			  ("Error setting caps"));
+      else
+      {
+	GST_DEBUG_OBJECT (s,"Caps set correctly");
+	status = 0;
+      }
+      if (stream == 0 && caps)
+	gst_caps_unref (caps);
+      gst_usb_src_reply (s, request, GST_USB_ACK, &status, sizeof status);
+      break;
+    default:
+      GST_WARNING_OBJECT(s,"Unknown downstream event");
+      /* Don't let the sink wait for the timeout */
+      gst_usb_src_reply (s, request, GST_USB_ACK, &status, sizeof status);
+      break;	  
+  }
 }
 
-
-static gboolean gst_usb_src_send_caps(GstUsbSrc *s, GstCaps *caps)
+/* Sends the reply to a request on the up events endpoint, only the down
+ * events thread writes there */
+static gboolean gst_usb_src_reply(GstUsbSrc *s, GstUsbControlHeader *request,
+				  guint type, gconstpointer payload,
+				  guint length)
 {
-  GstDPPacketizer *gdp = gst_dp_packetizer_new (GST_DP_VERSION_0_2);
-  guint8 *header, *payload;
-  guint *length, paylength;	
-  
-  length = g_malloc(sizeof(guint));
-
-  /* Make a package from the given caps */	
-  gdp->packet_from_caps(caps,
-                        GST_DP_HEADER_FLAG_NONE,
-                        &length[0],
-                        &header,
-                        &payload);
+  GstUsbControlHeader header;
 
-  /* Send the size of the header */
-  if (usb_gadget_transfer(s->gadget, 
-			  GAD_UP_EP, 
-			  (unsigned char *) length,
-			  sizeof(guint)) != GAD_EOK){   
-    g_free(length);
-    g_free(header);
-    g_free(payload);
-    gst_dp_packetizer_free (gdp);
-    return FALSE;								  
-  }
+  header.type = GST_USB_WITH_STREAM (type, GST_USB_GET_STREAM (request->type));
+  header.seq = request->seq;
+  header.length = length;
 
-  /* Now send the header */
   if (usb_gadget_transfer(s->gadget, 
 			  GAD_UP_EP, 
-			  (unsigned char *) header,
-			  length[0]) != GAD_EOK){   
-    g_free(length);
-    g_free(header);
-    g_free(payload);
-    gst_dp_packetizer_free (gdp);
-    return FALSE;								  
+			  (unsigned char *) &header,
+			  sizeof header) != GAD_EOK ||
+      (length > 0 &&
+       usb_gadget_transfer(s->gadget, 
+			   GAD_UP_EP, 
+			   (unsigned char *) payload,
+			   length) != GAD_EOK))
+  {
+    GST_WARNING_OBJECT(s,"Error replying to request %u", request->seq);
+    return FALSE;
   }
-  
-  /* Get the length of the payload */
-  paylength = GST_READ_UINT32_BE(header+6);
 
-  /* Send the payload */
-  if (usb_gadget_transfer(s->gadget, 
-			  GAD_UP_EP, 
-			  (unsigned char *) payload,
-			  paylength) != GAD_EOK){   
-    g_free(length);
-    g_free(header);
-    g_free(payload);
-    gst_dp_packetizer_free (gdp);
-    return FALSE;								  
-  }
-
-  g_free(length);
-  g_free(header);
-  g_free(payload);
-  gst_dp_packetizer_free (gdp);
   return TRUE;
 }
 
-
-static GstCaps *gst_usb_src_receive_caps(GstUsbSrc *s)
+/* Sets the caps of an extra stream, adding its pad the first time. The
+ * pad pushes from its own task */
+static gboolean gst_usb_src_set_stream_caps(GstUsbSrc *s, guint stream,
+					    GstCaps *caps)
 {
-  GstCaps *caps;
-  guint8 *header, *payload;
-  guint *length = g_malloc(sizeof(guint)), paylength;
-  
-  /* Wait unitl gadget is connected */
-  if (s->gadget->connected != 1)
+  GstPad *pad = s->streams[stream];
+  GAsyncQueue *queue = NULL;
+  gboolean added = FALSE, ret = TRUE;
+  gchar *name;
+
+  if (pad == NULL)
   {
-    g_free(length);
-    return NULL;
-  }
-  
-  /* Ask for the size of the header */
-  if ( usb_gadget_transfer (s->gadget,
-			    GAD_DOWN_EP,   
-			    (unsigned char *) length, 
-			    sizeof(guint)) != GAD_EOK){	
-    g_free(length);  		
-    return NULL;
+    name = g_strdup_printf ("src_%u", stream);
+    pad = gst_pad_new_from_static_template (&stream_factory, name);
+    g_free (name);
+    gst_pad_use_fixed_caps (pad);
+    queue = g_async_queue_new_full ((GDestroyNotify) gst_usb_src_frame_free);
+    gst_pad_set_element_private (pad, queue);
+    gst_pad_set_active (pad, TRUE);
+    added = TRUE;
   }
 
-  /* Alocate memory for the header */
-  header = (void *) g_malloc(length[0]);
-    
-  /* Ask for the header */
-  if ( usb_gadget_transfer (s->gadget,
-			    GAD_DOWN_EP,   
-			    (unsigned char *) header, 
-			    length[0]) != GAD_EOK){	
-    g_free(length);
-    g_free(header);  											
-    return NULL;
+  if (caps == NULL || !gst_pad_set_caps (pad, caps))
+  {
+    GST_ELEMENT_ERROR(s,STREAM,FAILED,(NULL),
+		      ("Error setting caps of stream %u", stream));
+    ret = FALSE;
   }
+  else
+    GST_DEBUG_OBJECT (s,"Caps of stream %u set correctly", stream);
+  if (caps)
+    gst_caps_unref (caps);
 
-  /* Check for the payload type to be a caps header */
-  if (GST_READ_UINT16_BE(header+4) != GST_DP_PAYLOAD_CAPS){
-    GST_WARNING_OBJECT(s, "Received header is not a cap's header");  
-    g_free(length);
-    g_free(header);  
-    return NULL;
+  if (added)
+  {
+    GST_DEBUG_OBJECT (s, "Adding pad for stream %u", stream);
+    gst_element_add_pad (GST_ELEMENT (s), pad);
+    gst_pad_push_event (pad, gst_event_new_new_segment (FALSE, 1.0,
+					GST_FORMAT_TIME, 0, -1, 0));
+    /* Only now buffers of the stream are queued */
+    GST_OBJECT_LOCK (s);
+    s->streams[stream] = pad;
+    s->stream_frames[stream] = queue;
+    GST_OBJECT_UNLOCK (s);
+    gst_pad_start_task (pad, (GstTaskFunction) gst_usb_src_stream_loop, pad);
   }
 
-  /* Get the size of the payload */
-  paylength = GST_READ_UINT32_BE(header+6);
-  payload = g_malloc(paylength);
-  
-  /* Ask for the payload */
-  if ( usb_gadget_transfer (s->gadget,
-			    GAD_DOWN_EP, 
-			    (unsigned char *) payload, 
-			    paylength) != GAD_EOK){
-    g_free(length);  
-    g_free(payload);
-    g_free(header);  
-    return NULL;
+  return ret;
+}
+
+static void gst_usb_src_remove_streams(GstUsbSrc *s)
+{
+  GAsyncQueue *queue;
+  GstPad *pad;
+  guint i;
+
+  for (i = 1; i < GST_USB_MAX_STREAMS; i++)
+  {
+    if (s->streams[i] == NULL)
+      continue;
+    GST_OBJECT_LOCK (s);
+    pad = s->streams[i];
+    queue = s->stream_frames[i];
+    s->streams[i] = NULL;
+    s->stream_frames[i] = NULL;
+    GST_OBJECT_UNLOCK (s);
+    /* Deactivating unblocks a push, the task is gone once stopped */
+    gst_pad_set_active (pad, FALSE);
+    gst_pad_stop_task (pad);
+    gst_element_remove_pad (GST_ELEMENT (s), pad);
+    /* Along with the frames nobody pushed */
+    g_async_queue_unref (queue);
   }
-  
-  /* Finally get caps from header and payload */
-  caps = gst_dp_caps_from_packet (length[0],
-                                  header,
-                                  payload);
-  /* Free allocated vectors */
-  g_free(length);  
-  g_free(payload);
-  g_free(header);  
-  
-  return caps;
 }
 
+static void close_down_event(void *param)
+{
+  GST_INFO ("Closing down events thread");		
+  guint8 *message = (guint8 *) param;	
+  g_free(message);	
+}
+
+
 static GstStateChangeReturn
 gst_usb_src_change_state (GstElement * element,
     GstStateChange transition)
 {
   GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
   GstUsbSrc *src = GST_USB_SRC (element);
-  guint *notification = g_malloc(sizeof(guint));   
- 										
+  guint notification;
+
   /* Handle ramp-up state changes */
   switch (transition) 
   {
@@ -568,14 +2098,13 @@ gst_usb_src_change_state (GstElement * element,
       }
 
       /* Send sink the play notification */
-      notification[0] = GST_USB_PLAY;
+      notification = GST_USB_PLAY;
       GST_DEBUG_OBJECT (src,"Notifying sink play status");
       if ( usb_gadget_transfer (src->gadget,
-				GAD_UP_EP,   
-				(unsigned char *) notification, 
+				GAD_NOTIFY_EP,
+				(unsigned char *) &notification, 
 				sizeof(guint)) != GAD_EOK)
 	{
-	g_free(notification);	  							
 	GST_ELEMENT_ERROR(src,STREAM,FAILED,(NULL),
 			  ("Error Establishing connection with sink"));
 	return GST_STATE_CHANGE_FAILURE;
@@ -601,7 +2130,6 @@ gst_usb_src_change_state (GstElement * element,
     default:
       break;
   }
-  g_free(notification);
   return ret;
 }
 
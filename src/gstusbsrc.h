@@ -10,6 +10,9 @@
 #include <gst/dataprotocol/dataprotocol.h>
 #include "usbgadget.h"
 #include "gstusbmessages.h"
+#include "linktest.h"
+#include "usbprof.h"
+#include "usbthread.h"
 
 G_BEGIN_DECLS
 
@@ -27,6 +30,84 @@ G_BEGIN_DECLS
 typedef struct _GstUsbSrc      GstUsbSrc;
 typedef struct _GstUsbSrcClass GstUsbSrcClass;
 
+/* Stream and low latency endpoints, each one read by its own thread */
+#define GST_USB_SRC_N_READERS 2
+
+/**
+ * What to do with a frame whose payload doesn't match its CRC
+ */
+typedef enum _GstUsbSrcCrcAction
+{
+  /** Drop the buffer */
+  GST_USB_SRC_CRC_DROP,
+
+  /** Push it with the DISCONT flag, so decoders resynchronize */
+  GST_USB_SRC_CRC_MARK,
+
+  /** Push it as is, only count it */
+  GST_USB_SRC_CRC_IGNORE
+
+} GstUsbSrcCrcAction;
+
+/**
+ * Reference frame of a stream, the sink sends raw video as its difference
+ * with it
+ */
+typedef struct _GstUsbSrcDelta
+{
+  /** Private copy of the frame, the one pushed belongs downstream */
+  GstBuffer *ref;
+
+  /** Number of the reference, as counted by the sink */
+  guint id;
+
+  /** The sink was asked for a keyframe and it didn't come yet */
+  gboolean key_requested;
+
+} GstUsbSrcDelta;
+
+/**
+ * Thread reading whole frames from one data endpoint
+ */
+typedef struct _GstUsbSrcReader
+{
+  /** Element the reader belongs to */
+  GstUsbSrc *src;
+
+  /** Endpoint the frames are read from */
+  GAD_EP_ADDRESS endp;
+
+  pthread_t thread;
+
+  /** Compressed payloads land here before being unpacked into their
+   * buffer, grown as needed */
+  guint8 *scratch;
+  guint scratch_size;
+
+  /** Stripe tag read ahead on the second stream endpoint, for a frame
+   * yet to come */
+  gboolean stripe_pending;
+  guint stripe_seq;
+
+  /** Stream of the frame being read, from its preamble until it's handed
+   * over, -1 in between. Guarded by the frames lock */
+  gint frame_stream;
+
+} GstUsbSrcReader;
+
+/**
+ * Frame handed by the readers to the streaming thread
+ */
+typedef struct _GstUsbSrcFrame
+{
+  /** NULL marks the end of the stream */
+  GstBuffer *buffer;
+
+  /** Stream the buffer belongs to, 0 for the always pad */
+  guint stream;
+
+} GstUsbSrcFrame;
+
 struct _GstUsbSrc
 {
   GstPushSrc parent;
@@ -39,6 +120,112 @@ struct _GstUsbSrc
 
   /* block device when busy */
   GMutex  *state_lock;
+
+  /* Set by unlock() to get out of create() while the link is idle */
+  gboolean flushing;
+
+  /* Buffers arriving later than this are dropped, -1 disables it */
+  gint64 max_lateness;
+  guint64 dropped_late;
+
+  /* Frames of both lanes in arrival order, filled by the readers. Past
+   * max_size_buffers frames the readers wait on frames_cond, which is
+   * signaled as frames are taken out and on unlock and stop */
+  GAsyncQueue *frames;
+  guint max_size_buffers;
+  GMutex *frames_lock;
+  GCond *frames_cond;
+  GstUsbSrcReader readers[GST_USB_SRC_N_READERS];
+  gboolean readers_running;
+
+  /* Error that stopped a reader, GAD_EOK otherwise */
+  gint reader_ret;
+
+  /* Largest bulk transfer to issue, 0 for no limit */
+  guint max_transfer;
+
+  /* Negotiated with the sink once connected: features both ends support
+   * and the transfer limit of the link */
+  guint link_features;
+  guint link_max_transfer;
+
+  /* Resume mode: stay up across disconnections of the cable */
+  gboolean resume;
+
+  /* Gadget session the sink was last told about, and when the link went
+   * down if it's down now */
+  guint link_session;
+  GstClockTime outage_start;
+  guint64 outages;
+
+  /* Frames dropped because their header or payload was broken */
+  guint64 framing_errors;
+
+  /* Payloads that failed their CRC and what to do with them */
+  GstUsbSrcCrcAction crc_action;
+  guint64 crc_checked;
+  guint64 crc_errors;
+
+  /* Compressed payloads received */
+  guint64 decompressed_frames;
+
+  /* References of the delta coded streams. Only the reader of the stream
+   * endpoint touches them */
+  GstUsbSrcDelta delta_refs[GST_USB_MAX_STREAMS];
+  guint64 delta_frames;
+  guint64 delta_missed;
+
+  /* Link qualification: the reader of the stream endpoint checks the
+   * pattern the sink streams instead of reading frames. Error positions
+   * are stream offsets, G_MAXUINT64 while there's none */
+  LINK_TEST_PATTERN test_mode;
+  guint64 test_bytes;
+  /* Bytes per test transfer, told by the sink in the capability exchange,
+   * 0 until then */
+  gint test_size;
+  guint64 test_errors;
+  guint64 test_first_error;
+  guint64 test_last_error;
+
+  /* Script of the emulated link the transfers go through, NULL to use
+   * the real one */
+  gchar *emulate;
+
+  /* Files the endpoint traffic is recorded to, and served from instead
+   * of the gadget, NULL if unused */
+  gchar *capture;
+  gchar *replay;
+  gboolean replay_realtime;
+
+  /* Name of the loop to the usbsink of this process served instead of
+   * the gadget, NULL if unused */
+  gchar *loop;
+
+  /* Readers that reached the end of the replayed capture */
+  gint readers_ended;
+
+  /* Where the CPU goes in each phase of the data path, NULL unless
+   * configured with --enable-profiling */
+  usb_prof *prof;
+
+  /* Scheduling of the I/O threads the element creates, the gadget's too,
+   * the cpus point into thread_affinity once started. The streaming thread
+   * belongs to the pipeline and is left alone */
+  usb_thread_sched sched;
+  gchar *thread_affinity;
+
+  /* Microseconds the stream reads spin for their completion, 0 to sleep */
+  guint busy_poll;
+
+  /* Serial number the gadget reports, NULL for none */
+  gchar *serial;
+
+  /* Sometimes pads, indexed by stream id. Stream 0 is the always pad */
+  GstPad *streams[GST_USB_MAX_STREAMS];
+
+  /* Frames of each sometimes pad, pushed by the task of the pad so a
+   * blocked stream doesn't hold the others back */
+  GAsyncQueue *stream_frames[GST_USB_MAX_STREAMS];
 };
 
 struct _GstUsbSrcClass 
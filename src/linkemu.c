@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ *
+ * Emulation of a bad link on top of a good one. Transfers still go
+ * through the real endpoints, but they are held back to the bandwidth and
+ * latency of the emulated link, and some of them are stalled, shortened
+ * or failed as the script says. Every transfer draws the same amount of
+ * random numbers whatever happens to it, from the stream of its endpoint,
+ * so a seed replays the same events on each endpoint whichever way the
+ * threads of the different endpoints interleave.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "linkemu.h"
+
+static uint64_t now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Sleeps until a monotonic time, non zero if a signal interrupted it */
+static int sleep_until (uint64_t us)
+{
+  struct timespec ts;
+
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  return clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR;
+}
+
+/* xorshift64*, plenty for picking the victims */
+static uint64_t emu_random (uint64_t *rng)
+{
+  uint64_t x = *rng;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *rng = x;
+  return x * 0x2545f4914f6cdd1dull;
+}
+
+/* Uniform in [0, 1) */
+static double emu_uniform (uint64_t *rng)
+{
+  return (emu_random (rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Random number stream of an endpoint, IN ones take the upper half */
+static uint64_t *emu_rng (link_emu *emu, unsigned int endp)
+{
+  return &emu->rng[((endp >> 3) & 0x10) | (endp & 0x0f)];
+}
+
+/* Non negative number with an optional k, M or G multiplier */
+static int parse_number (const char *text, double *value)
+{
+  char *end;
+
+  *value = strtod (text, &end);
+  if (end == text || *value < 0)
+    return 0;
+
+  switch (*end)
+  {
+    case 'k':
+      *value *= 1e3;
+      end++;
+      break;
+    case 'M':
+      *value *= 1e6;
+      end++;
+      break;
+    case 'G':
+      *value *= 1e9;
+      end++;
+      break;
+  }
+  return *end == '\0';
+}
+
+static int parse_phase (link_emu *emu, link_emu_phase *phase, char *text)
+{
+  char *item, *value, *save;
+  double v;
+
+  for (item = strtok_r (text, ",", &save); item != NULL;
+       item = strtok_r (NULL, ",", &save))
+  {
+    while (*item == ' ')
+      item++;
+    value = strchr (item, '=');
+    if (value == NULL)
+      return 0;
+    *value++ = '\0';
+    if (!parse_number (value, &v))
+      return 0;
+
+    if (strcmp (item, "bandwidth") == 0)
+      phase->bandwidth = v;
+    else if (strcmp (item, "latency") == 0)
+      phase->latency = v;
+    else if (strcmp (item, "jitter") == 0)
+      phase->jitter = v;
+    else if (strcmp (item, "stall") == 0 && v <= 1)
+      phase->stall = v;
+    else if (strcmp (item, "stall-time") == 0)
+      phase->stall_time = v;
+    else if (strcmp (item, "short") == 0 && v <= 1)
+      phase->short_rate = v;
+    else if (strcmp (item, "disconnect") == 0 && v <= 1)
+      phase->disconnect = v;
+    else if (strcmp (item, "disconnect-time") == 0)
+      phase->disconnect_time = v;
+    else if (strcmp (item, "at") == 0)
+      phase->at = v * 1000;
+    else if (strcmp (item, "seed") == 0)
+      emu->seed = v;
+    else
+      return 0;
+  }
+  return 1;
+}
+
+link_emu *link_emu_new (const char *script)
+{
+  link_emu *emu = calloc (1, sizeof (link_emu));
+  char *text = strdup (script), *phase, *save;
+  int i;
+
+  if (emu == NULL || text == NULL)
+    goto error;
+
+  for (phase = strtok_r (text, ";", &save); phase != NULL;
+       phase = strtok_r (NULL, ";", &save))
+  {
+    if (emu->n_phases == LINK_EMU_MAX_PHASES)
+      goto error;
+    /* Whatever the phase doesn't set stays as it was */
+    if (emu->n_phases > 0)
+      emu->phases[emu->n_phases] = emu->phases[emu->n_phases - 1];
+    if (!parse_phase (emu, &emu->phases[emu->n_phases], phase))
+      goto error;
+    if (emu->n_phases > 0 &&
+	emu->phases[emu->n_phases].at < emu->phases[emu->n_phases - 1].at)
+      goto error;
+    emu->n_phases++;
+  }
+  if (emu->n_phases == 0)
+    goto error;
+
+  /* Streams far apart from each other, never 0 */
+  for (i = 0; i < LINK_EMU_MAX_ENDPOINTS; i++)
+    emu->rng[i] = (((emu->seed + 1) * 0x9e3779b97f4a7c15ull) ^
+		   ((uint64_t) (i + 1) * 0xbf58476d1ce4e5b9ull)) | 1;
+
+  pthread_mutex_init (&emu->lock, NULL);
+  free (text);
+  return emu;
+
+error:
+  free (text);
+  free (emu);
+  return NULL;
+}
+
+void link_emu_free (link_emu *emu)
+{
+  pthread_mutex_destroy (&emu->lock);
+  free (emu);
+}
+
+/* Phase in effect, called with the lock taken */
+static link_emu_phase *link_emu_phase_now (link_emu *emu, uint64_t now)
+{
+  int i;
+
+  if (emu->start == 0)
+    emu->start = now;
+  for (i = emu->n_phases - 1; i > 0; i--)
+    if (emu->phases[i].at <= now - emu->start)
+      break;
+  return &emu->phases[i];
+}
+
+LINK_EMU_ACTION link_emu_begin (link_emu *emu, unsigned int endp,
+				int *length, unsigned int timeout)
+{
+  LINK_EMU_ACTION action = LINK_EMU_PASS;
+  uint64_t now = now_us (), stall = 0;
+  link_emu_phase *phase;
+  double disconnect, stalled, shortened;
+  uint64_t cut, *rng;
+
+  pthread_mutex_lock (&emu->lock);
+  phase = link_emu_phase_now (emu, now);
+  rng = emu_rng (emu, endp);
+  disconnect = emu_uniform (rng);
+  stalled = emu_uniform (rng);
+  shortened = emu_uniform (rng);
+  cut = emu_random (rng);
+  emu->transfers++;
+
+  if (now < emu->down_until)
+    action = LINK_EMU_DISCONNECT;
+  else if (disconnect < phase->disconnect)
+  {
+    emu->down_until = now + (uint64_t) phase->disconnect_time * 1000;
+    emu->disconnects++;
+    action = LINK_EMU_DISCONNECT;
+  }
+  else if (stalled < phase->stall)
+  {
+    stall = phase->stall_time;
+    emu->stalls++;
+  }
+  else if (length != NULL && *length > 1 && shortened < phase->short_rate)
+  {
+    *length = 1 + cut % (*length - 1);
+    emu->shorts++;
+    action = LINK_EMU_SHORT;
+  }
+  pthread_mutex_unlock (&emu->lock);
+
+  if (stall > 0)
+  {
+    if (timeout != 0 && stall >= timeout)
+    {
+      sleep_until (now + (uint64_t) timeout * 1000);
+      return LINK_EMU_TIMEOUT;
+    }
+    if (sleep_until (now + stall * 1000))
+      return LINK_EMU_TIMEOUT;
+  }
+
+  return action;
+}
+
+unsigned int link_emu_wait_up (link_emu *emu)
+{
+  uint64_t until;
+  unsigned int outage;
+
+  pthread_mutex_lock (&emu->lock);
+  until = emu->down_until;
+  outage = emu->disconnects;
+  pthread_mutex_unlock (&emu->lock);
+
+  if (until > now_us () && sleep_until (until))
+    return 0;
+  return outage;
+}
+
+void link_emu_end (link_emu *emu, unsigned int endp, int transferred)
+{
+  uint64_t now = now_us (), deadline;
+  link_emu_phase *phase;
+  uint64_t r;
+  int64_t jitter = 0;
+
+  pthread_mutex_lock (&emu->lock);
+  phase = link_emu_phase_now (emu, now);
+  r = emu_random (emu_rng (emu, endp));
+  if (phase->jitter > 0)
+    jitter = (int64_t) (r % (2 * (uint64_t) phase->jitter + 1)) -
+      phase->jitter;
+
+  /* Transfers share the wire one after the other, each one arrives the
+   * latency after it's done with it */
+  if (emu->wire_free < now)
+    emu->wire_free = now;
+  if (phase->bandwidth > 0)
+    emu->wire_free += (uint64_t) transferred * 1000000 / phase->bandwidth;
+  deadline = emu->wire_free + phase->latency;
+  if (jitter < 0 && (uint64_t) -jitter > phase->latency)
+    jitter = -(int64_t) phase->latency;
+  deadline += jitter;
+  pthread_mutex_unlock (&emu->lock);
+
+  if (deadline > now)
+    sleep_until (deadline);
+}
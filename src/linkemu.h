@@ -0,0 +1,161 @@
+#ifndef __LINK_EMU_H__
+#define __LINK_EMU_H__
+
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * What the emulated link does with a transfer
+ */
+typedef enum _LINK_EMU_ACTION
+{
+  /** Goes through, paced by link_emu_end() */
+  LINK_EMU_PASS,
+
+  /** Goes through but shortened, the length was reduced */
+  LINK_EMU_SHORT,
+
+  /** The link stalled past the timeout, nothing was transferred */
+  LINK_EMU_TIMEOUT,
+
+  /** The link is down, nothing was transferred */
+  LINK_EMU_DISCONNECT
+
+} LINK_EMU_ACTION;
+
+/** Most phases a script can have */
+#define LINK_EMU_MAX_PHASES 16
+
+/** Endpoints with a random number stream of their own, 16 of each
+ * direction */
+#define LINK_EMU_MAX_ENDPOINTS 32
+
+/**
+ * Behaviour of the link for a while. Rates are the probability of a
+ * transfer being hit, from 0 to 1.
+ */
+typedef struct _link_emu_phase
+{
+  /** Microseconds from the first transfer to the start of the phase */
+  uint64_t at;
+
+  /** Bytes per second, 0 is unlimited */
+  uint64_t bandwidth;
+
+  /** Microseconds every transfer takes to arrive, plus up to jitter
+   * more or less */
+  unsigned int latency;
+  unsigned int jitter;
+
+  /** Rate of the transfers that hang, and milliseconds they hang */
+  double stall;
+  unsigned int stall_time;
+
+  /** Rate of the transfers sent short */
+  double short_rate;
+
+  /** Rate of the transfers that bring the link down, and milliseconds
+   * it stays down */
+  double disconnect;
+  unsigned int disconnect_time;
+
+} link_emu_phase;
+
+/**
+ * Emulated link, shared by all the transfers on one side of it
+ */
+typedef struct _link_emu
+{
+  link_emu_phase phases[LINK_EMU_MAX_PHASES];
+  int n_phases;
+
+  /** Guards everything below */
+  pthread_mutex_t lock;
+
+  /** Seed of the script */
+  uint64_t seed;
+
+  /** Random number generator state of each endpoint, from the seed, so
+   * the events an endpoint sees only depend on its own transfers */
+  uint64_t rng[LINK_EMU_MAX_ENDPOINTS];
+
+  /** Monotonic microseconds of the first transfer, 0 before it */
+  uint64_t start;
+
+  /** When the emulated wire is done with what was sent so far */
+  uint64_t wire_free;
+
+  /** When the link comes back after a disconnection */
+  uint64_t down_until;
+
+  /** What was done to the transfers so far */
+  uint64_t transfers;
+  uint64_t stalls;
+  uint64_t shorts;
+  uint64_t disconnects;
+
+} link_emu;
+
+/**
+  * \brief Creates an emulated link from a script. The script is a list
+  * of phases separated by ';', each one a list of key=value separated by
+  * ','. Keys are bandwidth (bytes per second, with optional k, M or G),
+  * latency and jitter (microseconds), stall, short and disconnect
+  * (rates), stall-time and disconnect-time (milliseconds), at (start of
+  * the phase in milliseconds) and seed. A phase starts with the settings
+  * of the previous one. For instance
+  * "bandwidth=20M,latency=500,seed=7;at=10000,stall=0.01,stall-time=200"
+  * \param script Description of the link.
+  * \return The link, NULL if the script is malformed.
+  */
+extern link_emu *link_emu_new (const char *script);
+
+/**
+  * \brief Releases an emulated link.
+  * \param emu Link to release.
+  */
+extern void link_emu_free (link_emu *emu);
+
+/**
+  * \brief Decides what happens to a transfer, to call right before it.
+  * Stalls are waited here.
+  * \param emu Emulated link.
+  * \param endp Endpoint of the transfer, an address with the direction in
+  * bit 7 or any other number below 16 telling the endpoints apart. The
+  * events of an endpoint replay with the seed as long as its transfers
+  * aren't issued from several threads at once.
+  * \param length Length of the transfer, reduced on #LINK_EMU_SHORT.
+  * NULL if the transfer can't be shortened, as it's the other side that
+  * decides the length of a read.
+  * \param timeout Milliseconds the transfer waits at most, 0 for ever.
+  * \return What to do with the transfer. #LINK_EMU_TIMEOUT is returned
+  * too if a signal interrupted the stall.
+  */
+extern LINK_EMU_ACTION link_emu_begin (link_emu *emu, unsigned int endp,
+				       int *length, unsigned int timeout);
+
+/**
+  * \brief Waits until the transfer would have made it through the
+  * emulated link, to call right after it.
+  * \param emu Emulated link.
+  * \param endp Endpoint of the transfer, as given to link_emu_begin().
+  * \param transferred Bytes actually transferred.
+  */
+extern void link_emu_end (link_emu *emu, unsigned int endp,
+			  int transferred);
+
+/**
+  * \brief Waits until the emulated link is back from a disconnection, to
+  * recover from a #LINK_EMU_DISCONNECT the way a real link is recovered
+  * once the host configures the device again.
+  * \param emu Emulated link.
+  * \return Number of the disconnection, the same for all the transfers
+  * it failed. 0 if a signal interrupted the wait.
+  */
+extern unsigned int link_emu_wait_up (link_emu *emu);
+
+#endif /* __LINK_EMU_H__ */
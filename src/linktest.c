@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ *
+ * Link qualification patterns. Generating and checking a block is a
+ * memcpy or memcmp against a precomputed copy of the pattern, both run
+ * with the vector units by the C library, so the test isn't limited by
+ * the CPU.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "linktest.h"
+
+uint8_t *link_test_pattern_new (LINK_TEST_PATTERN pattern, size_t size)
+{
+  size_t i, n = size + LINK_TEST_PERIOD;
+  uint8_t *buf = malloc (n);
+
+  if (buf == NULL)
+    return NULL;
+
+  switch (pattern)
+  {
+    case LINK_TEST_MOD63:
+      for (i = 0; i < n; i++)
+	buf[i] = (uint8_t) (i % LINK_TEST_PERIOD);
+      break;
+    default:
+      memset (buf, 0, n);
+      break;
+  }
+  return buf;
+}
+
+const uint8_t *link_test_data (const uint8_t *pattern, uint64_t offset)
+{
+  return pattern + offset % LINK_TEST_PERIOD;
+}
+
+size_t link_test_check (const uint8_t *pattern, const uint8_t *data,
+			size_t length, uint64_t offset, size_t *first)
+{
+  const uint8_t *expected = link_test_data (pattern, offset);
+  size_t i, bad = 0;
+
+  if (memcmp (data, expected, length) == 0)
+    return 0;
+
+  /* Only a bad block pays for the byte by byte scan */
+  for (i = 0; i < length; i++)
+    if (data[i] != expected[i] && bad++ == 0)
+      *first = i;
+
+  return bad;
+}
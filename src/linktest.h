@@ -0,0 +1,64 @@
+#ifndef __LINK_TEST_H__
+#define __LINK_TEST_H__
+
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Data streamed to qualify a link, the same ones the gadget test threads
+ * use. The pattern runs over the whole stream, not over each transfer,
+ * so a lost or repeated packet shows up as an error.
+ */
+typedef enum _LINK_TEST_PATTERN
+{
+  /** Normal operation, no test */
+  LINK_TEST_NONE,
+
+  /** Endless stream of zeros */
+  LINK_TEST_ZERO,
+
+  /** Byte n of the stream is n % 63 */
+  LINK_TEST_MOD63
+
+} LINK_TEST_PATTERN;
+
+/** The patterns repeat every this many bytes */
+#define LINK_TEST_PERIOD 63
+
+/**
+  * \brief Allocates a buffer with the pattern, from which a block of up
+  * to size bytes starting at any stream offset can be taken.
+  * \param pattern Pattern to generate.
+  * \param size Largest block that will be taken.
+  * \return The buffer, to release with free(), or NULL.
+  */
+extern uint8_t *link_test_pattern_new (LINK_TEST_PATTERN pattern,
+				       size_t size);
+
+/**
+  * \brief Pattern data at a stream offset.
+  * \param pattern Buffer from link_test_pattern_new().
+  * \param offset Offset in the stream.
+  * \return Pointer to the pattern data starting at offset.
+  */
+extern const uint8_t *link_test_data (const uint8_t *pattern,
+				      uint64_t offset);
+
+/**
+  * \brief Verifies received data against the pattern.
+  * \param pattern Buffer from link_test_pattern_new().
+  * \param data Data received.
+  * \param length Size in bytes of the data, no more than the pattern size.
+  * \param offset Offset of the data in the stream.
+  * \param first Set to the position in data of the first bad byte.
+  * \return Number of bad bytes, 0 if the data is good.
+  */
+extern size_t link_test_check (const uint8_t *pattern, const uint8_t *data,
+			       size_t length, uint64_t offset,
+			       size_t *first);
+
+#endif /* __LINK_TEST_H__ */
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ *
+ * Capture file: a 16 byte header with the magic, then one record per
+ * transfer. A record is a 16 byte header, the little endian arrival time
+ * in nanoseconds from the start of the capture, the little endian length,
+ * the endpoint and the flags, followed by the data padded to 8 bytes. The
+ * file grows in big steps while recording, a record with no flags marks
+ * the end of the ones written if the recorder died before trimming it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usbcapture.h"
+
+#define USB_CAPTURE_MAGIC "USBCAP01"
+
+/* Size of the file header and of the header of every record */
+#define USB_CAPTURE_HEADER 16
+#define USB_CAPTURE_RECORD 16
+
+/* The recording file is grown this much at a time */
+#define USB_CAPTURE_GROW (64 << 20)
+
+/* Flags of a record */
+#define USB_CAPTURE_VALID 0x01
+#define USB_CAPTURE_WRITE 0x02
+
+#define USB_CAPTURE_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+struct _usb_capture
+{
+  int fd;
+  uint8_t *map;
+  size_t map_size;
+
+  /* Bytes of the file in use */
+  size_t used;
+
+  int replay;
+  int realtime;
+
+  /* Guards everything below, and the map while recording */
+  pthread_mutex_t lock;
+
+  /* Signaled each time a record is fully read */
+  pthread_cond_t cond;
+
+  /* Monotonic nanoseconds the recording or the replay started at */
+  uint64_t start;
+
+  /* Replay: record being read, bytes of it already served and time of
+   * the first record */
+  size_t pos;
+  size_t consumed;
+  uint64_t first;
+};
+
+static uint64_t now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void put_le (uint8_t *p, uint64_t v, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    p[i] = v >> (8 * i);
+}
+
+static uint64_t get_le (const uint8_t *p, int n)
+{
+  uint64_t v = 0;
+  int i;
+
+  for (i = n - 1; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+static usb_capture *usb_capture_alloc (int fd)
+{
+  usb_capture *cap = calloc (1, sizeof (usb_capture));
+  pthread_condattr_t attr;
+
+  if (cap == NULL)
+    return NULL;
+  cap->fd = fd;
+  pthread_mutex_init (&cap->lock, NULL);
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&cap->cond, &attr);
+  pthread_condattr_destroy (&attr);
+  return cap;
+}
+
+usb_capture *usb_capture_new (const char *path)
+{
+  usb_capture *cap;
+  int fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0)
+    return NULL;
+  if (ftruncate (fd, USB_CAPTURE_GROW) < 0 ||
+      (cap = usb_capture_alloc (fd)) == NULL)
+  {
+    close (fd);
+    return NULL;
+  }
+
+  cap->map_size = USB_CAPTURE_GROW;
+  cap->map = mmap (NULL, cap->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+  if (cap->map == MAP_FAILED)
+  {
+    cap->map = NULL;
+    usb_capture_free (cap);
+    return NULL;
+  }
+  memcpy (cap->map, USB_CAPTURE_MAGIC, 8);
+  memset (cap->map + 8, 0, USB_CAPTURE_HEADER - 8);
+  cap->used = USB_CAPTURE_HEADER;
+  cap->start = now_ns ();
+  return cap;
+}
+
+usb_capture *usb_capture_open (const char *path, int realtime)
+{
+  usb_capture *cap;
+  struct stat st;
+  size_t pos, length;
+  int fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) < 0 || st.st_size < USB_CAPTURE_HEADER ||
+      (cap = usb_capture_alloc (fd)) == NULL)
+  {
+    close (fd);
+    return NULL;
+  }
+
+  cap->replay = 1;
+  cap->realtime = realtime;
+  cap->map_size = st.st_size;
+  cap->map = mmap (NULL, cap->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (cap->map == MAP_FAILED)
+  {
+    cap->map = NULL;
+    usb_capture_free (cap);
+    return NULL;
+  }
+  if (memcmp (cap->map, USB_CAPTURE_MAGIC, 8) != 0)
+  {
+    usb_capture_free (cap);
+    return NULL;
+  }
+  madvise (cap->map, cap->map_size, MADV_SEQUENTIAL);
+
+  /* Records end at the first one not fully written */
+  for (pos = USB_CAPTURE_HEADER;
+       pos + USB_CAPTURE_RECORD <= cap->map_size &&
+       (cap->map[pos + 13] & USB_CAPTURE_VALID); pos += length)
+  {
+    length = USB_CAPTURE_RECORD +
+        USB_CAPTURE_ALIGN (get_le (cap->map + pos + 8, 4));
+    if (length > cap->map_size - pos)
+      break;
+  }
+  cap->used = pos;
+  cap->pos = USB_CAPTURE_HEADER;
+  if (cap->used > cap->pos)
+    cap->first = get_le (cap->map + cap->pos, 8);
+  return cap;
+}
+
+/* Makes room for need more bytes, called with the lock taken */
+static int usb_capture_grow (usb_capture *cap, size_t need)
+{
+  size_t size = cap->map_size + (need > USB_CAPTURE_GROW ?
+                                 USB_CAPTURE_ALIGN (need) : USB_CAPTURE_GROW);
+
+  munmap (cap->map, cap->map_size);
+  cap->map = NULL;
+  if (ftruncate (cap->fd, size) < 0)
+    return 0;
+  cap->map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0);
+  if (cap->map == MAP_FAILED)
+  {
+    cap->map = NULL;
+    return 0;
+  }
+  cap->map_size = size;
+  return 1;
+}
+
+void usb_capture_record (usb_capture *cap, int endp, int writing,
+                         const void *data, int length)
+{
+  size_t need = USB_CAPTURE_RECORD + USB_CAPTURE_ALIGN (length);
+  uint8_t *p;
+
+  pthread_mutex_lock (&cap->lock);
+  /* A failure to grow the file ends the recording, what was recorded
+   * is kept */
+  if (cap->map == NULL ||
+      (cap->used + need > cap->map_size && !usb_capture_grow (cap, need)))
+  {
+    pthread_mutex_unlock (&cap->lock);
+    return;
+  }
+
+  p = cap->map + cap->used;
+  put_le (p, now_ns () - cap->start, 8);
+  put_le (p + 8, length, 4);
+  p[12] = endp;
+  p[14] = p[15] = 0;
+  memcpy (p + USB_CAPTURE_RECORD, data, length);
+  /* Valid only once the rest is there */
+  p[13] = USB_CAPTURE_VALID | (writing ? USB_CAPTURE_WRITE : 0);
+  cap->used += need;
+  pthread_mutex_unlock (&cap->lock);
+}
+
+static void usb_capture_unlock (void *param)
+{
+  pthread_mutex_unlock ((pthread_mutex_t *) param);
+}
+
+/* Waits on the capture until a monotonic time, 0 for ever. Returns non
+ * zero if the time passed */
+static int usb_capture_wait (usb_capture *cap, uint64_t until)
+{
+  struct timespec ts;
+
+  if (until == 0)
+  {
+    pthread_cond_wait (&cap->cond, &cap->lock);
+    return 0;
+  }
+  ts.tv_sec = until / 1000000000;
+  ts.tv_nsec = until % 1000000000;
+  return pthread_cond_timedwait (&cap->cond, &cap->lock, &ts) == ETIMEDOUT;
+}
+
+int usb_capture_read (usb_capture *cap, int endp, void *buffer,
+                      int length, unsigned int timeout)
+{
+  uint64_t now = now_ns (), deadline = 0, release;
+  const uint8_t *rec;
+  size_t size;
+  int ret;
+
+  if (timeout != 0)
+    deadline = now + (uint64_t) timeout * 1000000;
+
+  /* The waits are cancellation points, don't leave the lock taken */
+  pthread_mutex_lock (&cap->lock);
+  pthread_cleanup_push (usb_capture_unlock, (void *) &cap->lock);
+  if (cap->start == 0)
+    cap->start = now;
+
+  for (;;)
+  {
+    /* Nobody waits for what was sent */
+    while (cap->pos < cap->used && (cap->map[cap->pos + 13] & USB_CAPTURE_WRITE))
+      cap->pos += USB_CAPTURE_RECORD +
+          USB_CAPTURE_ALIGN (get_le (cap->map + cap->pos + 8, 4));
+    if (cap->pos >= cap->used)
+    {
+      ret = USB_CAPTURE_END;
+      break;
+    }
+
+    rec = cap->map + cap->pos;
+    if (rec[12] != endp)
+    {
+      /* A transfer of another endpoint comes first */
+      if (usb_capture_wait (cap, deadline))
+      {
+        ret = USB_CAPTURE_TIMEOUT;
+        break;
+      }
+      continue;
+    }
+
+    release = cap->start + (get_le (rec, 8) - cap->first);
+    if (cap->realtime && now_ns () < release)
+    {
+      if (deadline != 0 && deadline < release)
+      {
+        usb_capture_wait (cap, deadline);
+        if (now_ns () >= deadline)
+        {
+          ret = USB_CAPTURE_TIMEOUT;
+          break;
+        }
+      }
+      else
+        usb_capture_wait (cap, release);
+      continue;
+    }
+
+    size = get_le (rec + 8, 4) - cap->consumed;
+    ret = size < (size_t) length ? (int) size : length;
+    memcpy (buffer, rec + USB_CAPTURE_RECORD + cap->consumed, ret);
+    cap->consumed += ret;
+    if (cap->consumed == get_le (rec + 8, 4))
+    {
+      cap->pos += USB_CAPTURE_RECORD + USB_CAPTURE_ALIGN (cap->consumed);
+      cap->consumed = 0;
+      pthread_cond_broadcast (&cap->cond);
+    }
+    break;
+  }
+  pthread_cleanup_pop (1);
+
+  return ret;
+}
+
+int usb_capture_free (usb_capture *cap)
+{
+  int ret = 0;
+
+  if (cap->map != NULL)
+    munmap (cap->map, cap->map_size);
+  if (!cap->replay && ftruncate (cap->fd, cap->used) < 0)
+    ret = -errno;
+  close (cap->fd);
+  pthread_cond_destroy (&cap->cond);
+  pthread_mutex_destroy (&cap->lock);
+  free (cap);
+  return ret;
+}
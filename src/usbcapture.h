@@ -0,0 +1,76 @@
+#ifndef __USB_CAPTURE_H__
+#define __USB_CAPTURE_H__
+
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+#include <stdint.h>
+
+/**
+ * Capture of the traffic of a set of endpoints, in a memory mapped file.
+ * Every transfer is stored with its endpoint and arrival time, so it can
+ * be served again later as if it came from the link.
+ */
+typedef struct _usb_capture usb_capture;
+
+/** No transfer was available before the timeout */
+#define USB_CAPTURE_TIMEOUT (-1)
+
+/** Every transfer in the capture was served */
+#define USB_CAPTURE_END (-2)
+
+/**
+  * \brief Starts recording to a file, replacing it if it exists.
+  * \param path File to record to.
+  * \return The capture, NULL if the file can't be created.
+  */
+extern usb_capture *usb_capture_new (const char *path);
+
+/**
+  * \brief Opens a capture to replay it.
+  * \param path File recorded by usb_capture_new().
+  * \param realtime Non zero to serve the transfers with their original
+  * timing, zero to serve them as fast as they are read.
+  * \return The capture, NULL if the file can't be opened or it isn't a
+  * capture.
+  */
+extern usb_capture *usb_capture_open (const char *path, int realtime);
+
+/**
+  * \brief Records a transfer. Safe to call from several threads, the
+  * transfers are stored in the order the calls are made.
+  * \param cap Capture being recorded.
+  * \param endp Endpoint of the transfer.
+  * \param writing Non zero if the data was sent, zero if it was received.
+  * \param data Data transferred.
+  * \param length Length in bytes of the data.
+  */
+extern void usb_capture_record (usb_capture *cap, int endp, int writing,
+                                const void *data, int length);
+
+/**
+  * \brief Serves the next transfer received on an endpoint. Transfers
+  * are served in the order they were recorded across all endpoints, so
+  * this waits until the ones before it were read. Sent transfers are
+  * skipped.
+  * \param cap Capture being replayed.
+  * \param endp Endpoint to read from.
+  * \param buffer Where to store the data.
+  * \param length Size of the buffer, the rest of a bigger transfer is
+  * served on the next read.
+  * \param timeout Time in milliseconds to give up, 0 waits for ever.
+  * \return Bytes read, #USB_CAPTURE_TIMEOUT or #USB_CAPTURE_END.
+  */
+extern int usb_capture_read (usb_capture *cap, int endp, void *buffer,
+                             int length, unsigned int timeout);
+
+/**
+  * \brief Closes a capture. A recording is trimmed to what was recorded.
+  * \param cap Capture to close, freed even on error.
+  * \return 0, or -errno if the recording couldn't be trimmed and keeps
+  * unused room at its end.
+  */
+extern int usb_capture_free (usb_capture *cap);
+
+#endif /* __USB_CAPTURE_H__ */
@@ -30,9 +30,12 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include <asm/byteorder.h>
 
+#include <linux/aio_abi.h>
 #include <linux/types.h>
 #include <linux/usb/gadgetfs.h>
 #include <linux/usb/ch9.h>
@@ -45,9 +48,12 @@
 #include "usbstring.h"
 #include "usbgadget.h"
 #include "usbgadget_descriptors.h"
+#include "linkemu.h"
+#include "usbcapture.h"
+#include "usbloop.h"
+#include "usbthread.h"
 
 //static int verbose;
-static int pattern;
 
 
 /* kernel drivers could autoconfigure like this too ... if
@@ -85,6 +91,24 @@ static GADGET_EXIT_CODE autoconfig (usb_gadget *gadget)
 	= hs_evdown_desc.bEndpointAddress
 	= USB_DIR_OUT | 1;
       gadget->ev_down.NAME = "ep1out";
+
+      fs_stream2_desc.bEndpointAddress
+	= hs_stream2_desc.bEndpointAddress
+	= USB_DIR_OUT | 3;
+      gadget->stream2.NAME = "ep3out";
+      gst_usb_intf.bNumEndpoints = 4;
+
+      fs_lane_desc.bEndpointAddress
+	= hs_lane_desc.bEndpointAddress
+	= USB_DIR_OUT | 4;
+      gadget->lane.NAME = "ep4out";
+      gst_usb_intf.bNumEndpoints = 5;
+
+      fs_notify_desc.bEndpointAddress
+	= hs_notify_desc.bEndpointAddress
+	= USB_DIR_IN | 5;
+      gadget->notify.NAME = "ep5in";
+      gst_usb_intf.bNumEndpoints = 6;
     } 
   else 
     {
@@ -111,41 +135,6 @@ static void close_ep0 (void *param)
     perror ("close");
 }
 
-static void close_fd (void *param)
-{
-  int	status, fd;
-  
-  fd = *(int *)param;     	  
-  
-  /* test the FIFO ioctls (non-ep0 code paths) */
-  status = ioctl (fd, GADGETFS_FIFO_STATUS);
-  if (status < 0) 
-    {
-      /* ENODEV reported after disconnect */
-      if (errno != ENODEV && errno != -EOPNOTSUPP)
-	/* 
-	 * TODO: Find a way to pass error handling to GSTREAMER
-	 */
-	perror ("get fifo status");	
-    } else 
-    {
-      if (status) 
-	{
-	  status = ioctl (fd, GADGETFS_FIFO_FLUSH);
-	  if (status < 0)
-	    /* 
-	     * TODO: Find a way to pass error handling to GSTREAMER
-	     */
-	    perror ("fifo flush");
-	}
-    }
-  if (close (fd) < 0)
-    /* 
-     * TODO: Find a way to pass error handling to GSTREAMER
-     */
-    perror ("close");
-}
-
 
 /* you should be able to open and configure endpoints
  * whether or not the host is connected
@@ -193,208 +182,12 @@ ep_config (char *name, const char *label,
   ep_config(name,__FUNCTION__, &fs_evup_desc, &hs_evup_desc)
 #define ev_down_open(name)						\
   ep_config(name,__FUNCTION__, &fs_evdown_desc, &hs_evdown_desc)	
-	
-
-
-static unsigned long fill_in_buf(void *buf, unsigned long nbytes)
-{
-#ifdef	DO_PIPE
-  /* pipe stdin to host */
-  nbytes = fread (buf, 1, nbytes, stdin);
-  if (nbytes == 0) {
-    if (ferror (stdin))
-      perror ("read stdin");
-    if (feof (stdin))
-      errno = ENODEV;
-  }
-#else
-  switch (pattern) {
-    unsigned	i;
-
-  default:
-    // FALLTHROUGH
-  case 0:		/* endless streams of zeros */
-    memset (buf, 0, nbytes);
-    break;
-  case 1:		/* mod63 repeating pattern */
-    for (i = 0; i < nbytes; i++)
-      ((__u8 *)buf)[i] = (__u8) (i % 63);
-    break;
-  }
-#endif
-  return nbytes;
-}
-
-#define DO_PIPE
-static int empty_out_buf(void *buf, unsigned long nbytes)
-{
-  unsigned len;
-
-#ifdef	DO_PIPE
-  /* pipe from host to stdout */
-  len = fwrite (buf, nbytes, 1, stdout);
-  if (len != nbytes) {
-    if (ferror (stdout))
-      perror ("write stdout");
-  }
-#else
-  unsigned	i;
-  __u8		expected, *data;
-
-  for (i = 0, data = buf; i < nbytes; i++, data++) {
-    switch (pattern) {
-    case 0:
-      expected = 0;
-      break;
-    case 1:
-      expected = i % 63;
-      break;
-    default:	/* no verify */
-      i = nbytes - 1;
-      continue;
-    }
-    if (*data == expected)
-      continue;
-    fprintf (stderr, "bad OUT byte %d, expected %02x got %02x\n",
-	     i, expected, *data);
-    for (i = 0, data = 0; i < nbytes; i++, data++) {
-      if (0 == (i % 16))
-	fprintf (stderr, "%4d:", i);
-      fprintf (stderr, " %02x", *data);
-      if (15 == (i % 16))
-	fprintf (stderr, "\n");
-    }
-    return -1;
-  }
-  len = i;
-#endif
-  memset (buf, 0, nbytes);
-  return len;
-}
-
-static void *simple_stream_thread (void *param)
-{
-  
-  int  status;
-  char  buf [USB_BUFSIZE];
-
-  usb_gadget *gadget = (usb_gadget *)param;
-  int verbose = gadget->verbosity;
-  char *name = gadget->stream.NAME;
-  
-  status = stream_open (name);
-  if (status < 0)
-    perror("stream fd open");
-  
-  gadget->stream.fd = status;
-  pthread_cleanup_push (close_fd, (void *)&(gadget->stream.fd));
-	
-  do 
-    {
-      /* original LinuxThreads cancelation didn't work right
-       * so test for it explicitly.
-       */
-      pthread_testcancel();
-	
-      errno = 0;
-      status = read (gadget->stream.fd, buf, sizeof buf);
-	    
-      if (status < 0)
-	break;
-      status = empty_out_buf (buf, status);
-    } while (status > 0);
-	
-  if (status == 0) {
-    if (verbose)
-      fprintf (stderr, "done %s\n", __FUNCTION__);
-  } else if (verbose > 2 || errno != ESHUTDOWN) /* normal disconnect */
-    perror ("write");
-
-  fflush (stdout);
-  fflush (stderr);
-  pthread_cleanup_pop (1);
-
-  return 0;
-}
-
-static void *simple_ev_up_thread (void *param)
-{
-  int		status;
-  char		buf [USB_BUFSIZE];
-
-  usb_gadget *gadget = (usb_gadget *)param;
-  int verbose = gadget->verbosity;
-  char *name = gadget->ev_up.NAME;
-  status = ev_up_open (name);
-  if (status < 0)
-    return 0;
-  gadget->ev_up.fd = status;
-  /* synchronous reads of endless streams of data */
-  pthread_cleanup_push (close_fd, (void *)&(gadget->ev_up.fd));
-  do {
-    unsigned long	len;
-
-    /* original LinuxThreads cancelation didn't work right
-     * so test for it explicitly.
-     */
-    pthread_testcancel ();
-
-    len = fill_in_buf (buf, sizeof buf);
-    if (len > 0)
-      status = write (gadget->ev_up.fd, buf, len);
-    else
-      status = 0;
-
-  } while (status > 0);
-  if (status == 0) {
-    if (verbose)
-      fprintf (stderr, "done %s\n", __FUNCTION__);
-  } else if (verbose > 2 || errno != ESHUTDOWN) /* normal disconnect */
-    perror ("read");
-  fflush (stdout);
-  fflush (stderr);
-  pthread_cleanup_pop (1);
-
-  return 0;
-}
-
-static void *simple_ev_down_thread (void *param)
-{
-  int		status;
-  char		buf [USB_BUFSIZE];
-
-  usb_gadget *gadget = (usb_gadget *)param;
-  int verbose = gadget->verbosity;    
-  char *name = gadget->ev_down.NAME;
-  status = ev_down_open (name);
-  if (status < 0)
-    return 0;
-  gadget->ev_down.fd = status;
-  /* synchronous reads of endless streams of data */
-  pthread_cleanup_push (close_fd, (void *) &(gadget->ev_down.fd));
-  do {
-    /* original LinuxThreads cancelation didn't work right
-     * so test for it explicitly.
-     */
-    pthread_testcancel ();
-    errno = 0;
-    status = read (gadget->ev_down.fd, buf, sizeof buf);
-
-    if (status < 0)
-      break;
-    status = empty_out_buf (buf, status);
-  } while (status > 0);
-  if (status == 0) {
-    if (verbose)
-      fprintf (stderr, "done %s\n", __FUNCTION__);
-  } else if (verbose > 2 || errno != ESHUTDOWN) /* normal disconnect */
-    perror ("read");
-  fflush (stdout);
-  fflush (stderr);
-  pthread_cleanup_pop (1);
-
-  return 0;
-}
+#define stream2_open(name)						\
+  ep_config(name,__FUNCTION__, &fs_stream2_desc, &hs_stream2_desc)
+#define lane_open(name)						\
+  ep_config(name,__FUNCTION__, &fs_lane_desc, &hs_lane_desc)
+#define notify_open(name)						\
+  ep_config(name,__FUNCTION__, &fs_notify_desc, &hs_notify_desc)
 
 static void start_io (usb_gadget *gadget)
 {
@@ -440,7 +233,38 @@ static void start_io (usb_gadget *gadget)
     if (gadget->verbosity > GLEVEL1)
       printf("Down events file descriptor opened\n");
   gadget->ev_down.fd = status;
+
+  /* ***************************************/
+  status = stream2_open (gadget->stream2.NAME);
+  if (status < 0)
+    perror("second stream fd open");
+  else
+    if (gadget->verbosity > GLEVEL1)
+      printf("Second stream file descriptor opened\n");
+  gadget->stream2.fd = status;
+
+  /* ***************************************/
+  status = lane_open (gadget->lane.NAME);
+  if (status < 0)
+    perror("low latency fd open");
+  else
+    if (gadget->verbosity > GLEVEL1)
+      printf("Low latency file descriptor opened\n");
+  gadget->lane.fd = status;
+
+  /* ***************************************/
+  status = notify_open (gadget->notify.NAME);
+  if (status < 0)
+    perror("notifications fd open");
+  else
+    if (gadget->verbosity > GLEVEL1)
+      printf("Notifications file descriptor opened\n");
+  gadget->notify.fd = status;
+  pthread_mutex_lock (&gadget->link_lock);
   gadget->connected=1;
+  gadget->session++;
+  pthread_cond_broadcast (&gadget->link_cond);
+  pthread_mutex_unlock (&gadget->link_lock);
   /* ***************************************/
 
   /* give the other threads a chance to run before we report
@@ -455,8 +279,56 @@ static void start_io (usb_gadget *gadget)
     perror("sigmask");
 }
 
+static void unlock_link (void *param)
+{
+  pthread_mutex_unlock ((pthread_mutex_t *) param);
+}
+
+/* Registers a transfer on the endpoint files, so they aren't closed under
+ * it. Fails once the link is down */
+static int use_endpoints (usb_gadget *gadget)
+{
+  int connected;
+
+  pthread_mutex_lock (&gadget->link_lock);
+  connected = gadget->connected;
+  if (connected)
+    gadget->users++;
+  pthread_mutex_unlock (&gadget->link_lock);
+  return connected;
+}
+
+static void release_endpoints (void *param)
+{
+  usb_gadget *gadget = (usb_gadget *) param;
+
+  pthread_mutex_lock (&gadget->link_lock);
+  if (--gadget->users == 0)
+    pthread_cond_broadcast (&gadget->link_cond);
+  pthread_mutex_unlock (&gadget->link_lock);
+}
+
+/* Closes the endpoint files once the transfers using them are over. On a
+ * disconnection the controller fails the pending ones with ESHUTDOWN, on
+ * usb_gadget_free() the caller already stopped its threads */
 static void stop_io (usb_gadget *gadget)
 {
+  int connected;
+
+  /* The wait is a cancellation point, don't leave the lock taken */
+  pthread_mutex_lock (&gadget->link_lock);
+  pthread_cleanup_push (unlock_link, (void *) &gadget->link_lock);
+  connected = gadget->connected;
+  /* No new transfers from now on */
+  gadget->connected = 0;
+  pthread_cond_broadcast (&gadget->link_cond);
+  while (gadget->users > 0)
+    pthread_cond_wait (&gadget->link_cond, &gadget->link_lock);
+  pthread_cleanup_pop (1);
+
+  /* Already closed on a disconnection */
+  if (!connected)
+    return;
        
   /* ***************************************************/
   if (close (gadget->stream.fd) < 0)
@@ -488,7 +360,30 @@ static void stop_io (usb_gadget *gadget)
     if (gadget->verbosity > GLEVEL1)
       printf("Downstream events file descriptor closed\n");  
   /* ****************************************************/
-  gadget->connected=0;	
+
+  if (close (gadget->stream2.fd) < 0)
+    perror ("close");
+  else
+    if (gadget->verbosity > GLEVEL1)
+      printf("Second stream file descriptor closed\n");
+  /* ****************************************************/
+
+  if (close (gadget->lane.fd) < 0)
+    perror ("close");
+  else
+    if (gadget->verbosity > GLEVEL1)
+      printf("Low latency file descriptor closed\n");
+  /* ****************************************************/
+
+  if (close (gadget->notify.fd) < 0)
+    perror ("close");
+  else
+    if (gadget->verbosity > GLEVEL1)
+      printf("Notifications file descriptor closed\n");
+  /* ****************************************************/
+
+  gadget->stream.fd = gadget->ev_up.fd = gadget->ev_down.fd = -1;
+  gadget->stream2.fd = gadget->lane.fd = gadget->notify.fd = -1;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -538,6 +433,15 @@ static int init_device (usb_gadget *gadget)
   if (HIGHSPEED)
     cp = build_config (cp, hs_eps);
 
+  /* A serial lets the host tell the boards apart */
+  if (gadget->serial && gadget->serial[0])
+    {
+      strncpy (serial, gadget->serial, sizeof serial - 1);
+      device_desc.iSerialNumber = STRINGID_SERIAL;
+    }
+  else
+    device_desc.iSerialNumber = 0;
+
   /* and device descriptor at the end */
   memcpy (cp, &device_desc, sizeof device_desc);
   cp += sizeof device_desc;
@@ -555,6 +459,59 @@ static int init_device (usb_gadget *gadget)
   return fd;
 }
 
+/* Vendor requests are passed to the handler set by the user. Returns -1
+ * if the request has to be stalled */
+static int handle_vendor (usb_gadget *gadget, struct usb_ctrlrequest *setup)
+{
+  unsigned char *buf;
+  int status, fd = gadget->ep0.fd;
+  __u16 value, index, length;
+
+  value = __le16_to_cpu(setup->wValue);
+  index = __le16_to_cpu(setup->wIndex);
+  length = __le16_to_cpu(setup->wLength);
+
+  if (gadget->vendor_func == NULL || length > GAD_VENDOR_MAX)
+    return -1;
+
+  buf = malloc (length ? length : 1);
+  if (buf == NULL)
+    return -1;
+
+  if (setup->bRequestType & USB_DIR_IN)
+    {
+      status = gadget->vendor_func (gadget, setup->bRequest, value, index,
+				    buf, length, gadget->vendor_data);
+      if (status < 0)
+	{
+	  free (buf);
+	  return -1;
+	}
+      if (status > length)
+	status = length;
+      if (write (fd, buf, status) < 0)
+	{
+	  if (errno == EIDRM)
+	    fprintf (stderr, "vendor request timeout\n");
+	  else
+	    perror ("write vendor data");
+	}
+    }
+  else
+    {
+      /* Get the data stage, with no data this is just the ack */
+      status = read (fd, buf, length);
+      if (status < 0)
+	perror ("read vendor data");
+      else
+	gadget->vendor_func (gadget, setup->bRequest, value, index,
+			     buf, status, gadget->vendor_data);
+    }
+
+  free (buf);
+  return 0;
+}
+
 static void handle_control (usb_gadget *gadget, struct usb_ctrlrequest *setup)
 {
   int   status, tmp;
@@ -573,6 +530,13 @@ static void handle_control (usb_gadget *gadget, struct usb_ctrlrequest *setup)
             setup->bRequestType, setup->bRequest,
             value, index, length);
 
+  if ((setup->bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR)
+    {
+      if (handle_vendor (gadget, setup) < 0)
+	goto stall;
+      return;
+    }
+
   switch (setup->bRequest) 
     {	/* usb 2.0 spec ch9 requests */
     case USB_REQ_GET_DESCRIPTOR:
@@ -691,6 +655,21 @@ static void handle_control (usb_gadget *gadget, struct usb_ctrlrequest *setup)
 	  status = errno;
 	  perror ("reset down events fd");
 	}
+      if (ioctl (gadget->stream2.fd, GADGETFS_CLEAR_HALT) < 0) 
+	{
+	  status = errno;
+	  perror ("reset second stream fd");
+	}
+      if (ioctl (gadget->lane.fd, GADGETFS_CLEAR_HALT) < 0) 
+	{
+	  status = errno;
+	  perror ("reset low latency fd");
+	}
+      if (ioctl (gadget->notify.fd, GADGETFS_CLEAR_HALT) < 0) 
+	{
+	  status = errno;
+	  perror ("reset notifications fd");
+	}
       /* FIXME eventually reset the status endpoint too */
       if (status)
         goto stall;
@@ -844,14 +823,139 @@ static void *simple_ep0_thread (void *param)
 
 /*-------------------------------------------------------------------------*/
 
+/* Endpoint files only do blocking i/o, parallel transfers hand all but
+ * the first one to helper threads.
+ */
+typedef struct _gadget_worker
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  usb_gadget *gadget;
+
+  /* Transfer to run, NULL when idle */
+  usb_gadget_xfer *job;
+  int running;
+} gadget_worker;
+
+static void *worker_thread (void *param)
+{
+  gadget_worker *w = (gadget_worker *) param;
+  usb_gadget_xfer *job;
+
+  pthread_mutex_lock (&w->lock);
+  for (;;)
+    {
+      while (w->running && w->job == NULL)
+	pthread_cond_wait (&w->cond, &w->lock);
+      if (!w->running)
+	break;
+      job = w->job;
+      pthread_mutex_unlock (&w->lock);
+
+      job->status = usb_gadget_transfer (w->gadget, job->endp,
+					 job->buffer, job->length);
+
+      pthread_mutex_lock (&w->lock);
+      w->job = NULL;
+      pthread_cond_broadcast (&w->cond);
+    }
+  pthread_mutex_unlock (&w->lock);
+  return 0;
+}
+
+static gadget_worker *worker_new (usb_gadget *gadget)
+{
+  gadget_worker *w = calloc (1, sizeof (gadget_worker));
+
+  if (w == NULL)
+    return NULL;
+  pthread_mutex_init (&w->lock, NULL);
+  pthread_cond_init (&w->cond, NULL);
+  w->gadget = gadget;
+  w->running = 1;
+  if (pthread_create (&w->thread, NULL, worker_thread, w) != 0)
+    {
+      free (w);
+      return NULL;
+    }
+  usb_thread_setup (w->thread, "gadget-worker", gadget->sched);
+  return w;
+}
+
+static void worker_free (gadget_worker *w)
+{
+  pthread_mutex_lock (&w->lock);
+  w->running = 0;
+  pthread_cond_broadcast (&w->cond);
+  pthread_mutex_unlock (&w->lock);
+  pthread_join (w->thread, 0);
+  pthread_cond_destroy (&w->cond);
+  pthread_mutex_destroy (&w->lock);
+  free (w);
+}
+
+int usb_gadget_transfer_parallel (usb_gadget *gadget,
+				  usb_gadget_xfer *xfers,
+				  int n)
+{
+  gadget_worker *w;
+  int i, status = GAD_EOK;
+
+  if (n < 1 || n > GAD_MAX_PARALLEL)
+    return ERR_NO_DEVICE;
+
+  for (i = 1; i < n; i++)
+    {
+      if (gadget->workers[i - 1] == NULL)
+	gadget->workers[i - 1] = worker_new (gadget);
+      w = gadget->workers[i - 1];
+      if (w == NULL)
+	return ERR_THRD;
+      pthread_mutex_lock (&w->lock);
+      w->job = &xfers[i];
+      pthread_cond_broadcast (&w->cond);
+      pthread_mutex_unlock (&w->lock);
+    }
+
+  xfers[0].status = usb_gadget_transfer (gadget, xfers[0].endp,
+					 xfers[0].buffer, xfers[0].length);
+
+  for (i = 1; i < n; i++)
+    {
+      w = gadget->workers[i - 1];
+      pthread_mutex_lock (&w->lock);
+      while (w->job != NULL)
+	pthread_cond_wait (&w->cond, &w->lock);
+      pthread_mutex_unlock (&w->lock);
+    }
+
+  for (i = 0; i < n; i++)
+    if (xfers[i].status != GAD_EOK && status == GAD_EOK)
+      status = xfers[i].status;
+
+  return status;
+}
+
 GADGET_EXIT_CODE usb_gadget_new (usb_gadget *gadget, VERBOSITY v)
 {
   gadget->verbosity = v;
-  gadget->stream.func = simple_stream_thread;
-  gadget->ev_up.func = simple_ev_up_thread;
-  gadget->ev_down.func = simple_ev_down_thread;
   gadget->ep0.func = simple_ep0_thread;
   gadget->connected=0;
+  gadget->session=0;
+  gadget->users=0;
+  gadget->emu_outage=0;
+  pthread_mutex_init (&gadget->link_lock, NULL);
+  pthread_cond_init (&gadget->link_cond, NULL);
+  gadget->vendor_func = NULL;
+  gadget->vendor_data = NULL;
+  memset (gadget->workers, 0, sizeof gadget->workers);
+  gadget->emu = NULL;
+  gadget->capture = NULL;
+  gadget->replay = NULL;
+  gadget->loop = NULL;
+  gadget->busy_poll = 0;
+  gadget->stream.aio = gadget->stream2.aio = gadget->lane.aio = 0;
   
   if (chdir ("/dev/gadget") < 0)
     return ERR_GAD_DIR;
@@ -863,51 +967,604 @@ GADGET_EXIT_CODE usb_gadget_new (usb_gadget *gadget, VERBOSITY v)
   if (pthread_create (&(gadget->ep0.thread), NULL,
 		      (void *) gadget->ep0.func, (void *) gadget) != 0)
     return ERR_THRD;  
+  usb_thread_setup (gadget->ep0.thread, "gadget-ep0", gadget->sched);
 
   return GAD_EOK; 
 }
 
+GADGET_EXIT_CODE usb_gadget_replay_new (usb_gadget *gadget, const char *path,
+				       int realtime, VERBOSITY v)
+{
+  gadget->verbosity = v;
+  gadget->stream.fd = gadget->ev_up.fd = gadget->ev_down.fd = -1;
+  gadget->stream2.fd = gadget->lane.fd = gadget->notify.fd = -1;
+  gadget->ep0.fd = -1;
+  gadget->users = 0;
+  gadget->emu_outage = 0;
+  pthread_mutex_init (&gadget->link_lock, NULL);
+  pthread_cond_init (&gadget->link_cond, NULL);
+  gadget->vendor_func = NULL;
+  gadget->vendor_data = NULL;
+  memset (gadget->workers, 0, sizeof gadget->workers);
+  gadget->emu = NULL;
+  gadget->capture = NULL;
+  gadget->loop = NULL;
+  gadget->busy_poll = 0;
+  gadget->stream.aio = gadget->stream2.aio = gadget->lane.aio = 0;
+
+  gadget->replay = usb_capture_open (path, realtime);
+  if (gadget->replay == NULL)
+    {
+      pthread_cond_destroy (&gadget->link_cond);
+      pthread_mutex_destroy (&gadget->link_lock);
+      return ERR_OPEN_FD;
+    }
+
+  /* There's no host to wait for */
+  gadget->connected = 1;
+  gadget->session = 1;
+
+  return GAD_EOK;
+}
+
+/* Vendor requests of the host of a loop, passed as handle_vendor() does */
+static int loop_control (void *user_data, int in, unsigned char request,
+			 unsigned short value, unsigned short index,
+			 unsigned char *buffer, int length)
+{
+  usb_gadget *gadget = (usb_gadget *) user_data;
+  int status;
+
+  if (gadget->vendor_func == NULL || length > GAD_VENDOR_MAX)
+    return -1;
+
+  status = gadget->vendor_func (gadget, request, value, index, buffer,
+				length, gadget->vendor_data);
+  /* The data stage of an OUT request can't be stalled anymore */
+  return in ? status : length;
+}
+
+GADGET_EXIT_CODE usb_gadget_loop_new (usb_gadget *gadget, const char *name,
+				      VERBOSITY v)
+{
+  gadget->verbosity = v;
+  gadget->stream.fd = gadget->ev_up.fd = gadget->ev_down.fd = -1;
+  gadget->stream2.fd = gadget->lane.fd = gadget->notify.fd = -1;
+  gadget->ep0.fd = -1;
+  gadget->users = 0;
+  gadget->emu_outage = 0;
+  pthread_mutex_init (&gadget->link_lock, NULL);
+  pthread_cond_init (&gadget->link_cond, NULL);
+  gadget->vendor_func = NULL;
+  gadget->vendor_data = NULL;
+  memset (gadget->workers, 0, sizeof gadget->workers);
+  gadget->emu = NULL;
+  gadget->capture = NULL;
+  gadget->replay = NULL;
+  gadget->busy_poll = 0;
+  gadget->stream.aio = gadget->stream2.aio = gadget->lane.aio = 0;
+
+  gadget->loop = usb_loop_open (name);
+  if (gadget->loop == NULL ||
+      usb_loop_attach (gadget->loop, USB_LOOP_GADGET) != 0)
+    {
+      if (gadget->loop)
+	usb_loop_close (gadget->loop);
+      gadget->loop = NULL;
+      pthread_cond_destroy (&gadget->link_cond);
+      pthread_mutex_destroy (&gadget->link_lock);
+      return ERR_OPEN_FD;
+    }
+  usb_loop_set_control (gadget->loop, loop_control, gadget);
+
+  /* Plugged and configured as soon as it's created, the host finds it
+   * by name */
+  gadget->connected = 1;
+  gadget->session = 1;
+
+  return GAD_EOK;
+}
+
+static void aio_free (endpoint *ep);
+
 GADGET_EXIT_CODE usb_gadget_free (usb_gadget *gadget)
 {
-  /* Sub threads are canceled here */	
-  stop_io(gadget);
-  /* Cancel main events thread */
-  pthread_cancel (gadget->ep0.thread);
-  if (pthread_join (gadget->ep0.thread, 0) != 0)
-    return 	ERR_JN_THRD;
+  GADGET_EXIT_CODE ret = GAD_EOK;
+  int i;
+
+  /* Sub threads are canceled here, the ones waiting on a loop fail once
+   * it's unplugged */
+  if (gadget->loop)
+    usb_loop_detach (gadget->loop, USB_LOOP_GADGET);
+  else if (gadget->replay == NULL)
+    stop_io(gadget);
+  for (i = 0; i < GAD_MAX_PARALLEL - 1; i++)
+    if (gadget->workers[i] != NULL)
+      worker_free (gadget->workers[i]);
+  /* Cancel main events thread, a replay or a loop has none */
+  if (gadget->replay == NULL && gadget->loop == NULL)
+    {
+      pthread_cancel (gadget->ep0.thread);
+      if (pthread_join (gadget->ep0.thread, 0) != 0)
+	return 	ERR_JN_THRD;
+    }
+  pthread_cond_destroy (&gadget->link_cond);
+  pthread_mutex_destroy (&gadget->link_lock);
+  aio_free (&gadget->stream);
+  aio_free (&gadget->stream2);
+  aio_free (&gadget->lane);
+  if (gadget->emu)
+    {
+      link_emu_free (gadget->emu);
+      gadget->emu = NULL;
+    }
+  if (gadget->capture)
+    {
+      if (usb_capture_free (gadget->capture) < 0)
+	ret = ERR_CAPTURE;
+      gadget->capture = NULL;
+    }
+  if (gadget->replay)
+    {
+      usb_capture_free (gadget->replay);
+      gadget->replay = NULL;
+    }
+  if (gadget->loop)
+    {
+      usb_loop_close (gadget->loop);
+      gadget->loop = NULL;
+    }
+  return ret;
+}
+
+int usb_gadget_wait_session (usb_gadget *gadget, unsigned int session,
+			     unsigned int timeout)
+{
+  struct timespec ts;
+  int ret = GAD_EOK;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout / 1000;
+  ts.tv_nsec += (timeout % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+
+  /* The wait is a cancellation point, don't leave the lock taken */
+  pthread_mutex_lock (&gadget->link_lock);
+  pthread_cleanup_push (unlock_link, (void *) &gadget->link_lock);
+  while (!gadget->connected || gadget->session == session)
+    if (pthread_cond_timedwait (&gadget->link_cond, &gadget->link_lock,
+				&ts) == ETIMEDOUT)
+      {
+	ret = ERR_TIMEOUT_FD;
+	break;
+      }
+  pthread_cleanup_pop (1);
+
+  return ret;
+}
+
+void usb_gadget_set_vendor_handler (usb_gadget *gadget,
+				    usb_gadget_vendor_func func,
+				    void *user_data)
+{
+  gadget->vendor_data = user_data;
+  gadget->vendor_func = func;
+}
+
+/* gadgetfs endpoint files can't be polled, but a signal interrupts a
+ * blocked read and dequeues its request. Transfer timeouts arm a timer
+ * that sends this signal to the calling thread only. Each thread creates
+ * its timer on its first timeout and re-arms it from then on.
+ */
+#define GAD_TIMEOUT_SIGNAL (SIGRTMIN + 2)
+
+/* Older C libraries only have the union member */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static pthread_once_t timeout_signal_once = PTHREAD_ONCE_INIT;
+static pthread_key_t timeout_key;
+
+/* Timer of the calling thread, valid once timeout_timer_created */
+static __thread timer_t timeout_timer;
+static __thread int timeout_timer_created;
+
+static void timeout_signal_handler (int signo)
+{
+  /* Nothing to do, just make read() return EINTR */
+}
+
+/* Runs as a thread with a timer exits, param is its timeout_timer */
+static void timeout_timer_delete (void *param)
+{
+  timer_delete (*(timer_t *) param);
+}
+
+static void timeout_signal_install (void)
+{
+  struct sigaction sa;
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_handler = timeout_signal_handler;
+  sigemptyset (&sa.sa_mask);
+  /* No SA_RESTART, the interrupted read must not be restarted */
+  sa.sa_flags = 0;
+  if (sigaction (GAD_TIMEOUT_SIGNAL, &sa, NULL) < 0)
+    perror ("timeout sigaction");
+  pthread_key_create (&timeout_key, timeout_timer_delete);
+}
+
+static int set_timeout (unsigned int timeout)
+{
+  struct itimerspec its;
+
+  memset (&its, 0, sizeof its);
+  its.it_value.tv_sec = timeout / 1000;
+  its.it_value.tv_nsec = (timeout % 1000) * 1000000;
+  return timer_settime (timeout_timer, 0, &its, NULL);
+}
+
+/* Arms the timer that interrupts the blocking i/o of the calling thread */
+static int arm_timeout (unsigned int timeout)
+{
+  struct sigevent sev;
+
+  pthread_once (&timeout_signal_once, timeout_signal_install);
+
+  if (!timeout_timer_created)
+    {
+      memset (&sev, 0, sizeof sev);
+      sev.sigev_notify = SIGEV_THREAD_ID;
+      sev.sigev_signo = GAD_TIMEOUT_SIGNAL;
+      sev.sigev_notify_thread_id = syscall (SYS_gettid);
+      if (timer_create (CLOCK_MONOTONIC, &sev, &timeout_timer) < 0)
+	return ERR_THRD;
+      timeout_timer_created = 1;
+      pthread_setspecific (timeout_key, &timeout_timer);
+    }
+
+  if (set_timeout (timeout) < 0)
+    return ERR_THRD;
   return GAD_EOK;
 }
 
-int usb_gadget_transfer (usb_gadget *gadget, 
-			 GAD_EP_ADDRESS endp,
-                         unsigned char *buffer,
-			 int length){
-  int  status;
-  
-  int verbose = gadget->verbosity;
+/* Stops the timer of the calling thread before it fires */
+static void disarm_timeout (void)
+{
+  set_timeout (0);
+}
+
+static int gadget_transfer (usb_gadget *gadget, GAD_EP_ADDRESS endp,
+			    unsigned char *buffer, int length,
+			    unsigned int timeout);
+
+/* Busy polling is for the stream reads, the rest are seldom and small */
+static int busy_polled (usb_gadget *gadget, GAD_EP_ADDRESS endp)
+{
+  return gadget->busy_poll && gadget->replay == NULL &&
+    gadget->loop == NULL &&
+    (endp == GAD_STREAM_EP || endp == GAD_STREAM2_EP || endp == GAD_LANE_EP);
+}
+
+static long long now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* A read of a gadgetfs endpoint waits for the transfer in the kernel even
+ * with O_NONBLOCK, only its AIO returns right away. So the busy polled
+ * reads are submitted as AIO and their completion is polled without
+ * sleeping for the idle budget, then slept for up to the timeout. Errors
+ * look like the ones of read(), a timeout fails with EINTR as if the
+ * timer signal interrupted it */
+static int busy_read (usb_gadget *gadget, endpoint *ep,
+		      unsigned char *buffer, int length,
+		      unsigned int timeout)
+{
+  struct iocb cb, *cbs[1] = { &cb };
+  struct io_event event;
+  struct timespec ts, *wait = NULL;
+  long long start = now_us (), left;
+  int r, err = EINTR;
+
+  if (ep->aio == 0 && syscall (SYS_io_setup, 1, &ep->aio) < 0)
+    {
+      ep->aio = 0;
+      return -1;
+    }
+
+  memset (&cb, 0, sizeof cb);
+  cb.aio_fildes = ep->fd;
+  cb.aio_lio_opcode = IOCB_CMD_PREAD;
+  cb.aio_buf = (unsigned long) buffer;
+  cb.aio_nbytes = length;
+  if (syscall (SYS_io_submit, ep->aio, 1, cbs) != 1)
+    return -1;
+
+  ts.tv_sec = ts.tv_nsec = 0;
+  do
+    r = syscall (SYS_io_getevents, ep->aio, 1, 1, &event, &ts);
+  while (r == 0 && now_us () - start < gadget->busy_poll);
+
+  while (r == 0 || (r < 0 && errno == EINTR))
+    {
+      if (timeout)
+	{
+	  left = (long long) timeout * 1000 - (now_us () - start);
+	  if (left <= 0)
+	    break;
+	  ts.tv_sec = left / 1000000;
+	  ts.tv_nsec = (left % 1000000) * 1000;
+	  wait = &ts;
+	}
+      r = syscall (SYS_io_getevents, ep->aio, 1, 1, &event, wait);
+    }
+  if (r == 1)
+    {
+      if ((long long) event.res >= 0)
+	return event.res;
+      errno = (int) -event.res;
+      return -1;
+    }
+  if (r < 0)
+    err = errno;
+
+  /* Dequeue it. Older kernels hand the event back right away, newer ones
+   * post it like a completion, which it may have become meanwhile */
+  if (syscall (SYS_io_cancel, ep->aio, &cb, &event) == 0 ||
+      syscall (SYS_io_getevents, ep->aio, 1, 1, &event, NULL) == 1)
+    if ((long long) event.res >= 0)
+      return event.res;
+  errno = err;
+  return -1;
+}
+
+static void aio_free (endpoint *ep)
+{
+  if (ep->aio)
+    syscall (SYS_io_destroy, ep->aio);
+  ep->aio = 0;
+}
+
+int usb_gadget_transfer_timeout (usb_gadget *gadget,
+				 GAD_EP_ADDRESS endp,
+				 unsigned char *buffer,
+				 int length,
+				 unsigned int timeout)
+{
+  int status;
+
+  /* Busy polled reads keep their own time */
+  if (timeout == 0 || busy_polled (gadget, endp))
+    return gadget_transfer (gadget, endp, buffer, length, timeout);
+
+  if (arm_timeout (timeout) != GAD_EOK)
+    return ERR_THRD;
+
+  status = gadget_transfer (gadget, endp, buffer, length, timeout);
+  if (status != GAD_EOK && errno == EINTR)
+    status = ERR_TIMEOUT_FD;
+
+  disarm_timeout ();
+  return status;
+}
+
+/* Exit code of a failed endpoint i/o. gadgetfs fails the pending i/o
+ * with ESHUTDOWN when the host goes away, and the files are closed once
+ * ep0 hears of it */
+static int io_error (usb_gadget *gadget, int code)
+{
+  if (errno == ESHUTDOWN || (errno == EBADF && !gadget->connected))
+    return ERR_LINK_FD;
+  return code;
+}
+
+/* The emulated link went down. The host never noticed, so once the link
+ * is back the session is bumped here as if it configured the device
+ * again, once for each disconnection */
+static int emu_disconnected (usb_gadget *gadget, int writing)
+{
+  unsigned int outage = link_emu_wait_up (gadget->emu);
+
+  if (outage == 0)
+    {
+      /* The timeout went off first */
+      errno = EINTR;
+      return writing ? ERR_WRITE_FD : ERR_READ_FD;
+    }
+
+  pthread_mutex_lock (&gadget->link_lock);
+  if (gadget->emu_outage != outage)
+    {
+      gadget->emu_outage = outage;
+      gadget->session++;
+      pthread_cond_broadcast (&gadget->link_cond);
+    }
+  pthread_mutex_unlock (&gadget->link_lock);
+
+  errno = ESHUTDOWN;
+  return ERR_LINK_FD;
+}
+
+/* Address of each endpoint on a loop, the one of its descriptors */
+static const int loop_address[] = {
+  [GAD_STREAM_EP] = USB_DIR_OUT | 2,
+  [GAD_UP_EP] = USB_DIR_IN | 1,
+  [GAD_DOWN_EP] = USB_DIR_OUT | 1,
+  [GAD_STREAM2_EP] = USB_DIR_OUT | 3,
+  [GAD_LANE_EP] = USB_DIR_OUT | 4,
+  [GAD_NOTIFY_EP] = USB_DIR_IN | 5
+};
+
+/* Raw i/o on the file of an endpoint, the amount of bytes transferred or
+ * an error code. The timeout is already armed by the caller, it's only
+ * needed by a replay or a loop, whose waits aren't interrupted by the
+ * signal */
+static int endpoint_do_io (usb_gadget *gadget,
+			   GAD_EP_ADDRESS endp,
+			   unsigned char *buffer,
+			   int length,
+			   unsigned int timeout)
+{
+  int  status, fd, writing = 0;
+  endpoint *ep = NULL;
   
-  errno = 0;
   switch (endp)
     {
     case GAD_STREAM_EP:
-      status = read (gadget->stream.fd, buffer, length);
-      if (status < 0)
-        return ERR_READ_FD;
+      ep = &gadget->stream;
+      fd = gadget->stream.fd;
       break;
     case GAD_DOWN_EP:
-      status = read (gadget->ev_down.fd, buffer, length);
-      if (status < 0)
-        return ERR_READ_FD;
+      fd = gadget->ev_down.fd;
       break; 
+    case GAD_STREAM2_EP:
+      ep = &gadget->stream2;
+      fd = gadget->stream2.fd;
+      break;
+    case GAD_LANE_EP:
+      ep = &gadget->lane;
+      fd = gadget->lane.fd;
+      break;
     case GAD_UP_EP:
-      status = write (gadget->ev_up.fd, buffer, length);
-      if (status < 0)
-        return ERR_WRITE_FD;
+      fd = gadget->ev_up.fd;
+      writing = 1;
       break;      
+    case GAD_NOTIFY_EP:
+      fd = gadget->notify.fd;
+      writing = 1;
+      break;
     default:
       return ERR_NO_DEVICE;  	  
     }	  	
 
+  errno = 0;
+  /* Only writes can be cut short, the host decides the length of reads.
+   * The errors look like the ones of the real endpoint files */
+  if (gadget->emu)
+    switch (link_emu_begin (gadget->emu, endp, writing ? &length : NULL, 0))
+      {
+      case LINK_EMU_TIMEOUT:
+	errno = EINTR;
+	return writing ? ERR_WRITE_FD : ERR_READ_FD;
+      case LINK_EMU_DISCONNECT:
+	return emu_disconnected (gadget, writing);
+      default:
+	break;
+      }
+
+  if (gadget->replay)
+    {
+      /* What the src sends goes nowhere */
+      status = writing ? length : usb_capture_read (gadget->replay, endp,
+						    buffer, length, timeout);
+      if (status == USB_CAPTURE_TIMEOUT)
+	{
+	  errno = EINTR;
+	  return ERR_READ_FD;
+	}
+      if (status == USB_CAPTURE_END)
+	return ERR_END_FD;
+    }
+  else if (gadget->loop)
+    {
+      status = writing ?
+	usb_loop_write (gadget->loop, USB_LOOP_GADGET, loop_address[endp],
+			buffer, length, timeout) :
+	usb_loop_read (gadget->loop, USB_LOOP_GADGET, loop_address[endp],
+		       buffer, length, timeout);
+      if (status == USB_LOOP_TIMEOUT)
+	{
+	  errno = EINTR;
+	  return writing ? ERR_WRITE_FD : ERR_READ_FD;
+	}
+      /* Only once the gadget itself was unplugged */
+      if (status < 0)
+	{
+	  errno = ESHUTDOWN;
+	  return ERR_LINK_FD;
+	}
+    }
+  else if (writing)
+    {
+      status = write (fd, buffer, length);
+      if (status < 0)
+        return io_error (gadget, ERR_WRITE_FD);
+    }
+  else if (busy_polled (gadget, endp))
+    {
+      status = busy_read (gadget, ep, buffer, length, timeout);
+      if (status < 0)
+        return io_error (gadget, ERR_READ_FD);
+    }
+  else
+    {
+      status = read (fd, buffer, length);
+      if (status < 0)
+        return io_error (gadget, ERR_READ_FD);
+    }
+
+  if (gadget->emu)
+    link_emu_end (gadget->emu, endp, status);
+  if (gadget->capture)
+    usb_capture_record (gadget->capture, endp, writing, buffer, status);
+
+  return status;
+}
+
+static int endpoint_io (usb_gadget *gadget,
+			GAD_EP_ADDRESS endp,
+			unsigned char *buffer,
+			int length,
+			unsigned int timeout)
+{
+  int status;
+
+  /* A replay or a loop has no files */
+  if (gadget->replay || gadget->loop)
+    return endpoint_do_io (gadget, endp, buffer, length, timeout);
+
+  if (!use_endpoints (gadget))
+    {
+      errno = ESHUTDOWN;
+      return ERR_LINK_FD;
+    }
+  /* Reads are cancellation points */
+  pthread_cleanup_push (release_endpoints, (void *) gadget);
+  status = endpoint_do_io (gadget, endp, buffer, length, timeout);
+  pthread_cleanup_pop (1);
+
+  return status;
+}
+
+int usb_gadget_transfer (usb_gadget *gadget, 
+			 GAD_EP_ADDRESS endp,
+                         unsigned char *buffer,
+			 int length){
+  return gadget_transfer (gadget, endp, buffer, length, 0);
+}
+
+static int gadget_transfer (usb_gadget *gadget,
+			    GAD_EP_ADDRESS endp,
+			    unsigned char *buffer,
+			    int length,
+			    unsigned int timeout){
+  int  status;
+  
+  int verbose = gadget->verbosity;
+  
+  status = endpoint_io (gadget, endp, buffer, length, timeout);
+  if (status < 0)
+    return status;
+
   if (status == 0) 
     {
       if (verbose)
@@ -919,3 +1576,30 @@ int usb_gadget_transfer (usb_gadget *gadget,
   /* Is it better to return the amount of bytes read? */
   return GAD_EOK;
 }
+
+int usb_gadget_read (usb_gadget *gadget,
+		     GAD_EP_ADDRESS endp,
+		     unsigned char *buffer,
+		     int length,
+		     unsigned int timeout,
+		     int *transferred)
+{
+  int status, armed;
+
+  /* Busy polled reads keep their own time */
+  armed = timeout != 0 && !busy_polled (gadget, endp);
+  if (armed && arm_timeout (timeout) != GAD_EOK)
+    return ERR_THRD;
+
+  status = endpoint_io (gadget, endp, buffer, length, timeout);
+  if (status < 0 && errno == EINTR)
+    status = ERR_TIMEOUT_FD;
+
+  if (armed)
+    disarm_timeout ();
+  if (status < 0)
+    return status;
+
+  *transferred = status;
+  return GAD_EOK;
+}
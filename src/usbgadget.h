@@ -13,7 +13,17 @@ typedef enum _GAD_EP_ADDRESS
   GAD_UP_EP,
   
   /** Downstream events */
-  GAD_DOWN_EP
+  GAD_DOWN_EP,
+
+  /** Second streaming endpoint, used for striped payloads */
+  GAD_STREAM2_EP,
+
+  /** Low latency endpoint, small buffers that can't wait behind the
+   * stream */
+  GAD_LANE_EP,
+
+  /** Interrupt endpoint for upstream notifications */
+  GAD_NOTIFY_EP
   	
 } GAD_EP_ADDRESS;	  
 
@@ -68,6 +78,19 @@ typedef enum _GADGET_EXIT_CODE
   
   /** No device to configure */
   ERR_NO_DEVICE = -10,
+
+  /** Transfer didn't start before the timeout */
+  ERR_TIMEOUT_FD = -11,
+
+  /** Replay reached the end of the capture */
+  ERR_END_FD = -12,
+
+  /** Recorded capture couldn't be trimmed when closed */
+  ERR_CAPTURE = -13,
+
+  /** The host went away, the endpoint is gone until it configures the
+   * device again */
+  ERR_LINK_FD = -14,
   	
 } GADGET_EXIT_CODE;
 
@@ -87,9 +110,53 @@ typedef struct _endpoint
 	
 	/** Endpoint related function */
 	void *(*func) (void *);
+
+	/** AIO context of the busy polled reads, 0 until the first one */
+	unsigned long aio;
 	
 } endpoint;
 
+/**
+ * One of several transfers running at the same time
+ */
+typedef struct _usb_gadget_xfer
+{
+  /** Endpoint to read from or write to */
+  GAD_EP_ADDRESS endp;
+
+  /** Buffer to store or take the data */
+  unsigned char *buffer;
+
+  /** Length in bytes of the transfer */
+  int length;
+
+  /** Exit code of the transfer */
+  int status;
+
+} usb_gadget_xfer;
+
+/** Maximum amount of transfers run by usb_gadget_transfer_parallel() */
+#define GAD_MAX_PARALLEL 4
+
+/** Largest data stage accepted for a vendor control request */
+#define GAD_VENDOR_MAX 4096
+
+struct _usb_gadget;
+
+/**
+ * Handler of the vendor control requests received on ep0. For IN requests
+ * it fills the buffer and returns the length of the reply, for OUT ones
+ * it gets the data stage in the buffer. A negative return stalls the
+ * request.
+ */
+typedef int (*usb_gadget_vendor_func) (struct _usb_gadget *gadget,
+                                       unsigned char request,
+                                       unsigned short value,
+                                       unsigned short index,
+                                       unsigned char *buffer,
+                                       int length,
+                                       void *user_data);
+
 /**
  * Gadget struct
  */
@@ -106,15 +173,77 @@ typedef struct _usb_gadget
   
   /** Upstream events structure */
   endpoint ev_up;
+
+  /** Second streaming endpoint structure */
+  endpoint stream2;
+
+  /** Low latency endpoint structure */
+  endpoint lane;
+
+  /** Notifications endpoint structure */
+  endpoint notify;
+
+  /** Handler of vendor control requests, they are stalled if NULL */
+  usb_gadget_vendor_func vendor_func;
+  void *vendor_data;
+
+  /** Helper threads for parallel transfers, created on first use */
+  struct _gadget_worker *workers[GAD_MAX_PARALLEL - 1];
   
   /** Device name */
   char *DEVNAME;
   
   /** Flag indicating connection status */
   int connected;
+
+  /** Incremented each time the host configures the device */
+  unsigned int session;
+
+  /** Transfers running on the endpoint files, which aren't closed until
+   * they are over */
+  int users;
+
+  /** Last disconnection of the emulated link the session was bumped
+   * for, 0 for none */
+  unsigned int emu_outage;
+
+  /** Guards connected, session, users and emu_outage, signaled when
+   * they change */
+  pthread_mutex_t link_lock;
+  pthread_cond_t link_cond;
   
   /** Level of verbosity of the execution */
   VERBOSITY verbosity;
+
+  /** Emulated link the endpoint transfers go through, NULL for the real
+   * one. Set after usb_gadget_new(), usb_gadget_free() releases it */
+  struct _link_emu *emu;
+
+  /** Capture the endpoint transfers are recorded to, NULL if they
+   * aren't. Set after usb_gadget_new(), usb_gadget_free() closes it */
+  struct _usb_capture *capture;
+
+  /** Capture served instead of the endpoints by a gadget created with
+   * usb_gadget_replay_new(), NULL for a real one */
+  struct _usb_capture *replay;
+
+  /** Loop to a host of this process served instead of the endpoints by a
+   * gadget created with usb_gadget_loop_new(), NULL for a real one */
+  struct _usb_loop *loop;
+
+  /** Scheduling of the threads the gadget creates, NULL for the default.
+   * Set before usb_gadget_new(), which leaves it alone */
+  const struct _usb_thread_sched *sched;
+
+  /** Microseconds a read of a stream endpoint spins waiting for its
+   * completion before sleeping for it, 0 to always sleep. Set after
+   * usb_gadget_new() */
+  unsigned int busy_poll;
+
+  /** Serial number the device reports, so the host can tell it from
+   * other boards, NULL for none. Set before usb_gadget_new(), which
+   * leaves it alone */
+  const char *serial;
   
 } usb_gadget;
 
@@ -126,10 +255,111 @@ typedef struct _usb_gadget
   */
 extern GADGET_EXIT_CODE usb_gadget_new(usb_gadget *gadget, VERBOSITY v);
 
+/**
+  * \brief Creates a gadget with no device behind, its reads are served
+  * from a capture and its writes are discarded. It is connected right
+  * away and reads fail with #ERR_END_FD once the capture is over.
+  * \param gadget Object to create.
+  * \param path Capture to replay, recorded through the capture field.
+  * \param realtime Non zero to serve the transfers with their original
+  * timing, zero to serve them as fast as they are read.
+  * \param v Verbosity level of the context. See #_VERBOSE.
+  * \return #GAD_EOK or #ERR_OPEN_FD if the capture can't be opened.
+  */
+extern GADGET_EXIT_CODE usb_gadget_replay_new (usb_gadget *gadget,
+                                               const char *path,
+                                               int realtime,
+                                               VERBOSITY v);
+
+/**
+  * \brief Creates a gadget with no device behind, plugged in the loop of
+  * that name for a host of this process to open, see usbloop.h. It is
+  * connected right away, its writes are queued until the host reads them.
+  * \param gadget Object to create.
+  * \param name Name of the loop, the one of the loop field of the
+  * selection of the host.
+  * \param v Verbosity level of the context. See #_VERBOSE.
+  * \return #GAD_EOK or #ERR_OPEN_FD if another gadget is plugged in the
+  * loop.
+  */
+extern GADGET_EXIT_CODE usb_gadget_loop_new (usb_gadget *gadget,
+                                             const char *name,
+                                             VERBOSITY v);
+
 extern GADGET_EXIT_CODE usb_gadget_free(usb_gadget *gadget);
 
+/**
+  * \brief Sets the handler of vendor control requests on ep0, which runs
+  * in the ep0 thread, or in the one of the host for a loop.
+  * \param gadget Object to set the handler on.
+  * \param func Handler, NULL stalls every vendor request.
+  * \param user_data Data passed to the handler.
+  */
+extern void usb_gadget_set_vendor_handler (usb_gadget *gadget,
+                                           usb_gadget_vendor_func func,
+                                           void *user_data);
+
+/**
+  * \brief Waits for the host to configure the device again, for instance
+  * after the cable was unplugged.
+  * \param gadget Object to wait on.
+  * \param session Value of the session field when the link was lost.
+  * \param timeout Time in milliseconds to give up.
+  * \return #GAD_EOK once connected in a newer session or #ERR_TIMEOUT_FD.
+  */
+extern int usb_gadget_wait_session (usb_gadget *gadget,
+                                    unsigned int session,
+                                    unsigned int timeout);
+
 extern int usb_gadget_transfer (usb_gadget *gadget,
                                 GAD_EP_ADDRESS endp, 
                                 unsigned char *buffer, 
 								int length);
+
+/**
+  * \brief Runs several transfers concurrently, for instance one per
+  * endpoint. Returns once all of them finished.
+  * \param gadget Object with the endpoints opened.
+  * \param xfers Transfers to run, status is filled for each of them.
+  * \param n Number of transfers, up to #GAD_MAX_PARALLEL.
+  * \return #GAD_EOK or the first error code found.
+  */
+extern int usb_gadget_transfer_parallel (usb_gadget *gadget,
+                                         usb_gadget_xfer *xfers,
+                                         int n);
+
+/**
+  * \brief Transfer that gives up if nothing arrived after a timeout.
+  * \param gadget Object with the endpoints opened.
+  * \param endp Endpoint to read from or write to.
+  * \param buffer Buffer to store or take the data.
+  * \param length Length in bytes of the transfer.
+  * \param timeout Time in milliseconds to give up, 0 waits forever.
+  * \return #GAD_EOK, #ERR_TIMEOUT_FD if the timeout expired or other
+  * error code.
+  */
+extern int usb_gadget_transfer_timeout (usb_gadget *gadget,
+                                        GAD_EP_ADDRESS endp,
+                                        unsigned char *buffer,
+                                        int length,
+                                        unsigned int timeout);
+
+/**
+  * \brief Reads whatever the host sent in one transfer, up to length
+  * bytes. Unlike usb_gadget_transfer() a short read is not an error.
+  * \param gadget Object with the endpoints opened.
+  * \param endp Endpoint to read from.
+  * \param buffer Buffer to store the data.
+  * \param length Size of the buffer.
+  * \param timeout Time in milliseconds to give up, 0 waits forever.
+  * \param transferred Where to store the amount of bytes read.
+  * \return #GAD_EOK, #ERR_TIMEOUT_FD if the timeout expired or other
+  * error code.
+  */
+extern int usb_gadget_read (usb_gadget *gadget,
+                            GAD_EP_ADDRESS endp,
+                            unsigned char *buffer,
+                            int length,
+                            unsigned int timeout,
+                            int *transferred);
 #endif /* __DRIVER_H__ */
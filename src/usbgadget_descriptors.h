@@ -21,7 +21,7 @@
 
 #define	STRINGID_MFGR		1
 #define	STRINGID_PRODUCT	2
-#define	STRINGID_SERIAL		0 //No serial id in this version
+#define	STRINGID_SERIAL		3 //Only reported if the gadget has one
 #define	STRINGID_CONFIG		4
 #define	STRINGID_INTERFACE	5
 
@@ -39,7 +39,7 @@ device_desc = {
   .idProduct =		__constant_cpu_to_le16 (DRIVER_PRODUCT_NUM),
   .iManufacturer =	STRINGID_MFGR,
   .iProduct =		STRINGID_PRODUCT,
-  .iSerialNumber =	STRINGID_SERIAL,
+  .iSerialNumber =	0,
   .bNumConfigurations =	1,
 };
 
@@ -84,6 +84,38 @@ fs_stream_desc = {
   .wMaxPacketSize =	__constant_cpu_to_le16 (64),
 };
 
+/* Second stream endpoint, striped payloads use both at once */
+static struct usb_endpoint_descriptor
+fs_stream2_desc = {
+  .bLength =		USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType =	USB_DT_ENDPOINT,
+
+  .bmAttributes =		USB_ENDPOINT_XFER_BULK,
+  .wMaxPacketSize =	__constant_cpu_to_le16 (64),
+};
+
+/* Low latency lane, small buffers don't queue behind the stream */
+static struct usb_endpoint_descriptor
+fs_lane_desc = {
+  .bLength =		USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType =	USB_DT_ENDPOINT,
+
+  .bmAttributes =		USB_ENDPOINT_XFER_BULK,
+  .wMaxPacketSize =	__constant_cpu_to_le16 (64),
+};
+
+/* Notifications go on an interrupt endpoint, the host controller polls it
+ * every frame no matter how busy the bulk endpoints are */
+static struct usb_endpoint_descriptor
+fs_notify_desc = {
+  .bLength =		USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType =	USB_DT_ENDPOINT,
+
+  .bmAttributes =		USB_ENDPOINT_XFER_INT,
+  .wMaxPacketSize =	__constant_cpu_to_le16 (8),
+  .bInterval =		1, //poll every frame
+};
+
 static struct usb_endpoint_descriptor
 fs_evup_desc = {
   .bLength =		USB_DT_ENDPOINT_SIZE,
@@ -103,10 +135,13 @@ fs_evdown_desc = {
 };
 
 
-static const struct usb_endpoint_descriptor *fs_eps [3] = {
+static const struct usb_endpoint_descriptor *fs_eps [] = {
   &fs_stream_desc,
   &fs_evup_desc,
   &fs_evdown_desc,
+  &fs_stream2_desc,
+  &fs_lane_desc,
+  &fs_notify_desc,
 };
 
 
@@ -125,6 +160,36 @@ hs_stream_desc = {
   .bInterval =		1, //send one NAK every microframe
 };
 
+static struct usb_endpoint_descriptor
+hs_stream2_desc = {
+  .bLength =		USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType =	USB_DT_ENDPOINT,
+
+  .bmAttributes =		USB_ENDPOINT_XFER_BULK,
+  .wMaxPacketSize =	__constant_cpu_to_le16 (512),
+  .bInterval =		1, //send one NAK every microframe
+};
+
+static struct usb_endpoint_descriptor
+hs_lane_desc = {
+  .bLength =		USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType =	USB_DT_ENDPOINT,
+
+  .bmAttributes =		USB_ENDPOINT_XFER_BULK,
+  .wMaxPacketSize =	__constant_cpu_to_le16 (512),
+  .bInterval =		1, //send one NAK every microframe
+};
+
+static struct usb_endpoint_descriptor
+hs_notify_desc = {
+  .bLength =		USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType =	USB_DT_ENDPOINT,
+
+  .bmAttributes =		USB_ENDPOINT_XFER_INT,
+  .wMaxPacketSize =	__constant_cpu_to_le16 (8),
+  .bInterval =		1, //poll every microframe
+};
+
 static struct usb_endpoint_descriptor
 hs_evup_desc = {
   .bLength =		USB_DT_ENDPOINT_SIZE,
@@ -149,6 +214,9 @@ static const struct usb_endpoint_descriptor *hs_eps [] = {
   &hs_stream_desc,
   &hs_evup_desc,
   &hs_evdown_desc,
+  &hs_stream2_desc,
+  &hs_lane_desc,
+  &hs_notify_desc,
 };
 
 
@@ -20,34 +20,443 @@
  */
 
 
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
 #include "usbhost.h"
+#include "linkemu.h"
+#include "usbloop.h"
+#include "usbthread.h"
 
-HOST_EXIT_CODE usb_host_new(usb_host *host, VERBOSE v)
+/* Every host of the process shares one libusb context, and one thread
+ * handles its events for all of them. The rest only wait for their
+ * transfers, so many devices don't mean many contexts, bus scans and
+ * threads polling them */
+static pthread_mutex_t usb_host_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static libusb_context *usb_host_shared_ctx = NULL;
+static int usb_host_shared_refs = 0;
+static pthread_t usb_host_events;
+static int usb_host_events_stop;
+
+/* How often the events thread checks if it has to stop, in ms */
+#define USB_HOST_EVENTS_TIMEOUT 100
+
+static void *usb_host_events_thread (void *param)
+{
+  struct timeval tv;
+
+  while (!usb_host_events_stop)
+  {
+    tv.tv_sec = USB_HOST_EVENTS_TIMEOUT / 1000;
+    tv.tv_usec = (USB_HOST_EVENTS_TIMEOUT % 1000) * 1000;
+    libusb_handle_events_timeout_completed (usb_host_shared_ctx, &tv,
+                                            &usb_host_events_stop);
+  }
+  return NULL;
+}
+
+/* Takes a reference to the shared context, created by the first host */
+static libusb_context *usb_host_shared_ref (VERBOSE v)
+{
+  libusb_context *ctx;
+
+  pthread_mutex_lock (&usb_host_shared_lock);
+  if (usb_host_shared_refs == 0)
+  {
+    if (libusb_init (&usb_host_shared_ctx) != 0)
+    {
+      pthread_mutex_unlock (&usb_host_shared_lock);
+      return NULL;
+    }
+    libusb_set_debug (usb_host_shared_ctx, v); /* Set level of verbosity */
+    usb_host_events_stop = 0;
+    if (pthread_create (&usb_host_events, NULL, usb_host_events_thread,
+                        NULL) != 0)
+    {
+      libusb_exit (usb_host_shared_ctx);
+      usb_host_shared_ctx = NULL;
+      pthread_mutex_unlock (&usb_host_shared_lock);
+      return NULL;
+    }
+    usb_thread_setup (usb_host_events, "usbhost-events", NULL);
+  }
+  usb_host_shared_refs++;
+  ctx = usb_host_shared_ctx;
+  pthread_mutex_unlock (&usb_host_shared_lock);
+
+  return ctx;
+}
+
+/* The last host gone stops the events thread and closes the context */
+static void usb_host_shared_unref (void)
 {
-  if (libusb_init ( &(host->ctx) ) == 1)  /* 0 on success LIBUSB_ERROR on error */
+  pthread_mutex_lock (&usb_host_shared_lock);
+  if (--usb_host_shared_refs == 0)
   {
+    usb_host_events_stop = 1;
+    pthread_join (usb_host_events, NULL);
+    libusb_exit (usb_host_shared_ctx);
+    usb_host_shared_ctx = NULL;
+  }
+  pthread_mutex_unlock (&usb_host_shared_lock);
+}
+
+HOST_EXIT_CODE usb_host_new(usb_host *host, VERBOSE v)
+{
+  host->ctx = usb_host_shared_ref (v);
+  if (host->ctx == NULL)
     return ERR_INIT;
-  }	
-  libusb_set_debug (host->ctx, v); /* Set level of verbosity */
+  host->private_ctx = 0;
+  host->verbose = v;
   host->connected = 0;
+  host->devh = NULL;
+  host->notify = NULL;
+  host->emu = NULL;
+  host->emu_down = 0;
+  host->busy_poll = 0;
+  host->loop = NULL;
+  host->loop_notify = 0;
+  pthread_mutex_init (&host->notify_lock, NULL);
+  pthread_cond_init (&host->notify_cond, NULL);
   
   return EOK;
 }
 
+HOST_EXIT_CODE usb_host_set_busy_poll(usb_host *host, unsigned int busy_poll)
+{
+  libusb_context *ctx;
+
+  if (host->devh != NULL)
+    return ERR_OPEN;
+
+  if (busy_poll > 0 && !host->private_ctx)
+  {
+    if (libusb_init (&ctx) != 0)
+      return ERR_INIT;
+    libusb_set_debug (ctx, host->verbose);
+    usb_host_shared_unref ();
+    host->ctx = ctx;
+    host->private_ctx = 1;
+  }
+  else if (busy_poll == 0 && host->private_ctx)
+  {
+    ctx = usb_host_shared_ref (host->verbose);
+    if (ctx == NULL)
+      return ERR_INIT;
+    libusb_exit (host->ctx);
+    host->ctx = ctx;
+    host->private_ctx = 0;
+  }
+  host->busy_poll = busy_poll;
+
+  return EOK;
+}
+
+int usb_host_match_parse(usb_host_match *match, const char *selector)
+{
+  const char *p = selector, *end, *value;
+  char *stop;
+  size_t len;
+  long n;
+
+  memset (match, 0, sizeof *match);
+  if (selector == NULL || *selector == '\0' || strcmp (selector, "any") == 0)
+    return 1;
+
+  while (*p != '\0')
+  {
+    end = strchr (p, ',');
+    if (end == NULL)
+      end = p + strlen (p);
+    value = memchr (p, '=', end - p);
+    if (value == NULL || ++value == end)
+      return 0;
+    len = end - value;
+
+    if (strncmp (p, "bus=", 4) == 0)
+    {
+      n = strtol (value, &stop, 10);
+      if (stop != end || n < 1 || n > 255)
+        return 0;
+      match->bus = n;
+    }
+    else if (strncmp (p, "port=", 5) == 0)
+    {
+      for (match->n_ports = 0; value < end; value = stop + 1)
+      {
+        n = strtol (value, &stop, 10);
+        if (stop == value || n < 1 || n > 255 ||
+            match->n_ports == USB_HOST_MAX_PORTS ||
+            (stop != end && (*stop != '.' || stop + 1 == end)))
+          return 0;
+        match->ports[match->n_ports++] = n;
+        if (stop == end)
+          break;
+      }
+    }
+    else if (strncmp (p, "serial=", 7) == 0)
+    {
+      if (len >= USB_HOST_SERIAL_SIZE)
+        return 0;
+      memcpy (match->serial, value, len);
+      match->serial[len] = '\0';
+    }
+    else if (strncmp (p, "loop=", 5) == 0)
+    {
+      if (len >= USB_HOST_LOOP_SIZE)
+        return 0;
+      memcpy (match->loop, value, len);
+      match->loop[len] = '\0';
+    }
+    else
+      return 0;
+
+    p = *end == ',' ? end + 1 : end;
+  }
+
+  return 1;
+}
+
+/* Non zero if the device is at the bus and ports of the selection */
+static int usb_host_match_location(libusb_device *dev,
+                                   const usb_host_match *match)
+{
+  uint8_t ports[USB_HOST_MAX_PORTS];
+  int n_ports;
+
+  if (match->bus && libusb_get_bus_number (dev) != match->bus)
+    return 0;
+  if (match->n_ports)
+  {
+    n_ports = libusb_get_port_numbers (dev, ports, USB_HOST_MAX_PORTS);
+    if (n_ports != match->n_ports ||
+        memcmp (ports, match->ports, n_ports) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/* Non zero if the opened device has the serial of the selection */
+static int usb_host_match_serial(libusb_device_handle *devh,
+                                 const struct libusb_device_descriptor *desc,
+                                 const usb_host_match *match)
+{
+  unsigned char serial[USB_HOST_SERIAL_SIZE];
+
+  if (match->serial[0] == '\0')
+    return 1;
+  return desc->iSerialNumber != 0 &&
+    libusb_get_string_descriptor_ascii (devh, desc->iSerialNumber, serial,
+                                        sizeof serial) >= 0 &&
+    strcmp ((char *) serial, match->serial) == 0;
+}
+
+/* Only the emulated link went down, the device is still configured */
+static void usb_host_emu_reopen(usb_host *host)
+{
+  if (host->emu && host->emu_down)
+  {
+    while (link_emu_wait_up (host->emu) == 0);
+    host->emu_down = 0;
+    host->connected = 1;
+  }
+}
+
+/* Plugs the host in the loop of a gadget of this process */
+static HOST_EXIT_CODE usb_host_loop_open(usb_host *host, const char *name)
+{
+  int r;
+
+  host->loop = usb_loop_open (name);
+  if (host->loop == NULL)
+    return ERR_OPEN;
+
+  r = usb_loop_attach (host->loop, USB_LOOP_HOST);
+  if (r != 0)
+  {
+    usb_loop_close (host->loop);
+    host->loop = NULL;
+    return r == USB_LOOP_BUSY ? ERR_INTERFACE : ERR_FOUND;
+  }
+
+  usb_host_emu_reopen (host);
+  return EOK;
+}
+
+HOST_EXIT_CODE usb_host_device_open_match(usb_host *host,
+                                          uint16_t vendor_id,
+                                          uint16_t product_id,
+                                          const usb_host_match *match)
+{
+  struct libusb_device_descriptor desc;
+  libusb_device **list;
+  HOST_EXIT_CODE ret = ERR_FOUND;
+  ssize_t n, i;
+
+  /* There's no bus to scan for a gadget of this process */
+  if (match && match->loop[0] != '\0')
+    return usb_host_loop_open (host, match->loop);
+
+  n = libusb_get_device_list (host->ctx, &list);
+  if (n < 0)
+    return ERR_FOUND;
+
+  for (i = 0; i < n && ret != EOK; i++)
+  {
+    if (libusb_get_device_descriptor (list[i], &desc) != 0 ||
+        desc.idVendor != vendor_id || desc.idProduct != product_id ||
+        (match && !usb_host_match_location (list[i], match)))
+      continue;
+
+    if (libusb_open (list[i], &(host->devh)) != 0)
+    {
+      host->devh = NULL;
+      ret = ERR_OPEN;
+      continue;
+    }
+    if (match && !usb_host_match_serial (host->devh, &desc, match))
+    {
+      libusb_close (host->devh);
+      host->devh = NULL;
+      continue;
+    }
+    /* Claimed by another host, the next one may be free */
+    if (libusb_claim_interface (host->devh, 0) != 0)
+    {
+      libusb_close (host->devh);
+      host->devh = NULL;
+      ret = ERR_INTERFACE;
+      continue;
+    }
+    ret = EOK;
+  }
+  libusb_free_device_list (list, 1);
+
+  if (ret == EOK)
+    usb_host_emu_reopen (host);
+
+  return ret;
+}
+
 HOST_EXIT_CODE usb_host_device_open(usb_host *host, uint16_t vendor_id,
 						uint16_t product_id)
 {
-	
-  host->devh = libusb_open_device_with_vid_pid(host->ctx,
-                                               vendor_id,
-                                               product_id);
-  if (host->devh == NULL)
-    return ERR_OPEN;			
-  
-  if (libusb_claim_interface (host->devh,0) != 0)
-    return ERR_INTERFACE; 	
-  
-  return EOK;								   
+  return usb_host_device_open_match (host, vendor_id, product_id, NULL);
+}
+
+static long long usb_host_now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Handles the libusb events until a transfer callback sets completed.
+ * Busy polling handles them without sleeping for the idle budget first,
+ * so a completion is seen as soon as it lands instead of after a wakeup */
+static int usb_host_wait (usb_host *host, int *completed)
+{
+  struct timeval zero = { 0, 0 };
+  long long start;
+  int r = 0;
+
+  if (host->busy_poll)
+  {
+    start = usb_host_now_us ();
+    while (!*completed && r == 0 &&
+           usb_host_now_us () - start < host->busy_poll)
+      r = libusb_handle_events_timeout_completed (host->ctx, &zero,
+                                                  completed);
+  }
+  while (!*completed && (r == 0 || r == LIBUSB_ERROR_INTERRUPTED))
+    r = libusb_handle_events_completed (host->ctx, completed);
+
+  return *completed ? 0 : r;
+}
+
+static void bulk_transfer_cb (struct libusb_transfer *transfer)
+{
+  *((int *) transfer->user_data) = 1;
+}
+
+/* libusb_bulk_transfer() waiting with usb_host_wait() */
+static int usb_host_bulk_transfer (usb_host *host, unsigned char endp,
+                                   unsigned char *buffer, int length,
+                                   int *transferred, unsigned int timeout)
+{
+  struct libusb_transfer *transfer = libusb_alloc_transfer (0);
+  int r, completed = 0;
+
+  *transferred = 0;
+  if (transfer == NULL)
+    return LIBUSB_ERROR_NO_MEM;
+
+  libusb_fill_bulk_transfer (transfer, host->devh, endp, buffer, length,
+                             bulk_transfer_cb, &completed, timeout);
+  r = libusb_submit_transfer (transfer);
+  if (r != 0)
+  {
+    libusb_free_transfer (transfer);
+    return r;
+  }
+
+  /* The events can't be handled, give up on the transfer */
+  if (usb_host_wait (host, &completed) != 0)
+  {
+    libusb_cancel_transfer (transfer);
+    while (!completed)
+      libusb_handle_events_completed (host->ctx, &completed);
+  }
+
+  *transferred = transfer->actual_length;
+  switch (transfer->status)
+  {
+    case LIBUSB_TRANSFER_COMPLETED:
+      r = 0;
+      break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      r = LIBUSB_ERROR_TIMEOUT;
+      break;
+    case LIBUSB_TRANSFER_STALL:
+      r = LIBUSB_ERROR_PIPE;
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      r = LIBUSB_ERROR_NO_DEVICE;
+      break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+      r = LIBUSB_ERROR_OVERFLOW;
+      break;
+    default:
+      r = LIBUSB_ERROR_IO;
+      break;
+  }
+  libusb_free_transfer (transfer);
+
+  return r;
+}
+
+/* Bulk transfer through the loop, with the return codes of libusb */
+static int usb_host_loop_transfer (usb_host *host, unsigned char endp,
+                                   unsigned char *buffer, int length,
+                                   int *transferred, unsigned int timeout)
+{
+  int r;
+
+  if (endp & LIBUSB_ENDPOINT_IN)
+    r = usb_loop_read (host->loop, USB_LOOP_HOST, endp, buffer, length,
+                       timeout);
+  else
+    r = usb_loop_write (host->loop, USB_LOOP_HOST, endp, buffer, length,
+                        timeout);
+
+  *transferred = r < 0 ? 0 : r;
+  if (r == USB_LOOP_TIMEOUT)
+    return LIBUSB_ERROR_TIMEOUT;
+  if (r < 0)
+    return LIBUSB_ERROR_NO_DEVICE;
+  return 0;
 }
 
 HOST_EXIT_CODE usb_host_device_transfer(usb_host *host, 
@@ -56,21 +465,444 @@ HOST_EXIT_CODE usb_host_device_transfer(usb_host *host,
 					int length,
 					unsigned int timeout)
 {
-  int r = libusb_bulk_transfer(host->devh, (unsigned char) endp, 
-                               buffer, length, &(host->transferred),
-			       timeout);
+  HOST_EXIT_CODE ret = usb_host_device_transfer_timed(host, endp, buffer,
+                                                      length, timeout,
+                                                      &(host->transferred));
+
+  /* Callers of this one can't resume a partial transfer */
+  if (ret == ERR_TIMEOUT)
+    return ERR_TRANSFER;
+
+  return ret;
+}
+
+HOST_EXIT_CODE usb_host_device_transfer_timed(usb_host *host,
+					      EP_ADRESS endp,
+					      unsigned char *buffer,
+					      int length,
+					      unsigned int timeout,
+					      int *transferred)
+{
+  int r, wanted = length;
+
+  /* Only writes can be cut short, the device decides the length of reads */
+  if (host->emu)
+    switch (link_emu_begin (host->emu, endp,
+                            (endp & LIBUSB_ENDPOINT_IN) ? NULL : &length,
+                            timeout))
+    {
+      case LINK_EMU_TIMEOUT:
+        *transferred = 0;
+        return ERR_TIMEOUT;
+      case LINK_EMU_DISCONNECT:
+        *transferred = 0;
+        host->emu_down = 1;
+        return ERR_TRANSFER;
+      default:
+        break;
+    }
+
+  if (host->loop)
+    r = usb_host_loop_transfer(host, (unsigned char) endp,
+                               buffer, length, transferred,
+                               timeout);
+  else if (host->busy_poll)
+    r = usb_host_bulk_transfer(host, (unsigned char) endp,
+                               buffer, length, transferred,
+                               timeout);
+  else
+    r = libusb_bulk_transfer(host->devh, (unsigned char) endp, 
+                             buffer, length, transferred,
+                             timeout);
+  if (host->emu)
+    link_emu_end (host->emu, endp, *transferred);
   
-  if (r != 0 && host->transferred != length){
+  if (r == LIBUSB_ERROR_TIMEOUT && *transferred != length)
+    return ERR_TIMEOUT;
+
+  if (r != 0 && *transferred != length){
     return ERR_TRANSFER; 
   }
+
+  /* Emulated short write, the caller resumes it as a partial one */
+  if (*transferred != wanted && !(endp & LIBUSB_ENDPOINT_IN))
+    return ERR_TIMEOUT;
   
   return EOK;
 }								  
 
+/* Completion tracking of a set of parallel transfers. pending counts the
+ * transfers still running plus one held by the submitter until they are
+ * all submitted, so done isn't set while there are more to come. It is
+ * changed both by the submitter and by whichever thread handles the
+ * events, hence the atomics */
+typedef struct _parallel_state
+{
+  int pending;
+  int done;
+} parallel_state;
+
+/* Called from whichever thread is handling libusb events */
+static void parallel_transfer_cb (struct libusb_transfer *transfer)
+{
+  parallel_state *state = (parallel_state *) transfer->user_data;
+
+  if (__sync_sub_and_fetch (&state->pending, 1) == 0)
+    state->done = 1;
+}
+
+HOST_EXIT_CODE usb_host_device_transfer_parallel(usb_host *host,
+						 usb_host_transfer *xfers,
+						 int n,
+						 unsigned int timeout)
+{
+  struct libusb_transfer **transfers;
+  HOST_EXIT_CODE ret = EOK;
+  parallel_state state = { 1, 0 };
+  int i, length;
+
+  /* Nothing to run concurrently */
+  if (n == 1)
+    return usb_host_device_transfer_timed(host, xfers[0].endp,
+                                          xfers[0].buffer, xfers[0].length,
+                                          timeout, &(xfers[0].transferred));
+
+  /* A loop queues the writes without waiting for the gadget, one after
+   * the other is as good */
+  if (host->loop)
+  {
+    for (i = 0; i < n; i++)
+      xfers[i].transferred = 0;
+    for (i = 0; i < n && ret == EOK; i++)
+      ret = usb_host_device_transfer_timed(host, xfers[i].endp,
+                                           xfers[i].buffer, xfers[i].length,
+                                           timeout, &(xfers[i].transferred));
+    return ret;
+  }
+
+  transfers = calloc (n, sizeof (struct libusb_transfer *));
+  if (transfers == NULL)
+    return ERR_TRANSFER;
+
+  for (i = 0; i < n; i++)
+  {
+    xfers[i].transferred = 0;
+    length = xfers[i].length;
+    if (host->emu)
+    {
+      switch (link_emu_begin (host->emu, xfers[i].endp,
+                              (xfers[i].endp & LIBUSB_ENDPOINT_IN) ?
+                              NULL : &length, timeout))
+      {
+        case LINK_EMU_TIMEOUT:
+          ret = ERR_TIMEOUT;
+          break;
+        case LINK_EMU_DISCONNECT:
+          host->emu_down = 1;
+          ret = ERR_TRANSFER;
+          break;
+        default:
+          break;
+      }
+      if (ret != EOK)
+        break;
+    }
+    transfers[i] = libusb_alloc_transfer (0);
+    if (transfers[i] == NULL)
+    {
+      ret = ERR_TRANSFER;
+      break;
+    }
+    libusb_fill_bulk_transfer (transfers[i], host->devh,
+                               (unsigned char) xfers[i].endp,
+                               xfers[i].buffer, length,
+                               parallel_transfer_cb, &state, timeout);
+    __sync_fetch_and_add (&state.pending, 1);
+    if (libusb_submit_transfer (transfers[i]) != 0)
+    {
+      __sync_fetch_and_sub (&state.pending, 1);
+      libusb_free_transfer (transfers[i]);
+      transfers[i] = NULL;
+      ret = ERR_TRANSFER;
+      break;
+    }
+  }
+
+  /* On a submit error let the ones already running finish */
+  if (ret != EOK)
+    for (i = 0; i < n; i++)
+      if (transfers[i] != NULL)
+        libusb_cancel_transfer (transfers[i]);
+
+  /* Drop the reference of the submitter, the last one sets done */
+  if (__sync_sub_and_fetch (&state.pending, 1) == 0)
+    state.done = 1;
+
+  /* The events can't be handled, give up on the transfers */
+  if (usb_host_wait (host, &(state.done)) != 0)
+  {
+    for (i = 0; i < n && transfers[i] != NULL; i++)
+      libusb_cancel_transfer (transfers[i]);
+    while (!state.done)
+      libusb_handle_events_completed (host->ctx, &(state.done));
+  }
+
+  for (i = 0; i < n && transfers[i] != NULL; i++)
+  {
+    xfers[i].transferred = transfers[i]->actual_length;
+    if (host->emu)
+      link_emu_end (host->emu, xfers[i].endp, xfers[i].transferred);
+    switch (transfers[i]->status)
+    {
+      case LIBUSB_TRANSFER_COMPLETED:
+        /* Emulated short write */
+        if (transfers[i]->length != xfers[i].length && ret == EOK)
+          ret = ERR_TIMEOUT;
+        break;
+      case LIBUSB_TRANSFER_CANCELLED:
+        /* Only here when another one failed, ret says why */
+        break;
+      case LIBUSB_TRANSFER_TIMED_OUT:
+        if (ret == EOK)
+          ret = ERR_TIMEOUT;
+        break;
+      default:
+        ret = ERR_TRANSFER;
+        break;
+    }
+    libusb_free_transfer (transfers[i]);
+  }
+  free (transfers);
+
+  return ret;
+}
+
+HOST_EXIT_CODE usb_host_device_control(usb_host *host,
+				       int in,
+				       unsigned char request,
+				       unsigned short value,
+				       unsigned short index,
+				       unsigned char *buffer,
+				       int length,
+				       unsigned int timeout,
+				       int *transferred)
+{
+  uint8_t type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE |
+    (in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT);
+  int r;
+
+  /* The gadget answers right away, there's no timeout to apply */
+  if (host->loop)
+    r = usb_loop_control(host->loop, in, request, value, index, buffer,
+                         length);
+  else
+    r = libusb_control_transfer(host->devh, type, request, value, index,
+                                buffer, length, timeout);
+
+  if (r == LIBUSB_ERROR_TIMEOUT)
+    return ERR_TIMEOUT;
+  if (r < 0)
+    return ERR_TRANSFER;
+
+  if (transferred)
+    *transferred = r;
+  return EOK;
+}
+
+/* Runs in the events thread, or in the waiter of a private context */
+static void notify_transfer_cb (struct libusb_transfer *transfer)
+{
+  usb_host *host = (usb_host *) transfer->user_data;
+
+  pthread_mutex_lock (&host->notify_lock);
+  host->notify_done = 1;
+  pthread_cond_broadcast (&host->notify_cond);
+  pthread_mutex_unlock (&host->notify_lock);
+}
+
+/* Handles the events of a private context until the notify transfer
+ * callback runs, nobody else does */
+static int notify_handle_events (usb_host *host, unsigned int timeout)
+{
+  long long end = usb_host_now_us () + (long long) timeout * 1000, left;
+  struct timeval tv;
+  int r = 0;
+
+  while (!host->notify_done && (r == 0 || r == LIBUSB_ERROR_INTERRUPTED))
+  {
+    left = USB_HOST_EVENTS_TIMEOUT * 1000;
+    if (timeout != 0 && end - usb_host_now_us () < left)
+      left = end - usb_host_now_us ();
+    if (left <= 0)
+      break;
+    tv.tv_sec = left / 1000000;
+    tv.tv_usec = left % 1000000;
+    r = libusb_handle_events_timeout_completed (host->ctx, &tv,
+                                                &host->notify_done);
+  }
+  return host->notify_done;
+}
+
+/* Waits for the notify transfer callback, up to timeout ms or forever
+ * if 0. Non zero if it came */
+static int notify_wait_done (usb_host *host, unsigned int timeout)
+{
+  struct timespec deadline;
+  int done, r = 0;
+
+  if (host->private_ctx)
+    return notify_handle_events (host, timeout);
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock (&host->notify_lock);
+  while (!host->notify_done && r == 0)
+  {
+    if (timeout == 0)
+      pthread_cond_wait (&host->notify_cond, &host->notify_lock);
+    else
+      r = pthread_cond_timedwait (&host->notify_cond, &host->notify_lock,
+                                  &deadline);
+  }
+  done = host->notify_done;
+  pthread_mutex_unlock (&host->notify_lock);
+
+  return done;
+}
+
+HOST_EXIT_CODE usb_host_notify_start(usb_host *host,
+				     EP_ADRESS endp,
+				     int length)
+{
+  if (length > USB_HOST_NOTIFY_SIZE)
+    return ERR_TRANSFER;
+
+  /* Nothing to post, the notifications stay queued in the loop */
+  if (host->loop)
+  {
+    host->loop_notify = endp;
+    return EOK;
+  }
+
+  host->notify = libusb_alloc_transfer (0);
+  if (host->notify == NULL)
+    return ERR_TRANSFER;
+
+  /* No timeout, the transfer stays posted until a notification arrives */
+  libusb_fill_interrupt_transfer (host->notify, host->devh,
+                                  (unsigned char) endp,
+                                  host->notify_buffer, length,
+                                  notify_transfer_cb, host, 0);
+  host->notify_done = 0;
+  if (libusb_submit_transfer (host->notify) != 0)
+  {
+    libusb_free_transfer (host->notify);
+    host->notify = NULL;
+    return ERR_TRANSFER;
+  }
+
+  return EOK;
+}
+
+HOST_EXIT_CODE usb_host_notify_wait(usb_host *host,
+				    unsigned char *buffer,
+				    int length,
+				    unsigned int timeout)
+{
+  HOST_EXIT_CODE ret;
+  int r;
+
+  if (host->loop && host->loop_notify)
+  {
+    r = usb_loop_read (host->loop, USB_LOOP_HOST, host->loop_notify, buffer,
+                       length, timeout);
+    if (r == USB_LOOP_TIMEOUT)
+      return ERR_TIMEOUT;
+    return r == length ? EOK : ERR_TRANSFER;
+  }
+
+  if (host->notify == NULL)
+    return ERR_TRANSFER;
+
+  if (!notify_wait_done (host, timeout))
+    return ERR_TIMEOUT;
+
+  if (host->notify->status == LIBUSB_TRANSFER_COMPLETED &&
+      host->notify->actual_length == length)
+  {
+    memcpy (buffer, host->notify_buffer, length);
+    ret = EOK;
+  }
+  else
+    ret = ERR_TRANSFER;
+
+  /* Post it again right away, the next notification doesn't wait for the
+   * caller to handle this one */
+  host->notify_done = 0;
+  host->notify->length = length;
+  if (libusb_submit_transfer (host->notify) != 0)
+  {
+    libusb_free_transfer (host->notify);
+    host->notify = NULL;
+    return ERR_TRANSFER;
+  }
+
+  return ret;
+}
+
+void usb_host_notify_stop(usb_host *host)
+{
+  host->loop_notify = 0;
+  if (host->notify == NULL)
+    return;
+
+  if (libusb_cancel_transfer (host->notify) == 0)
+    notify_wait_done (host, 0);
+
+  libusb_free_transfer (host->notify);
+  host->notify = NULL;
+}
+
+void usb_host_device_close(usb_host *host)
+{
+  usb_host_notify_stop (host);
+  if (host->loop)
+  {
+    usb_loop_detach (host->loop, USB_LOOP_HOST);
+    usb_loop_close (host->loop);
+    host->loop = NULL;
+    host->connected = 0;
+    return;
+  }
+  if (host->devh == NULL)
+    return;
+
+  libusb_release_interface (host->devh, 0);
+  libusb_close (host->devh);
+  host->devh = NULL;
+  host->connected = 0;
+}
 
 void usb_host_free(usb_host *device){	
-  libusb_release_interface (device->devh, 0); 
-  libusb_close (device->devh);	
-  libusb_exit (device->ctx);
+  usb_host_device_close (device);
+  if (device->private_ctx)
+    libusb_exit (device->ctx);
+  else
+    usb_host_shared_unref ();
+  device->ctx = NULL;
+  pthread_cond_destroy (&device->notify_cond);
+  pthread_mutex_destroy (&device->notify_lock);
+  if (device->emu)
+  {
+    link_emu_free (device->emu);
+    device->emu = NULL;
+  }
 }
 
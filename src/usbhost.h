@@ -33,7 +33,19 @@ typedef enum _EP_ADDRESS
   EP3_IN  = 0x83,
   
   /** Endpoint 3 configured for OUT direcion */
-  EP3_OUT = 0x03
+  EP3_OUT = 0x03,
+
+  /** Endpoint 4 configured for IN direcion */
+  EP4_IN  = 0x84,
+
+  /** Endpoint 4 configured for OUT direcion */
+  EP4_OUT = 0x04,
+
+  /** Endpoint 5 configured for IN direcion */
+  EP5_IN  = 0x85,
+
+  /** Endpoint 5 configured for OUT direcion */
+  EP5_OUT = 0x05
   
 } EP_ADRESS;
 
@@ -58,7 +70,10 @@ typedef enum _HOST_EXIT_CODE
   ERR_OPEN,
   
   /** Error during transfer */
-  ERR_TRANSFER
+  ERR_TRANSFER,
+
+  /** Transfer didn't complete before the timeout */
+  ERR_TIMEOUT
   
 } HOST_EXIT_CODE;
 
@@ -82,13 +97,74 @@ typedef enum _VERBOSE
 } VERBOSE;
 
 
+/**
+ * One of several bulk transfers running at the same time
+ */
+typedef struct _usb_host_transfer
+{
+  /** Endpoint address to write to or read from */
+  EP_ADRESS endp;
+
+  /** Buffer containing the data to transfer */
+  unsigned char *buffer;
+
+  /** Length in bytes of the data to transfer */
+  int length;
+
+  /** Amount of bytes actually transferred */
+  int transferred;
+
+} usb_host_transfer;
+
+/** Maximum size of a notification read from the interrupt endpoint */
+#define USB_HOST_NOTIFY_SIZE 8
+
+/** Longest port path, hubs nest up to 7 deep */
+#define USB_HOST_MAX_PORTS 7
+
+/** Largest serial number read from a device, the terminator included */
+#define USB_HOST_SERIAL_SIZE 128
+
+/** Longest loop name, the terminator included */
+#define USB_HOST_LOOP_SIZE 64
+
+/**
+ * Which one of several devices with the same ids to open, fields left
+ * empty match any device
+ */
+typedef struct _usb_host_match
+{
+  /** Bus number, 0 for any */
+  int bus;
+
+  /** Ports from the root hub down to the device, none for any */
+  uint8_t ports[USB_HOST_MAX_PORTS];
+  int n_ports;
+
+  /** Serial number, empty for any */
+  char serial[USB_HOST_SERIAL_SIZE];
+
+  /** Name of a loop to the gadget of this process, see usbloop.h, empty
+   * for a device on the bus. The other fields don't apply to a loop */
+  char loop[USB_HOST_LOOP_SIZE];
+
+} usb_host_match;
+
 /**
  * Simple device struct.
  */
 typedef struct _usb_host
 {
-  /** Pointer to a libusb context */	
+  /** Pointer to the libusb context, shared by all the hosts of the
+   * process. Its events are handled by a thread of its own */	
   libusb_context *ctx;
+
+  /** Set when ctx belongs to this host alone, see
+   * usb_host_set_busy_poll() */
+  int private_ctx;
+
+  /** Verbosity of the contexts */
+  VERBOSE verbose;
   
   /** Pointer to a libusb device handle */
   libusb_device_handle *devh;
@@ -101,17 +177,96 @@ typedef struct _usb_host
   
   /** Upstream events thread to receive from usb link */
   pthread_t up_events;
+
+  /** Interrupt transfer kept posted on the notifications endpoint */
+  struct libusb_transfer *notify;
+
+  /** Data of the last notification received */
+  unsigned char notify_buffer[USB_HOST_NOTIFY_SIZE];
+
+  /** Set by the notify transfer callback once it completes, guarded by
+   * notify_lock and signaled on notify_cond */
+  int notify_done;
+  pthread_mutex_t notify_lock;
+  pthread_cond_t notify_cond;
+
+  /** Emulated link the bulk transfers go through, NULL for the real
+   * one. Set after usb_host_new(), usb_host_free() releases it */
+  struct _link_emu *emu;
+
+  /** Set once the emulated link went down. The device never noticed and
+   * won't announce itself again, the next open waits for the link to
+   * come back and marks the host connected */
+  int emu_down;
+
+  /** Microseconds a bulk transfer spins on the libusb events waiting for
+   * its completion before sleeping for it, 0 to always sleep. Set with
+   * usb_host_set_busy_poll() */
+  unsigned int busy_poll;
+
+  /** Loop the device is reached through instead of the bus, see
+   * usbloop.h. Set by usb_host_device_open_match() when the selection
+   * names one, NULL otherwise */
+  struct _usb_loop *loop;
+  /** Notifications endpoint of a loop, 0 when not listening */
+  int loop_notify;
   
 } usb_host;
 
  /**
-  * \brief Object constructor.
+  * \brief Object constructor. The first host of the process creates the
+  * shared libusb context and the thread handling its events, the last one
+  * freed closes them.
   * \param host Object to create.
   * \param v Verbosity level of the context. See #_VERBOSE.
   * \return Code with the return status.
   */
 extern HOST_EXIT_CODE usb_host_new(usb_host *host, VERBOSE v);
 
+ /**
+  * \brief Sets how long the bulk transfers spin on the libusb events
+  * waiting for their completion before sleeping for it. A spinning host
+  * gets a libusb context of its own with no events thread, otherwise that
+  * thread would take the completions from under the spinning waiters. The
+  * threads waiting on the host handle its events themselves then, so the
+  * notifications only arrive while usb_host_notify_wait() runs, and the
+  * host scans the bus on its own. To call before opening the device.
+  * \param host Object created with usb_host_new(), with no open device.
+  * \param busy_poll Microseconds to spin, 0 to always sleep and go back to
+  * the shared context.
+  * \return #EOK, #ERR_OPEN if the device is open or #ERR_INIT if the
+  * context couldn't be created.
+  */
+extern HOST_EXIT_CODE usb_host_set_busy_poll(usb_host *host,
+                                             unsigned int busy_poll);
+
+
+ /**
+  * \brief Parses a device selector, comma separated fields as in
+  * "bus=1,port=2.1,serial=board3". Any field can be left out. A
+  * "loop=name" field selects the loop of that name instead of a device.
+  * \param match Where to store the selection.
+  * \param selector Selector to parse, NULL, empty or "any" match any
+  * device.
+  * \return Non zero on success, zero if the selector is malformed.
+  */
+extern int usb_host_match_parse(usb_host_match *match,
+                                const char *selector);
+
+ /**
+  * \brief Opens the first device with the ids that matches the selection
+  * and isn't claimed yet, by this process or another.
+  * \param host Object in wich the device will be opened.
+  * \param vendor_id Vendor ID of the device to be opened.
+  * \param product_id Product ID of the device to be opened.
+  * \param match Device to pick, NULL for any.
+  * \return #EOK, #ERR_FOUND if no device matches, #ERR_OPEN or
+  * #ERR_INTERFACE if the ones that do can't be opened or claimed.
+  */
+extern HOST_EXIT_CODE usb_host_device_open_match(usb_host *host,
+								uint16_t vendor_id,
+								uint16_t product_id,
+								const usb_host_match *match);
 
  /**
   * \brief Method to open the desired device.
@@ -139,6 +294,105 @@ extern HOST_EXIT_CODE usb_host_device_transfer(usb_host *host,
 								  int length,
 								  unsigned int timeout);
 
+/**
+ * \brief Method to transfer bulk data reporting partial transfers.
+ * \param host Object that contains an opened device.
+ * \param endp Endpoint address to write to or read from.
+ * \param buffer Buffer containing the data to transfer.
+ * \param length Length in bytes of the data to transfer.
+ * \param timeout Time in milliseconds to the transfer to give up, 0 waits
+ * forever.
+ * \param transferred Where to store the amount of bytes actually
+ * transferred, it is valid on #ERR_TIMEOUT too.
+ * \return Code with the transfer status.
+ */
+extern HOST_EXIT_CODE usb_host_device_transfer_timed(usb_host *host,
+								  EP_ADRESS endp,
+								  unsigned char *buffer,
+								  int length,
+								  unsigned int timeout,
+								  int *transferred);
+
+ /**
+ * \brief Method to run several bulk transfers concurrently, for instance
+ * one per endpoint. Returns once all of them finished.
+ * \param host Object that contains an opened device.
+ * \param xfers Transfers to run, transferred is filled for each of them.
+ * \param n Number of transfers.
+ * \param timeout Time in milliseconds to the transfers to give up, 0 waits
+ * forever.
+ * \return #EOK, #ERR_TIMEOUT if any timed out or #ERR_TRANSFER.
+ */
+extern HOST_EXIT_CODE usb_host_device_transfer_parallel(usb_host *host,
+								  usb_host_transfer *xfers,
+								  int n,
+								  unsigned int timeout);
+
+ /**
+ * \brief Method to run a vendor control request on the device.
+ * \param host Object that contains an opened device.
+ * \param in Non zero for device to host requests.
+ * \param request Vendor request code, the bRequest field.
+ * \param value The wValue field.
+ * \param index The wIndex field.
+ * \param buffer Data stage, for IN requests it receives the reply.
+ * \param length Length in bytes of the data stage.
+ * \param timeout Time in milliseconds to the request to give up.
+ * \param transferred Where to store the length of the data stage actually
+ * transferred, can be NULL.
+ * \return #EOK, #ERR_TIMEOUT or #ERR_TRANSFER if the device stalled it.
+ */
+extern HOST_EXIT_CODE usb_host_device_control(usb_host *host,
+								  int in,
+								  unsigned char request,
+								  unsigned short value,
+								  unsigned short index,
+								  unsigned char *buffer,
+								  int length,
+								  unsigned int timeout,
+								  int *transferred);
+
+ /**
+ * \brief Posts an interrupt transfer on the notifications endpoint, it is
+ * posted again every time a notification is taken, so the host controller
+ * keeps polling the endpoint.
+ * \param host Object that contains an opened device.
+ * \param endp Interrupt IN endpoint address.
+ * \param length Size of a notification, up to #USB_HOST_NOTIFY_SIZE.
+ * \return Code with the return status.
+ */
+extern HOST_EXIT_CODE usb_host_notify_start(usb_host *host,
+								  EP_ADRESS endp,
+								  int length);
+
+ /**
+ * \brief Waits for a notification on the endpoint given to
+ * usb_host_notify_start().
+ * \param host Object with the notifications transfer posted.
+ * \param buffer Buffer to store the notification.
+ * \param length Size of the notification.
+ * \param timeout Time in milliseconds to give up, 0 waits forever.
+ * \return #EOK, #ERR_TIMEOUT if nothing arrived or #ERR_TRANSFER.
+ */
+extern HOST_EXIT_CODE usb_host_notify_wait(usb_host *host,
+								  unsigned char *buffer,
+								  int length,
+								  unsigned int timeout);
+
+ /**
+ * \brief Cancels the notifications transfer.
+ * \param host Object with the notifications transfer posted.
+ */
+extern void usb_host_notify_stop(usb_host *host);
+
+ /**
+  * \brief Closes the device opened with usb_host_device_open(), the
+  * context stays valid so the device can be opened again, for instance
+  * after it was unplugged.
+  * \param host Object with an opened device.
+  */
+extern void usb_host_device_close(usb_host *host);
+
  /**
   * \brief Object destructor.
   * \param host Usb host device to free.
@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ *
+ * Loopback link: the loops of the process are kept in a list, looked up
+ * by name. Each endpoint of a loop queues its transfers as copies, so the
+ * writer carries on as if the device took them. One lock and one
+ * condition cover all the endpoints of a loop, waiters check what they
+ * wait for again on every broadcast.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbloop.h"
+
+/* Endpoints 0 to 15 of each direction */
+#define USB_LOOP_ENDPOINTS 32
+#define USB_LOOP_INDEX(endp) ((((endp) & 0x80) >> 3) | ((endp) & 0x0f))
+
+/* A transfer waiting for its reader, the data follows it */
+typedef struct _usb_loop_transfer
+{
+  struct _usb_loop_transfer *next;
+  int length;
+
+  /* Bytes of it already read */
+  int consumed;
+} usb_loop_transfer;
+
+typedef struct _usb_loop_queue
+{
+  usb_loop_transfer *head;
+  usb_loop_transfer *tail;
+
+  /* Bytes of the transfers in the queue */
+  size_t queued;
+} usb_loop_queue;
+
+struct _usb_loop
+{
+  char *name;
+  int refs;
+  struct _usb_loop *next;
+
+  /* Guards everything below */
+  pthread_mutex_t lock;
+
+  /* Broadcast on every change */
+  pthread_cond_t cond;
+
+  /* By side. The epoch is bumped on each detach, so a call notices one
+   * even if the side was attached again meanwhile */
+  int attached[2];
+  unsigned int epoch[2];
+
+  usb_loop_control_func control;
+  void *control_data;
+
+  /* Control requests running on the gadget */
+  int controls;
+
+  usb_loop_queue queues[USB_LOOP_ENDPOINTS];
+};
+
+static pthread_mutex_t usb_loop_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static usb_loop *usb_loop_list = NULL;
+
+static void usb_loop_flush (usb_loop_queue *q)
+{
+  usb_loop_transfer *t;
+
+  while ((t = q->head) != NULL)
+    {
+      q->head = t->next;
+      free (t);
+    }
+  q->tail = NULL;
+  q->queued = 0;
+}
+
+usb_loop *usb_loop_open (const char *name)
+{
+  usb_loop *loop;
+
+  pthread_mutex_lock (&usb_loop_list_lock);
+  for (loop = usb_loop_list; loop != NULL; loop = loop->next)
+    if (strcmp (loop->name, name) == 0)
+      break;
+
+  if (loop == NULL)
+    {
+      loop = calloc (1, sizeof *loop);
+      if (loop == NULL || (loop->name = strdup (name)) == NULL)
+	{
+	  free (loop);
+	  pthread_mutex_unlock (&usb_loop_list_lock);
+	  return NULL;
+	}
+      pthread_mutex_init (&loop->lock, NULL);
+      pthread_cond_init (&loop->cond, NULL);
+      loop->next = usb_loop_list;
+      usb_loop_list = loop;
+    }
+  loop->refs++;
+  pthread_mutex_unlock (&usb_loop_list_lock);
+
+  return loop;
+}
+
+void usb_loop_close (usb_loop *loop)
+{
+  usb_loop **p;
+  int i;
+
+  pthread_mutex_lock (&usb_loop_list_lock);
+  if (--loop->refs > 0)
+    {
+      pthread_mutex_unlock (&usb_loop_list_lock);
+      return;
+    }
+  for (p = &usb_loop_list; *p != loop; p = &(*p)->next);
+  *p = loop->next;
+  pthread_mutex_unlock (&usb_loop_list_lock);
+
+  for (i = 0; i < USB_LOOP_ENDPOINTS; i++)
+    usb_loop_flush (&loop->queues[i]);
+  pthread_cond_destroy (&loop->cond);
+  pthread_mutex_destroy (&loop->lock);
+  free (loop->name);
+  free (loop);
+}
+
+int usb_loop_attach (usb_loop *loop, USB_LOOP_SIDE side)
+{
+  int ret = 0;
+
+  pthread_mutex_lock (&loop->lock);
+  if (loop->attached[side])
+    ret = USB_LOOP_BUSY;
+  else if (side == USB_LOOP_HOST && !loop->attached[USB_LOOP_GADGET])
+    ret = USB_LOOP_CLOSED;
+  else
+    loop->attached[side] = 1;
+  pthread_mutex_unlock (&loop->lock);
+
+  return ret;
+}
+
+void usb_loop_detach (usb_loop *loop, USB_LOOP_SIDE side)
+{
+  int i;
+
+  pthread_mutex_lock (&loop->lock);
+  if (!loop->attached[side])
+    {
+      pthread_mutex_unlock (&loop->lock);
+      return;
+    }
+  loop->attached[side] = 0;
+  loop->epoch[side]++;
+  pthread_cond_broadcast (&loop->cond);
+
+  if (side == USB_LOOP_GADGET)
+    {
+      /* Nothing in flight survives an unplugged device */
+      for (i = 0; i < USB_LOOP_ENDPOINTS; i++)
+	usb_loop_flush (&loop->queues[i]);
+      while (loop->controls > 0)
+	pthread_cond_wait (&loop->cond, &loop->lock);
+      loop->control = NULL;
+      loop->control_data = NULL;
+    }
+  pthread_mutex_unlock (&loop->lock);
+}
+
+void usb_loop_set_control (usb_loop *loop, usb_loop_control_func func,
+			   void *user_data)
+{
+  pthread_mutex_lock (&loop->lock);
+  loop->control = func;
+  loop->control_data = user_data;
+  pthread_mutex_unlock (&loop->lock);
+}
+
+static void usb_loop_unlock (void *param)
+{
+  pthread_mutex_unlock ((pthread_mutex_t *) param);
+}
+
+/* Absolute time of a timeout in ms, as the condition waits want it */
+static void usb_loop_deadline (struct timespec *ts, unsigned int timeout)
+{
+  clock_gettime (CLOCK_REALTIME, ts);
+  ts->tv_sec += timeout / 1000;
+  ts->tv_nsec += (timeout % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000)
+    {
+      ts->tv_sec++;
+      ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Checks a call can start, keeping the epochs it started with. With the
+ * lock taken */
+static int usb_loop_enter (usb_loop *loop, USB_LOOP_SIDE side,
+			   unsigned int *epoch)
+{
+  if (!loop->attached[side] ||
+      (side == USB_LOOP_HOST && !loop->attached[USB_LOOP_GADGET]))
+    return USB_LOOP_CLOSED;
+  epoch[USB_LOOP_HOST] = loop->epoch[USB_LOOP_HOST];
+  epoch[USB_LOOP_GADGET] = loop->epoch[USB_LOOP_GADGET];
+  return 0;
+}
+
+/* Waits for a change, with the lock taken. 0, #USB_LOOP_TIMEOUT or
+ * #USB_LOOP_CLOSED once the side, or the gadget of a host, was detached
+ * since the call started */
+static int usb_loop_wait (usb_loop *loop, USB_LOOP_SIDE side,
+			  const unsigned int *epoch, unsigned int timeout,
+			  const struct timespec *deadline)
+{
+  if (timeout == 0)
+    pthread_cond_wait (&loop->cond, &loop->lock);
+  else if (pthread_cond_timedwait (&loop->cond, &loop->lock,
+				   deadline) == ETIMEDOUT)
+    return USB_LOOP_TIMEOUT;
+
+  if (loop->epoch[side] != epoch[side] ||
+      (side == USB_LOOP_HOST &&
+       loop->epoch[USB_LOOP_GADGET] != epoch[USB_LOOP_GADGET]))
+    return USB_LOOP_CLOSED;
+  return 0;
+}
+
+int usb_loop_write (usb_loop *loop, USB_LOOP_SIDE side, int endp,
+		    const void *data, int length, unsigned int timeout)
+{
+  usb_loop_queue *q = &loop->queues[USB_LOOP_INDEX (endp)];
+  usb_loop_transfer *t;
+  unsigned int epoch[2];
+  struct timespec deadline;
+  int ret;
+
+  usb_loop_deadline (&deadline, timeout);
+  pthread_mutex_lock (&loop->lock);
+  /* The wait is a cancellation point, don't leave the lock taken */
+  pthread_cleanup_push (usb_loop_unlock, (void *) &loop->lock);
+  ret = usb_loop_enter (loop, side, epoch);
+  while (ret == 0 && q->queued > 0 &&
+	 q->queued + length > USB_LOOP_MAX_QUEUED)
+    ret = usb_loop_wait (loop, side, epoch, timeout, &deadline);
+
+  if (ret == 0)
+    {
+      t = malloc (sizeof *t + length);
+      if (t == NULL)
+	ret = USB_LOOP_CLOSED;
+      else
+	{
+	  t->next = NULL;
+	  t->length = length;
+	  t->consumed = 0;
+	  memcpy (t + 1, data, length);
+	  if (q->tail)
+	    q->tail->next = t;
+	  else
+	    q->head = t;
+	  q->tail = t;
+	  q->queued += length;
+	  pthread_cond_broadcast (&loop->cond);
+	  ret = length;
+	}
+    }
+  pthread_cleanup_pop (1);
+
+  return ret;
+}
+
+int usb_loop_read (usb_loop *loop, USB_LOOP_SIDE side, int endp,
+		   void *buffer, int length, unsigned int timeout)
+{
+  usb_loop_queue *q = &loop->queues[USB_LOOP_INDEX (endp)];
+  usb_loop_transfer *t;
+  unsigned int epoch[2];
+  struct timespec deadline;
+  int ret;
+
+  usb_loop_deadline (&deadline, timeout);
+  pthread_mutex_lock (&loop->lock);
+  pthread_cleanup_push (usb_loop_unlock, (void *) &loop->lock);
+  ret = usb_loop_enter (loop, side, epoch);
+  while (ret == 0 && q->head == NULL)
+    ret = usb_loop_wait (loop, side, epoch, timeout, &deadline);
+
+  if (ret == 0)
+    {
+      t = q->head;
+      ret = t->length - t->consumed;
+      if (ret > length)
+	ret = length;
+      memcpy (buffer, (uint8_t *) (t + 1) + t->consumed, ret);
+      t->consumed += ret;
+      if (t->consumed == t->length)
+	{
+	  q->head = t->next;
+	  if (q->head == NULL)
+	    q->tail = NULL;
+	  q->queued -= t->length;
+	  free (t);
+	  /* There is room for a writer */
+	  pthread_cond_broadcast (&loop->cond);
+	}
+    }
+  pthread_cleanup_pop (1);
+
+  return ret;
+}
+
+int usb_loop_control (usb_loop *loop, int in, unsigned char request,
+		      unsigned short value, unsigned short index,
+		      unsigned char *buffer, int length)
+{
+  usb_loop_control_func func;
+  void *data;
+  int ret;
+
+  pthread_mutex_lock (&loop->lock);
+  if (!loop->attached[USB_LOOP_HOST] || !loop->attached[USB_LOOP_GADGET])
+    {
+      pthread_mutex_unlock (&loop->lock);
+      return USB_LOOP_CLOSED;
+    }
+  func = loop->control;
+  data = loop->control_data;
+  loop->controls++;
+  pthread_mutex_unlock (&loop->lock);
+
+  /* Out of the lock, the handler may use the loop too */
+  ret = func ? func (data, in, request, value, index, buffer, length) : -1;
+  if (ret < 0)
+    ret = USB_LOOP_STALL;
+  else if (ret > length)
+    ret = length;
+
+  pthread_mutex_lock (&loop->lock);
+  if (--loop->controls == 0)
+    pthread_cond_broadcast (&loop->cond);
+  pthread_mutex_unlock (&loop->lock);
+
+  return ret;
+}
@@ -0,0 +1,153 @@
+#ifndef __USB_LOOP_H__
+#define __USB_LOOP_H__
+
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+/**
+ * Link between a host and a gadget of the same process, with no device
+ * in between. Loops are found by name, the first one to open a name
+ * creates it. What one side writes on an endpoint is queued until the
+ * other side reads it, one transfer at a time, so short reads behave as
+ * on the bus.
+ */
+typedef struct _usb_loop usb_loop;
+
+/**
+ * Side of the loop a call is made from
+ */
+typedef enum _USB_LOOP_SIDE
+{
+  /** Writes the OUT endpoints, reads the IN ones. Fails while no gadget
+   * is attached, as with the device unplugged */
+  USB_LOOP_HOST,
+
+  /** Writes the IN endpoints, reads the OUT ones. Works with no host
+   * attached, as a configured device whose host isn't polling it */
+  USB_LOOP_GADGET
+
+} USB_LOOP_SIDE;
+
+/** No transfer was available, or no room for one, before the timeout */
+#define USB_LOOP_TIMEOUT (-1)
+
+/** The other side isn't attached, or this one was detached meanwhile */
+#define USB_LOOP_CLOSED (-2)
+
+/** The side is attached already */
+#define USB_LOOP_BUSY (-3)
+
+/** The gadget stalled a control request */
+#define USB_LOOP_STALL (-4)
+
+/** Bytes queued on an endpoint before its writer waits for the reader.
+ * A bigger transfer still goes on an empty endpoint */
+#define USB_LOOP_MAX_QUEUED (1 << 20)
+
+/**
+ * Handler of the vendor control requests of the host, called from the
+ * thread of the host. For IN requests it fills the buffer and returns the
+ * length of the reply, for OUT ones it gets the data stage in the buffer.
+ * A negative return stalls the request.
+ */
+typedef int (*usb_loop_control_func) (void *user_data, int in,
+                                      unsigned char request,
+                                      unsigned short value,
+                                      unsigned short index,
+                                      unsigned char *buffer, int length);
+
+/**
+  * \brief Takes a reference to the loop with a name, creating it if it
+  * doesn't exist.
+  * \param name Name shared by both sides.
+  * \return The loop, NULL if out of memory.
+  */
+extern usb_loop *usb_loop_open (const char *name);
+
+/**
+  * \brief Drops a reference taken with usb_loop_open(), the last one
+  * frees the loop. Detach the side first.
+  * \param loop Loop to close.
+  */
+extern void usb_loop_close (usb_loop *loop);
+
+/**
+  * \brief Plugs one side in. Only one host and one gadget can be attached
+  * at a time, and a host only while a gadget is, as a device has to be
+  * plugged to be opened.
+  * \param loop Loop to attach to.
+  * \param side Side to attach.
+  * \return 0, #USB_LOOP_BUSY if that side is attached already or
+  * #USB_LOOP_CLOSED if a host finds no gadget.
+  */
+extern int usb_loop_attach (usb_loop *loop, USB_LOOP_SIDE side);
+
+/**
+  * \brief Unplugs one side, its calls waiting on the loop return
+  * #USB_LOOP_CLOSED. A host leaves the device configured, what was queued
+  * either way stays for the next one. A gadget is unplugged: what was
+  * queued is dropped, the calls of the host fail too and the detach waits
+  * for the control request the host is running.
+  * \param loop Loop to detach from.
+  * \param side Side to detach.
+  */
+extern void usb_loop_detach (usb_loop *loop, USB_LOOP_SIDE side);
+
+/**
+  * \brief Sets the handler of the control requests, for the gadget to
+  * call once attached.
+  * \param loop Loop the gadget is attached to.
+  * \param func Handler, NULL stalls every request.
+  * \param user_data Passed to the handler.
+  */
+extern void usb_loop_set_control (usb_loop *loop, usb_loop_control_func func,
+                                  void *user_data);
+
+/**
+  * \brief Queues a transfer for the other side.
+  * \param loop Loop the side is attached to.
+  * \param side Side writing.
+  * \param endp Endpoint address, with the IN bit for the gadget.
+  * \param data Data to transfer.
+  * \param length Length in bytes of the data.
+  * \param timeout Time in milliseconds to give up waiting for room, 0
+  * waits for ever.
+  * \return Bytes queued, all of them, #USB_LOOP_TIMEOUT or
+  * #USB_LOOP_CLOSED.
+  */
+extern int usb_loop_write (usb_loop *loop, USB_LOOP_SIDE side, int endp,
+                           const void *data, int length,
+                           unsigned int timeout);
+
+/**
+  * \brief Takes the next transfer queued by the other side. Waiting is a
+  * cancellation point.
+  * \param loop Loop the side is attached to.
+  * \param side Side reading.
+  * \param endp Endpoint address, with the IN bit for the host.
+  * \param buffer Where to store the data.
+  * \param length Size of the buffer, the rest of a bigger transfer is
+  * served on the next read.
+  * \param timeout Time in milliseconds to give up, 0 waits for ever.
+  * \return Bytes read, #USB_LOOP_TIMEOUT or #USB_LOOP_CLOSED.
+  */
+extern int usb_loop_read (usb_loop *loop, USB_LOOP_SIDE side, int endp,
+                          void *buffer, int length, unsigned int timeout);
+
+/**
+  * \brief Runs a vendor control request of the host on the gadget.
+  * \param loop Loop the host is attached to.
+  * \param in Non zero for device to host requests.
+  * \param request Vendor request code.
+  * \param value The wValue field.
+  * \param index The wIndex field.
+  * \param buffer Data stage, for IN requests it receives the reply.
+  * \param length Length in bytes of the data stage.
+  * \return Length of the data stage, #USB_LOOP_STALL or #USB_LOOP_CLOSED.
+  */
+extern int usb_loop_control (usb_loop *loop, int in, unsigned char request,
+                             unsigned short value, unsigned short index,
+                             unsigned char *buffer, int length);
+
+#endif /* __USB_LOOP_H__ */
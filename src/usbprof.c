@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ *
+ * Phase profiling of the data path. Each thread opens a group of perf
+ * events on itself, cycles leading instructions and cache misses, so a
+ * phase costs two reads of the group and the counts only grow while the
+ * thread runs. The totals of a phase are shared by every thread running
+ * it and added to with atomics. Without --enable-profiling nothing calls
+ * in here, and the counters aren't even built.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usbprof.h"
+
+static uint64_t now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef ENABLE_PROFILING
+#include <linux/perf_event.h>
+
+/* Events of the group, in USB_PROF_COUNTER order */
+static const uint64_t usb_prof_events[USB_PROF_N_COUNTERS] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES
+};
+
+/* Group leader of the calling thread, -2 until it's tried and -1 if the
+ * kernel said no */
+static __thread int usb_prof_group = -2;
+static __thread int usb_prof_fds[USB_PROF_N_COUNTERS];
+
+static pthread_key_t usb_prof_key;
+static pthread_once_t usb_prof_once = PTHREAD_ONCE_INIT;
+
+/* Runs as a thread with counters exits, param is its usb_prof_fds. Key
+ * destructors run before the thread's TLS is released, so the group is
+ * reset too, a later destructor profiling again opens a new one */
+static void usb_prof_close (void *param)
+{
+  int *fds = param;
+  int i;
+
+  for (i = USB_PROF_N_COUNTERS - 1; i >= 0; i--)
+    close (fds[i]);
+  usb_prof_group = -2;
+}
+
+static void usb_prof_init_key (void)
+{
+  pthread_key_create (&usb_prof_key, usb_prof_close);
+}
+
+static int usb_prof_event_open (uint64_t config, int group, int user_only)
+{
+  struct perf_event_attr attr;
+
+  memset (&attr, 0, sizeof attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof attr;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = user_only;
+  attr.exclude_hv = 1;
+  return syscall (__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/* Opens the group of the calling thread. Kernel time is counted too, the
+ * transfers spend most of theirs there, unless we aren't allowed to */
+static int usb_prof_open (void)
+{
+  int i, user_only;
+
+  for (user_only = 0; user_only <= 1; user_only++)
+  {
+    for (i = 0; i < USB_PROF_N_COUNTERS; i++)
+    {
+      usb_prof_fds[i] = usb_prof_event_open (usb_prof_events[i],
+					     i ? usb_prof_fds[0] : -1,
+					     user_only);
+      if (usb_prof_fds[i] < 0)
+	break;
+    }
+    if (i == USB_PROF_N_COUNTERS)
+    {
+      pthread_once (&usb_prof_once, usb_prof_init_key);
+      pthread_setspecific (usb_prof_key, usb_prof_fds);
+      return usb_prof_fds[0];
+    }
+    while (--i >= 0)
+      close (usb_prof_fds[i]);
+  }
+  return -1;
+}
+
+static int usb_prof_read (uint64_t *counters)
+{
+  uint64_t values[1 + USB_PROF_N_COUNTERS];
+
+  if (usb_prof_group == -2)
+    usb_prof_group = usb_prof_open ();
+  if (usb_prof_group < 0 ||
+      read (usb_prof_group, values, sizeof values) != sizeof values)
+    return 0;
+  memcpy (counters, values + 1, sizeof (uint64_t) * USB_PROF_N_COUNTERS);
+  return 1;
+}
+#else
+static int usb_prof_read (uint64_t *counters)
+{
+  (void) counters;
+  return 0;
+}
+#endif
+
+usb_prof *usb_prof_new (const char *const *names, int n_phases)
+{
+  usb_prof *prof = calloc (1, sizeof (usb_prof));
+  int i;
+
+  if (prof == NULL)
+    return NULL;
+  prof->phases = calloc (n_phases, sizeof (usb_prof_phase));
+  if (prof->phases == NULL)
+  {
+    free (prof);
+    return NULL;
+  }
+  prof->n_phases = n_phases;
+  for (i = 0; i < n_phases; i++)
+    prof->phases[i].name = names[i];
+  return prof;
+}
+
+void usb_prof_free (usb_prof *prof)
+{
+  free (prof->phases);
+  free (prof);
+}
+
+void usb_prof_start (usb_prof_mark *mark)
+{
+  mark->hw = usb_prof_read (mark->counters);
+  mark->ns = now_ns ();
+}
+
+void usb_prof_lap (usb_prof *prof, int phase, usb_prof_mark *mark)
+{
+  usb_prof_phase *p = &prof->phases[phase];
+  uint64_t ns = now_ns (), counters[USB_PROF_N_COUNTERS];
+  int i, hw = usb_prof_read (counters);
+
+  __sync_fetch_and_add (&p->count, 1);
+  __sync_fetch_and_add (&p->ns, ns - mark->ns);
+  if (hw && mark->hw)
+  {
+    for (i = 0; i < USB_PROF_N_COUNTERS; i++)
+      __sync_fetch_and_add (&p->counters[i], counters[i] - mark->counters[i]);
+    prof->hw = 1;
+  }
+
+  /* The next phase starts here */
+  mark->ns = ns;
+  mark->hw = hw;
+  memcpy (mark->counters, counters, sizeof counters);
+}
@@ -0,0 +1,113 @@
+#ifndef __USB_PROF_H__
+#define __USB_PROF_H__
+
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+#include <stdint.h>
+
+/**
+ * Hardware counters read around every phase, on top of the elapsed time
+ */
+typedef enum _USB_PROF_COUNTER
+{
+  /** CPU cycles */
+  USB_PROF_CYCLES,
+
+  /** Instructions retired */
+  USB_PROF_INSTRUCTIONS,
+
+  /** Last level cache misses */
+  USB_PROF_CACHE_MISSES,
+
+  USB_PROF_N_COUNTERS
+
+} USB_PROF_COUNTER;
+
+/**
+ * Totals of one phase, over every thread that ran it
+ */
+typedef struct _usb_prof_phase
+{
+  /** Name of the phase, as given to usb_prof_new() */
+  const char *name;
+
+  /** Times the phase ran */
+  uint64_t count;
+
+  /** Nanoseconds spent in the phase, blocked ones included */
+  uint64_t ns;
+
+  /** Counts of the #USB_PROF_COUNTER, only while the thread ran */
+  uint64_t counters[USB_PROF_N_COUNTERS];
+
+} usb_prof_phase;
+
+/**
+ * Profile of an element, split in phases
+ */
+typedef struct _usb_prof
+{
+  usb_prof_phase *phases;
+  int n_phases;
+
+  /** Non zero once a thread read the hardware counters, they stay at 0
+   * if the kernel doesn't let us have them */
+  int hw;
+
+} usb_prof;
+
+/**
+ * Where the current phase of a thread started
+ */
+typedef struct _usb_prof_mark
+{
+  uint64_t ns;
+  uint64_t counters[USB_PROF_N_COUNTERS];
+  int hw;
+} usb_prof_mark;
+
+/**
+  * \brief Creates a profile.
+  * \param names Name of every phase, they must outlive the profile.
+  * \param n_phases Number of phases.
+  * \return The profile, NULL if out of memory.
+  */
+extern usb_prof *usb_prof_new (const char *const *names, int n_phases);
+
+/**
+  * \brief Releases a profile.
+  * \param prof Profile to release.
+  */
+extern void usb_prof_free (usb_prof *prof);
+
+/**
+  * \brief Marks the start of a phase. The counters of the calling thread
+  * are opened the first time, and closed when it exits.
+  * \param mark Where to keep the start.
+  */
+extern void usb_prof_start (usb_prof_mark *mark);
+
+/**
+  * \brief Ends a phase started at the mark, which then starts the next
+  * one, so a sequence of phases takes a single usb_prof_start().
+  * \param prof Profile to add the phase to.
+  * \param phase Index of the phase in the names given to usb_prof_new().
+  * \param mark Start of the phase, moved to now.
+  */
+extern void usb_prof_lap (usb_prof *prof, int phase, usb_prof_mark *mark);
+
+/**
+ * The hooks in the data path cost a couple of syscalls per phase, they are
+ * only there when configured with --enable-profiling.
+ */
+#ifdef ENABLE_PROFILING
+#define USB_PROF_START(mark) usb_prof_start (mark)
+#define USB_PROF_LAP(prof, phase, mark) usb_prof_lap (prof, phase, mark)
+#else
+#define USB_PROF_START(mark) ((void) (mark))
+#define USB_PROF_LAP(prof, phase, mark) ((void) (prof), (void) (mark))
+#endif
+
+#endif /* __USB_PROF_H__ */
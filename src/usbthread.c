@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+/* For the affinity calls */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbthread.h"
+
+/* Parses a list of cpus into a set, zero if it's malformed */
+static int usb_thread_parse_cpus (const char *list, cpu_set_t *cpus)
+{
+  const char *p = list;
+  char *end;
+  long first, last, cpu;
+
+  CPU_ZERO (cpus);
+  for (;;)
+  {
+    first = strtol (p, &end, 10);
+    if (end == p || first < 0)
+      return 0;
+    last = first;
+    if (*end == '-')
+    {
+      p = end + 1;
+      last = strtol (p, &end, 10);
+      if (end == p || last < first)
+	return 0;
+    }
+    if (last >= CPU_SETSIZE)
+      return 0;
+    for (cpu = first; cpu <= last; cpu++)
+      CPU_SET (cpu, cpus);
+
+    if (*end == '\0')
+      return 1;
+    if (*end != ',')
+      return 0;
+    p = end + 1;
+  }
+}
+
+int usb_thread_cpus_valid (const char *list)
+{
+  cpu_set_t cpus;
+
+  return usb_thread_parse_cpus (list, &cpus);
+}
+
+int usb_thread_setup (pthread_t thread, const char *name,
+		      const usb_thread_sched *sched)
+{
+  struct sched_param param;
+  cpu_set_t cpus;
+  int ret = 0, err;
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  char cut[USB_THREAD_NAME_MAX + 1];
+
+  if (name)
+  {
+    strncpy (cut, name, USB_THREAD_NAME_MAX);
+    cut[USB_THREAD_NAME_MAX] = '\0';
+    pthread_setname_np (thread, cut);
+  }
+#endif
+
+  if (sched == NULL)
+    return 0;
+
+  if (sched->policy != SCHED_OTHER)
+  {
+    memset (&param, 0, sizeof param);
+    param.sched_priority = sched->priority;
+    ret = pthread_setschedparam (thread, sched->policy, &param);
+  }
+  if (sched->cpus && usb_thread_parse_cpus (sched->cpus, &cpus) &&
+      (err = pthread_setaffinity_np (thread, sizeof cpus, &cpus)) != 0 &&
+      ret == 0)
+    ret = err;
+
+  return ret;
+}
@@ -0,0 +1,50 @@
+#ifndef __USB_THREAD_H__
+#define __USB_THREAD_H__
+
+/*
+ * Copyright (C) 2011 RidgeRun
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+/** Longest thread name the kernel keeps, the rest is cut */
+#define USB_THREAD_NAME_MAX 15
+
+/**
+ * Scheduling of the I/O threads of an element
+ */
+typedef struct _usb_thread_sched
+{
+  /** SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+  int policy;
+
+  /** Real time priority, only used with SCHED_FIFO and SCHED_RR */
+  int priority;
+
+  /** Cpus the threads run on, as in "0,2-3", NULL for any */
+  const char *cpus;
+
+} usb_thread_sched;
+
+/**
+  * \brief Checks a list of cpus.
+  * \param list Comma separated cpus or ranges of cpus, as in "0,2-3".
+  * \return Non zero if the list is well formed.
+  */
+extern int usb_thread_cpus_valid (const char *list);
+
+/**
+  * \brief Names a thread and schedules it, to call right after creating
+  * it. The name is set even if the scheduling fails.
+  * \param thread Thread to set up.
+  * \param name Name shown by ps, top and perf, cut to
+  * #USB_THREAD_NAME_MAX characters. NULL to leave it.
+  * \param sched Scheduling to apply, NULL for the default.
+  * \return 0 on success, the error number otherwise. EPERM means the
+  * process isn't allowed real time priorities.
+  */
+extern int usb_thread_setup (pthread_t thread, const char *name,
+			     const usb_thread_sched *sched);
+
+#endif /* __USB_THREAD_H__ */
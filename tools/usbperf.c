@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ *
+ * usbperf: raw throughput and latency of the USB link, with nothing but
+ * the usbhost and usbgadget layers in the way. Run the gadget role on the
+ * board and the host role on the PC, with the same options:
+ *
+ *   gadget$ usbperf gadget -s 65536 -q 2 -e 2
+ *   host$   usbperf host -s 65536 -q 2 -e 2 -t 10
+ *
+ * Throughput mode runs queue depth transfers at once on each stream
+ * endpoint, every one in its own thread so a finished transfer is posted
+ * again right away. The depth is for the host only: gadgetfs serializes
+ * the reads of an endpoint file, so the gadget keeps one read per
+ * endpoint whatever -q says. Latency mode bounces a transfer on the
+ * events endpoints, host to gadget and back, and times each round trip.
+ *
+ * With -E the transfers go through an emulated link, see linkemu.h:
+ *
+ *   host$   usbperf host -E "bandwidth=10M,latency=2000,stall=0.01,seed=1"
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usbhost.h"
+#include "usbgadget.h"
+#include "linkemu.h"
+
+/* Ids the gadget enumerates with */
+#define USBPERF_VENDOR_ID  0x0525
+#define USBPERF_PRODUCT_ID 0xa4a4
+
+/* Milliseconds a transfer waits before checking if the test is over */
+#define USBPERF_TIMEOUT 1000
+
+#define USBPERF_MAX_ENDPOINTS 2
+#define USBPERF_MAX_DEPTH 16
+
+typedef enum _USBPERF_ROLE
+{
+  USBPERF_HOST,
+  USBPERF_GADGET
+} USBPERF_ROLE;
+
+typedef struct _usbperf
+{
+  USBPERF_ROLE role;
+  usb_host host;
+  usb_gadget gadget;
+
+  /* Options */
+  int size;
+  int depth;
+  int endpoints;
+  int seconds;
+  int latency;
+  int rounds;
+  const char *emulate;
+
+  /* Shared by the workers */
+  volatile int running;
+  volatile unsigned long long bytes;
+  volatile unsigned long long retries;
+  volatile int failed;
+} usbperf;
+
+typedef struct _usbperf_worker
+{
+  usbperf *perf;
+  int endpoint;
+  pthread_t thread;
+} usbperf_worker;
+
+static double now_seconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage (const char *name)
+{
+  fprintf (stderr,
+	   "Usage: %s host|gadget [options]\n"
+	   "  -s size     bytes per transfer (default 65536, 64 with -l)\n"
+	   "  -q depth    transfers in flight per endpoint, host only (default 1,\n"
+	   "              max %d)\n"
+	   "  -e count    stream endpoints to use, 1 or 2 (default 1)\n"
+	   "  -t seconds  length of the throughput test (default 10)\n"
+	   "  -l          measure round trip latency instead\n"
+	   "  -n rounds   round trips in latency mode (default 1000)\n"
+	   "  -E script   go through an emulated link\n",
+	   name, USBPERF_MAX_DEPTH);
+}
+
+/* Throughput worker, keeps one transfer in flight on its endpoint */
+static void *usbperf_worker_run (void *param)
+{
+  usbperf_worker *worker = (usbperf_worker *) param;
+  usbperf *perf = worker->perf;
+  unsigned char *buf = malloc (perf->size);
+  int ret, transferred;
+
+  if (buf == NULL)
+  {
+    perf->failed = 1;
+    return NULL;
+  }
+  memset (buf, 0, perf->size);
+
+  while (perf->running)
+  {
+    if (perf->role == USBPERF_HOST)
+    {
+      ret = usb_host_device_transfer_timed (&perf->host,
+	  worker->endpoint ? EP3_OUT : EP2_OUT, buf, perf->size,
+	  USBPERF_TIMEOUT, &transferred);
+      if (ret == ERR_TIMEOUT)
+	__sync_fetch_and_add (&perf->retries, 1);
+      else if (ret != EOK)
+	break;
+    }
+    else
+    {
+      ret = usb_gadget_read (&perf->gadget,
+	  worker->endpoint ? GAD_STREAM2_EP : GAD_STREAM_EP, buf, perf->size,
+	  USBPERF_TIMEOUT, &transferred);
+      if (ret == ERR_TIMEOUT_FD)
+	continue;
+      if (ret != GAD_EOK)
+	break;
+    }
+    __sync_fetch_and_add (&perf->bytes, transferred);
+  }
+
+  if (perf->running)
+  {
+    fprintf (stderr, "Transfer failed on endpoint %d\n", worker->endpoint);
+    perf->failed = 1;
+  }
+  free (buf);
+  return NULL;
+}
+
+static int usbperf_throughput (usbperf *perf)
+{
+  usbperf_worker workers[USBPERF_MAX_ENDPOINTS * USBPERF_MAX_DEPTH];
+  int i, n = perf->endpoints, second = 0;
+  unsigned long long last = 0, bytes;
+  double start = 0, t, prev = 0;
+
+  /* More readers of an endpoint file would only wait for each other */
+  if (perf->role == USBPERF_HOST)
+    n *= perf->depth;
+
+  perf->running = 1;
+  for (i = 0; i < n; i++)
+  {
+    workers[i].perf = perf;
+    workers[i].endpoint = i % perf->endpoints;
+    if (pthread_create (&workers[i].thread, NULL, usbperf_worker_run,
+			&workers[i]) != 0)
+    {
+      fprintf (stderr, "Unable to create worker thread\n");
+      perf->running = 0;
+      n = i;
+      break;
+    }
+  }
+
+  /* The gadget starts counting with the first data and stops once the
+   * host has been silent for a while */
+  while (perf->running && !perf->failed)
+  {
+    usleep (100000);
+    bytes = perf->bytes;
+    t = now_seconds ();
+    if (start == 0)
+    {
+      if (bytes == 0)
+	continue;
+      start = prev = t;
+      last = bytes;
+      continue;
+    }
+    if (t - prev < 1.0)
+      continue;
+
+    second++;
+    printf ("%3d s  %10.2f MB/s\n", second, (bytes - last) / (t - prev) / 1e6);
+    fflush (stdout);
+    if (perf->role == USBPERF_GADGET && bytes == last)
+      break;
+    if (perf->role == USBPERF_HOST && second >= perf->seconds)
+      break;
+    last = bytes;
+    prev = t;
+  }
+  perf->running = 0;
+  t = now_seconds ();
+
+  for (i = 0; i < n; i++)
+    pthread_join (workers[i].thread, NULL);
+
+  if (start > 0)
+    printf ("total  %llu bytes in %.2f s, %.2f MB/s, %llu retries\n",
+	    perf->bytes, t - start, perf->bytes / (t - start) / 1e6,
+	    perf->retries);
+  return perf->failed ? 1 : 0;
+}
+
+static int compare_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static int usbperf_latency (usbperf *perf)
+{
+  unsigned char *buf = malloc (perf->size);
+  double *rtt = malloc (perf->rounds * sizeof (double));
+  double t, sum = 0;
+  int i, ret = 0;
+
+  if (buf == NULL || rtt == NULL)
+  {
+    free (buf);
+    free (rtt);
+    return 1;
+  }
+  memset (buf, 0, perf->size);
+
+  for (i = 0; i < perf->rounds; i++)
+  {
+    if (perf->role == USBPERF_GADGET)
+    {
+      /* Echo whatever comes down back up */
+      if (usb_gadget_transfer (&perf->gadget, GAD_DOWN_EP, buf,
+			       perf->size) != GAD_EOK ||
+	  usb_gadget_transfer (&perf->gadget, GAD_UP_EP, buf,
+			       perf->size) != GAD_EOK)
+	break;
+      continue;
+    }
+
+    t = now_seconds ();
+    if (usb_host_device_transfer (&perf->host, EP1_OUT, buf, perf->size,
+				  USBPERF_TIMEOUT) != EOK ||
+	usb_host_device_transfer (&perf->host, EP1_IN, buf, perf->size,
+				  USBPERF_TIMEOUT) != EOK)
+      break;
+    rtt[i] = now_seconds () - t;
+    sum += rtt[i];
+  }
+
+  if (i < perf->rounds)
+  {
+    fprintf (stderr, "Round trip %d failed\n", i);
+    ret = 1;
+  }
+  if (perf->role == USBPERF_HOST && i > 0)
+  {
+    qsort (rtt, i, sizeof (double), compare_double);
+    printf ("%d round trips of %d bytes: min %.1f us, avg %.1f us, "
+	    "p99 %.1f us, max %.1f us\n", i, perf->size, rtt[0] * 1e6,
+	    sum / i * 1e6, rtt[(i * 99) / 100] * 1e6, rtt[i - 1] * 1e6);
+  }
+
+  free (buf);
+  free (rtt);
+  return ret;
+}
+
+static int usbperf_open (usbperf *perf)
+{
+  link_emu *emu = NULL;
+
+  if (perf->emulate && (emu = link_emu_new (perf->emulate)) == NULL)
+  {
+    fprintf (stderr, "Malformed emulation script\n");
+    return 0;
+  }
+
+  if (perf->role == USBPERF_HOST)
+  {
+    if (usb_host_new (&perf->host, LEVEL0) != EOK)
+    {
+      fprintf (stderr, "Failed opening usb context\n");
+      if (emu)
+	link_emu_free (emu);
+      return 0;
+    }
+    if (usb_host_device_open (&perf->host, USBPERF_VENDOR_ID,
+			      USBPERF_PRODUCT_ID) != EOK)
+    {
+      fprintf (stderr, "No gadget found, is usbperf gadget running?\n");
+      perf->host.emu = emu;
+      usb_host_free (&perf->host);
+      return 0;
+    }
+    perf->host.emu = emu;
+    return 1;
+  }
+
+  if (usb_gadget_new (&perf->gadget, GLEVEL0) != GAD_EOK)
+  {
+    fprintf (stderr, "Can't start the gadget, is gadgetfs mounted on "
+	     "/dev/gadget?\n");
+    if (emu)
+      link_emu_free (emu);
+    return 0;
+  }
+  perf->gadget.emu = emu;
+  fprintf (stderr, "Waiting for the host...\n");
+  while (perf->gadget.connected != 1)
+    usleep (1000);
+  return 1;
+}
+
+static void usbperf_close (usbperf *perf)
+{
+  link_emu *emu = perf->role == USBPERF_HOST ? perf->host.emu :
+    perf->gadget.emu;
+
+  if (emu)
+    printf ("emulated %llu transfers: %llu stalled, %llu short, "
+	    "%llu disconnections\n", (unsigned long long) emu->transfers,
+	    (unsigned long long) emu->stalls,
+	    (unsigned long long) emu->shorts,
+	    (unsigned long long) emu->disconnects);
+
+  if (perf->role == USBPERF_HOST)
+    usb_host_free (&perf->host);
+  else
+    usb_gadget_free (&perf->gadget);
+}
+
+int main (int argc, char **argv)
+{
+  usbperf perf;
+  int opt, ret;
+
+  memset (&perf, 0, sizeof perf);
+  perf.size = 0;
+  perf.depth = 1;
+  perf.endpoints = 1;
+  perf.seconds = 10;
+  perf.rounds = 1000;
+
+  if (argc < 2)
+  {
+    usage (argv[0]);
+    return 1;
+  }
+  if (strcmp (argv[1], "host") == 0)
+    perf.role = USBPERF_HOST;
+  else if (strcmp (argv[1], "gadget") == 0)
+    perf.role = USBPERF_GADGET;
+  else
+  {
+    usage (argv[0]);
+    return 1;
+  }
+
+  optind = 2;
+  while ((opt = getopt (argc, argv, "s:q:e:t:ln:E:")) != -1)
+  {
+    switch (opt)
+    {
+      case 's':
+	perf.size = atoi (optarg);
+	break;
+      case 'q':
+	perf.depth = atoi (optarg);
+	break;
+      case 'e':
+	perf.endpoints = atoi (optarg);
+	break;
+      case 't':
+	perf.seconds = atoi (optarg);
+	break;
+      case 'l':
+	perf.latency = 1;
+	break;
+      case 'n':
+	perf.rounds = atoi (optarg);
+	break;
+      case 'E':
+	perf.emulate = optarg;
+	break;
+      default:
+	usage (argv[0]);
+	return 1;
+    }
+  }
+  if (perf.size == 0)
+    perf.size = perf.latency ? 64 : 65536;
+  if (perf.size < 0 || perf.depth < 1 || perf.depth > USBPERF_MAX_DEPTH ||
+      perf.endpoints < 1 || perf.endpoints > USBPERF_MAX_ENDPOINTS ||
+      perf.seconds < 1 || perf.rounds < 1)
+  {
+    usage (argv[0]);
+    return 1;
+  }
+
+  if (perf.role == USBPERF_GADGET && perf.depth > 1)
+    fprintf (stderr, "The queue depth only applies to the host, ignored\n");
+
+  if (!usbperf_open (&perf))
+    return 1;
+
+  if (perf.latency)
+    ret = usbperf_latency (&perf);
+  else
+    ret = usbperf_throughput (&perf);
+
+  usbperf_close (&perf);
+  return ret;
+}
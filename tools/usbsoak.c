@@ -0,0 +1,615 @@
+/*
+ * Copyright (C) 2011 RidgeRun
+ *
+ * usbsoak: long running check of usbsink and usbsrc for memory growth and
+ * throughput drift. No board is needed, usbsink streams to a usbsrc of
+ * the same process through a loop, see usbloop.h:
+ *
+ *   $ usbsoak -c 500 -n 4000
+ *
+ * Each cycle fakesrc sends random sized frames through usbsink, changing
+ * caps now and then, and the frames come out of usbsrc into a fakesink.
+ * With -F they go through usbfanout to several usbsrc instead, each
+ * branch may drop frames then, so a cycle also ends once everything was
+ * sent and nothing arrives anymore.
+ * The sizes come from the GLib random generator, seeded with -S or with a
+ * seed printed at start so a failing run can be repeated. With -f usbsrc
+ * replays a capture recorded on a board with its capture property
+ * instead, as fast as it can.
+ *
+ * Every cycle takes the pipelines from NULL to PLAYING and back, some of
+ * them pausing or stopping half way. After the warmup cycles the first
+ * window of cycles is the baseline, and the test fails as soon as the last
+ * window drifts from it: RSS grown past the limit, more allocations per
+ * buffer or less throughput than the tolerance allows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gst/gst.h>
+
+#define USBSOAK_MAX_WINDOW 64
+#define USBSOAK_MAX_SINKS 8
+
+/* Loops usbsink streams to usbsrc through, one per usbsrc */
+#define USBSOAK_LOOP "usbsoak%d"
+
+/* Quiet time after the last frame was sent that ends a cycle */
+#define USBSOAK_QUIET (500 * GST_MSECOND)
+
+/* Caps the stream goes through */
+static const gchar *usbsoak_caps[] = {
+  "application/x-usbsoak, variant=(int)0",
+  "application/x-usbsoak, variant=(int)1, rate=(int)30",
+  "application/x-usbsoak, variant=(int)2, rate=(int)60",
+};
+
+/* What a cycle did, and the RSS once it was back to NULL */
+typedef struct _usbsoak_sample
+{
+  gdouble rss;
+  guint64 allocs;
+  guint64 buffers;
+  guint64 bytes;
+  GstClockTime played;
+} usbsoak_sample;
+
+/* Figures of a window of cycles, ratios of the sums so the cycles cut
+ * short weigh what they did */
+typedef struct _usbsoak_figures
+{
+  gdouble rss;
+  gdouble allocs;
+  gdouble throughput;
+} usbsoak_figures;
+
+typedef struct _usbsoak
+{
+  /* Options */
+  gint cycles;
+  gint warmup;
+  gint window;
+  gint frames;
+  gint sinks;
+  gint max_size;
+  gint caps_every;
+  gint seconds;
+  gdouble rss_limit;
+  gdouble alloc_tolerance;
+  gdouble rate_tolerance;
+  const gchar *file;
+  guint32 seed;
+
+  /* usbsrc into the fakesink, and fakesrc into usbsink unless replaying */
+  GstElement *pipeline;
+  GstElement *sender;
+  GstElement *filter;
+
+  /* Counted by the handoffs of the sink */
+  volatile guint64 buffers;
+  volatile guint64 bytes;
+
+  /* Buffers counted once every frame of the cycle arrived, and frames
+   * fakesrc sent in the cycle */
+  guint64 target;
+  gint sent;
+
+  usbsoak_sample samples[USBSOAK_MAX_WINDOW];
+  usbsoak_figures baseline;
+  gint n_samples;
+} usbsoak;
+
+/* Allocations made through GLib, slices included as G_SLICE is set to
+ * always-malloc before anything else runs */
+static volatile guint64 allocations;
+
+static gpointer
+count_malloc (gsize n)
+{
+  __sync_fetch_and_add (&allocations, 1);
+  return malloc (n);
+}
+
+static gpointer
+count_realloc (gpointer mem, gsize n)
+{
+  if (mem == NULL)
+    __sync_fetch_and_add (&allocations, 1);
+  return realloc (mem, n);
+}
+
+static gpointer
+count_calloc (gsize n, gsize size)
+{
+  __sync_fetch_and_add (&allocations, 1);
+  return calloc (n, size);
+}
+
+static GMemVTable count_vtable = {
+  count_malloc, count_realloc, free, count_calloc, count_malloc, count_realloc
+};
+
+static void usage (const char *name)
+{
+  fprintf (stderr,
+	   "Usage: %s [options]\n"
+	   "  -c cycles   state cycles to run (default 200)\n"
+	   "  -w cycles   warmup cycles left out of the check (default 10)\n"
+	   "  -W cycles   cycles averaged for the baseline and the check, a "
+	   "multiple of 4 (default 8, max %d)\n"
+	   "  -f file     replay this capture instead of streaming through "
+	   "usbsink\n"
+	   "  -n frames   frames sent each cycle (default 4000)\n"
+	   "  -s bytes    largest frame sent (default 65536)\n"
+	   "  -C frames   frames between caps changes (default 500)\n"
+	   "  -t seconds  longest a cycle runs (default 60)\n"
+	   "  -m KiB      RSS growth allowed (default 1024)\n"
+	   "  -a percent  allocations per buffer growth allowed (default 5)\n"
+	   "  -r percent  throughput loss allowed (default 20)\n"
+	   "  -S seed     seed of the frame sizes (default a new one)\n"
+	   "  -F sinks    stream through usbfanout to this many usbsrc "
+	   "(default 1, max %d)\n",
+	   name, USBSOAK_MAX_WINDOW, USBSOAK_MAX_SINKS);
+}
+
+/* Resident set size in KiB */
+static gdouble usbsoak_rss (void)
+{
+  unsigned long size, resident;
+  FILE *f = fopen ("/proc/self/statm", "r");
+
+  if (f == NULL)
+    return 0;
+  if (fscanf (f, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose (f);
+  return resident * (sysconf (_SC_PAGESIZE) / 1024.0);
+}
+
+static void
+usbsoak_handoff (GstElement *sink, GstBuffer *buf, GstPad *pad,
+		 gpointer user_data)
+{
+  usbsoak *soak = (usbsoak *) user_data;
+
+  /* Each usbsrc hands off from its own thread */
+  __sync_fetch_and_add (&soak->bytes, GST_BUFFER_SIZE (buf));
+  /* Ends the cycle, usbsrc doesn't end its stream with the sink's */
+  if (__sync_add_and_fetch (&soak->buffers, 1) == soak->target)
+    gst_element_post_message (sink,
+        gst_message_new_application (GST_OBJECT (sink),
+            gst_structure_new ("usbsoak-done", NULL)));
+}
+
+/* Stamps the frames fakesrc sends, changing the caps now and then */
+static void
+usbsoak_feed (GstElement *src, GstBuffer *buf, GstPad *pad,
+	      gpointer user_data)
+{
+  usbsoak *soak = (usbsoak *) user_data;
+  GstCaps *caps;
+
+  if (soak->sent % soak->caps_every == 0)
+  {
+    caps = gst_caps_from_string (usbsoak_caps[(soak->sent / soak->caps_every)
+					      % G_N_ELEMENTS (usbsoak_caps)]);
+    g_object_set (soak->filter, "caps", caps, NULL);
+    gst_caps_unref (caps);
+  }
+  GST_BUFFER_TIMESTAMP (buf) = soak->sent * (GST_SECOND / 30);
+  GST_BUFFER_DURATION (buf) = GST_SECOND / 30;
+  soak->sent++;
+}
+
+/* One usbsrc per loop, or the one replaying the capture, each into a
+ * fakesink counting what it gets */
+static GstElement *usbsoak_receiver (usbsoak *soak)
+{
+  GstElement *pipeline, *src, *sink;
+  gchar *name;
+  gint i;
+
+  pipeline = gst_pipeline_new ("receiver");
+  for (i = 0; i < soak->sinks; i++)
+  {
+    src = gst_element_factory_make ("usbsrc", NULL);
+    sink = gst_element_factory_make ("fakesink", NULL);
+    if (src == NULL || sink == NULL)
+    {
+      fprintf (stderr, "usbsrc not found, is GST_PLUGIN_PATH set?\n");
+      if (src)
+	gst_object_unref (src);
+      if (sink)
+	gst_object_unref (sink);
+      gst_object_unref (pipeline);
+      return NULL;
+    }
+
+    if (soak->file)
+      g_object_set (src, "replay", soak->file, "replay-realtime", FALSE,
+		    NULL);
+    else
+    {
+      name = g_strdup_printf (USBSOAK_LOOP, i);
+      g_object_set (src, "loop", name, NULL);
+      g_free (name);
+    }
+    g_object_set (sink, "sync", FALSE, "signal-handoffs", TRUE, NULL);
+    g_signal_connect (sink, "handoff", G_CALLBACK (usbsoak_handoff), soak);
+    gst_bin_add_many (GST_BIN (pipeline), src, sink, NULL);
+    gst_element_link (src, sink);
+  }
+  return pipeline;
+}
+
+/* fakesrc with random sized frames into usbsink, or usbfanout for more
+ * than one usbsrc, through a capsfilter setting their caps */
+static GstElement *usbsoak_sender (usbsoak *soak)
+{
+  GstElement *pipeline, *src, *sink;
+  GString *devices;
+  gint i;
+
+  pipeline = gst_pipeline_new ("sender");
+  src = gst_element_factory_make ("fakesrc", NULL);
+  soak->filter = gst_element_factory_make ("capsfilter", NULL);
+  sink = gst_element_factory_make (soak->sinks > 1 ? "usbfanout" : "usbsink",
+				   NULL);
+  if (src == NULL || soak->filter == NULL || sink == NULL)
+  {
+    fprintf (stderr, "usbsink not found, is GST_PLUGIN_PATH set?\n");
+    if (src)
+      gst_object_unref (src);
+    if (soak->filter)
+      gst_object_unref (soak->filter);
+    if (sink)
+      gst_object_unref (sink);
+    gst_object_unref (pipeline);
+    return NULL;
+  }
+
+  gst_util_set_object_arg (G_OBJECT (src), "sizetype", "random");
+  g_object_set (src, "sizemin", 1, "sizemax", soak->max_size,
+		"num-buffers", soak->frames, "signal-handoffs", TRUE, NULL);
+  g_signal_connect (src, "handoff", G_CALLBACK (usbsoak_feed), soak);
+
+  devices = g_string_new (NULL);
+  for (i = 0; i < soak->sinks; i++)
+    g_string_append_printf (devices, "%sloop=" USBSOAK_LOOP, i ? ";" : "",
+			    i);
+  g_object_set (sink, soak->sinks > 1 ? "devices" : "device", devices->str,
+		NULL);
+  g_string_free (devices, TRUE);
+
+  /* No clock, the frames go as fast as the loop takes them. The sinks of
+   * usbfanout would sync to it otherwise */
+  gst_pipeline_use_clock (GST_PIPELINE (pipeline), NULL);
+  gst_bin_add_many (GST_BIN (pipeline), src, soak->filter, sink, NULL);
+  gst_element_link_many (src, soak->filter, sink, NULL);
+  return pipeline;
+}
+
+/* Takes the pipelines to a state, the receiver first on the way up so
+ * usbsink finds its gadget and last on the way down so usbsink doesn't
+ * lose it. Only the way down is waited for, the sender prerolls once
+ * usbsrc plays */
+static gboolean usbsoak_set_state (usbsoak *soak, GstState state)
+{
+  GstElement *first = soak->pipeline, *second = soak->sender;
+  gboolean up = state == GST_STATE_PLAYING, ret = TRUE;
+
+  if (!up && second)
+  {
+    first = soak->sender;
+    second = soak->pipeline;
+  }
+  if (gst_element_set_state (first, state) == GST_STATE_CHANGE_FAILURE)
+    ret = FALSE;
+  if (!up)
+    gst_element_get_state (first, NULL, NULL, GST_CLOCK_TIME_NONE);
+  if (second && (ret || !up))
+  {
+    if (gst_element_set_state (second, state) == GST_STATE_CHANGE_FAILURE)
+      ret = FALSE;
+    if (!up)
+      gst_element_get_state (second, NULL, NULL, GST_CLOCK_TIME_NONE);
+  }
+  return ret;
+}
+
+/* Waits for the end of the stream, or of the frames of the cycle, an
+ * error of either pipeline or the timeout. FALSE on error */
+static gboolean usbsoak_wait (usbsoak *soak, GstClockTime timeout)
+{
+  GstBus *bus = gst_element_get_bus (soak->pipeline), *sender_bus = NULL;
+  GstClockTime end = gst_util_get_timestamp () + timeout, now, quiet = 0;
+  GstMessage *msg = NULL;
+  GError *error = NULL;
+  gchar *debug = NULL;
+  gboolean ret = TRUE, sent = FALSE;
+  guint64 buffers = 0;
+
+  if (soak->sender)
+    sender_bus = gst_element_get_bus (soak->sender);
+  /* Both buses in slices, they can't be waited on at once */
+  while (msg == NULL && (now = gst_util_get_timestamp ()) < end)
+  {
+    /* Everything was sent, what didn't arrive yet was dropped */
+    if (sent && soak->buffers != buffers)
+    {
+      buffers = soak->buffers;
+      quiet = now;
+    }
+    else if (sent && now - quiet >= USBSOAK_QUIET)
+      break;
+
+    msg = gst_bus_timed_pop_filtered (bus, MIN (end - now, 50 * GST_MSECOND),
+				      GST_MESSAGE_EOS | GST_MESSAGE_ERROR |
+				      GST_MESSAGE_APPLICATION);
+    if (msg == NULL && sender_bus)
+      msg = gst_bus_pop_filtered (sender_bus,
+				  GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    if (msg && GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS &&
+	GST_MESSAGE_SRC (msg) == GST_OBJECT (soak->sender))
+    {
+      gst_message_unref (msg);
+      msg = NULL;
+      sent = TRUE;
+      buffers = soak->buffers;
+      quiet = now;
+    }
+  }
+  if (msg && GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR)
+  {
+    gst_message_parse_error (msg, &error, &debug);
+    fprintf (stderr, "Error: %s (%s)\n", error->message,
+	     debug ? debug : "no details");
+    g_error_free (error);
+    g_free (debug);
+    ret = FALSE;
+  }
+  if (msg)
+    gst_message_unref (msg);
+  if (sender_bus)
+    gst_object_unref (sender_bus);
+  gst_object_unref (bus);
+  return ret;
+}
+
+/* One trip from NULL to PLAYING and back. One cycle out of four is cut
+ * short and another one paused, at a random point */
+static gboolean usbsoak_cycle (usbsoak *soak, gint cycle,
+			       usbsoak_sample *sample)
+{
+  guint64 allocs = allocations, buffers = soak->buffers, bytes = soak->bytes;
+  GstClockTime timeout = soak->seconds * GST_SECOND, start;
+  gint action = cycle % 4;
+  gboolean ret = TRUE;
+
+  soak->target = soak->file ? 0 : buffers + soak->frames * soak->sinks;
+  soak->sent = 0;
+  start = gst_util_get_timestamp ();
+  if (!usbsoak_set_state (soak, GST_STATE_PLAYING))
+    ret = FALSE;
+  else if (action == 0)
+  {
+    /* Stop while frames are still coming */
+    ret = usbsoak_wait (soak, g_random_int_range (1, 200) * GST_MSECOND);
+  }
+  else if (action == 1)
+  {
+    /* Pause half way and carry on */
+    ret = usbsoak_wait (soak, g_random_int_range (1, 200) * GST_MSECOND);
+    usbsoak_set_state (soak, GST_STATE_PAUSED);
+    if (ret && !usbsoak_set_state (soak, GST_STATE_PLAYING))
+      ret = FALSE;
+    if (ret)
+      ret = usbsoak_wait (soak, timeout);
+  }
+  else
+    ret = usbsoak_wait (soak, timeout);
+  sample->played = gst_util_get_timestamp () - start;
+
+  usbsoak_set_state (soak, GST_STATE_NULL);
+
+  sample->rss = usbsoak_rss ();
+  sample->allocs = allocations - allocs;
+  sample->buffers = soak->buffers - buffers;
+  sample->bytes = soak->bytes - bytes;
+  return ret;
+}
+
+static usbsoak_figures usbsoak_figures_of (usbsoak_sample *samples, gint n)
+{
+  usbsoak_figures figures = { 0, 0, 0 };
+  guint64 allocs = 0, buffers = 0, bytes = 0;
+  GstClockTime played = 0;
+  gint i;
+
+  for (i = 0; i < n; i++)
+  {
+    figures.rss += samples[i].rss / n;
+    allocs += samples[i].allocs;
+    buffers += samples[i].buffers;
+    bytes += samples[i].bytes;
+    played += samples[i].played;
+  }
+  if (buffers > 0)
+    figures.allocs = (gdouble) allocs / buffers;
+  if (played > 0)
+    figures.throughput = bytes * 1e9 / played;
+  return figures;
+}
+
+/* Adds a sample after the warmup, FALSE once it drifted */
+static gboolean usbsoak_check (usbsoak *soak, gint cycle,
+			       usbsoak_sample *sample)
+{
+  usbsoak_figures mean;
+
+  soak->samples[soak->n_samples++ % soak->window] = *sample;
+  if (soak->n_samples < soak->window)
+    return TRUE;
+  mean = usbsoak_figures_of (soak->samples, soak->window);
+  if (soak->n_samples == soak->window)
+  {
+    soak->baseline = mean;
+    printf ("baseline: %.0f KiB, %.2f allocations per buffer, %.2f MB/s\n",
+	    mean.rss, mean.allocs, mean.throughput / 1e6);
+    return TRUE;
+  }
+
+  if (mean.rss > soak->baseline.rss + soak->rss_limit)
+  {
+    printf ("FAIL cycle %d: RSS grew %.0f KiB over the baseline\n", cycle,
+	    mean.rss - soak->baseline.rss);
+    return FALSE;
+  }
+  if (mean.allocs > soak->baseline.allocs * (1 + soak->alloc_tolerance))
+  {
+    printf ("FAIL cycle %d: %.2f allocations per buffer, %.2f in the "
+	    "baseline\n", cycle, mean.allocs, soak->baseline.allocs);
+    return FALSE;
+  }
+  if (mean.throughput < soak->baseline.throughput * (1 - soak->rate_tolerance))
+  {
+    printf ("FAIL cycle %d: %.2f MB/s, %.2f MB/s in the baseline\n", cycle,
+	    mean.throughput / 1e6, soak->baseline.throughput / 1e6);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+int main (int argc, char **argv)
+{
+  usbsoak soak;
+  usbsoak_sample sample;
+  usbsoak_figures figures;
+  gboolean seeded = FALSE;
+  gint opt, cycle, ret = 0;
+
+  /* Before GLib allocates anything */
+  g_setenv ("G_SLICE", "always-malloc", TRUE);
+  g_mem_set_vtable (&count_vtable);
+
+  memset (&soak, 0, sizeof soak);
+  soak.cycles = 200;
+  soak.warmup = 10;
+  soak.window = 8;
+  soak.frames = 4000;
+  soak.sinks = 1;
+  soak.max_size = 65536;
+  soak.caps_every = 500;
+  soak.seconds = 60;
+  soak.rss_limit = 1024;
+  soak.alloc_tolerance = 0.05;
+  soak.rate_tolerance = 0.2;
+
+  while ((opt = getopt (argc, argv, "c:w:W:f:n:s:C:t:m:a:r:S:F:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'c':
+	soak.cycles = atoi (optarg);
+	break;
+      case 'w':
+	soak.warmup = atoi (optarg);
+	break;
+      case 'W':
+	soak.window = atoi (optarg);
+	break;
+      case 'f':
+	soak.file = optarg;
+	break;
+      case 'n':
+	soak.frames = atoi (optarg);
+	break;
+      case 's':
+	soak.max_size = atoi (optarg);
+	break;
+      case 'C':
+	soak.caps_every = atoi (optarg);
+	break;
+      case 't':
+	soak.seconds = atoi (optarg);
+	break;
+      case 'm':
+	soak.rss_limit = atof (optarg);
+	break;
+      case 'a':
+	soak.alloc_tolerance = atof (optarg) / 100;
+	break;
+      case 'r':
+	soak.rate_tolerance = atof (optarg) / 100;
+	break;
+      case 'S':
+	soak.seed = strtoul (optarg, NULL, 0);
+	seeded = TRUE;
+	break;
+      case 'F':
+	soak.sinks = atoi (optarg);
+	break;
+      default:
+	usage (argv[0]);
+	return 1;
+    }
+  }
+  if (soak.cycles < 1 || soak.warmup < 0 || soak.window < 4 ||
+      soak.window % 4 != 0 || soak.window > USBSOAK_MAX_WINDOW ||
+      soak.frames < 1 || soak.max_size < 1 || soak.caps_every < 1 || soak.seconds < 1 ||
+      soak.sinks < 1 || soak.sinks > USBSOAK_MAX_SINKS ||
+      (soak.file && soak.sinks > 1))
+  {
+    usage (argv[0]);
+    return 1;
+  }
+
+  gst_init (&argc, &argv);
+
+  /* Printed so a failing run can be repeated */
+  if (!seeded)
+    soak.seed = g_random_int ();
+  g_random_set_seed (soak.seed);
+  printf ("seed: %u\n", soak.seed);
+
+  soak.pipeline = usbsoak_receiver (&soak);
+  if (soak.pipeline && soak.file == NULL &&
+      (soak.sender = usbsoak_sender (&soak)) == NULL)
+  {
+    gst_object_unref (soak.pipeline);
+    soak.pipeline = NULL;
+  }
+  if (soak.pipeline == NULL)
+    ret = 1;
+
+  for (cycle = 1; soak.pipeline && cycle <= soak.cycles; cycle++)
+  {
+    if (!usbsoak_cycle (&soak, cycle, &sample))
+    {
+      printf ("FAIL cycle %d: a pipeline failed\n", cycle);
+      ret = 1;
+      break;
+    }
+    figures = usbsoak_figures_of (&sample, 1);
+    printf ("cycle %4d  %8.0f KiB  %8.2f allocs/buffer  %8.2f MB/s\n", cycle,
+	    figures.rss, figures.allocs, figures.throughput / 1e6);
+    fflush (stdout);
+    if (cycle > soak.warmup && !usbsoak_check (&soak, cycle, &sample))
+    {
+      ret = 1;
+      break;
+    }
+  }
+  if (ret == 0)
+    printf ("PASS %d cycles, %" G_GUINT64_FORMAT " buffers\n", soak.cycles,
+	    soak.buffers);
+
+  if (soak.sender)
+    gst_object_unref (soak.sender);
+  if (soak.pipeline)
+    gst_object_unref (soak.pipeline);
+  return ret;
+}